@@ -16,7 +16,8 @@ objects := ctree.c disk-io.c radix-tree.c extent-tree.c print-tree.c \
           extent-cache.c extent_io.c volumes.c utils.c repair.c \
           qgroup.c raid6.c free-space-cache.c list_sort.c props.c \
           ulist.c qgroup-verify.c backref.c string-table.c task-utils.c \
-          inode.c file.c find-root.c
+          inode.c file.c find-root.c async-io.c ext-sort.c \
+          mem-pool.c metadump.c
 cmds_objects := cmds-subvolume.c cmds-filesystem.c cmds-device.c cmds-scrub.c \
                cmds-inspect.c cmds-balance.c cmds-send.c cmds-receive.c \
                cmds-quota.c cmds-qgroup.c cmds-replace.c cmds-check.c \
@@ -90,7 +91,7 @@ LOCAL_SRC_FILES := \
 
 LOCAL_C_INCLUDES := $(common_C_INCLUDES)
 LOCAL_CFLAGS := $(STATIC_CFLAGS)
-LOCAL_STATIC_LIBRARIES := $(btrfs_static_libraries) liblzo-static $(btrfs_system_static_libraries)
+LOCAL_STATIC_LIBRARIES := $(btrfs_static_libraries) liblzo-static libz $(btrfs_system_static_libraries)
 
 LOCAL_EXPORT_C_INCLUDES := $(common_C_INCLUDES)
 LOCAL_MODULE_TAGS := optional
@@ -106,7 +107,7 @@ LOCAL_SRC_FILES := \
 LOCAL_C_INCLUDES := $(common_C_INCLUDES)
 LOCAL_CFLAGS := $(STATIC_CFLAGS)
 LOCAL_SHARED_LIBRARIES := $(btrfs_shared_libraries)
-LOCAL_STATIC_LIBRARIES := libbtrfs liblzo-static
+LOCAL_STATIC_LIBRARIES := libbtrfs liblzo-static libz
 LOCAL_SYSTEM_SHARED_LIBRARIES := libc libcutils
 
 LOCAL_EXPORT_C_INCLUDES := $(common_C_INCLUDES)
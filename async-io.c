@@ -0,0 +1,426 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+/*
+ * Keep several reads in flight at once.  io_uring is used when the kernel
+ * supports it, otherwise a pool of threads issuing preadv(), and with a
+ * queue depth of 1 the requests are simply read one after another.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#ifdef HAVE_LINUX_IO_URING_H
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
+#include "kerncompat.h"
+#include "async-io.h"
+
+enum async_io_engine {
+	ASYNC_IO_SYNC,
+	ASYNC_IO_URING,
+	ASYNC_IO_THREADS,
+};
+
+#ifdef HAVE_LINUX_IO_URING_H
+struct async_io_uring {
+	int fd;
+	unsigned int sq_entries;
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int *sq_mask;
+	unsigned int *sq_array;
+	struct io_uring_sqe *sqes;
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int *cq_mask;
+	struct io_uring_cqe *cqes;
+	void *sq_ring;
+	size_t sq_ring_size;
+	void *cq_ring;
+	size_t cq_ring_size;
+	size_t sqes_size;
+};
+#endif
+
+struct async_io_pool {
+	pthread_t *threads;
+	int nr_threads;
+	pthread_mutex_t lock;
+	pthread_cond_t work_cond;
+	pthread_cond_t done_cond;
+	struct async_io_req *reqs;
+	int nr;
+	int next;
+	int done;
+	int stop;
+};
+
+struct async_io_ctx {
+	enum async_io_engine engine;
+	unsigned int queue_depth;
+	/* batches from several threads are submitted one after another */
+	pthread_mutex_t lock;
+#ifdef HAVE_LINUX_IO_URING_H
+	struct async_io_uring ring;
+#endif
+	struct async_io_pool pool;
+};
+
+static void do_one_read(struct async_io_req *req)
+{
+	req->ret = preadv(req->fd, req->iov, req->iovcnt, req->offset);
+	if (req->ret < 0)
+		req->ret = -errno;
+}
+
+#ifdef HAVE_LINUX_IO_URING_H
+static int uring_setup(struct async_io_uring *ring, unsigned int entries)
+{
+	struct io_uring_params p;
+	int fd;
+
+	memset(&p, 0, sizeof(p));
+	fd = syscall(__NR_io_uring_setup, entries, &p);
+	if (fd < 0)
+		return -errno;
+
+	ring->fd = fd;
+	ring->sq_entries = p.sq_entries;
+	ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	ring->cq_ring_size = p.cq_off.cqes +
+			     p.cq_entries * sizeof(struct io_uring_cqe);
+	ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+	ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+			     MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	if (ring->sq_ring == MAP_FAILED)
+		goto close_fd;
+	ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+			     MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+	if (ring->cq_ring == MAP_FAILED)
+		goto unmap_sq;
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED)
+		goto unmap_cq;
+
+	ring->sq_head = ring->sq_ring + p.sq_off.head;
+	ring->sq_tail = ring->sq_ring + p.sq_off.tail;
+	ring->sq_mask = ring->sq_ring + p.sq_off.ring_mask;
+	ring->sq_array = ring->sq_ring + p.sq_off.array;
+	ring->cq_head = ring->cq_ring + p.cq_off.head;
+	ring->cq_tail = ring->cq_ring + p.cq_off.tail;
+	ring->cq_mask = ring->cq_ring + p.cq_off.ring_mask;
+	ring->cqes = ring->cq_ring + p.cq_off.cqes;
+	return 0;
+
+unmap_cq:
+	munmap(ring->cq_ring, ring->cq_ring_size);
+unmap_sq:
+	munmap(ring->sq_ring, ring->sq_ring_size);
+close_fd:
+	close(fd);
+	return -ENOMEM;
+}
+
+static void uring_exit(struct async_io_uring *ring)
+{
+	munmap(ring->sqes, ring->sqes_size);
+	munmap(ring->cq_ring, ring->cq_ring_size);
+	munmap(ring->sq_ring, ring->sq_ring_size);
+	close(ring->fd);
+}
+
+/* returns the number of completions collected */
+static unsigned int uring_reap(struct async_io_uring *ring,
+			       struct async_io_req *reqs)
+{
+	unsigned int head = *ring->cq_head;
+	unsigned int nr = 0;
+
+	while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+		struct io_uring_cqe *cqe;
+
+		cqe = &ring->cqes[head & *ring->cq_mask];
+		reqs[cqe->user_data].ret = cqe->res;
+		head++;
+		nr++;
+	}
+	__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+	return nr;
+}
+
+/*
+ * Should io_uring_enter() fail, the requests the kernel has not taken yet
+ * are taken back from the submission queue, the ones in flight are waited
+ * for and the rest are read synchronously.  The buffers are not touched by
+ * the kernel anymore once this returns, the error is returned all the same.
+ */
+static int uring_submit_wait(struct async_io_ctx *ctx,
+			     struct async_io_req *reqs, int nr)
+{
+	struct async_io_uring *ring = &ctx->ring;
+	unsigned int unsubmitted = 0;
+	unsigned int inflight = 0;
+	unsigned int reaped;
+	unsigned int tail;
+	unsigned int head;
+	int next = 0;
+	int done = 0;
+	int err = 0;
+	int ret;
+
+	while (done < nr) {
+		tail = *ring->sq_tail;
+		head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+		while (next < nr && inflight < ctx->queue_depth &&
+		       tail - head < ring->sq_entries) {
+			unsigned int idx = tail & *ring->sq_mask;
+			struct io_uring_sqe *sqe = &ring->sqes[idx];
+
+			memset(sqe, 0, sizeof(*sqe));
+			sqe->opcode = IORING_OP_READV;
+			sqe->fd = reqs[next].fd;
+			sqe->addr = (unsigned long)reqs[next].iov;
+			sqe->len = reqs[next].iovcnt;
+			sqe->off = reqs[next].offset;
+			sqe->user_data = next;
+			ring->sq_array[idx] = idx;
+			tail++;
+			next++;
+			inflight++;
+			unsubmitted++;
+		}
+		__atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+
+		ret = syscall(__NR_io_uring_enter, ring->fd, unsubmitted, 1,
+			      IORING_ENTER_GETEVENTS, NULL, 0);
+		if (ret < 0) {
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+			err = -errno;
+			break;
+		}
+		unsubmitted -= ret;
+
+		reaped = uring_reap(ring, reqs);
+		inflight -= reaped;
+		done += reaped;
+	}
+	if (!err)
+		return 0;
+
+	/* the queued entries were filled in order, the last ones are unused */
+	head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	tail = *ring->sq_tail;
+	__atomic_store_n(ring->sq_tail, head, __ATOMIC_RELEASE);
+	next -= tail - head;
+	inflight -= tail - head;
+
+	while (inflight) {
+		ret = syscall(__NR_io_uring_enter, ring->fd, 0, 1,
+			      IORING_ENTER_GETEVENTS, NULL, 0);
+		if (ret < 0 && errno != EINTR && errno != EAGAIN)
+			usleep(1000);
+		inflight -= uring_reap(ring, reqs);
+	}
+	for (; next < nr; next++)
+		do_one_read(&reqs[next]);
+	return err;
+}
+#endif
+
+static void *pool_worker(void *data)
+{
+	struct async_io_pool *pool = data;
+	struct async_io_req *req;
+
+	pthread_mutex_lock(&pool->lock);
+	while (!pool->stop) {
+		if (pool->next >= pool->nr) {
+			pthread_cond_wait(&pool->work_cond, &pool->lock);
+			continue;
+		}
+		req = &pool->reqs[pool->next++];
+		pthread_mutex_unlock(&pool->lock);
+
+		do_one_read(req);
+
+		pthread_mutex_lock(&pool->lock);
+		if (++pool->done == pool->nr)
+			pthread_cond_signal(&pool->done_cond);
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return NULL;
+}
+
+static void pool_exit(struct async_io_pool *pool)
+{
+	int i;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->stop = 1;
+	pthread_cond_broadcast(&pool->work_cond);
+	pthread_mutex_unlock(&pool->lock);
+
+	for (i = 0; i < pool->nr_threads; i++)
+		pthread_join(pool->threads[i], NULL);
+	free(pool->threads);
+	pthread_mutex_destroy(&pool->lock);
+	pthread_cond_destroy(&pool->work_cond);
+	pthread_cond_destroy(&pool->done_cond);
+}
+
+static int pool_init(struct async_io_pool *pool, unsigned int nr_threads)
+{
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->work_cond, NULL);
+	pthread_cond_init(&pool->done_cond, NULL);
+
+	pool->threads = calloc(nr_threads, sizeof(pthread_t));
+	if (!pool->threads)
+		return -ENOMEM;
+	for (pool->nr_threads = 0; pool->nr_threads < nr_threads;
+	     pool->nr_threads++) {
+		if (pthread_create(&pool->threads[pool->nr_threads], NULL,
+				   pool_worker, pool))
+			break;
+	}
+	if (pool->nr_threads == 0) {
+		pool_exit(pool);
+		return -EAGAIN;
+	}
+	return 0;
+}
+
+static int pool_submit_wait(struct async_io_pool *pool,
+			    struct async_io_req *reqs, int nr)
+{
+	pthread_mutex_lock(&pool->lock);
+	pool->reqs = reqs;
+	pool->nr = nr;
+	pool->next = 0;
+	pool->done = 0;
+	pthread_cond_broadcast(&pool->work_cond);
+	while (pool->done < pool->nr)
+		pthread_cond_wait(&pool->done_cond, &pool->lock);
+	pool->reqs = NULL;
+	pool->nr = 0;
+	pool->next = 0;
+	pthread_mutex_unlock(&pool->lock);
+	return 0;
+}
+
+/*
+ * Create a context keeping up to @queue_depth reads in flight.  A depth of 0
+ * or 1 reads synchronously in the caller's thread.
+ */
+struct async_io_ctx *async_io_init(unsigned int queue_depth)
+{
+	struct async_io_ctx *ctx;
+
+	ctx = calloc(1, sizeof(*ctx));
+	if (!ctx)
+		return NULL;
+
+	pthread_mutex_init(&ctx->lock, NULL);
+	ctx->queue_depth = max(queue_depth, 1U);
+	ctx->engine = ASYNC_IO_SYNC;
+	if (ctx->queue_depth == 1)
+		return ctx;
+
+#ifdef HAVE_LINUX_IO_URING_H
+	if (uring_setup(&ctx->ring, ctx->queue_depth) == 0) {
+		ctx->engine = ASYNC_IO_URING;
+		return ctx;
+	}
+#endif
+	if (pool_init(&ctx->pool, ctx->queue_depth) == 0)
+		ctx->engine = ASYNC_IO_THREADS;
+	return ctx;
+}
+
+void async_io_exit(struct async_io_ctx *ctx)
+{
+	if (!ctx)
+		return;
+
+	switch (ctx->engine) {
+#ifdef HAVE_LINUX_IO_URING_H
+	case ASYNC_IO_URING:
+		uring_exit(&ctx->ring);
+		break;
+#endif
+	case ASYNC_IO_THREADS:
+		pool_exit(&ctx->pool);
+		break;
+	default:
+		break;
+	}
+	pthread_mutex_destroy(&ctx->lock);
+	free(ctx);
+}
+
+/*
+ * Issue all @nr requests and return once every one of them has completed,
+ * the per-request result is in reqs[i].ret.  A failure of the engine itself
+ * is returned as -errno, the requests are still completed before that.
+ */
+int async_io_submit_wait(struct async_io_ctx *ctx, struct async_io_req *reqs,
+			 int nr)
+{
+	int ret;
+	int i;
+
+	if (nr <= 0)
+		return 0;
+
+	if (ctx->engine == ASYNC_IO_SYNC) {
+		for (i = 0; i < nr; i++)
+			do_one_read(&reqs[i]);
+		return 0;
+	}
+
+	pthread_mutex_lock(&ctx->lock);
+#ifdef HAVE_LINUX_IO_URING_H
+	if (ctx->engine == ASYNC_IO_URING)
+		ret = uring_submit_wait(ctx, reqs, nr);
+	else
+#endif
+		ret = pool_submit_wait(&ctx->pool, reqs, nr);
+	pthread_mutex_unlock(&ctx->lock);
+	return ret;
+}
+
+const char *async_io_engine_name(struct async_io_ctx *ctx)
+{
+	switch (ctx->engine) {
+	case ASYNC_IO_URING:
+		return "io_uring";
+	case ASYNC_IO_THREADS:
+		return "threads";
+	default:
+		return "sync";
+	}
+}
@@ -0,0 +1,44 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+#ifndef __BTRFS_ASYNC_IO_H__
+#define __BTRFS_ASYNC_IO_H__
+
+#include <sys/types.h>
+#include <sys/uio.h>
+#include "kerncompat.h"
+
+/*
+ * One vectored read, @ret is set to the number of bytes read or -errno
+ * once the request completes.
+ */
+struct async_io_req {
+	int fd;
+	struct iovec *iov;
+	int iovcnt;
+	u64 offset;
+	ssize_t ret;
+};
+
+struct async_io_ctx;
+
+struct async_io_ctx *async_io_init(unsigned int queue_depth);
+void async_io_exit(struct async_io_ctx *ctx);
+int async_io_submit_wait(struct async_io_ctx *ctx, struct async_io_req *reqs,
+			 int nr);
+const char *async_io_engine_name(struct async_io_ctx *ctx);
+
+#endif
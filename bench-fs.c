@@ -0,0 +1,1153 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+/*
+ * Fill a filesystem freshly made by mkfs.btrfs with a synthetic data set for
+ * the benchmarks in tests/bench.sh.  The files are created in a subvolume
+ * named "data" the same way mkfs --rootdir creates them, and the snapshots
+ * of that subvolume are linked next to it in the top level.  Everything is
+ * drawn from a seeded generator, so the same options always give the same
+ * trees.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <string.h>
+#include <sys/stat.h>
+#include "kerncompat.h"
+#include "ctree.h"
+#include "disk-io.h"
+#include "transaction.h"
+#include "utils.h"
+#include "volumes.h"
+
+#define BENCH_SUBVOL_OBJECTID	BTRFS_FIRST_FREE_OBJECTID
+#define BENCH_SUBVOL_NAME	"data"
+
+/* same limit as mkfs, a data extent is never bigger than 1MiB */
+#define BENCH_MAX_EXTENT	(1024 * 1024)
+
+/* pieces of a fragmented file are 1 to 16 sectors long */
+#define BENCH_FRAG_SECTORS	16
+
+/* commit after this many new inodes to bound the dirty tree blocks */
+#define BENCH_COMMIT_INODES	4096
+
+/*
+ * Metadata chunks are only allocated by the tree blocks of the subvolumes and
+ * only once the space info looks full, which is too late for a transaction
+ * that changes many snapshotted leaves.  Keep this much free at its start.
+ */
+#define BENCH_METADATA_FREE	(32 * 1024 * 1024)
+
+/* the files whose extents a reflinked file may share */
+#define BENCH_REFLINK_FILES	1024
+
+/* all the inodes get the same times so the trees are reproducible */
+#define BENCH_TIME		1400000000ULL
+
+struct bench_opts {
+	u64 seed;
+	u64 nr_files;
+	u64 fanout;
+	u64 min_size;
+	u64 max_size;
+	u32 reflink_pct;
+	u32 frag_pct;
+	u32 change_pct;
+	u32 nr_snapshots;
+	int quota;
+};
+
+struct bench_extent {
+	u64 file_pos;
+	u64 bytenr;
+	u64 len;
+};
+
+struct bench_file {
+	u64 size;
+	int nr_extents;
+	int max_extents;
+	struct bench_extent *extents;
+};
+
+struct bench_fs {
+	struct bench_opts opts;
+	struct btrfs_root *fs_root;
+	struct btrfs_root *root;
+	struct btrfs_root *quota_root;
+	struct btrfs_trans_handle *trans;
+	u64 rand_state;
+	u64 next_ino;
+	u64 root_dir_size;
+	u64 root_dir_index;
+
+	/* the filler between the pieces of the fragmented files */
+	u64 spacer_ino;
+	u64 spacer_pos;
+	struct btrfs_inode_item spacer_inode;
+
+	struct bench_file files[BENCH_REFLINK_FILES];
+	u64 nr_reflink_files;
+
+	struct extent_buffer *eb;
+	char *data;
+
+	u64 nr_dirs;
+	u64 nr_inline;
+	u64 nr_extents;
+	u64 nr_reflinks;
+	u64 data_bytes;
+};
+
+static u64 bench_rand(struct bench_fs *b)
+{
+	u64 x = b->rand_state;
+
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	b->rand_state = x;
+	return x * 0x2545F4914F6CDD1DULL;
+}
+
+static u64 bench_rand_below(struct bench_fs *b, u64 n)
+{
+	return n ? bench_rand(b) % n : 0;
+}
+
+static int bench_percent(struct bench_fs *b, u32 pct)
+{
+	return bench_rand_below(b, 100) < pct;
+}
+
+static void fill_random(struct bench_fs *b, char *buf, u64 len)
+{
+	u64 val;
+	u64 i;
+
+	for (i = 0; i < len; i += sizeof(val)) {
+		val = bench_rand(b);
+		memcpy(buf + i, &val, min_t(u64, sizeof(val), len - i));
+	}
+}
+
+static int size_bits(u64 size)
+{
+	int bits = 0;
+
+	while (size) {
+		bits++;
+		size >>= 1;
+	}
+	return bits;
+}
+
+/*
+ * The sizes are spread evenly over the powers of two between the minimum and
+ * the maximum, so there are about as many 4KiB files as 1MiB ones.
+ */
+static u64 bench_file_size(struct bench_fs *b)
+{
+	u64 lo = b->opts.min_size;
+	u64 hi = b->opts.max_size;
+	int lo_bits = size_bits(lo);
+	int hi_bits = size_bits(hi);
+	int bits;
+	u64 start;
+	u64 end;
+
+	bits = lo_bits + bench_rand_below(b, hi_bits - lo_bits + 1);
+	start = bits ? 1ULL << (bits - 1) : 0;
+	end = bits ? (1ULL << bits) - 1 : 0;
+	start = max(start, lo);
+	end = min(end, hi);
+	return start + bench_rand_below(b, end - start + 1);
+}
+
+static void init_inode(struct bench_fs *b, struct btrfs_inode_item *inode,
+		       u32 mode, u64 size)
+{
+	memset(inode, 0, sizeof(*inode));
+	btrfs_set_stack_inode_generation(inode, b->trans->transid);
+	btrfs_set_stack_inode_size(inode, size);
+	btrfs_set_stack_inode_nlink(inode, 1);
+	btrfs_set_stack_inode_mode(inode, mode);
+	btrfs_set_stack_timespec_sec(&inode->atime, BENCH_TIME);
+	btrfs_set_stack_timespec_sec(&inode->ctime, BENCH_TIME);
+	btrfs_set_stack_timespec_sec(&inode->mtime, BENCH_TIME);
+}
+
+/*
+ * The subvolume gets a new root node in every transaction it is changed in,
+ * so its root item is written back when the transaction is committed.
+ */
+static int record_root_in_trans(struct btrfs_trans_handle *trans,
+				struct btrfs_root *root)
+{
+	struct extent_buffer *eb;
+	int ret;
+
+	if (root->last_trans == trans->transid)
+		return 0;
+	root->track_dirty = 1;
+	root->last_trans = trans->transid;
+	root->commit_root = root->node;
+	extent_buffer_get(root->node);
+
+	eb = root->node;
+	extent_buffer_get(eb);
+	ret = btrfs_cow_block(trans, root, eb, NULL, 0, &eb);
+	free_extent_buffer(eb);
+	add_root_to_dirty_list(root);
+	return ret;
+}
+
+static int reserve_metadata(struct bench_fs *b)
+{
+	struct btrfs_fs_info *fs_info = b->fs_root->fs_info;
+	struct btrfs_block_group_cache *cache;
+	u64 flags = BTRFS_BLOCK_GROUP_METADATA;
+	u64 size = 0;
+	u64 free = 0;
+	u64 start = 0;
+	u64 chunk_start;
+	u64 chunk_size;
+	int ret;
+
+	/* mkfs leaves a small single group behind, go by the biggest ones */
+	while ((cache = btrfs_lookup_first_block_group(fs_info, start))) {
+		if ((cache->flags & BTRFS_BLOCK_GROUP_METADATA) &&
+		    cache->key.offset > size) {
+			size = cache->key.offset;
+			flags = cache->flags;
+		}
+		start = cache->key.objectid + cache->key.offset;
+	}
+	start = 0;
+	while ((cache = btrfs_lookup_first_block_group(fs_info, start))) {
+		if (cache->flags == flags)
+			free += cache->key.offset -
+				btrfs_block_group_used(&cache->item);
+		start = cache->key.objectid + cache->key.offset;
+	}
+	if (free >= BENCH_METADATA_FREE)
+		return 0;
+
+	ret = btrfs_alloc_chunk(b->trans, fs_info->extent_root, &chunk_start,
+				&chunk_size, flags);
+	if (ret)
+		return ret;
+	ret = btrfs_make_block_group(b->trans, fs_info->extent_root, 0, flags,
+				     BTRFS_FIRST_CHUNK_TREE_OBJECTID,
+				     chunk_start, chunk_size);
+	if (ret)
+		return ret;
+	set_extent_dirty(&fs_info->free_space_cache, chunk_start,
+			 chunk_start + chunk_size - 1, 0);
+	return 0;
+}
+
+static int start_trans(struct bench_fs *b)
+{
+	int ret;
+
+	b->trans = btrfs_start_transaction(b->fs_root, 1);
+	if (!b->trans)
+		return -ENOMEM;
+	ret = reserve_metadata(b);
+	if (ret || !b->root)
+		return ret;
+	return record_root_in_trans(b->trans, b->root);
+}
+
+static int commit_trans(struct bench_fs *b)
+{
+	int ret;
+
+	ret = btrfs_commit_transaction(b->trans, b->fs_root);
+	b->trans = NULL;
+	return ret;
+}
+
+static int add_dir_entry(struct bench_fs *b, struct btrfs_root *root,
+			 u64 dir, u64 *index, const char *name, u64 ino,
+			 u8 filetype)
+{
+	struct btrfs_key location;
+	int len = strlen(name);
+	int ret;
+
+	location.objectid = ino;
+	location.type = BTRFS_INODE_ITEM_KEY;
+	location.offset = 0;
+	ret = btrfs_insert_dir_item(b->trans, root, name, len, dir, &location,
+				    filetype, *index);
+	if (ret)
+		return ret;
+	ret = btrfs_insert_inode_ref(b->trans, root, name, len, ino, dir,
+				     *index);
+	(*index)++;
+	return ret;
+}
+
+static int add_dir_size(struct bench_fs *b, struct btrfs_root *root, u64 dir,
+			u64 bytes)
+{
+	struct btrfs_inode_item *inode_item;
+	struct extent_buffer *leaf;
+	struct btrfs_path path;
+	struct btrfs_key key;
+	int ret;
+
+	btrfs_init_path(&path);
+	key.objectid = dir;
+	key.type = BTRFS_INODE_ITEM_KEY;
+	key.offset = 0;
+	ret = btrfs_lookup_inode(b->trans, root, &path, &key, 1);
+	if (ret > 0)
+		ret = -ENOENT;
+	if (ret)
+		goto out;
+	leaf = path.nodes[0];
+	inode_item = btrfs_item_ptr(leaf, path.slots[0],
+				    struct btrfs_inode_item);
+	btrfs_set_inode_size(leaf, inode_item,
+			     btrfs_inode_size(leaf, inode_item) + bytes);
+	btrfs_mark_buffer_dirty(leaf);
+out:
+	btrfs_release_path(&path);
+	return ret;
+}
+
+static int next_dir_index(struct btrfs_root *root, u64 dir, u64 *index)
+{
+	struct btrfs_path path;
+	struct btrfs_key key;
+	int ret;
+
+	btrfs_init_path(&path);
+	key.objectid = dir;
+	key.type = BTRFS_DIR_INDEX_KEY;
+	key.offset = (u64)-1;
+	ret = btrfs_search_slot(NULL, root, &key, &path, 0, 0);
+	if (ret < 0)
+		goto out;
+	*index = 2;
+	if (path.slots[0] > 0) {
+		path.slots[0]--;
+		btrfs_item_key_to_cpu(path.nodes[0], &key, path.slots[0]);
+		if (key.objectid == dir && key.type == BTRFS_DIR_INDEX_KEY)
+			*index = key.offset + 1;
+	}
+	ret = 0;
+out:
+	btrfs_release_path(&path);
+	return ret;
+}
+
+/* link the subvolume @root_objectid into the top level directory */
+static int link_subvol(struct bench_fs *b, const char *name, u64 root_objectid)
+{
+	struct btrfs_root *fs_root = b->fs_root;
+	struct btrfs_root *tree_root = fs_root->fs_info->tree_root;
+	struct btrfs_key location;
+	u64 dir = btrfs_root_dirid(&fs_root->root_item);
+	u64 index;
+	int len = strlen(name);
+	int ret;
+
+	ret = next_dir_index(fs_root, dir, &index);
+	if (ret)
+		return ret;
+
+	location.objectid = root_objectid;
+	location.type = BTRFS_ROOT_ITEM_KEY;
+	location.offset = (u64)-1;
+	ret = btrfs_insert_dir_item(b->trans, fs_root, name, len, dir,
+				    &location, BTRFS_FT_DIR, index);
+	if (ret)
+		return ret;
+	ret = add_dir_size(b, fs_root, dir, len * 2);
+	if (ret)
+		return ret;
+
+	/* add the backref first */
+	ret = btrfs_add_root_ref(b->trans, tree_root, root_objectid,
+				 BTRFS_ROOT_BACKREF_KEY,
+				 fs_root->root_key.objectid, dir, index,
+				 name, len);
+	if (ret)
+		return ret;
+
+	/* now add the forward ref */
+	return btrfs_add_root_ref(b->trans, tree_root,
+				  fs_root->root_key.objectid,
+				  BTRFS_ROOT_REF_KEY, root_objectid, dir,
+				  index, name, len);
+}
+
+/* the root node of a new tree */
+static struct extent_buffer *alloc_empty_leaf(struct bench_fs *b, u64 owner)
+{
+	struct btrfs_fs_info *fs_info = b->fs_root->fs_info;
+	struct btrfs_disk_key disk_key = {0, 0, 0};
+	struct extent_buffer *leaf;
+
+	leaf = btrfs_alloc_free_block(b->trans, b->fs_root,
+				      b->fs_root->leafsize, owner, &disk_key,
+				      0, 0, 0);
+	if (IS_ERR(leaf))
+		return leaf;
+
+	memset_extent_buffer(leaf, 0, 0, sizeof(struct btrfs_header));
+	btrfs_set_header_level(leaf, 0);
+	btrfs_set_header_bytenr(leaf, leaf->start);
+	btrfs_set_header_generation(leaf, b->trans->transid);
+	btrfs_set_header_backref_rev(leaf, BTRFS_MIXED_BACKREF_REV);
+	btrfs_set_header_owner(leaf, owner);
+	write_extent_buffer(leaf, fs_info->fsid, btrfs_header_fsid(),
+			    BTRFS_FSID_SIZE);
+	write_extent_buffer(leaf, fs_info->chunk_tree_uuid,
+			    btrfs_header_chunk_tree_uuid(leaf),
+			    BTRFS_UUID_SIZE);
+	btrfs_mark_buffer_dirty(leaf);
+	return leaf;
+}
+
+static int create_subvol(struct bench_fs *b)
+{
+	struct btrfs_fs_info *fs_info = b->fs_root->fs_info;
+	struct btrfs_root_item root_item;
+	struct extent_buffer *leaf;
+	struct btrfs_root *root;
+	struct btrfs_key key;
+	int ret;
+
+	leaf = alloc_empty_leaf(b, BENCH_SUBVOL_OBJECTID);
+	if (IS_ERR(leaf))
+		return PTR_ERR(leaf);
+
+	memcpy(&root_item, &b->fs_root->root_item, sizeof(root_item));
+	btrfs_set_root_bytenr(&root_item, leaf->start);
+	btrfs_set_root_level(&root_item, 0);
+	btrfs_set_root_generation(&root_item, b->trans->transid);
+	btrfs_set_root_refs(&root_item, 1);
+	btrfs_set_root_last_snapshot(&root_item, 0);
+	btrfs_set_root_dirid(&root_item, BTRFS_FIRST_FREE_OBJECTID);
+	free_extent_buffer(leaf);
+
+	key.objectid = BENCH_SUBVOL_OBJECTID;
+	key.type = BTRFS_ROOT_ITEM_KEY;
+	key.offset = 0;
+	ret = btrfs_insert_root(b->trans, fs_info->tree_root, &key,
+				&root_item);
+	if (ret)
+		return ret;
+
+	key.offset = (u64)-1;
+	root = btrfs_read_fs_root(fs_info, &key);
+	if (IS_ERR(root))
+		return PTR_ERR(root);
+	ret = record_root_in_trans(b->trans, root);
+	if (ret)
+		return ret;
+	ret = btrfs_make_root_dir(b->trans, root, BTRFS_FIRST_FREE_OBJECTID);
+	if (ret)
+		return ret;
+	b->root = root;
+	b->root_dir_index = 2;
+	return link_subvol(b, BENCH_SUBVOL_NAME, BENCH_SUBVOL_OBJECTID);
+}
+
+/*
+ * Write @len bytes of random data to a new extent and record it in the file
+ * the same way mkfs does.
+ */
+static int write_extent(struct bench_fs *b, u64 ino,
+			struct btrfs_inode_item *inode, u64 file_pos, u64 len,
+			u64 *bytenr)
+{
+	struct btrfs_root *root = b->root;
+	u32 sectorsize = root->sectorsize;
+	struct btrfs_key key;
+	u64 done;
+	int ret;
+
+	ret = btrfs_reserve_extent(b->trans, root, len, 0, 0, (u64)-1, &key, 1);
+	if (ret)
+		return ret;
+
+	fill_random(b, b->data, len);
+	ret = btrfs_csum_file_blocks(b->trans, root->fs_info->csum_root,
+				     key.objectid + len, key.objectid,
+				     b->data, len);
+	if (ret)
+		return ret;
+
+	for (done = 0; done < len; done += sectorsize) {
+		memcpy(b->eb->data, b->data + done, sectorsize);
+		b->eb->start = key.objectid + done;
+		b->eb->len = sectorsize;
+		ret = write_and_map_eb(b->trans, root, b->eb);
+		if (ret) {
+			fprintf(stderr, "output file write failed\n");
+			return ret;
+		}
+	}
+
+	ret = btrfs_record_file_extent(b->trans, root, ino, inode, file_pos,
+				       key.objectid, len);
+	if (ret)
+		return ret;
+	*bytenr = key.objectid;
+	b->nr_extents++;
+	b->data_bytes += len;
+	return 0;
+}
+
+static int remember_extent(struct bench_file *file, u64 file_pos, u64 bytenr,
+			   u64 len)
+{
+	struct bench_extent *extents;
+
+	if (file->nr_extents == file->max_extents) {
+		file->max_extents = file->max_extents ? file->max_extents * 2 : 4;
+		extents = realloc(file->extents,
+				  file->max_extents * sizeof(*extents));
+		if (!extents)
+			return -ENOMEM;
+		file->extents = extents;
+	}
+	extents = &file->extents[file->nr_extents++];
+	extents->file_pos = file_pos;
+	extents->bytenr = bytenr;
+	extents->len = len;
+	return 0;
+}
+
+/*
+ * Fill a regular file with data.  The extents of a fragmented file are cut in
+ * small pieces and a sector of the spacer file is put between two of them,
+ * so they can not be merged and are scattered over the block group.
+ */
+static int write_file_data(struct bench_fs *b, u64 ino,
+			   struct btrfs_inode_item *inode, u64 size)
+{
+	struct bench_file *file;
+	u32 sectorsize = b->root->sectorsize;
+	u64 total = round_up(size, sectorsize);
+	u64 pos = 0;
+	u64 bytenr;
+	u64 len;
+	int frag = b->spacer_ino && bench_percent(b, b->opts.frag_pct);
+	int ret;
+
+	file = &b->files[b->nr_reflink_files++ % BENCH_REFLINK_FILES];
+	file->size = size;
+	file->nr_extents = 0;
+
+	while (pos < total) {
+		len = min_t(u64, total - pos, BENCH_MAX_EXTENT);
+		if (frag)
+			len = min_t(u64, len, sectorsize *
+				    (1 + bench_rand_below(b, BENCH_FRAG_SECTORS)));
+		ret = write_extent(b, ino, inode, pos, len, &bytenr);
+		if (ret)
+			return ret;
+		ret = remember_extent(file, pos, bytenr, len);
+		if (ret)
+			return ret;
+		pos += len;
+
+		if (!frag)
+			continue;
+		ret = write_extent(b, b->spacer_ino, &b->spacer_inode,
+				   b->spacer_pos, sectorsize, &bytenr);
+		if (ret)
+			return ret;
+		b->spacer_pos += sectorsize;
+	}
+	return 0;
+}
+
+/* share all the extents of one of the last regular files written */
+static int reflink_file_data(struct bench_fs *b, u64 ino,
+			     struct btrfs_inode_item *inode)
+{
+	struct bench_file *file;
+	struct bench_extent *extent;
+	u64 nr = min_t(u64, b->nr_reflink_files, BENCH_REFLINK_FILES);
+	int ret;
+	int i;
+
+	file = &b->files[bench_rand_below(b, nr)];
+	btrfs_set_stack_inode_size(inode, file->size);
+	for (i = 0; i < file->nr_extents; i++) {
+		extent = &file->extents[i];
+		ret = btrfs_record_file_extent(b->trans, b->root, ino, inode,
+					       extent->file_pos, extent->bytenr,
+					       extent->len);
+		if (ret)
+			return ret;
+	}
+	b->nr_reflinks++;
+	return 0;
+}
+
+static int create_file(struct bench_fs *b, u64 dir, u64 *index,
+		       u64 *dir_size, u64 nr)
+{
+	struct btrfs_root *root = b->root;
+	struct btrfs_inode_item inode;
+	char name[32];
+	u64 ino = b->next_ino++;
+	u64 size;
+	int ret;
+
+	snprintf(name, sizeof(name), "f%08llu", (unsigned long long)nr);
+	ret = add_dir_entry(b, root, dir, index, name, ino,
+			    BTRFS_FT_REG_FILE);
+	if (ret)
+		return ret;
+	*dir_size += strlen(name) * 2;
+
+	if (b->nr_reflink_files && bench_percent(b, b->opts.reflink_pct)) {
+		init_inode(b, &inode, S_IFREG | 0644, 0);
+		ret = reflink_file_data(b, ino, &inode);
+		goto out;
+	}
+
+	size = bench_file_size(b);
+	init_inode(b, &inode, S_IFREG | 0644, size);
+	if (!size) {
+		ret = 0;
+	} else if (size < root->sectorsize &&
+		   size <= BTRFS_MAX_INLINE_DATA_SIZE(root)) {
+		fill_random(b, b->data, size);
+		ret = btrfs_insert_inline_extent(b->trans, root, ino, 0,
+						 b->data, size);
+		btrfs_set_stack_inode_nbytes(&inode, size);
+		b->nr_inline++;
+	} else {
+		ret = write_file_data(b, ino, &inode, size);
+	}
+out:
+	if (ret)
+		return ret;
+	return btrfs_insert_inode(b->trans, root, ino, &inode);
+}
+
+static int finish_dir(struct bench_fs *b, u64 dir, u64 size)
+{
+	struct btrfs_inode_item inode;
+
+	init_inode(b, &inode, S_IFDIR | 0755, size);
+	return btrfs_insert_inode(b->trans, b->root, dir, &inode);
+}
+
+static int create_files(struct bench_fs *b)
+{
+	struct btrfs_root *root = b->root;
+	u64 root_dir = btrfs_root_dirid(&root->root_item);
+	u64 dir = 0;
+	u64 dir_size = 0;
+	u64 index = 0;
+	u64 since_commit = 0;
+	char name[32];
+	u64 i;
+	int ret;
+
+	for (i = 0; i < b->opts.nr_files; i++) {
+		if (i % b->opts.fanout == 0) {
+			if (dir) {
+				ret = finish_dir(b, dir, dir_size);
+				if (ret)
+					return ret;
+			}
+			dir = b->next_ino++;
+			dir_size = 0;
+			index = 2;
+			snprintf(name, sizeof(name), "d%06llu",
+				 (unsigned long long)b->nr_dirs++);
+			ret = add_dir_entry(b, root, root_dir,
+					    &b->root_dir_index, name, dir,
+					    BTRFS_FT_DIR);
+			if (ret)
+				return ret;
+			b->root_dir_size += strlen(name) * 2;
+		}
+		ret = create_file(b, dir, &index, &dir_size, i);
+		if (ret)
+			return ret;
+
+		if (++since_commit < BENCH_COMMIT_INODES)
+			continue;
+		since_commit = 0;
+		ret = commit_trans(b);
+		if (!ret)
+			ret = start_trans(b);
+		if (ret)
+			return ret;
+	}
+	if (dir) {
+		ret = finish_dir(b, dir, dir_size);
+		if (ret)
+			return ret;
+	}
+
+	if (b->spacer_ino) {
+		btrfs_set_stack_inode_size(&b->spacer_inode, b->spacer_pos);
+		ret = btrfs_insert_inode(b->trans, root, b->spacer_ino,
+					 &b->spacer_inode);
+		if (ret)
+			return ret;
+		ret = add_dir_entry(b, root, root_dir, &b->root_dir_index,
+				    ".frag", b->spacer_ino, BTRFS_FT_REG_FILE);
+		if (ret)
+			return ret;
+		b->root_dir_size += strlen(".frag") * 2;
+	}
+	return add_dir_size(b, root, root_dir, b->root_dir_size);
+}
+
+/* bump the times of @pct percent of the inodes, so the snapshots diverge */
+static int change_inodes(struct bench_fs *b, u32 pct, u64 time)
+{
+	struct btrfs_inode_item *inode_item;
+	struct extent_buffer *leaf;
+	struct btrfs_path path;
+	struct btrfs_key key;
+	u64 first = BTRFS_FIRST_FREE_OBJECTID + 1;
+	u64 nr = (b->next_ino - first) * pct / 100;
+	u64 i;
+	int ret = 0;
+
+	btrfs_init_path(&path);
+	for (i = 0; i < nr; i++) {
+		key.objectid = first + bench_rand_below(b, b->next_ino - first);
+		key.type = BTRFS_INODE_ITEM_KEY;
+		key.offset = 0;
+		ret = btrfs_lookup_inode(b->trans, b->root, &path, &key, 1);
+		if (ret > 0)
+			ret = -ENOENT;
+		if (ret)
+			break;
+		leaf = path.nodes[0];
+		inode_item = btrfs_item_ptr(leaf, path.slots[0],
+					    struct btrfs_inode_item);
+		btrfs_set_inode_transid(leaf, inode_item, b->trans->transid);
+		btrfs_set_timespec_sec(leaf, btrfs_inode_mtime(inode_item),
+				       time);
+		btrfs_set_timespec_sec(leaf, btrfs_inode_ctime(inode_item),
+				       time);
+		btrfs_mark_buffer_dirty(leaf);
+		btrfs_release_path(&path);
+	}
+	btrfs_release_path(&path);
+	return ret;
+}
+
+/*
+ * Snapshot the data subvolume.  Nothing may change the subvolume after its
+ * root is copied until the transaction is committed, the blocks the snapshot
+ * shares with it are not marked as written yet and would not be COWed.
+ */
+static int create_snapshot(struct bench_fs *b, u64 objectid, int nr)
+{
+	struct btrfs_root *root = b->root;
+	struct btrfs_root_item root_item;
+	struct extent_buffer *tmp;
+	struct btrfs_key key;
+	char name[32];
+	int ret;
+
+	ret = btrfs_copy_root(b->trans, root, root->node, &tmp, objectid);
+	if (ret)
+		return ret;
+
+	memcpy(&root_item, &root->root_item, sizeof(root_item));
+	btrfs_set_root_bytenr(&root_item, tmp->start);
+	btrfs_set_root_level(&root_item, btrfs_header_level(tmp));
+	btrfs_set_root_generation(&root_item, b->trans->transid);
+	btrfs_set_root_refs(&root_item, 1);
+	btrfs_set_root_last_snapshot(&root_item, b->trans->transid);
+	free_extent_buffer(tmp);
+
+	key.objectid = objectid;
+	key.type = BTRFS_ROOT_ITEM_KEY;
+	key.offset = b->trans->transid;
+	ret = btrfs_insert_root(b->trans, root->fs_info->tree_root, &key,
+				&root_item);
+	if (ret)
+		return ret;
+	btrfs_set_root_last_snapshot(&root->root_item, b->trans->transid);
+
+	snprintf(name, sizeof(name), "snap-%04d", nr);
+	return link_subvol(b, name, objectid);
+}
+
+static int create_snapshots(struct bench_fs *b)
+{
+	u32 i;
+	int ret;
+
+	for (i = 0; i < b->opts.nr_snapshots; i++) {
+		ret = start_trans(b);
+		if (ret)
+			return ret;
+		if (i) {
+			ret = change_inodes(b, b->opts.change_pct,
+					    BENCH_TIME + i);
+			if (ret)
+				return ret;
+		}
+		ret = create_snapshot(b, BENCH_SUBVOL_OBJECTID + 1 + i, i + 1);
+		if (ret)
+			return ret;
+		ret = commit_trans(b);
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+static int insert_qgroup(struct btrfs_trans_handle *trans,
+			 struct btrfs_root *quota_root, u64 qgroupid)
+{
+	struct btrfs_qgroup_info_item info;
+	struct btrfs_qgroup_limit_item limit;
+	struct btrfs_key key;
+	int ret;
+
+	memset(&info, 0, sizeof(info));
+	btrfs_set_stack_qgroup_info_generation(&info, trans->transid);
+	key.objectid = 0;
+	key.type = BTRFS_QGROUP_INFO_KEY;
+	key.offset = qgroupid;
+	ret = btrfs_insert_item(trans, quota_root, &key, &info, sizeof(info));
+	if (ret)
+		return ret;
+
+	memset(&limit, 0, sizeof(limit));
+	key.type = BTRFS_QGROUP_LIMIT_KEY;
+	return btrfs_insert_item(trans, quota_root, &key, &limit,
+				 sizeof(limit));
+}
+
+/*
+ * Enable quotas with a qgroup for each subvolume.  Their counters are left
+ * at zero and marked inconsistent, as when the kernel has enabled quotas and
+ * not rescanned yet.
+ */
+static int enable_quota(struct bench_fs *b)
+{
+	struct btrfs_fs_info *fs_info = b->fs_root->fs_info;
+	struct btrfs_qgroup_status_item status;
+	struct btrfs_root_item root_item;
+	struct extent_buffer *leaf;
+	struct btrfs_root *root;
+	struct btrfs_key key;
+	u32 i;
+	int ret;
+
+	leaf = alloc_empty_leaf(b, BTRFS_QUOTA_TREE_OBJECTID);
+	if (IS_ERR(leaf))
+		return PTR_ERR(leaf);
+
+	memset(&root_item, 0, sizeof(root_item));
+	btrfs_set_root_bytenr(&root_item, leaf->start);
+	btrfs_set_root_level(&root_item, 0);
+	btrfs_set_root_generation(&root_item, b->trans->transid);
+	btrfs_set_root_refs(&root_item, 1);
+	free_extent_buffer(leaf);
+
+	key.objectid = BTRFS_QUOTA_TREE_OBJECTID;
+	key.type = BTRFS_ROOT_ITEM_KEY;
+	key.offset = 0;
+	ret = btrfs_insert_root(b->trans, fs_info->tree_root, &key,
+				&root_item);
+	if (ret)
+		return ret;
+
+	key.offset = (u64)-1;
+	root = btrfs_read_fs_root_no_cache(fs_info, &key);
+	if (IS_ERR(root))
+		return PTR_ERR(root);
+	b->quota_root = root;
+	ret = record_root_in_trans(b->trans, root);
+	if (ret)
+		return ret;
+
+	memset(&status, 0, sizeof(status));
+	btrfs_set_stack_qgroup_status_version(&status,
+					      BTRFS_QGROUP_STATUS_VERSION);
+	btrfs_set_stack_qgroup_status_generation(&status, b->trans->transid);
+	btrfs_set_stack_qgroup_status_flags(&status,
+					    BTRFS_QGROUP_STATUS_FLAG_ON |
+					    BTRFS_QGROUP_STATUS_FLAG_INCONSISTENT);
+	key.objectid = 0;
+	key.type = BTRFS_QGROUP_STATUS_KEY;
+	key.offset = 0;
+	ret = btrfs_insert_item(b->trans, root, &key, &status, sizeof(status));
+	if (ret)
+		return ret;
+
+	ret = insert_qgroup(b->trans, root, BTRFS_FS_TREE_OBJECTID);
+	for (i = 0; !ret && i <= b->opts.nr_snapshots; i++)
+		ret = insert_qgroup(b->trans, root, BENCH_SUBVOL_OBJECTID + i);
+	return ret;
+}
+
+static int subvol_exists(struct btrfs_root *tree_root)
+{
+	struct btrfs_path path;
+	struct btrfs_key key;
+	int ret;
+
+	btrfs_init_path(&path);
+	key.objectid = BENCH_SUBVOL_OBJECTID;
+	key.type = BTRFS_ROOT_ITEM_KEY;
+	key.offset = 0;
+	ret = btrfs_search_slot(NULL, tree_root, &key, &path, 0, 0);
+	if (ret < 0)
+		goto out;
+	ret = 0;
+	if (path.slots[0] >= btrfs_header_nritems(path.nodes[0]))
+		goto out;
+	btrfs_item_key_to_cpu(path.nodes[0], &key, path.slots[0]);
+	ret = key.objectid == BENCH_SUBVOL_OBJECTID &&
+	      key.type == BTRFS_ROOT_ITEM_KEY;
+out:
+	btrfs_release_path(&path);
+	return ret;
+}
+
+static int bench_fs(struct bench_fs *b)
+{
+	u32 sectorsize = b->fs_root->sectorsize;
+	int ret;
+
+	b->eb = calloc(1, sizeof(*b->eb) + sectorsize);
+	b->data = malloc(BENCH_MAX_EXTENT);
+	if (!b->eb || !b->data)
+		return -ENOMEM;
+
+	ret = start_trans(b);
+	if (ret)
+		return ret;
+	ret = create_subvol(b);
+	if (ret)
+		return ret;
+
+	b->next_ino = BTRFS_FIRST_FREE_OBJECTID + 1;
+	if (b->opts.frag_pct) {
+		b->spacer_ino = b->next_ino++;
+		init_inode(b, &b->spacer_inode, S_IFREG | 0644, 0);
+	}
+	ret = create_files(b);
+	if (ret)
+		return ret;
+	ret = commit_trans(b);
+	if (ret)
+		return ret;
+	ret = create_snapshots(b);
+	if (ret || !b->opts.quota)
+		return ret;
+
+	ret = start_trans(b);
+	if (ret)
+		return ret;
+	ret = enable_quota(b);
+	if (ret)
+		return ret;
+	ret = commit_trans(b);
+	if (ret)
+		return ret;
+	free_extent_buffer(b->quota_root->node);
+	free(b->quota_root);
+	return 0;
+}
+
+static void print_usage(int ret)
+{
+	fprintf(stderr, "usage: bench-fs [options] <image>\n");
+	fprintf(stderr, "fill a filesystem just made by mkfs.btrfs with synthetic files\n");
+	fprintf(stderr, "\t-i|--inodes <count>      number of files, default 1000\n");
+	fprintf(stderr, "\t-d|--fanout <count>      files per directory, default 100\n");
+	fprintf(stderr, "\t-s|--size <min>[:<max>]  file sizes, spread evenly over the powers of\n");
+	fprintf(stderr, "\t                         two between min and max, default 0:64k\n");
+	fprintf(stderr, "\t-r|--reflink <percent>   files sharing the extents of an earlier file\n");
+	fprintf(stderr, "\t-f|--fragment <percent>  files cut in small scattered extents\n");
+	fprintf(stderr, "\t-n|--snapshots <count>   snapshots taken of the files\n");
+	fprintf(stderr, "\t-c|--change <percent>    inodes changed between two snapshots, default 1\n");
+	fprintf(stderr, "\t-q|--quota               enable quotas, with a qgroup for each subvolume\n");
+	fprintf(stderr, "\t-S|--seed <seed>         seed of the generator, default 1\n");
+	exit(ret);
+}
+
+static u32 parse_percent(const char *str)
+{
+	u64 pct = arg_strtou64(str);
+
+	if (pct > 100) {
+		fprintf(stderr, "ERROR: percentage out of range: %s\n", str);
+		exit(1);
+	}
+	return pct;
+}
+
+static void parse_size_range(char *str, struct bench_opts *opts)
+{
+	char *sep = strchr(str, ':');
+
+	if (sep) {
+		*sep = '\0';
+		opts->max_size = parse_size(sep + 1);
+	}
+	opts->min_size = parse_size(str);
+	if (!sep)
+		opts->max_size = opts->min_size;
+	if (opts->min_size > opts->max_size ||
+	    opts->max_size > 1ULL << 40) {
+		fprintf(stderr, "ERROR: invalid size range\n");
+		exit(1);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	struct btrfs_root *root;
+	struct bench_fs *b;
+	int ret;
+	int i;
+
+	b = calloc(1, sizeof(*b));
+	if (!b) {
+		fprintf(stderr, "ERROR: not enough memory\n");
+		return 1;
+	}
+	b->opts.seed = 1;
+	b->opts.nr_files = 1000;
+	b->opts.fanout = 100;
+	b->opts.max_size = 64 * 1024;
+	b->opts.change_pct = 1;
+
+	while (1) {
+		int c;
+		static const struct option long_options[] = {
+			{ "inodes", required_argument, NULL, 'i' },
+			{ "fanout", required_argument, NULL, 'd' },
+			{ "size", required_argument, NULL, 's' },
+			{ "reflink", required_argument, NULL, 'r' },
+			{ "fragment", required_argument, NULL, 'f' },
+			{ "snapshots", required_argument, NULL, 'n' },
+			{ "change", required_argument, NULL, 'c' },
+			{ "quota", no_argument, NULL, 'q' },
+			{ "seed", required_argument, NULL, 'S' },
+			{ "help", no_argument, NULL, GETOPT_VAL_HELP },
+			{ NULL, 0, NULL, 0 }
+		};
+
+		c = getopt_long(argc, argv, "i:d:s:r:f:n:c:qS:", long_options,
+				NULL);
+		if (c < 0)
+			break;
+		switch (c) {
+		case 'i':
+			b->opts.nr_files = arg_strtou64(optarg);
+			break;
+		case 'd':
+			b->opts.fanout = arg_strtou64(optarg);
+			break;
+		case 's':
+			parse_size_range(optarg, &b->opts);
+			break;
+		case 'r':
+			b->opts.reflink_pct = parse_percent(optarg);
+			break;
+		case 'f':
+			b->opts.frag_pct = parse_percent(optarg);
+			break;
+		case 'n':
+			b->opts.nr_snapshots = arg_strtou64(optarg);
+			break;
+		case 'c':
+			b->opts.change_pct = parse_percent(optarg);
+			break;
+		case 'q':
+			b->opts.quota = 1;
+			break;
+		case 'S':
+			b->opts.seed = arg_strtou64(optarg);
+			break;
+		case GETOPT_VAL_HELP:
+		default:
+			print_usage(c != GETOPT_VAL_HELP);
+		}
+	}
+	set_argv0(argv);
+	if (check_argc_exact(argc - optind, 1))
+		print_usage(1);
+	if (!b->opts.fanout) {
+		fprintf(stderr, "ERROR: the fanout must not be 0\n");
+		return 1;
+	}
+
+	/* xorshift must not start from 0 */
+	b->rand_state = b->opts.seed * 0x9E3779B97F4A7C15ULL + 1;
+
+	root = open_ctree(argv[optind], 0, OPEN_CTREE_WRITES);
+	if (!root) {
+		fprintf(stderr, "ERROR: unable to open %s\n", argv[optind]);
+		return 1;
+	}
+	b->fs_root = root->fs_info->fs_root;
+	if (subvol_exists(root->fs_info->tree_root)) {
+		fprintf(stderr,
+			"ERROR: %s already has synthetic files, make a new filesystem\n",
+			argv[optind]);
+		close_ctree(root);
+		return 1;
+	}
+
+	ret = bench_fs(b);
+	if (ret) {
+		/* the image is scratch, leave the transaction uncommitted */
+		fprintf(stderr, "ERROR: failed to create the files: %d\n", ret);
+		return 1;
+	}
+	printf("created %llu files in %llu directories, %llu inline, %llu reflinked\n",
+	       (unsigned long long)b->opts.nr_files,
+	       (unsigned long long)b->nr_dirs,
+	       (unsigned long long)b->nr_inline,
+	       (unsigned long long)b->nr_reflinks);
+	printf("wrote %llu data extents, %llu bytes\n",
+	       (unsigned long long)b->nr_extents,
+	       (unsigned long long)b->data_bytes);
+	printf("took %u snapshots\n", b->opts.nr_snapshots);
+
+	close_ctree(root);
+	for (i = 0; i < BENCH_REFLINK_FILES; i++)
+		free(b->files[i].extents);
+	free(b->data);
+	free(b->eb);
+	free(b);
+	return 0;
+}
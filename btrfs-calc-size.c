@@ -204,6 +204,7 @@ static int walk_nodes(struct btrfs_root *root, struct btrfs_path *path,
 		if (cur_blocknr > stat->highest_bytenr)
 			stat->highest_bytenr = cur_blocknr;
 		free_extent_buffer(tmp);
+		path->nodes[level - 1] = NULL;
 		if (ret) {
 			fprintf(stderr, "Error walking down path\n");
 			break;
@@ -340,6 +341,8 @@ static int calc_root_size(struct btrfs_root *tree_root, struct btrfs_key *key,
 	stat.highest_bytenr = stat.lowest_bytenr;
 	stat.min_cluster_size = (u64)-1;
 	stat.max_cluster_size = root->leafsize;
+	/* the path drops its reference when it is freed */
+	extent_buffer_get(root->node);
 	path->nodes[level] = root->node;
 	if (gettimeofday(&start, NULL)) {
 		fprintf(stderr, "Error getting time: %d\n", errno);
@@ -425,28 +425,33 @@ fail:
 	return ret;
 }
 
+/* read this much of an extent at a time to checksum it */
+#define CSUM_EXTENT_BATCH	(1024 * 1024)
+
 static int csum_disk_extent(struct btrfs_trans_handle *trans,
 			    struct btrfs_root *root,
 			    u64 disk_bytenr, u64 num_bytes)
 {
-	u32 blocksize = root->sectorsize;
+	u32 batch = min_t(u64, num_bytes, CSUM_EXTENT_BATCH);
+	u32 len;
 	u64 offset;
 	char *buffer;
 	int ret = 0;
 
-	buffer = malloc(blocksize);
+	buffer = malloc(batch);
 	if (!buffer)
 		return -ENOMEM;
-	for (offset = 0; offset < num_bytes; offset += blocksize) {
+	for (offset = 0; offset < num_bytes; offset += len) {
+		len = min_t(u64, num_bytes - offset, batch);
 		ret = read_disk_extent(root, disk_bytenr + offset,
-					blocksize, buffer);
+					len, buffer);
 		if (ret)
 			break;
-		ret = btrfs_csum_file_block(trans,
-					    root->fs_info->csum_root,
-					    disk_bytenr + num_bytes,
-					    disk_bytenr + offset,
-					    buffer, blocksize);
+		ret = btrfs_csum_file_blocks(trans,
+					     root->fs_info->csum_root,
+					     disk_bytenr + num_bytes,
+					     disk_bytenr + offset,
+					     buffer, len);
 		if (ret)
 			break;
 	}
@@ -24,7 +24,7 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <dirent.h>
-#include <zlib.h>
+#include <ctype.h>
 #include <getopt.h>
 
 #include "kerncompat.h"
@@ -35,35 +35,7 @@
 #include "utils.h"
 #include "volumes.h"
 #include "extent_io.h"
-
-#define HEADER_MAGIC		0xbd5c25e27295668bULL
-#define MAX_PENDING_SIZE	(256 * 1024)
-#define BLOCK_SIZE		1024
-#define BLOCK_MASK		(BLOCK_SIZE - 1)
-
-#define COMPRESS_NONE		0
-#define COMPRESS_ZLIB		1
-
-struct meta_cluster_item {
-	__le64 bytenr;
-	__le32 size;
-} __attribute__ ((__packed__));
-
-struct meta_cluster_header {
-	__le64 magic;
-	__le64 bytenr;
-	__le32 nritems;
-	u8 compress;
-} __attribute__ ((__packed__));
-
-/* cluster header + index items + buffers */
-struct meta_cluster {
-	struct meta_cluster_header header;
-	struct meta_cluster_item items[];
-} __attribute__ ((__packed__));
-
-#define ITEMS_PER_CLUSTER ((BLOCK_SIZE - sizeof(struct meta_cluster)) / \
-			   sizeof(struct meta_cluster_item))
+#include "metadump.h"
 
 struct fs_chunk {
 	u64 logical;
@@ -81,7 +53,240 @@ struct async_work {
 	u64 size;
 	u8 *buffer;
 	size_t bufsize;
-	int error;
+	u8 compress;
+	int ready;
+};
+
+/*
+ * Bounded multi-producer multi-consumer ring of work items.  Every slot has
+ * a sequence number telling whether it is free for the push of that round or
+ * filled for the pop, so pushing and popping are a compare and swap on the
+ * tail or the head.  The mutex and the conditions are only taken to sleep on
+ * an empty or full ring, or to wait for the completion of items, and by the
+ * other side when it sees sleepers.
+ */
+struct work_slot {
+	u64 seq;
+	void *item;
+};
+
+struct work_queue {
+	u64 head __attribute__ ((aligned(64)));
+	u64 tail __attribute__ ((aligned(64)));
+	u64 completed __attribute__ ((aligned(64)));
+	struct work_slot *slots;
+	u64 mask;
+	int pop_waiters;
+	int push_waiters;
+	int completion_waiters;
+	int closed;
+	pthread_mutex_t mutex;
+	pthread_cond_t not_empty;
+	pthread_cond_t not_full;
+	pthread_cond_t completion;
+};
+
+/* the ring holds at least @nr items */
+static int work_queue_init(struct work_queue *q, u64 nr)
+{
+	u64 size = 1;
+	u64 i;
+
+	memset(q, 0, sizeof(*q));
+	while (size < nr)
+		size <<= 1;
+	q->slots = malloc(size * sizeof(*q->slots));
+	if (!q->slots)
+		return -ENOMEM;
+	for (i = 0; i < size; i++)
+		q->slots[i].seq = i;
+	q->mask = size - 1;
+	pthread_mutex_init(&q->mutex, NULL);
+	pthread_cond_init(&q->not_empty, NULL);
+	pthread_cond_init(&q->not_full, NULL);
+	pthread_cond_init(&q->completion, NULL);
+	return 0;
+}
+
+static void work_queue_destroy(struct work_queue *q)
+{
+	pthread_cond_destroy(&q->completion);
+	pthread_cond_destroy(&q->not_full);
+	pthread_cond_destroy(&q->not_empty);
+	pthread_mutex_destroy(&q->mutex);
+	free(q->slots);
+}
+
+/* wake up the sleepers on @cond if there are any, @waiters is theirs */
+static void work_queue_wake(struct work_queue *q, int *waiters,
+			    pthread_cond_t *cond)
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (!__atomic_load_n(waiters, __ATOMIC_RELAXED))
+		return;
+	pthread_mutex_lock(&q->mutex);
+	pthread_cond_broadcast(cond);
+	pthread_mutex_unlock(&q->mutex);
+}
+
+static int work_queue_try_push(struct work_queue *q, void *item)
+{
+	struct work_slot *slot;
+	u64 pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+	s64 diff;
+
+	while (1) {
+		slot = &q->slots[pos & q->mask];
+		diff = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - pos;
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&q->tail, &pos, pos + 1,
+							1, __ATOMIC_RELAXED,
+							__ATOMIC_RELAXED))
+				break;
+		} else if (diff < 0) {
+			return 0;
+		} else {
+			pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+		}
+	}
+	slot->item = item;
+	__atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+	work_queue_wake(q, &q->pop_waiters, &q->not_empty);
+	return 1;
+}
+
+static void *work_queue_try_pop(struct work_queue *q)
+{
+	struct work_slot *slot;
+	u64 pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+	void *item;
+	s64 diff;
+
+	while (1) {
+		slot = &q->slots[pos & q->mask];
+		diff = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - (pos + 1);
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&q->head, &pos, pos + 1,
+							1, __ATOMIC_RELAXED,
+							__ATOMIC_RELAXED))
+				break;
+		} else if (diff < 0) {
+			return NULL;
+		} else {
+			pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+		}
+	}
+	item = slot->item;
+	__atomic_store_n(&slot->seq, pos + q->mask + 1, __ATOMIC_RELEASE);
+	work_queue_wake(q, &q->push_waiters, &q->not_full);
+	return item;
+}
+
+/*
+ * Sleep on @cond until @ready says so.  The waiter count is raised before
+ * @ready is checked again, so that the other side either sees it and wakes
+ * us up, or made the change before and we don't sleep.
+ */
+static void work_queue_sleep(struct work_queue *q, int *waiters,
+			     pthread_cond_t *cond,
+			     int (*ready)(struct work_queue *q, void *arg),
+			     void *arg)
+{
+	pthread_mutex_lock(&q->mutex);
+	__atomic_add_fetch(waiters, 1, __ATOMIC_SEQ_CST);
+	while (!ready(q, arg))
+		pthread_cond_wait(cond, &q->mutex);
+	__atomic_sub_fetch(waiters, 1, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&q->mutex);
+}
+
+static int work_queue_not_full(struct work_queue *q, void *arg)
+{
+	u64 tail = __atomic_load_n(&q->tail, __ATOMIC_SEQ_CST);
+
+	return tail - __atomic_load_n(&q->head, __ATOMIC_SEQ_CST) <= q->mask;
+}
+
+static int work_queue_not_empty(struct work_queue *q, void *arg)
+{
+	u64 head = __atomic_load_n(&q->head, __ATOMIC_SEQ_CST);
+
+	return __atomic_load_n(&q->tail, __ATOMIC_SEQ_CST) != head ||
+	       __atomic_load_n(&q->closed, __ATOMIC_SEQ_CST);
+}
+
+static void work_queue_push(struct work_queue *q, void *item)
+{
+	while (!work_queue_try_push(q, item))
+		work_queue_sleep(q, &q->push_waiters, &q->not_full,
+				 work_queue_not_full, NULL);
+}
+
+/* NULL once the queue is closed and empty */
+static void *work_queue_pop(struct work_queue *q)
+{
+	void *item;
+	int spins = 0;
+
+	while (1) {
+		item = work_queue_try_pop(q);
+		if (item || __atomic_load_n(&q->closed, __ATOMIC_ACQUIRE))
+			return item;
+		if (spins++ < 16)
+			sched_yield();
+		else
+			work_queue_sleep(q, &q->pop_waiters, &q->not_empty,
+					 work_queue_not_empty, NULL);
+	}
+}
+
+/* a popped item is done with */
+static void work_queue_complete(struct work_queue *q)
+{
+	__atomic_add_fetch(&q->completed, 1, __ATOMIC_RELEASE);
+	work_queue_wake(q, &q->completion_waiters, &q->completion);
+}
+
+static u64 work_queue_completed(struct work_queue *q)
+{
+	return __atomic_load_n(&q->completed, __ATOMIC_ACQUIRE);
+}
+
+static int work_queue_completed_since(struct work_queue *q, void *arg)
+{
+	return __atomic_load_n(&q->completed, __ATOMIC_SEQ_CST) !=
+	       *(u64 *)arg;
+}
+
+/* wait for the completion of more items than @seen */
+static void work_queue_wait(struct work_queue *q, u64 seen)
+{
+	work_queue_sleep(q, &q->completion_waiters, &q->completion,
+			 work_queue_completed_since, &seen);
+}
+
+/* wait for the completion of every item pushed */
+static void work_queue_drain(struct work_queue *q)
+{
+	u64 seen;
+
+	while ((seen = work_queue_completed(q)) !=
+	       __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE))
+		work_queue_wait(q, seen);
+}
+
+static void work_queue_close(struct work_queue *q)
+{
+	pthread_mutex_lock(&q->mutex);
+	__atomic_store_n(&q->closed, 1, __ATOMIC_SEQ_CST);
+	pthread_cond_broadcast(&q->not_empty);
+	pthread_mutex_unlock(&q->mutex);
+}
+
+/* a full cluster waiting for the compression of its items to be written */
+struct dump_cluster {
+	struct list_head list;
+	struct list_head items;
 };
 
 struct metadump_struct {
@@ -92,31 +297,50 @@ struct metadump_struct {
 
 	pthread_t *threads;
 	size_t num_threads;
-	pthread_mutex_t mutex;
-	pthread_cond_t cond;
-	struct rb_root name_tree;
-
-	struct list_head list;
+	struct work_queue queue;
+
+	/*
+	 * The names sanitized so far with their collision, by the crc of the
+	 * name in an open addressing hash kept at most half full.
+	 */
+	struct name **names;
+	unsigned long names_mask;
+	unsigned long nr_names;
+
+	/*
+	 * The items of the cluster being filled, then the full clusters not
+	 * written yet.  The items are written in order once compressed, at
+	 * most max_inflight are not written at a time.
+	 */
 	struct list_head ordered;
+	struct list_head clusters;
 	size_t num_items;
-	size_t num_ready;
+	size_t num_inflight;
+	size_t max_inflight;
 
 	u64 pending_start;
 	u64 pending_size;
 
+	const struct compress_method *compress;
 	int compress_level;
-	int done;
+	u64 since_generation;
 	int data;
 	int sanitize_names;
 
+	/* the items written, for the index of an indexed image */
+	int write_index;
+	struct meta_index_item *index;
+	size_t index_nr;
+	size_t index_alloc;
+
 	int error;
 };
 
 struct name {
-	struct rb_node n;
 	char *val;
 	char *sub;
 	u32 len;
+	u32 crc;
 };
 
 struct mdrestore_struct {
@@ -126,27 +350,30 @@ struct mdrestore_struct {
 	pthread_t *threads;
 	size_t num_threads;
 	pthread_mutex_t mutex;
-	pthread_cond_t cond;
+	struct work_queue queue;
 
 	struct rb_root chunk_tree;
 	struct rb_root physical_tree;
+	/* the items read before the super block, queued once it is */
 	struct list_head list;
 	struct list_head overlapping_chunks;
-	size_t num_items;
 	u32 leafsize;
 	u64 devid;
 	u64 alloced_chunks;
 	u64 last_physical_offset;
+	/* of the last super block restored, the base of the next delta */
+	u64 generation;
 	u8 uuid[BTRFS_UUID_SIZE];
 	u8 fsid[BTRFS_FSID_SIZE];
 
 	int compress_method;
-	int done;
 	int error;
 	int old_restore;
 	int fixup_offset;
 	int multi_devices;
 	int clear_space_cache;
+	/* with deltas, the blocks of deleted chunks are not written */
+	int skip_unmapped;
 	struct btrfs_fs_info *info;
 };
 
@@ -198,16 +425,6 @@ static char *generate_garbage(u32 name_len)
 	return buf;
 }
 
-static int name_cmp(struct rb_node *a, struct rb_node *b, int fuzz)
-{
-	struct name *entry = rb_entry(a, struct name, n);
-	struct name *ins = rb_entry(b, struct name, n);
-	u32 len;
-
-	len = min(ins->len, entry->len);
-	return memcmp(ins->val, entry->val, len);
-}
-
 static int chunk_cmp(struct rb_node *a, struct rb_node *b, int fuzz)
 {
 	struct fs_chunk *entry = rb_entry(a, struct fs_chunk, l);
@@ -290,6 +507,16 @@ static struct rb_node *tree_search(struct rb_root *root,
 	return NULL;
 }
 
+static int chunk_mapped(struct mdrestore_struct *mdres, u64 logical)
+{
+	struct fs_chunk search;
+
+	if (logical == BTRFS_SUPER_INFO_OFFSET)
+		return 1;
+	search.logical = logical;
+	return tree_search(&mdres->chunk_tree, &search.l, chunk_cmp, 1) != NULL;
+}
+
 static u64 logical_to_physical(struct mdrestore_struct *mdres, u64 logical, u64 *size)
 {
 	struct fs_chunk *fs_chunk;
@@ -317,21 +544,118 @@ static u64 logical_to_physical(struct mdrestore_struct *mdres, u64 logical, u64
 }
 
 
+static inline unsigned long name_hash(u32 crc)
+{
+	return (crc * 0x9E3779B97F4A7C15ULL) >> 32;
+}
+
+static struct name *name_search(struct metadump_struct *md, const char *val,
+				u32 len, u32 crc)
+{
+	struct name *entry;
+	unsigned long slot;
+
+	if (!md->names)
+		return NULL;
+	slot = name_hash(crc) & md->names_mask;
+	while ((entry = md->names[slot])) {
+		if (entry->crc == crc && entry->len == len &&
+		    !memcmp(entry->val, val, len))
+			return entry;
+		slot = (slot + 1) & md->names_mask;
+	}
+	return NULL;
+}
+
+static void name_hash_insert(struct name **names, unsigned long mask,
+			     struct name *name)
+{
+	unsigned long slot;
+
+	slot = name_hash(name->crc) & mask;
+	while (names[slot])
+		slot = (slot + 1) & mask;
+	names[slot] = name;
+}
+
+static int name_insert(struct metadump_struct *md, struct name *name)
+{
+	unsigned long size = md->names ? md->names_mask + 1 : 0;
+	struct name **names;
+	unsigned long i;
+
+	if ((md->nr_names + 1) * 2 > size) {
+		size = max(size * 2, 1024UL);
+		names = calloc(size, sizeof(*names));
+		if (!names)
+			return -ENOMEM;
+		for (i = 0; md->names && i <= md->names_mask; i++) {
+			if (md->names[i])
+				name_hash_insert(names, size - 1,
+						 md->names[i]);
+		}
+		free(md->names);
+		md->names = names;
+		md->names_mask = size - 1;
+	}
+	name_hash_insert(md->names, md->names_mask, name);
+	md->nr_names++;
+	return 0;
+}
+
+/*
+ * Find another name of the same length and crc, made of the characters from
+ * space to 127 but '/'.  The crc is linear, so the last 4 bytes are solved
+ * for from the crc of the bytes before them, and only those are searched,
+ * counting up from all spaces with the first byte moving fastest.  Every
+ * name of the alphabet is reached that way, so if none is found there is no
+ * collision.  Names of up to 4 bytes have none, as the crc of 4 bytes tells
+ * them apart.
+ */
+static int solve_collision(struct name *val)
+{
+	char *sub = val->sub;
+	u32 prefix_len;
+	u32 suffix;
+	u32 i;
+	u8 c;
+
+	if (val->len <= 4)
+		return 0;
+	prefix_len = val->len - 4;
+	memset(sub, ' ', prefix_len);
+	while (1) {
+		suffix = crc32c_le_suffix(crc32c(~1, sub, prefix_len),
+					  val->crc);
+		for (i = 0; i < 4; i++) {
+			c = suffix >> (i * 8);
+			if (c < ' ' || c > 127 || c == '/')
+				break;
+			sub[prefix_len + i] = c;
+		}
+		if (i == 4 && memcmp(sub, val->val, val->len))
+			return 1;
+
+		for (i = 0; i < prefix_len && sub[i] == 127; i++)
+			sub[i] = ' ';
+		if (i == prefix_len)
+			return 0;
+		sub[i]++;
+		if (sub[i] == '/')
+			sub[i]++;
+	}
+}
+
 static char *find_collision(struct metadump_struct *md, char *name,
 			    u32 name_len)
 {
 	struct name *val;
-	struct rb_node *entry;
-	struct name tmp;
-	unsigned long checksum;
-	int found = 0;
+	u32 crc;
 	int i;
 
-	tmp.val = name;
-	tmp.len = name_len;
-	entry = tree_search(&md->name_tree, &tmp.n, name_cmp, 0);
-	if (entry) {
-		val = rb_entry(entry, struct name, n);
+	crc = crc32c(~1, name, name_len);
+	val = name_search(md, name, name_len, crc);
+	if (val) {
 		free(name);
 		return val->sub;
 	}
@@ -347,47 +671,17 @@ static char *find_collision(struct metadump_struct *md, char *name,
 
 	val->val = name;
 	val->len = name_len;
+	val->crc = crc;
 	val->sub = malloc(name_len);
-	if (!val->sub) {
+	if (!val->sub || name_insert(md, val)) {
 		fprintf(stderr, "Couldn't sanitize name, enomem\n");
+		free(val->sub);
 		free(val);
 		free(name);
 		return NULL;
 	}
 
-	checksum = crc32c(~1, val->val, name_len);
-	memset(val->sub, ' ', name_len);
-	i = 0;
-	while (1) {
-		if (crc32c(~1, val->sub, name_len) == checksum &&
-		    memcmp(val->sub, val->val, val->len)) {
-			found = 1;
-			break;
-		}
-
-		if (val->sub[i] == 127) {
-			do {
-				i++;
-				if (i >= name_len)
-					break;
-			} while (val->sub[i] == 127);
-
-			if (i >= name_len)
-				break;
-			val->sub[i]++;
-			if (val->sub[i] == '/')
-				val->sub[i]++;
-			memset(val->sub, ' ', i);
-			i = 0;
-			continue;
-		} else {
-			val->sub[i]++;
-			if (val->sub[i] == '/')
-				val->sub[i]++;
-		}
-	}
-
-	if (!found) {
+	if (!solve_collision(val)) {
 		fprintf(stderr, "Couldn't find a collision for '%.*s', "
 			"generating normal garbage, it won't match indexes\n",
 			val->len, val->val);
@@ -399,8 +693,6 @@ static char *find_collision(struct metadump_struct *md, char *name,
 			val->sub[i] = c;
 		}
 	}
-
-	tree_insert(&md->name_tree, &val->n, name_cmp);
 	return val->sub;
 }
 
@@ -632,54 +924,48 @@ static void copy_buffer(struct metadump_struct *md, u8 *dst,
 	csum_block(dst, src->len);
 }
 
+static void dump_error(struct metadump_struct *md, int error)
+{
+	int old = 0;
+
+	__atomic_compare_exchange_n(&md->error, &old, error, 0,
+				    __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+}
+
 static void *dump_worker(void *data)
 {
 	struct metadump_struct *md = (struct metadump_struct *)data;
 	struct async_work *async;
+	void *ctx = NULL;
 	int ret;
 
-	while (1) {
-		pthread_mutex_lock(&md->mutex);
-		while (list_empty(&md->list)) {
-			if (md->done) {
-				pthread_mutex_unlock(&md->mutex);
-				goto out;
-			}
-			pthread_cond_wait(&md->cond, &md->mutex);
-		}
-		async = list_entry(md->list.next, struct async_work, list);
-		list_del_init(&async->list);
-		pthread_mutex_unlock(&md->mutex);
-
-		if (md->compress_level > 0) {
-			u8 *orig = async->buffer;
-
-			async->bufsize = compressBound(async->size);
-			async->buffer = malloc(async->bufsize);
-			if (!async->buffer) {
-				fprintf(stderr, "Error allocing buffer\n");
-				pthread_mutex_lock(&md->mutex);
-				if (!md->error)
-					md->error = -ENOMEM;
-				pthread_mutex_unlock(&md->mutex);
-				pthread_exit(NULL);
-			}
-
-			ret = compress2(async->buffer,
-					 (unsigned long *)&async->bufsize,
-					 orig, async->size, md->compress_level);
-
-			if (ret != Z_OK)
-				async->error = 1;
+	while ((async = work_queue_pop(&md->queue))) {
+		u8 *orig = async->buffer;
 
+		async->bufsize = md->compress->bound(async->size);
+		async->buffer = malloc(async->bufsize);
+		if (!async->buffer) {
+			fprintf(stderr, "Error allocing buffer\n");
+			async->buffer = orig;
+			async->bufsize = async->size;
+			dump_error(md, -ENOMEM);
+		} else {
+			ret = md->compress->compress(&ctx, md->compress_level,
+						     async->buffer,
+						     &async->bufsize, orig,
+						     async->size);
+			if (ret) {
+				fprintf(stderr, "Error compressing %d\n", ret);
+				dump_error(md, ret);
+			}
 			free(orig);
 		}
 
-		pthread_mutex_lock(&md->mutex);
-		md->num_ready++;
-		pthread_mutex_unlock(&md->mutex);
+		__atomic_store_n(&async->ready, 1, __ATOMIC_RELEASE);
+		work_queue_complete(&md->queue);
 	}
-out:
+	if (ctx)
+		md->compress->free_ctx(ctx);
 	pthread_exit(NULL);
 }
 
@@ -687,82 +973,98 @@ static void meta_cluster_init(struct metadump_struct *md, u64 start)
 {
 	struct meta_cluster_header *header;
 
-	md->num_items = 0;
-	md->num_ready = 0;
 	header = &md->cluster->header;
 	header->magic = cpu_to_le64(HEADER_MAGIC);
 	header->bytenr = cpu_to_le64(start);
 	header->nritems = cpu_to_le32(0);
-	header->compress = md->compress_level > 0 ?
-			   COMPRESS_ZLIB : COMPRESS_NONE;
+	header->compress = md->compress ? md->compress->type : COMPRESS_NONE;
+}
+
+static void free_async_list(struct list_head *list)
+{
+	struct async_work *async;
+
+	while (!list_empty(list)) {
+		async = list_entry(list->next, struct async_work, ordered);
+		list_del_init(&async->ordered);
+		free(async->buffer);
+		free(async);
+	}
 }
 
 static void metadump_destroy(struct metadump_struct *md, int num_threads)
 {
+	struct dump_cluster *cluster;
+	unsigned long slot;
 	int i;
-	struct rb_node *n;
-
-	pthread_mutex_lock(&md->mutex);
-	md->done = 1;
-	pthread_cond_broadcast(&md->cond);
-	pthread_mutex_unlock(&md->mutex);
 
+	work_queue_close(&md->queue);
 	for (i = 0; i < num_threads; i++)
 		pthread_join(md->threads[i], NULL);
+	work_queue_destroy(&md->queue);
+
+	/* left over by an error */
+	while (!list_empty(&md->clusters)) {
+		cluster = list_entry(md->clusters.next, struct dump_cluster,
+				     list);
+		list_del_init(&cluster->list);
+		free_async_list(&cluster->items);
+		free(cluster);
+	}
+	free_async_list(&md->ordered);
 
-	pthread_cond_destroy(&md->cond);
-	pthread_mutex_destroy(&md->mutex);
-
-	while ((n = rb_first(&md->name_tree))) {
-		struct name *name;
-
-		name = rb_entry(n, struct name, n);
-		rb_erase(n, &md->name_tree);
-		free(name->val);
-		free(name->sub);
-		free(name);
+	for (slot = 0; md->names && slot <= md->names_mask; slot++) {
+		if (!md->names[slot])
+			continue;
+		free(md->names[slot]->val);
+		free(md->names[slot]->sub);
+		free(md->names[slot]);
 	}
+	free(md->names);
 	free(md->threads);
 	free(md->cluster);
+	free(md->index);
 }
 
 static int metadump_init(struct metadump_struct *md, struct btrfs_root *root,
-			 FILE *out, int num_threads, int compress_level,
-			 int sanitize_names)
+			 FILE *out, int num_threads,
+			 const struct compress_method *compress,
+			 int compress_level, int sanitize_names)
 {
 	int i, ret = 0;
 
 	memset(md, 0, sizeof(*md));
-	pthread_cond_init(&md->cond, NULL);
-	pthread_mutex_init(&md->mutex, NULL);
-	INIT_LIST_HEAD(&md->list);
 	INIT_LIST_HEAD(&md->ordered);
+	INIT_LIST_HEAD(&md->clusters);
 	md->root = root;
 	md->out = out;
 	md->pending_start = (u64)-1;
+	md->compress = compress;
 	md->compress_level = compress_level;
+	md->max_inflight = max_t(size_t, 2 * ITEMS_PER_CLUSTER,
+				 8 * num_threads);
 	md->cluster = calloc(1, BLOCK_SIZE);
 	md->sanitize_names = sanitize_names;
 	if (sanitize_names > 1)
 		crc32c_optimization_init();
 
-	if (!md->cluster) {
-		pthread_cond_destroy(&md->cond);
-		pthread_mutex_destroy(&md->mutex);
+	if (!md->cluster)
 		return -ENOMEM;
+	ret = work_queue_init(&md->queue, md->max_inflight);
+	if (ret) {
+		free(md->cluster);
+		return ret;
 	}
 
 	meta_cluster_init(md, 0);
 	if (!num_threads)
 		return 0;
 
-	md->name_tree.rb_node = NULL;
 	md->num_threads = num_threads;
 	md->threads = calloc(num_threads, sizeof(pthread_t));
 	if (!md->threads) {
+		work_queue_destroy(&md->queue);
 		free(md->cluster);
-		pthread_cond_destroy(&md->cond);
-		pthread_mutex_destroy(&md->mutex);
 		return -ENOMEM;
 	}
 
@@ -773,7 +1075,7 @@ static int metadump_init(struct metadump_struct *md, struct btrfs_root *root,
 	}
 
 	if (ret)
-		metadump_destroy(md, i + 1);
+		metadump_destroy(md, i);
 
 	return ret;
 }
@@ -784,7 +1086,29 @@ static int write_zero(FILE *out, size_t size)
 	return fwrite(zero, size, 1, out);
 }
 
-static int write_buffers(struct metadump_struct *md, u64 *next)
+static int add_index_item(struct metadump_struct *md,
+			  struct async_work *async, u64 offset)
+{
+	struct meta_index_item *item;
+
+	if (md->index_nr == md->index_alloc) {
+		md->index_alloc = max_t(size_t, md->index_alloc * 2, 1024);
+		item = realloc(md->index, md->index_alloc * sizeof(*item));
+		if (!item)
+			return -ENOMEM;
+		md->index = item;
+	}
+	item = &md->index[md->index_nr++];
+	item->bytenr = cpu_to_le64(async->start);
+	item->offset = cpu_to_le64(offset);
+	item->size = cpu_to_le32(async->bufsize);
+	item->len = cpu_to_le32(async->size);
+	return 0;
+}
+
+/* write the index block and the items of a cluster, all compressed */
+static int write_buffers(struct metadump_struct *md, struct list_head *items,
+			 u64 *next)
 {
 	struct meta_cluster_header *header = &md->cluster->header;
 	struct meta_cluster_item *item;
@@ -794,29 +1118,11 @@ static int write_buffers(struct metadump_struct *md, u64 *next)
 	int ret;
 	int err = 0;
 
-	if (list_empty(&md->ordered))
+	if (list_empty(items))
 		goto out;
 
-	/* wait until all buffers are compressed */
-	while (!err && md->num_items > md->num_ready) {
-		struct timespec ts = {
-			.tv_sec = 0,
-			.tv_nsec = 10000000,
-		};
-		pthread_mutex_unlock(&md->mutex);
-		nanosleep(&ts, NULL);
-		pthread_mutex_lock(&md->mutex);
-		err = md->error;
-	}
-
-	if (err) {
-		fprintf(stderr, "One of the threads errored out %s\n",
-				strerror(err));
-		goto out;
-	}
-
 	/* setup and write index block */
-	list_for_each_entry(async, &md->ordered, ordered) {
+	list_for_each_entry(async, items, ordered) {
 		item = md->cluster->items + nritems;
 		item->bytenr = cpu_to_le64(async->start);
 		item->size = cpu_to_le32(async->bufsize);
@@ -832,11 +1138,14 @@ static int write_buffers(struct metadump_struct *md, u64 *next)
 
 	/* write buffers */
 	bytenr += le64_to_cpu(header->bytenr) + BLOCK_SIZE;
-	while (!list_empty(&md->ordered)) {
-		async = list_entry(md->ordered.next, struct async_work,
-				   ordered);
+	while (!list_empty(items)) {
+		async = list_entry(items->next, struct async_work, ordered);
 		list_del_init(&async->ordered);
+		md->num_inflight--;
 
+		if (!err && md->write_index &&
+		    async->start != DELTA_INFO_BYTENR)
+			err = add_index_item(md, async, bytenr);
 		bytenr += async->bufsize;
 		if (!err)
 			ret = fwrite(async->buffer, async->bufsize, 1,
@@ -869,6 +1178,245 @@ out:
 	return err;
 }
 
+/* queue the cluster being filled for writing */
+static int close_cluster(struct metadump_struct *md)
+{
+	struct dump_cluster *cluster;
+
+	cluster = malloc(sizeof(*cluster));
+	if (!cluster)
+		return -ENOMEM;
+	INIT_LIST_HEAD(&cluster->items);
+	list_splice_init(&md->ordered, &cluster->items);
+	list_add_tail(&cluster->list, &md->clusters);
+	md->num_items = 0;
+	return 0;
+}
+
+/*
+ * Whether all the items of @cluster are compressed.  With @wait, this waits
+ * for them instead, unless a thread errors out.
+ */
+static int cluster_ready(struct metadump_struct *md,
+			 struct dump_cluster *cluster, int wait)
+{
+	struct async_work *async;
+	u64 seen;
+	int err;
+
+	list_for_each_entry(async, &cluster->items, ordered) {
+		while (1) {
+			seen = work_queue_completed(&md->queue);
+			if (__atomic_load_n(&async->ready, __ATOMIC_ACQUIRE))
+				break;
+			err = __atomic_load_n(&md->error, __ATOMIC_ACQUIRE);
+			if (err)
+				return err;
+			if (!wait)
+				return 0;
+			work_queue_wait(&md->queue, seen);
+		}
+	}
+	return 1;
+}
+
+/*
+ * Write out the full clusters in order as long as they are compressed.  The
+ * reading goes on while the threads compress, it only waits for them when
+ * too many items are in flight, or at the end with @done.
+ */
+static int write_clusters(struct metadump_struct *md, int done)
+{
+	struct dump_cluster *cluster;
+	u64 start;
+	int ret;
+
+	while (!list_empty(&md->clusters)) {
+		cluster = list_entry(md->clusters.next, struct dump_cluster,
+				     list);
+		ret = cluster_ready(md, cluster,
+				    done || md->num_inflight >= md->max_inflight);
+		if (ret < 0) {
+			fprintf(stderr, "One of the threads errored out %s\n",
+				strerror(-ret));
+			return ret;
+		}
+		if (!ret)
+			break;
+		ret = write_buffers(md, &cluster->items, &start);
+		if (ret)
+			return ret;
+		meta_cluster_init(md, start);
+		list_del_init(&cluster->list);
+		free(cluster);
+	}
+	return 0;
+}
+
+static int index_item_cmp(const void *a, const void *b)
+{
+	const struct meta_index_item *ia = a;
+	const struct meta_index_item *ib = b;
+	u64 ba = le64_to_cpu(ia->bytenr);
+	u64 bb = le64_to_cpu(ib->bytenr);
+
+	if (ba != bb)
+		return ba < bb ? -1 : 1;
+	/* the longer first, so the items it covers are dropped */
+	if (ia->len != ib->len)
+		return le32_to_cpu(ia->len) > le32_to_cpu(ib->len) ? -1 : 1;
+	return 0;
+}
+
+/*
+ * Sort the index by bytenr and drop the items another one covers, which
+ * -w makes of the blocks shared by several trees.  With no item inside
+ * another, the last item starting before a block is the one holding it.
+ */
+static void sort_index(struct metadump_struct *md)
+{
+	struct meta_index_item *item;
+	size_t nr = 0;
+	size_t i;
+	u64 end = 0;
+
+	qsort(md->index, md->index_nr, sizeof(*md->index), index_item_cmp);
+	for (i = 0; i < md->index_nr; i++) {
+		item = &md->index[i];
+		if (nr && le64_to_cpu(item->bytenr) + le32_to_cpu(item->len) <=
+		    end)
+			continue;
+		end = le64_to_cpu(item->bytenr) + le32_to_cpu(item->len);
+		md->index[nr++] = *item;
+	}
+	md->index_nr = nr;
+}
+
+static int compress_index(struct metadump_struct *md,
+			  struct meta_index_item *items, u32 nritems,
+			  u8 **buffer, size_t *size)
+{
+	size_t len = nritems * sizeof(*items);
+	void *ctx = NULL;
+	int ret;
+
+	if (!md->compress) {
+		*buffer = malloc(len);
+		if (!*buffer)
+			return -ENOMEM;
+		memcpy(*buffer, items, len);
+		*size = len;
+		return 0;
+	}
+	*size = md->compress->bound(len);
+	*buffer = malloc(*size);
+	if (!*buffer)
+		return -ENOMEM;
+	ret = md->compress->compress(&ctx, md->compress_level, *buffer, size,
+				     (u8 *)items, len);
+	if (ctx)
+		md->compress->free_ctx(ctx);
+	if (ret) {
+		fprintf(stderr, "Error compressing the index %d\n", ret);
+		free(*buffer);
+		return ret;
+	}
+	return 0;
+}
+
+/*
+ * Write the index after the last cluster, the items grouped by the block
+ * group they start in.  The super block is in a group of its own.
+ */
+static int write_index(struct metadump_struct *md)
+{
+	struct btrfs_fs_info *fs_info = md->root->fs_info;
+	struct btrfs_block_group_cache *cache;
+	struct meta_index_header *header;
+	struct meta_index_footer footer;
+	struct meta_index_group *groups = NULL;
+	struct meta_index_group *group = NULL;
+	u8 **buffers = NULL;
+	u64 offset = le64_to_cpu(md->cluster->header.bytenr);
+	u64 data_offset;
+	u64 start, end;
+	u32 nrgroups = 0;
+	u32 nritems;
+	size_t size;
+	size_t first = 0;
+	size_t i;
+	int ret = 0;
+
+	sort_index(md);
+	groups = calloc(md->index_nr, sizeof(*groups));
+	buffers = calloc(md->index_nr, sizeof(*buffers));
+	header = calloc(1, BLOCK_SIZE);
+	if (!groups || !buffers || !header) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	for (i = 0; i < md->index_nr; i++) {
+		start = le64_to_cpu(md->index[i].bytenr);
+		end = start + le32_to_cpu(md->index[i].len);
+		cache = btrfs_lookup_block_group(fs_info, start);
+		if (cache) {
+			start = cache->key.objectid;
+			end = max(end, start + cache->key.offset);
+		}
+		if (!group || start != le64_to_cpu(group->start)) {
+			group = &groups[nrgroups++];
+			group->start = cpu_to_le64(start);
+		}
+		end = max(end, start + le64_to_cpu(group->length));
+		group->length = cpu_to_le64(end - start);
+		group->nritems = cpu_to_le32(le32_to_cpu(group->nritems) + 1);
+	}
+
+	data_offset = offset + BLOCK_SIZE + nrgroups * sizeof(*groups);
+	for (i = 0; i < nrgroups; i++) {
+		nritems = le32_to_cpu(groups[i].nritems);
+		ret = compress_index(md, md->index + first, nritems,
+				     &buffers[i], &size);
+		if (ret)
+			goto out;
+		groups[i].offset = cpu_to_le64(data_offset);
+		groups[i].size = cpu_to_le32(size);
+		data_offset += size;
+		first += nritems;
+	}
+
+	header->magic = cpu_to_le64(INDEX_MAGIC);
+	header->bytenr = cpu_to_le64(offset);
+	header->nrgroups = cpu_to_le32(nrgroups);
+	header->compress = md->compress ? md->compress->type : COMPRESS_NONE;
+	footer.magic = cpu_to_le64(INDEX_MAGIC);
+	footer.header = cpu_to_le64(offset);
+
+	if (fwrite(header, BLOCK_SIZE, 1, md->out) != 1 ||
+	    fwrite(groups, nrgroups * sizeof(*groups), 1, md->out) != 1)
+		goto write_error;
+	for (i = 0; i < nrgroups; i++) {
+		if (fwrite(buffers[i], le32_to_cpu(groups[i].size), 1,
+			   md->out) != 1)
+			goto write_error;
+	}
+	if (fwrite(&footer, sizeof(footer), 1, md->out) != 1)
+		goto write_error;
+	goto out;
+
+write_error:
+	fprintf(stderr, "Error writing out the index: %d\n", errno);
+	ret = -EIO;
+out:
+	for (i = 0; buffers && i < nrgroups; i++)
+		free(buffers[i]);
+	free(buffers);
+	free(groups);
+	free(header);
+	return ret;
+}
+
 static int read_data_extent(struct metadump_struct *md,
 			    struct async_work *async)
 {
@@ -932,6 +1480,32 @@ static int get_dev_fd(struct btrfs_root *root)
 	return dev->fd;
 }
 
+/* add @async, if any, to the cluster and write out what is ready */
+static int queue_async(struct metadump_struct *md, struct async_work *async,
+		       int done)
+{
+	int ret;
+
+	if (async) {
+		list_add_tail(&async->ordered, &md->ordered);
+		md->num_items++;
+		md->num_inflight++;
+		if (md->compress)
+			work_queue_push(&md->queue, async);
+		else
+			async->ready = 1;
+	}
+	if (md->num_items >= ITEMS_PER_CLUSTER || (done && md->num_items)) {
+		ret = close_cluster(md);
+		if (ret)
+			return ret;
+	}
+	ret = write_clusters(md, done);
+	if (ret)
+		fprintf(stderr, "Error writing buffers %d\n", ret);
+	return ret;
+}
+
 static int flush_pending(struct metadump_struct *md, int done)
 {
 	struct async_work *async = NULL;
@@ -1009,27 +1583,7 @@ static int flush_pending(struct metadump_struct *md, int done)
 		return 0;
 	}
 
-	pthread_mutex_lock(&md->mutex);
-	if (async) {
-		list_add_tail(&async->ordered, &md->ordered);
-		md->num_items++;
-		if (md->compress_level > 0) {
-			list_add_tail(&async->list, &md->list);
-			pthread_cond_signal(&md->cond);
-		} else {
-			md->num_ready++;
-		}
-	}
-	if (md->num_items >= ITEMS_PER_CLUSTER || done) {
-		ret = write_buffers(md, &start);
-		if (ret)
-			fprintf(stderr, "Error writing buffers %d\n",
-				errno);
-		else
-			meta_cluster_init(md, start);
-	}
-	pthread_mutex_unlock(&md->mutex);
-	return ret;
+	return queue_async(md, async, done);
 }
 
 static int add_extent(u64 start, u64 size, struct metadump_struct *md,
@@ -1050,6 +1604,42 @@ static int add_extent(u64 start, u64 size, struct metadump_struct *md,
 	return 0;
 }
 
+/*
+ * Whether the block at @bytenr of @generation goes in the image: in a delta,
+ * only the newer blocks and those of the system chunks do.
+ */
+static int want_block(struct metadump_struct *md, u64 bytenr, u64 generation)
+{
+	struct btrfs_block_group_cache *cache;
+
+	if (generation > md->since_generation)
+		return 1;
+	cache = btrfs_lookup_block_group(md->root->fs_info, bytenr);
+	return cache && (cache->flags & BTRFS_BLOCK_GROUP_SYSTEM);
+}
+
+static int add_delta_info(struct metadump_struct *md)
+{
+	struct meta_delta_info *info;
+	struct async_work *async;
+
+	async = calloc(1, sizeof(*async));
+	info = calloc(1, sizeof(*info));
+	if (!async || !info) {
+		free(async);
+		free(info);
+		return -ENOMEM;
+	}
+	info->base_generation = cpu_to_le64(md->since_generation);
+	memcpy(info->fsid, md->root->fs_info->super_copy->fsid,
+	       BTRFS_FSID_SIZE);
+	async->start = DELTA_INFO_BYTENR;
+	async->size = sizeof(*info);
+	async->bufsize = async->size;
+	async->buffer = (u8 *)info;
+	return queue_async(md, async, 0);
+}
+
 #ifdef BTRFS_COMPAT_EXTENT_TREE_V0
 static int is_tree_block(struct btrfs_root *extent_root,
 			 struct btrfs_path *path, u64 bytenr)
@@ -1099,6 +1689,9 @@ static int copy_tree_blocks(struct btrfs_root *root, struct extent_buffer *eb,
 	int i = 0;
 	int ret;
 
+	if (!want_block(metadump, btrfs_header_bytenr(eb),
+			btrfs_header_generation(eb)))
+		return 0;
 	ret = add_extent(btrfs_header_bytenr(eb), root->leafsize, metadump, 0);
 	if (ret) {
 		fprintf(stderr, "Error adding metadata block\n");
@@ -1117,6 +1710,9 @@ static int copy_tree_blocks(struct btrfs_root *root, struct extent_buffer *eb,
 				continue;
 			ri = btrfs_item_ptr(eb, i, struct btrfs_root_item);
 			bytenr = btrfs_disk_root_bytenr(eb, ri);
+			if (!want_block(metadump, bytenr,
+					btrfs_disk_root_generation(eb, ri)))
+				continue;
 			tmp = read_tree_block(root, bytenr, root->leafsize, 0);
 			if (!extent_buffer_uptodate(tmp)) {
 				fprintf(stderr,
@@ -1129,6 +1725,9 @@ static int copy_tree_blocks(struct btrfs_root *root, struct extent_buffer *eb,
 				return ret;
 		} else {
 			bytenr = btrfs_node_blockptr(eb, i);
+			if (!want_block(metadump, bytenr,
+					btrfs_node_ptr_generation(eb, i)))
+				continue;
 			tmp = read_tree_block(root, bytenr, root->leafsize, 0);
 			if (!extent_buffer_uptodate(tmp)) {
 				fprintf(stderr, "Error reading log block\n");
@@ -1217,6 +1816,11 @@ static int copy_space_cache(struct btrfs_root *root,
 
 		bytenr = btrfs_file_extent_disk_bytenr(leaf, fi);
 		num_bytes = btrfs_file_extent_disk_num_bytes(leaf, fi);
+		if (!want_block(metadump, bytenr,
+				btrfs_file_extent_generation(leaf, fi))) {
+			path->slots[0]++;
+			continue;
+		}
 		ret = add_extent(bytenr, num_bytes, metadump, 1);
 		if (ret) {
 			fprintf(stderr, "Error adding space cache blocks %d\n",
@@ -1288,8 +1892,10 @@ static int copy_from_extent_tree(struct metadump_struct *metadump,
 		if (btrfs_item_size_nr(leaf, path->slots[0]) > sizeof(*ei)) {
 			ei = btrfs_item_ptr(leaf, path->slots[0],
 					    struct btrfs_extent_item);
-			if (btrfs_extent_flags(leaf, ei) &
-			    BTRFS_EXTENT_FLAG_TREE_BLOCK) {
+			if ((btrfs_extent_flags(leaf, ei) &
+			     BTRFS_EXTENT_FLAG_TREE_BLOCK) &&
+			    want_block(metadump, bytenr,
+				       btrfs_extent_generation(leaf, ei))) {
 				ret = add_extent(bytenr, num_bytes, metadump,
 						 0);
 				if (ret) {
@@ -1333,7 +1939,10 @@ static int copy_from_extent_tree(struct metadump_struct *metadump,
 }
 
 static int create_metadump(const char *input, FILE *out, int num_threads,
-			   int compress_level, int sanitize, int walk_trees)
+			   const struct compress_method *compress,
+			   int compress_level, int sanitize, int walk_trees,
+			   u64 since_generation, const u8 *base_fsid,
+			   int indexed)
 {
 	struct btrfs_root *root;
 	struct btrfs_path *path = NULL;
@@ -1349,7 +1958,14 @@ static int create_metadump(const char *input, FILE *out, int num_threads,
 
 	BUG_ON(root->nodesize != root->leafsize);
 
-	ret = metadump_init(&metadump, root, out, num_threads,
+	if (base_fsid && memcmp(base_fsid, root->fs_info->super_copy->fsid,
+				BTRFS_FSID_SIZE)) {
+		fprintf(stderr, "The base image is not of this filesystem\n");
+		close_ctree(root);
+		return -EINVAL;
+	}
+
+	ret = metadump_init(&metadump, root, out, num_threads, compress,
 			    compress_level, sanitize);
 	if (ret) {
 		fprintf(stderr, "Error initing metadump %d\n", ret);
@@ -1357,6 +1973,17 @@ static int create_metadump(const char *input, FILE *out, int num_threads,
 		return ret;
 	}
 
+	metadump.write_index = indexed;
+	if (since_generation) {
+		metadump.since_generation = since_generation;
+		ret = add_delta_info(&metadump);
+		if (ret) {
+			fprintf(stderr, "Error adding delta info %d\n", ret);
+			err = ret;
+			goto out;
+		}
+	}
+
 	ret = add_extent(BTRFS_SUPER_INFO_OFFSET, BTRFS_SUPER_INFO_SIZE,
 			&metadump, 0);
 	if (ret) {
@@ -1408,6 +2035,11 @@ out:
 			err = ret;
 		fprintf(stderr, "Error flushing pending %d\n", ret);
 	}
+	if (!err && indexed) {
+		err = write_index(&metadump);
+		if (err)
+			fprintf(stderr, "Error writing the index %d\n", err);
+	}
 
 	metadump_destroy(&metadump, num_threads);
 
@@ -1687,6 +2319,14 @@ static void write_backup_supers(int fd, u8 *buf)
 	}
 }
 
+static void restore_error(struct mdrestore_struct *mdres, int error)
+{
+	int old = 0;
+
+	__atomic_compare_exchange_n(&mdres->error, &old, error, 0,
+				    __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+}
+
 static void *restore_worker(void *data)
 {
 	struct mdrestore_struct *mdres = (struct mdrestore_struct *)data;
@@ -1700,41 +2340,25 @@ static void *restore_worker(void *data)
 
 	outfd = fileno(mdres->out);
 	buffer = malloc(compress_size);
-	if (!buffer) {
-		fprintf(stderr, "Error allocing buffer\n");
-		pthread_mutex_lock(&mdres->mutex);
-		if (!mdres->error)
-			mdres->error = -ENOMEM;
-		pthread_mutex_unlock(&mdres->mutex);
-		pthread_exit(NULL);
-	}
 
-	while (1) {
+	while ((async = work_queue_pop(&mdres->queue))) {
 		u64 bytenr;
 		off_t offset = 0;
 		int err = 0;
 
-		pthread_mutex_lock(&mdres->mutex);
-		while (!mdres->leafsize || list_empty(&mdres->list)) {
-			if (mdres->done) {
-				pthread_mutex_unlock(&mdres->mutex);
-				goto out;
-			}
-			pthread_cond_wait(&mdres->cond, &mdres->mutex);
+		if (!buffer) {
+			fprintf(stderr, "Error allocing buffer\n");
+			restore_error(mdres, -ENOMEM);
+			goto next;
 		}
-		async = list_entry(mdres->list.next, struct async_work, list);
-		list_del_init(&async->list);
-		pthread_mutex_unlock(&mdres->mutex);
-
-		if (mdres->compress_method == COMPRESS_ZLIB) {
-			size = compress_size; 
-			ret = uncompress(buffer, (unsigned long *)&size,
-					 async->buffer, async->bufsize);
-			if (ret != Z_OK) {
-				fprintf(stderr, "Error decompressing %d\n",
-					ret);
-				err = -EIO;
-			}
+
+		if (async->compress != COMPRESS_NONE) {
+			size = compress_size;
+			ret = decompress_buffer(async->compress, buffer,
+						&size, async->buffer,
+						async->bufsize);
+			if (ret)
+				err = ret;
 			outbuf = buffer;
 		} else {
 			outbuf = async->buffer;
@@ -1760,6 +2384,15 @@ static void *restore_worker(void *data)
 		if (!mdres->fixup_offset) {
 			while (size) {
 				u64 chunk_size = size;
+
+				if (mdres->skip_unmapped &&
+				    !chunk_mapped(mdres, async->start + offset)) {
+					chunk_size = min_t(u64, size,
+							   mdres->leafsize);
+					size -= chunk_size;
+					offset += chunk_size;
+					continue;
+				}
 				if (!mdres->multi_devices && !mdres->old_restore)
 					bytenr = logical_to_physical(mdres,
 								     async->start + offset,
@@ -1797,20 +2430,29 @@ static void *restore_worker(void *data)
 		if (!mdres->multi_devices && async->start == BTRFS_SUPER_INFO_OFFSET)
 			write_backup_supers(outfd, outbuf);
 
-		pthread_mutex_lock(&mdres->mutex);
-		if (err && !mdres->error)
-			mdres->error = err;
-		mdres->num_items--;
-		pthread_mutex_unlock(&mdres->mutex);
-
+		if (err)
+			restore_error(mdres, err);
+next:
 		free(async->buffer);
 		free(async);
+		work_queue_complete(&mdres->queue);
 	}
-out:
 	free(buffer);
 	pthread_exit(NULL);
 }
 
+static void free_restore_list(struct list_head *list)
+{
+	struct async_work *async;
+
+	while (!list_empty(list)) {
+		async = list_entry(list->next, struct async_work, list);
+		list_del_init(&async->list);
+		free(async->buffer);
+		free(async);
+	}
+}
+
 static void mdrestore_destroy(struct mdrestore_struct *mdres, int num_threads)
 {
 	struct rb_node *n;
@@ -1824,16 +2466,12 @@ static void mdrestore_destroy(struct mdrestore_struct *mdres, int num_threads)
 		rb_erase(&entry->p, &mdres->physical_tree);
 		free(entry);
 	}
-	pthread_mutex_lock(&mdres->mutex);
-	mdres->done = 1;
-	pthread_cond_broadcast(&mdres->cond);
-	pthread_mutex_unlock(&mdres->mutex);
-
+	work_queue_close(&mdres->queue);
 	for (i = 0; i < num_threads; i++)
 		pthread_join(mdres->threads[i], NULL);
-
-	pthread_cond_destroy(&mdres->cond);
+	work_queue_destroy(&mdres->queue);
 	pthread_mutex_destroy(&mdres->mutex);
+	free_restore_list(&mdres->list);
 	free(mdres->threads);
 }
 
@@ -1845,7 +2483,6 @@ static int mdrestore_init(struct mdrestore_struct *mdres,
 	int i, ret = 0;
 
 	memset(mdres, 0, sizeof(*mdres));
-	pthread_cond_init(&mdres->cond, NULL);
 	pthread_mutex_init(&mdres->mutex, NULL);
 	INIT_LIST_HEAD(&mdres->list);
 	INIT_LIST_HEAD(&mdres->overlapping_chunks);
@@ -1860,13 +2497,24 @@ static int mdrestore_init(struct mdrestore_struct *mdres,
 	mdres->last_physical_offset = 0;
 	mdres->alloced_chunks = 0;
 
+	ret = work_queue_init(&mdres->queue,
+			      max_t(u64, 2 * ITEMS_PER_CLUSTER,
+				    8 * num_threads));
+	if (ret) {
+		pthread_mutex_destroy(&mdres->mutex);
+		return ret;
+	}
+
 	if (!num_threads)
 		return 0;
 
 	mdres->num_threads = num_threads;
 	mdres->threads = calloc(num_threads, sizeof(pthread_t));
-	if (!mdres->threads)
+	if (!mdres->threads) {
+		work_queue_destroy(&mdres->queue);
+		pthread_mutex_destroy(&mdres->mutex);
 		return -ENOMEM;
+	}
 	for (i = 0; i < num_threads; i++) {
 		ret = pthread_create(mdres->threads + i, NULL, restore_worker,
 				     mdres);
@@ -1874,7 +2522,7 @@ static int mdrestore_init(struct mdrestore_struct *mdres,
 			break;
 	}
 	if (ret)
-		mdrestore_destroy(mdres, i + 1);
+		mdrestore_destroy(mdres, i);
 	return ret;
 }
 
@@ -1886,22 +2534,17 @@ static int fill_mdres_info(struct mdrestore_struct *mdres,
 	u8 *outbuf;
 	int ret;
 
-	/* We've already been initialized */
-	if (mdres->leafsize)
-		return 0;
-
-	if (mdres->compress_method == COMPRESS_ZLIB) {
+	if (async->compress != COMPRESS_NONE) {
 		size_t size = MAX_PENDING_SIZE * 2;
 
 		buffer = malloc(MAX_PENDING_SIZE * 2);
 		if (!buffer)
 			return -ENOMEM;
-		ret = uncompress(buffer, (unsigned long *)&size,
-				 async->buffer, async->bufsize);
-		if (ret != Z_OK) {
-			fprintf(stderr, "Error decompressing %d\n", ret);
+		ret = decompress_buffer(async->compress, buffer, &size,
+					async->buffer, async->bufsize);
+		if (ret) {
 			free(buffer);
-			return -EIO;
+			return ret;
 		}
 		outbuf = buffer;
 	} else {
@@ -1909,15 +2552,64 @@ static int fill_mdres_info(struct mdrestore_struct *mdres,
 	}
 
 	super = (struct btrfs_super_block *)outbuf;
-	mdres->leafsize = btrfs_super_leafsize(super);
-	memcpy(mdres->fsid, super->fsid, BTRFS_FSID_SIZE);
-	memcpy(mdres->uuid, super->dev_item.uuid,
+	mdres->generation = btrfs_super_generation(super);
+	/* We've already been initialized */
+	if (!mdres->leafsize) {
+		mdres->leafsize = btrfs_super_leafsize(super);
+		memcpy(mdres->fsid, super->fsid, BTRFS_FSID_SIZE);
+		memcpy(mdres->uuid, super->dev_item.uuid,
 		       BTRFS_UUID_SIZE);
-	mdres->devid = le64_to_cpu(super->dev_item.devid);
+		mdres->devid = le64_to_cpu(super->dev_item.devid);
+	}
 	free(buffer);
 	return 0;
 }
 
+/* a delta applies over an image of its fs at least as new as its base */
+static int check_delta_info(struct mdrestore_struct *mdres,
+			    struct async_work *async)
+{
+	struct meta_delta_info info;
+	size_t size = sizeof(info);
+	u64 base_generation;
+	int ret;
+
+	if (async->compress != COMPRESS_NONE) {
+		ret = decompress_buffer(async->compress, (u8 *)&info, &size,
+					async->buffer, async->bufsize);
+		if (ret)
+			return ret;
+	} else if (async->bufsize == size) {
+		memcpy(&info, async->buffer, size);
+	} else {
+		size = 0;
+	}
+	if (size != sizeof(info)) {
+		fprintf(stderr, "Bad delta info in the image\n");
+		return -EIO;
+	}
+
+	base_generation = le64_to_cpu(info.base_generation);
+	if (!mdres->generation) {
+		fprintf(stderr,
+	"The image is a delta against generation %llu, restore its base first\n",
+			(unsigned long long)base_generation);
+		return -EINVAL;
+	}
+	if (memcmp(info.fsid, mdres->fsid, BTRFS_FSID_SIZE)) {
+		fprintf(stderr, "The delta is not of the same filesystem\n");
+		return -EINVAL;
+	}
+	if (base_generation > mdres->generation) {
+		fprintf(stderr,
+	"The delta against generation %llu does not apply over generation %llu\n",
+			(unsigned long long)base_generation,
+			(unsigned long long)mdres->generation);
+		return -EINVAL;
+	}
+	return 0;
+}
+
 static int add_cluster(struct meta_cluster *cluster,
 		       struct mdrestore_struct *mdres, u64 *next)
 {
@@ -1928,6 +2620,9 @@ static int add_cluster(struct meta_cluster *cluster,
 	u32 i, nritems;
 	int ret;
 
+	ret = check_compress_method(header->compress);
+	if (ret)
+		return ret;
 	mdres->compress_method = header->compress;
 
 	bytenr = le64_to_cpu(header->bytenr) + BLOCK_SIZE;
@@ -1956,21 +2651,39 @@ static int add_cluster(struct meta_cluster *cluster,
 		}
 		bytenr += async->bufsize;
 
-		pthread_mutex_lock(&mdres->mutex);
+		async->compress = header->compress;
+
+		if (async->start == DELTA_INFO_BYTENR) {
+			ret = check_delta_info(mdres, async);
+			free(async->buffer);
+			free(async);
+			if (ret)
+				return ret;
+			continue;
+		}
 		if (async->start == BTRFS_SUPER_INFO_OFFSET) {
 			ret = fill_mdres_info(mdres, async);
 			if (ret) {
 				fprintf(stderr, "Error setting up restore\n");
-				pthread_mutex_unlock(&mdres->mutex);
 				free(async->buffer);
 				free(async);
 				return ret;
 			}
 		}
-		list_add_tail(&async->list, &mdres->list);
-		mdres->num_items++;
-		pthread_cond_signal(&mdres->cond);
-		pthread_mutex_unlock(&mdres->mutex);
+		/* the blocks need the leafsize, from the super block */
+		if (!mdres->leafsize) {
+			list_add_tail(&async->list, &mdres->list);
+			continue;
+		}
+		while (!list_empty(&mdres->list)) {
+			struct async_work *prev;
+
+			prev = list_entry(mdres->list.next, struct async_work,
+					  list);
+			list_del_init(&prev->list);
+			work_queue_push(&mdres->queue, prev);
+		}
+		work_queue_push(&mdres->queue, async);
 	}
 	if (bytenr & BLOCK_MASK) {
 		char buffer[BLOCK_MASK];
@@ -1989,22 +2702,8 @@ static int add_cluster(struct meta_cluster *cluster,
 
 static int wait_for_worker(struct mdrestore_struct *mdres)
 {
-	int ret = 0;
-
-	pthread_mutex_lock(&mdres->mutex);
-	ret = mdres->error;
-	while (!ret && mdres->num_items > 0) {
-		struct timespec ts = {
-			.tv_sec = 0,
-			.tv_nsec = 10000000,
-		};
-		pthread_mutex_unlock(&mdres->mutex);
-		nanosleep(&ts, NULL);
-		pthread_mutex_lock(&mdres->mutex);
-		ret = mdres->error;
-	}
-	pthread_mutex_unlock(&mdres->mutex);
-	return ret;
+	work_queue_drain(&mdres->queue);
+	return __atomic_load_n(&mdres->error, __ATOMIC_ACQUIRE);
 }
 
 static int read_chunk_block(struct mdrestore_struct *mdres, u8 *buffer,
@@ -2125,7 +2824,7 @@ static int search_for_chunk_blocks(struct mdrestore_struct *mdres,
 		return -ENOMEM;
 	}
 
-	if (mdres->compress_method == COMPRESS_ZLIB) {
+	if (mdres->compress_method != COMPRESS_NONE) {
 		tmp = malloc(max_size);
 		if (!tmp) {
 			fprintf(stderr, "Error allocing tmp buffer\n");
@@ -2144,7 +2843,8 @@ static int search_for_chunk_blocks(struct mdrestore_struct *mdres,
 		}
 
 		ret = fread(cluster, BLOCK_SIZE, 1, mdres->in);
-		if (ret == 0) {
+		if (ret == 0 ||
+		    le64_to_cpu(cluster->header.magic) == INDEX_MAGIC) {
 			if (cluster_bytenr != 0) {
 				cluster_bytenr = 0;
 				current_cluster = 0;
@@ -2184,7 +2884,7 @@ static int search_for_chunk_blocks(struct mdrestore_struct *mdres,
 				break;
 			}
 
-			if (mdres->compress_method == COMPRESS_ZLIB) {
+			if (mdres->compress_method != COMPRESS_NONE) {
 				ret = fread(tmp, bufsize, 1, mdres->in);
 				if (ret != 1) {
 					fprintf(stderr, "Error reading: %d\n",
@@ -2194,15 +2894,11 @@ static int search_for_chunk_blocks(struct mdrestore_struct *mdres,
 				}
 
 				size = max_size;
-				ret = uncompress(buffer,
-						 (unsigned long *)&size, tmp,
-						 bufsize);
-				if (ret != Z_OK) {
-					fprintf(stderr, "Error decompressing "
-						"%d\n", ret);
-					ret = -EIO;
+				ret = decompress_buffer(mdres->compress_method,
+							buffer, &size, tmp,
+							bufsize);
+				if (ret)
 					break;
-				}
 			} else {
 				ret = fread(buffer, bufsize, 1, mdres->in);
 				if (ret != 1) {
@@ -2242,28 +2938,24 @@ static int search_for_chunk_blocks(struct mdrestore_struct *mdres,
 	return ret;
 }
 
-static int build_chunk_tree(struct mdrestore_struct *mdres,
-			    struct meta_cluster *cluster)
+/*
+ * Read the super block of the image @in into *@super, allocated.  The first
+ * cluster is left in @cluster.
+ */
+static int read_image_super(FILE *in, struct meta_cluster *cluster,
+			    u8 **super)
 {
-	struct btrfs_super_block *super;
 	struct meta_cluster_header *header;
 	struct meta_cluster_item *item = NULL;
-	u64 chunk_root_bytenr = 0;
 	u32 i, nritems;
-	u64 bytenr = 0;
 	u8 *buffer;
 	int ret;
 
-	/* We can't seek with stdin so don't bother doing this */
-	if (mdres->in == stdin)
-		return 0;
-
-	ret = fread(cluster, BLOCK_SIZE, 1, mdres->in);
+	ret = fread(cluster, BLOCK_SIZE, 1, in);
 	if (ret <= 0) {
 		fprintf(stderr, "Error reading in cluster: %d\n", errno);
 		return -EIO;
 	}
-	ret = 0;
 
 	header = &cluster->header;
 	if (le64_to_cpu(header->magic) != HEADER_MAGIC ||
@@ -2272,16 +2964,16 @@ static int build_chunk_tree(struct mdrestore_struct *mdres,
 		return -EIO;
 	}
 
-	bytenr += BLOCK_SIZE;
-	mdres->compress_method = header->compress;
+	ret = check_compress_method(header->compress);
+	if (ret)
+		return ret;
 	nritems = le32_to_cpu(header->nritems);
 	for (i = 0; i < nritems; i++) {
 		item = &cluster->items[i];
 
 		if (le64_to_cpu(item->bytenr) == BTRFS_SUPER_INFO_OFFSET)
 			break;
-		bytenr += le32_to_cpu(item->size);
-		if (fseek(mdres->in, le32_to_cpu(item->size), SEEK_CUR)) {
+		if (fseek(in, le32_to_cpu(item->size), SEEK_CUR)) {
 			fprintf(stderr, "Error seeking: %d\n", errno);
 			return -EIO;
 		}
@@ -2298,14 +2990,14 @@ static int build_chunk_tree(struct mdrestore_struct *mdres,
 		return -ENOMEM;
 	}
 
-	ret = fread(buffer, le32_to_cpu(item->size), 1, mdres->in);
+	ret = fread(buffer, le32_to_cpu(item->size), 1, in);
 	if (ret != 1) {
 		fprintf(stderr, "Error reading buffer: %d\n", errno);
 		free(buffer);
 		return -EIO;
 	}
 
-	if (mdres->compress_method == COMPRESS_ZLIB) {
+	if (header->compress != COMPRESS_NONE) {
 		size_t size = MAX_PENDING_SIZE * 2;
 		u8 *tmp;
 
@@ -2314,17 +3006,68 @@ static int build_chunk_tree(struct mdrestore_struct *mdres,
 			free(buffer);
 			return -ENOMEM;
 		}
-		ret = uncompress(tmp, (unsigned long *)&size,
-				 buffer, le32_to_cpu(item->size));
-		if (ret != Z_OK) {
-			fprintf(stderr, "Error decompressing %d\n", ret);
+		ret = decompress_buffer(header->compress, tmp, &size,
+					buffer, le32_to_cpu(item->size));
+		if (ret) {
 			free(buffer);
 			free(tmp);
-			return -EIO;
+			return ret;
 		}
 		free(buffer);
 		buffer = tmp;
 	}
+	*super = buffer;
+	return 0;
+}
+
+/* the generation and the fsid of the image at @path */
+static int image_generation(const char *path, u8 *fsid, u64 *generation)
+{
+	struct btrfs_super_block *super;
+	struct meta_cluster *cluster;
+	u8 *buffer;
+	FILE *in;
+	int ret;
+
+	in = fopen(path, "r");
+	if (!in) {
+		fprintf(stderr, "unable to open base image %s: %s\n", path,
+			strerror(errno));
+		return -errno;
+	}
+	cluster = malloc(BLOCK_SIZE);
+	if (!cluster) {
+		fclose(in);
+		return -ENOMEM;
+	}
+	ret = read_image_super(in, cluster, &buffer);
+	if (!ret) {
+		super = (struct btrfs_super_block *)buffer;
+		*generation = btrfs_super_generation(super);
+		memcpy(fsid, super->fsid, BTRFS_FSID_SIZE);
+		free(buffer);
+	}
+	free(cluster);
+	fclose(in);
+	return ret;
+}
+
+static int build_chunk_tree(struct mdrestore_struct *mdres,
+			    struct meta_cluster *cluster)
+{
+	struct btrfs_super_block *super;
+	u64 chunk_root_bytenr = 0;
+	u8 *buffer;
+	int ret;
+
+	/* We can't seek with stdin so don't bother doing this */
+	if (mdres->in == stdin)
+		return 0;
+
+	ret = read_image_super(mdres->in, cluster, &buffer);
+	if (ret)
+		return ret;
+	mdres->compress_method = cluster->header.compress;
 
 	pthread_mutex_lock(&mdres->mutex);
 	super = (struct btrfs_super_block *)buffer;
@@ -2474,17 +3217,60 @@ again:
 	return 0;
 }
 
-static int restore_metadump(const char *input, FILE *out, int old_restore,
+/* queue all the clusters of @in and wait for them to be written */
+static int restore_image(struct mdrestore_struct *mdres, FILE *in,
+			 struct meta_cluster *cluster)
+{
+	struct meta_cluster_header *header;
+	u64 bytenr = 0;
+	int ret = 0;
+	int err;
+
+	mdres->in = in;
+	if (in != stdin && fseek(in, 0, SEEK_SET)) {
+		fprintf(stderr, "Error seeking %d\n", errno);
+		return -EIO;
+	}
+
+	while (!__atomic_load_n(&mdres->error, __ATOMIC_ACQUIRE)) {
+		if (!fread(cluster, BLOCK_SIZE, 1, in))
+			break;
+
+		header = &cluster->header;
+		/* the clusters end where the index of the image starts */
+		if (le64_to_cpu(header->magic) == INDEX_MAGIC)
+			break;
+		if (le64_to_cpu(header->magic) != HEADER_MAGIC ||
+		    le64_to_cpu(header->bytenr) != bytenr) {
+			fprintf(stderr, "bad header in metadump image\n");
+			break;
+		}
+		ret = add_cluster(cluster, mdres, &bytenr);
+		if (ret) {
+			fprintf(stderr, "Error adding cluster\n");
+			break;
+		}
+	}
+	err = wait_for_worker(mdres);
+	return ret ? ret : err;
+}
+
+/*
+ * Restore the image @input to @out, then the @nr_deltas images of @deltas
+ * over it in order.
+ */
+static int restore_metadump(const char *input, const char **deltas,
+			    int nr_deltas, FILE *out, int old_restore,
 			    int num_threads, int fixup_offset,
 			    const char *target, int multi_devices)
 {
 	struct meta_cluster *cluster = NULL;
-	struct meta_cluster_header *header;
 	struct mdrestore_struct mdrestore;
 	struct btrfs_fs_info *info = NULL;
-	u64 bytenr = 0;
 	FILE *in = NULL;
+	FILE **delta_in = NULL;
 	int ret = 0;
+	int i;
 
 	if (!strcmp(input, "-")) {
 		in = stdin;
@@ -2496,6 +3282,23 @@ static int restore_metadump(const char *input, FILE *out, int old_restore,
 		}
 	}
 
+	if (nr_deltas) {
+		delta_in = calloc(nr_deltas, sizeof(*delta_in));
+		if (!delta_in) {
+			ret = -ENOMEM;
+			goto failed_open;
+		}
+	}
+	for (i = 0; i < nr_deltas; i++) {
+		delta_in[i] = fopen(deltas[i], "r");
+		if (!delta_in[i]) {
+			fprintf(stderr, "unable to open delta image %s: %s\n",
+				deltas[i], strerror(errno));
+			ret = 1;
+			goto failed_open;
+		}
+	}
+
 	/* NOTE: open with write mode */
 	if (fixup_offset) {
 		BUG_ON(!target);
@@ -2525,6 +3328,11 @@ static int restore_metadump(const char *input, FILE *out, int old_restore,
 	}
 
 	if (!multi_devices && !old_restore) {
+		/* the chunks are those of the newest image */
+		if (nr_deltas) {
+			mdrestore.in = delta_in[nr_deltas - 1];
+			mdrestore.skip_unmapped = 1;
+		}
 		ret = build_chunk_tree(&mdrestore, cluster);
 		if (ret)
 			goto out;
@@ -2532,30 +3340,9 @@ static int restore_metadump(const char *input, FILE *out, int old_restore,
 			remap_overlapping_chunks(&mdrestore);
 	}
 
-	if (in != stdin && fseek(in, 0, SEEK_SET)) {
-		fprintf(stderr, "Error seeking %d\n", errno);
-		goto out;
-	}
-
-	while (!mdrestore.error) {
-		ret = fread(cluster, BLOCK_SIZE, 1, in);
-		if (!ret)
-			break;
-
-		header = &cluster->header;
-		if (le64_to_cpu(header->magic) != HEADER_MAGIC ||
-		    le64_to_cpu(header->bytenr) != bytenr) {
-			fprintf(stderr, "bad header in metadump image\n");
-			ret = -EIO;
-			break;
-		}
-		ret = add_cluster(cluster, &mdrestore, &bytenr);
-		if (ret) {
-			fprintf(stderr, "Error adding cluster\n");
-			break;
-		}
-	}
-	ret = wait_for_worker(&mdrestore);
+	ret = restore_image(&mdrestore, in, cluster);
+	for (i = 0; !ret && i < nr_deltas; i++)
+		ret = restore_image(&mdrestore, delta_in[i], cluster);
 
 	if (!ret && !multi_devices && !old_restore) {
 		struct btrfs_root *root;
@@ -2591,6 +3378,9 @@ failed_info:
 	if (fixup_offset && info)
 		close_ctree(info->chunk_root);
 failed_open:
+	for (i = 0; i < nr_deltas && delta_in && delta_in[i]; i++)
+		fclose(delta_in[i]);
+	free(delta_in);
 	if (in != stdin)
 		fclose(in);
 	return ret;
@@ -2692,26 +3482,90 @@ out:
 
 static void print_usage(int ret)
 {
+	int i;
+
 	fprintf(stderr, "usage: btrfs-image [options] source target\n");
 	fprintf(stderr, "\t-r      \trestore metadump image\n");
-	fprintf(stderr, "\t-c value\tcompression level (0 ~ 9)\n");
+	fprintf(stderr, "\t-c value\tcompression level (0 ~ 9) or method[:level]\n");
+	for (i = 0; i < nr_compress_methods; i++)
+		fprintf(stderr, "\t        \t  %s: level %d ~ %d, default %d\n",
+			compress_methods[i].name, compress_methods[i].min_level,
+			compress_methods[i].max_level,
+			compress_methods[i].default_level);
 	fprintf(stderr, "\t-t value\tnumber of threads (1 ~ 32)\n");
 	fprintf(stderr, "\t-o      \tdon't mess with the chunk tree when restoring\n");
 	fprintf(stderr, "\t-s      \tsanitize file names, use once to just use garbage, use twice if you want crc collisions\n");
 	fprintf(stderr, "\t-w      \twalk all trees instead of using extent tree, do this if your extent tree is broken\n");
 	fprintf(stderr, "\t-m	   \trestore for multiple devices\n");
+	fprintf(stderr, "\t--since-generation gen\n");
+	fprintf(stderr, "\t        \tdump a delta image of the blocks newer than gen\n");
+	fprintf(stderr, "\t--base image\n");
+	fprintf(stderr, "\t        \tdump a delta image of the blocks newer than the image\n");
+	fprintf(stderr, "\t--delta image\n");
+	fprintf(stderr, "\t        \trestore the delta image over the source, can be repeated\n");
+	fprintf(stderr, "\t--index \tindex the image so the tools can open it without restoring it\n");
 	fprintf(stderr, "\n");
 	fprintf(stderr, "\tIn the dump mode, source is the btrfs device and target is the output file (use '-' for stdout).\n");
 	fprintf(stderr, "\tIn the restore mode, source is the dumped image and target is the btrfs device/file.\n");
 	exit(ret);
 }
 
+/*
+ * Parse the argument of -c: a zlib level, 0 for none, or a method name
+ * optionally followed by :level.  Returns the method, NULL for none.
+ */
+static const struct compress_method *parse_compress(const char *arg,
+						    int *level)
+{
+	const struct compress_method *method = NULL;
+	const char *sep = strchr(arg, ':');
+	size_t len = sep ? sep - arg : strlen(arg);
+	u64 value;
+	int i;
+
+	if (isdigit(arg[0])) {
+		value = arg_strtou64(arg);
+		if (value > 9)
+			print_usage(1);
+		*level = value;
+		return value ? &compress_methods[0] : NULL;
+	}
+
+	for (i = 0; i < nr_compress_methods; i++) {
+		if (strlen(compress_methods[i].name) == len &&
+		    !strncmp(compress_methods[i].name, arg, len)) {
+			method = &compress_methods[i];
+			break;
+		}
+	}
+	if (!method) {
+		fprintf(stderr, "ERROR: unsupported compression method: %.*s\n",
+			(int)len, arg);
+		exit(1);
+	}
+
+	*level = method->default_level;
+	if (sep) {
+		value = arg_strtou64(sep + 1);
+		if (value < method->min_level || value > method->max_level) {
+			fprintf(stderr,
+				"ERROR: %s compression level must be %d ~ %d\n",
+				method->name, method->min_level,
+				method->max_level);
+			exit(1);
+		}
+		*level = value;
+	}
+	return method;
+}
+
 int main(int argc, char *argv[])
 {
 	char *source;
 	char *target;
 	u64 num_threads = 1;
-	u64 compress_level = 0;
+	const struct compress_method *compress = NULL;
+	int compress_level = 0;
 	int create = 1;
 	int old_restore = 0;
 	int walk_trees = 0;
@@ -2720,10 +3574,27 @@ int main(int argc, char *argv[])
 	int sanitize = 0;
 	int dev_cnt = 0;
 	int usage_error = 0;
+	u64 since_generation = 0;
+	int indexed = 0;
+	const char *base = NULL;
+	const char **deltas = NULL;
+	int nr_deltas = 0;
+	u8 base_fsid[BTRFS_FSID_SIZE];
 	FILE *out;
 
 	while (1) {
+		enum {
+			GETOPT_VAL_SINCE_GENERATION = 256,
+			GETOPT_VAL_BASE,
+			GETOPT_VAL_DELTA,
+			GETOPT_VAL_INDEX,
+		};
 		static const struct option long_options[] = {
+			{ "since-generation", required_argument, NULL,
+				GETOPT_VAL_SINCE_GENERATION },
+			{ "base", required_argument, NULL, GETOPT_VAL_BASE },
+			{ "delta", required_argument, NULL, GETOPT_VAL_DELTA },
+			{ "index", no_argument, NULL, GETOPT_VAL_INDEX },
 			{ "help", no_argument, NULL, GETOPT_VAL_HELP},
 			{ NULL, 0, NULL, 0 }
 		};
@@ -2740,9 +3611,7 @@ int main(int argc, char *argv[])
 				print_usage(1);
 			break;
 		case 'c':
-			compress_level = arg_strtou64(optarg);
-			if (compress_level > 9)
-				print_usage(1);
+			compress = parse_compress(optarg, &compress_level);
 			break;
 		case 'o':
 			old_restore = 1;
@@ -2757,6 +3626,24 @@ int main(int argc, char *argv[])
 			create = 0;
 			multi_devices = 1;
 			break;
+		case GETOPT_VAL_SINCE_GENERATION:
+			since_generation = arg_strtou64(optarg);
+			break;
+		case GETOPT_VAL_BASE:
+			base = optarg;
+			break;
+		case GETOPT_VAL_DELTA:
+			deltas = realloc(deltas, (nr_deltas + 1) *
+					 sizeof(*deltas));
+			if (!deltas) {
+				fprintf(stderr, "ERROR: not enough memory\n");
+				exit(1);
+			}
+			deltas[nr_deltas++] = optarg;
+			break;
+		case GETOPT_VAL_INDEX:
+			indexed = 1;
+			break;
 			case GETOPT_VAL_HELP:
 		default:
 			print_usage(c != GETOPT_VAL_HELP);
@@ -2775,11 +3662,27 @@ int main(int argc, char *argv[])
 			fprintf(stderr, "Usage error: create and restore cannot be used at the same time\n");
 			usage_error++;
 		}
+		if (nr_deltas) {
+			fprintf(stderr, "Usage error: --delta is for restore\n");
+			usage_error++;
+		}
+		if (since_generation && base) {
+			fprintf(stderr, "Usage error: --since-generation and --base cannot be used at the same time\n");
+			usage_error++;
+		}
 	} else {
-		if (walk_trees || sanitize || compress_level) {
+		if (walk_trees || sanitize || compress) {
 			fprintf(stderr, "Usage error: use -w, -s, -c options for restore makes no sense\n");
 			usage_error++;
 		}
+		if (since_generation || base || indexed) {
+			fprintf(stderr, "Usage error: use --since-generation, --base, --index options for restore makes no sense\n");
+			usage_error++;
+		}
+		if (multi_devices && nr_deltas) {
+			fprintf(stderr, "Usage error: --delta cannot be used with -m\n");
+			usage_error++;
+		}
 		if (multi_devices && dev_cnt < 2) {
 			fprintf(stderr, "Usage error: not enough devices specified for -m option\n");
 			usage_error++;
@@ -2806,7 +3709,7 @@ int main(int argc, char *argv[])
 		}
 	}
 
-	if (num_threads == 1 && compress_level > 0) {
+	if (num_threads == 1 && compress) {
 		num_threads = sysconf(_SC_NPROCESSORS_ONLN);
 		if (num_threads <= 0)
 			num_threads = 1;
@@ -2822,11 +3725,20 @@ int main(int argc, char *argv[])
 			fprintf(stderr,
 		"WARNING: The device is mounted. Make sure the filesystem is quiescent.\n");
 
-		ret = create_metadump(source, out, num_threads,
-				      compress_level, sanitize, walk_trees);
+		if (base) {
+			ret = image_generation(base, base_fsid,
+					       &since_generation);
+			if (ret)
+				goto out;
+		}
+		ret = create_metadump(source, out, num_threads, compress,
+				      compress_level, sanitize, walk_trees,
+				      since_generation,
+				      base ? base_fsid : NULL, indexed);
 	} else {
-		ret = restore_metadump(source, out, old_restore, num_threads,
-				       0, target, multi_devices);
+		ret = restore_metadump(source, deltas, nr_deltas, out,
+				       old_restore, num_threads, 0, target,
+				       multi_devices);
 	}
 	if (ret) {
 		printk("%s failed (%s)\n", (create) ? "create" : "restore",
@@ -2873,7 +3785,7 @@ int main(int argc, char *argv[])
 		close_ctree(info->chunk_root);
 
 		/* fix metadata block to map correct chunk */
-		ret = restore_metadump(source, out, 0, num_threads, 1,
+		ret = restore_metadump(source, NULL, 0, out, 0, num_threads, 1,
 				       target, 1);
 		if (ret) {
 			fprintf(stderr, "fix metadump failed (error=%d)\n",
@@ -2897,5 +3809,6 @@ out:
 		}
 	}
 
+	free(deltas);
 	return !!ret;
 }
@@ -18,12 +18,17 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/resource.h>
 #include <unistd.h>
 #include <getopt.h>
+#include <time.h>
 #include <uuid/uuid.h>
 #include "ctree.h"
 #include "volumes.h"
@@ -39,6 +44,10 @@
 #include "rbtree-utils.h"
 #include "backref.h"
 #include "ulist.h"
+#include "ext-sort.h"
+#include "mem-pool.h"
+#include "crc32c.h"
+#include "task-utils.h"
 
 static u64 bytes_used = 0;
 static u64 total_csum_bytes = 0;
@@ -55,6 +64,36 @@ static int repair = 0;
 static int no_holes = 0;
 static int init_extent_tree = 0;
 static int check_data_csum = 0;
+static int check_threads = 1;
+static u64 mem_limit = 0;
+static int mem_stats = 0;
+
+enum {
+	IO_ORDER_LOGICAL,
+	IO_ORDER_PHYSICAL,
+};
+static int io_order = IO_ORDER_LOGICAL;
+
+/*
+ * The blocks and bytes done in the running phase, bumped from any thread and
+ * read by the progress reporter.
+ */
+static u64 progress_blocks;
+static u64 progress_bytes;
+
+static inline void check_progress_add(u64 blocks, u64 bytes)
+{
+	__atomic_add_fetch(&progress_blocks, blocks, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&progress_bytes, bytes, __ATOMIC_RELAXED);
+}
+
+static u64 check_clock_nsec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
 
 struct extent_backref {
 	struct list_head list;
@@ -126,6 +165,16 @@ struct extent_record {
 	unsigned int is_root:1;
 	unsigned int metadata:1;
 	unsigned int bad_full_backref:1;
+	unsigned int inline_ref_data:1;
+	unsigned int inline_ref_used:1;
+	/*
+	 * Room for the first backref, a tree backref for metadata records and
+	 * a data backref for data ones, see alloc_extent_rec().
+	 */
+	union {
+		struct tree_backref tree;
+		struct data_backref data;
+	} inline_ref[0];
 };
 
 struct inode_backref {
@@ -139,7 +188,7 @@ struct inode_backref {
 	u64 dir;
 	u64 index;
 	u16 namelen;
-	char name[0];
+	const char *name;
 };
 
 struct root_item_record {
@@ -437,12 +486,108 @@ struct ptr_node {
 	void *data;
 };
 
+/*
+ * The records we keep millions of come from pools instead of malloc.  The
+ * extent records and their backrefs are only touched by the main thread,
+ * the inode records are allocated by all the fs root walkers and the names
+ * of their backrefs are interned, there are a lot of same names across
+ * snapshots and directories.  All of them are given back after the phase
+ * using them.
+ */
+static struct mem_pool tree_extent_rec_pool;
+static struct mem_pool data_extent_rec_pool;
+static struct mem_pool tree_backref_pool;
+static struct mem_pool data_backref_pool;
+static struct mem_pool inode_rec_pool;
+static struct mem_pool inode_backref_pool;
+static struct name_pool inode_names;
+static u64 inline_extent_backrefs;
+static u64 nr_inode_names;
+static u64 inode_name_lookups;
+static u64 inode_name_bytes;
+
+static void init_record_pools(void)
+{
+	mem_pool_init(&tree_extent_rec_pool, "tree extent records",
+		      offsetof(struct extent_record, inline_ref) +
+		      sizeof(struct tree_backref), 0);
+	mem_pool_init(&data_extent_rec_pool, "data extent records",
+		      offsetof(struct extent_record, inline_ref) +
+		      sizeof(struct data_backref), 0);
+	mem_pool_init(&tree_backref_pool, "tree backrefs",
+		      sizeof(struct tree_backref), 0);
+	mem_pool_init(&data_backref_pool, "data backrefs",
+		      sizeof(struct data_backref), 0);
+	mem_pool_init(&inode_rec_pool, "inode records",
+		      sizeof(struct inode_record), 1);
+	mem_pool_init(&inode_backref_pool, "inode backrefs",
+		      sizeof(struct inode_backref), 1);
+	name_pool_init(&inode_names);
+}
+
+static void release_extent_rec_pools(void)
+{
+	mem_pool_release(&tree_extent_rec_pool);
+	mem_pool_release(&data_extent_rec_pool);
+	mem_pool_release(&tree_backref_pool);
+	mem_pool_release(&data_backref_pool);
+}
+
+/* the names can only go once no inode backref points to them anymore */
+static void release_inode_rec_pools(void)
+{
+	name_pool_stats(&inode_names, &nr_inode_names, &inode_name_lookups,
+			&inode_name_bytes);
+	mem_pool_release(&inode_rec_pool);
+	if (mem_pool_release(&inode_backref_pool))
+		return;
+	name_pool_free(&inode_names);
+	name_pool_init(&inode_names);
+}
+
+static struct inode_backref *alloc_inode_backref(const char *name,
+						 int namelen)
+{
+	struct inode_backref *backref;
+
+	backref = mem_pool_zalloc(&inode_backref_pool);
+	if (!backref)
+		return NULL;
+	backref->name = name_pool_intern(&inode_names, name, namelen);
+	if (!backref->name) {
+		mem_pool_free(&inode_backref_pool, backref);
+		return NULL;
+	}
+	backref->namelen = namelen;
+	return backref;
+}
+
+static void free_inode_backref(struct inode_backref *backref)
+{
+	mem_pool_free(&inode_backref_pool, backref);
+}
+
+/*
+ * Records of a tree block shared by several roots are collected once by the
+ * first walker getting there (@builder, NULL once complete) and spliced into
+ * the other roots.  @refs counts the roots still to consume the node, @users
+ * the walkers copying out of it right now.
+ */
 struct shared_node {
 	struct cache_extent cache;
 	struct cache_tree root_cache;
 	struct cache_tree inode_cache;
 	struct inode_record *current;
 	u32 refs;
+	u32 users;
+	struct walk_control *builder;
+};
+
+/* shared nodes of all the fs roots, the walkers may run in parallel */
+struct shared_cache {
+	struct cache_tree tree;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
 };
 
 struct block_info {
@@ -450,11 +595,79 @@ struct block_info {
 	u32 size;
 };
 
+/*
+ * The errors found by the check threads are collected in a report, which is
+ * printed when the serial check would have printed them.  Without a report
+ * they go to stderr right away.
+ */
+struct check_report {
+	char *buf;
+	size_t len;
+	size_t size;
+};
+
+static void __attribute__ ((format (printf, 2, 3)))
+report_error(struct check_report *report, const char *fmt, ...)
+{
+	va_list args;
+	size_t size;
+	char *buf;
+	int len;
+
+	va_start(args, fmt);
+	if (!report) {
+		vfprintf(stderr, fmt, args);
+		va_end(args);
+		return;
+	}
+	len = vsnprintf(NULL, 0, fmt, args);
+	va_end(args);
+	if (len < 0)
+		return;
+
+	if (report->len + len >= report->size) {
+		size = max_t(size_t, report->size * 2, report->len + len + 1);
+		buf = realloc(report->buf, size);
+		if (!buf) {
+			/* out of order is better than lost */
+			va_start(args, fmt);
+			vfprintf(stderr, fmt, args);
+			va_end(args);
+			return;
+		}
+		report->buf = buf;
+		report->size = size;
+	}
+	va_start(args, fmt);
+	vsnprintf(report->buf + report->len, len + 1, fmt, args);
+	va_end(args);
+	report->len += len;
+}
+
+static void free_report(struct check_report *report)
+{
+	free(report->buf);
+	memset(report, 0, sizeof(*report));
+}
+
+static void print_report(struct check_report *report)
+{
+	if (report->len) {
+		fflush(stdout);
+		fwrite(report->buf, 1, report->len, stderr);
+	}
+	free_report(report);
+}
+
 struct walk_control {
-	struct cache_tree shared;
+	struct shared_cache *shared;
 	struct shared_node *nodes[BTRFS_MAX_LEVEL];
 	int active_node;
 	int root_level;
+	struct shared_node *waiting_on;
+	int failed;
+	struct cache_tree *corrupt_blocks;
+	struct check_report *report;
 };
 
 struct bad_item {
@@ -515,10 +728,9 @@ static struct inode_record *clone_inode_rec(struct inode_record *orig_rec)
 	struct inode_backref *orig;
 	struct orphan_data_extent *src_orphan;
 	struct orphan_data_extent *dst_orphan;
-	size_t size;
 	int ret;
 
-	rec = malloc(sizeof(*rec));
+	rec = mem_pool_alloc(&inode_rec_pool);
 	memcpy(rec, orig_rec, sizeof(*rec));
 	rec->refs = 1;
 	INIT_LIST_HEAD(&rec->backrefs);
@@ -526,9 +738,8 @@ static struct inode_record *clone_inode_rec(struct inode_record *orig_rec)
 	rec->holes = RB_ROOT;
 
 	list_for_each_entry(orig, &orig_rec->backrefs, list) {
-		size = sizeof(*orig) + orig->namelen + 1;
-		backref = malloc(size);
-		memcpy(backref, orig, size);
+		backref = mem_pool_alloc(&inode_backref_pool);
+		memcpy(backref, orig, sizeof(*backref));
 		list_add_tail(&backref->list, &rec->backrefs);
 	}
 	list_for_each_entry(src_orphan, &orig_rec->orphan_extents, list) {
@@ -658,6 +869,8 @@ static void print_ref_error(int errors)
 	fprintf(stderr, "\n");
 }
 
+static void free_inode_rec(struct inode_record *rec);
+
 static struct inode_record *get_inode_rec(struct cache_tree *inode_cache,
 					  u64 ino, int mod)
 {
@@ -670,13 +883,13 @@ static struct inode_record *get_inode_rec(struct cache_tree *inode_cache,
 	if (cache) {
 		node = container_of(cache, struct ptr_node, cache);
 		rec = node->data;
-		if (mod && rec->refs > 1) {
+		if (mod && __atomic_load_n(&rec->refs, __ATOMIC_ACQUIRE) > 1) {
 			node->data = clone_inode_rec(rec);
-			rec->refs--;
+			free_inode_rec(rec);
 			rec = node->data;
 		}
 	} else if (mod) {
-		rec = calloc(1, sizeof(*rec));
+		rec = mem_pool_zalloc(&inode_rec_pool);
 		rec->ino = ino;
 		rec->extent_start = (u64)-1;
 		rec->refs = 1;
@@ -714,18 +927,18 @@ static void free_inode_rec(struct inode_record *rec)
 {
 	struct inode_backref *backref;
 
-	if (--rec->refs > 0)
+	if (__atomic_sub_fetch(&rec->refs, 1, __ATOMIC_ACQ_REL) > 0)
 		return;
 
 	while (!list_empty(&rec->backrefs)) {
 		backref = list_entry(rec->backrefs.next,
 				     struct inode_backref, list);
 		list_del(&backref->list);
-		free(backref);
+		free_inode_backref(backref);
 	}
 	free_orphan_data_extents(&rec->orphan_extents);
 	free_file_extent_holes(&rec->holes);
-	free(rec);
+	mem_pool_free(&inode_rec_pool, rec);
 }
 
 static int can_free_inode_rec(struct inode_record *rec)
@@ -754,7 +967,7 @@ static void maybe_free_inode_rec(struct cache_tree *inode_cache,
 				backref->errors |= REF_ERR_FILETYPE_UNMATCH;
 			if (!backref->errors && backref->found_inode_ref) {
 				list_del(&backref->list);
-				free(backref);
+				free_inode_backref(backref);
 			}
 		}
 	}
@@ -857,12 +1070,10 @@ static struct inode_backref *get_inode_backref(struct inode_record *rec,
 		return backref;
 	}
 
-	backref = malloc(sizeof(*backref) + namelen + 1);
-	memset(backref, 0, sizeof(*backref));
+	backref = alloc_inode_backref(name, namelen);
+	if (!backref)
+		return NULL;
 	backref->dir = dir;
-	backref->namelen = namelen;
-	memcpy(backref->name, name, namelen);
-	backref->name[namelen] = '\0';
 	list_add_tail(&backref->list, &rec->backrefs);
 	return backref;
 }
@@ -877,6 +1088,8 @@ static int add_inode_backref(struct cache_tree *inode_cache,
 
 	rec = get_inode_rec(inode_cache, ino, 1);
 	backref = get_inode_backref(rec, name, namelen, dir);
+	if (!backref)
+		return -ENOMEM;
 	if (errors)
 		backref->errors |= errors;
 	if (itemtype == BTRFS_DIR_INDEX_KEY) {
@@ -1000,19 +1213,20 @@ static int merge_inode_recs(struct inode_record *src, struct inode_record *dst,
 	return 0;
 }
 
+/*
+ * Add the records of @src_node to @dst_node, with @splice set they are moved
+ * over, otherwise @src_node is left alone and the records are shared.
+ */
 static int splice_shared_node(struct shared_node *src_node,
-			      struct shared_node *dst_node)
+			      struct shared_node *dst_node, int splice)
 {
 	struct cache_extent *cache;
 	struct ptr_node *node, *ins;
 	struct cache_tree *src, *dst;
 	struct inode_record *rec, *conflict;
 	u64 current_ino = 0;
-	int splice = 0;
 	int ret;
 
-	if (--src_node->refs == 0)
-		splice = 1;
 	if (src_node->current)
 		current_ino = src_node->current->ino;
 
@@ -1033,7 +1247,7 @@ again:
 			ins->cache.start = node->cache.start;
 			ins->cache.size = node->cache.size;
 			ins->data = rec;
-			rec->refs++;
+			__atomic_add_fetch(&rec->refs, 1, __ATOMIC_RELAXED);
 		}
 		ret = insert_cache_extent(dst, &ins->cache);
 		if (ret == -EEXIST) {
@@ -1113,48 +1327,131 @@ static int add_shared_node(struct cache_tree *shared, u64 bytenr, u32 refs)
 	return 0;
 }
 
+static void free_shared_node(struct shared_node *node)
+{
+	free_inode_recs_tree(&node->root_cache);
+	free_inode_recs_tree(&node->inode_cache);
+	free(node);
+}
+
+static void init_shared_cache(struct shared_cache *shared)
+{
+	cache_tree_init(&shared->tree);
+	pthread_mutex_init(&shared->lock, NULL);
+	pthread_cond_init(&shared->cond, NULL);
+}
+
+static void free_shared_cache(struct shared_cache *shared)
+{
+	struct cache_extent *cache;
+
+	while ((cache = first_cache_extent(&shared->tree))) {
+		remove_cache_extent(&shared->tree, cache);
+		free_shared_node(container_of(cache, struct shared_node,
+					      cache));
+	}
+}
+
+/*
+ * Waiting for @node would deadlock when its builder is (indirectly) waiting
+ * for a node we are building, only possible with a loop in the tree blocks.
+ */
+static int shared_node_deadlock(struct walk_control *wc,
+				struct shared_node *node)
+{
+	while (node && node->builder) {
+		if (node->builder == wc)
+			return 1;
+		node = node->builder->waiting_on;
+	}
+	return 0;
+}
+
+/*
+ * Drop one reference to @node and copy its records into @dest, the last
+ * reference moves them instead once nobody else is copying.  Called with the
+ * shared cache locked, returns with it unlocked.
+ */
+static void consume_shared_node(struct shared_cache *shared,
+				struct shared_node *node,
+				struct shared_node *dest)
+{
+	if (--node->refs == 0) {
+		remove_cache_extent(&shared->tree, &node->cache);
+		while (node->users)
+			pthread_cond_wait(&shared->cond, &shared->lock);
+		pthread_mutex_unlock(&shared->lock);
+		if (dest) {
+			splice_shared_node(node, dest, 1);
+			free(node);
+		} else {
+			free_shared_node(node);
+		}
+		return;
+	}
+	if (!dest) {
+		pthread_mutex_unlock(&shared->lock);
+		return;
+	}
+	node->users++;
+	pthread_mutex_unlock(&shared->lock);
+
+	splice_shared_node(node, dest, 0);
+
+	pthread_mutex_lock(&shared->lock);
+	if (--node->users == 0)
+		pthread_cond_broadcast(&shared->cond);
+	pthread_mutex_unlock(&shared->lock);
+}
+
 static int enter_shared_node(struct btrfs_root *root, u64 bytenr, u32 refs,
 			     struct walk_control *wc, int level)
 {
+	struct shared_cache *shared = wc->shared;
 	struct shared_node *node;
-	struct shared_node *dest;
+	struct shared_node *dest = NULL;
 
 	if (level == wc->active_node)
 		return 0;
 
 	BUG_ON(wc->active_node <= level);
-	node = find_shared_node(&wc->shared, bytenr);
+	pthread_mutex_lock(&shared->lock);
+again:
+	node = find_shared_node(&shared->tree, bytenr);
 	if (!node) {
-		add_shared_node(&wc->shared, bytenr, refs);
-		node = find_shared_node(&wc->shared, bytenr);
+		add_shared_node(&shared->tree, bytenr, refs);
+		node = find_shared_node(&shared->tree, bytenr);
+		node->builder = wc;
+		pthread_mutex_unlock(&shared->lock);
 		wc->nodes[level] = node;
 		wc->active_node = level;
 		return 0;
 	}
 
-	if (wc->root_level == wc->active_node &&
-	    btrfs_root_refs(&root->root_item) == 0) {
-		if (--node->refs == 0) {
-			free_inode_recs_tree(&node->root_cache);
-			free_inode_recs_tree(&node->inode_cache);
-			remove_cache_extent(&wc->shared, &node->cache);
-			free(node);
+	/* another walker is still collecting the records, wait for it */
+	if (node->builder && node->builder != wc) {
+		if (shared_node_deadlock(wc, node)) {
+			wc->failed = 1;
+			pthread_mutex_unlock(&shared->lock);
+			return 1;
 		}
-		return 1;
+		wc->waiting_on = node;
+		pthread_cond_wait(&shared->cond, &shared->lock);
+		wc->waiting_on = NULL;
+		goto again;
 	}
 
-	dest = wc->nodes[wc->active_node];
-	splice_shared_node(node, dest);
-	if (node->refs == 0) {
-		remove_cache_extent(&wc->shared, &node->cache);
-		free(node);
-	}
+	if (wc->root_level != wc->active_node ||
+	    btrfs_root_refs(&root->root_item) > 0)
+		dest = wc->nodes[wc->active_node];
+	consume_shared_node(shared, node, dest);
 	return 1;
 }
 
 static int leave_shared_node(struct btrfs_root *root,
 			     struct walk_control *wc, int level)
 {
+	struct shared_cache *shared = wc->shared;
 	struct shared_node *node;
 	struct shared_node *dest;
 	int i;
@@ -1173,17 +1470,38 @@ static int leave_shared_node(struct btrfs_root *root,
 	wc->active_node = i;
 
 	dest = wc->nodes[wc->active_node];
+	pthread_mutex_lock(&shared->lock);
+	node->builder = NULL;
+	pthread_cond_broadcast(&shared->cond);
 	if (wc->active_node < wc->root_level ||
 	    btrfs_root_refs(&root->root_item) > 0) {
 		BUG_ON(node->refs <= 1);
-		splice_shared_node(node, dest);
+		consume_shared_node(shared, node, dest);
 	} else {
 		BUG_ON(node->refs < 2);
 		node->refs--;
+		pthread_mutex_unlock(&shared->lock);
 	}
 	return 0;
 }
 
+/*
+ * A walk that stopped early leaves the shared nodes it was building
+ * incomplete, let the walkers waiting for them go on.
+ */
+static void abort_shared_nodes(struct walk_control *wc)
+{
+	int i;
+
+	pthread_mutex_lock(&wc->shared->lock);
+	for (i = 0; i < BTRFS_MAX_LEVEL; i++) {
+		if (wc->nodes[i] && wc->nodes[i]->builder == wc)
+			wc->nodes[i]->builder = NULL;
+	}
+	pthread_cond_broadcast(&wc->shared->cond);
+	pthread_mutex_unlock(&wc->shared->lock);
+}
+
 /*
  * Returns:
  * < 0 - on error
@@ -1255,7 +1573,8 @@ out:
 static int process_dir_item(struct btrfs_root *root,
 			    struct extent_buffer *eb,
 			    int slot, struct btrfs_key *key,
-			    struct shared_node *active_node)
+			    struct shared_node *active_node,
+			    struct check_report *report)
 {
 	u32 total;
 	u32 cur = 0;
@@ -1306,8 +1625,9 @@ static int process_dir_item(struct btrfs_root *root,
 					  namebuf, len, filetype,
 					  key->type, error);
 		} else {
-			fprintf(stderr, "invalid location in dir item %u\n",
-				location.type);
+			report_error(report,
+				     "invalid location in dir item %u\n",
+				     location.type);
 			add_inode_backref(inode_cache, BTRFS_MULTIPLE_OBJECTIDS,
 					  key->objectid, key->offset, namebuf,
 					  len, filetype, key->type, error);
@@ -1609,7 +1929,8 @@ static int process_one_leaf(struct btrfs_root *root, struct extent_buffer *eb,
 		switch (key.type) {
 		case BTRFS_DIR_ITEM_KEY:
 		case BTRFS_DIR_INDEX_KEY:
-			ret = process_dir_item(root, eb, i, &key, active_node);
+			ret = process_dir_item(root, eb, i, &key, active_node,
+					       wc->report);
 			break;
 		case BTRFS_INODE_REF_KEY:
 			ret = process_inode_ref(eb, i, &key, active_node);
@@ -1634,8 +1955,7 @@ static int process_one_leaf(struct btrfs_root *root, struct extent_buffer *eb,
 static void reada_walk_down(struct btrfs_root *root,
 			    struct extent_buffer *node, int slot)
 {
-	u64 bytenr;
-	u64 ptr_gen;
+	struct tree_block_ptr *ptrs;
 	u32 nritems;
 	u32 blocksize;
 	int i;
@@ -1646,12 +1966,18 @@ static void reada_walk_down(struct btrfs_root *root,
 		return;
 
 	nritems = btrfs_header_nritems(node);
+	if (slot >= nritems)
+		return;
+	ptrs = malloc((nritems - slot) * sizeof(*ptrs));
+	if (!ptrs)
+		return;
 	blocksize = btrfs_level_size(root, level - 1);
 	for (i = slot; i < nritems; i++) {
-		bytenr = btrfs_node_blockptr(node, i);
-		ptr_gen = btrfs_node_ptr_generation(node, i);
-		readahead_tree_block(root, bytenr, blocksize, ptr_gen);
+		ptrs[i - slot].bytenr = btrfs_node_blockptr(node, i);
+		ptrs[i - slot].gen = btrfs_node_ptr_generation(node, i);
 	}
+	read_tree_blocks(root, ptrs, nritems - slot, blocksize);
+	free(ptrs);
 }
 
 /*
@@ -1669,7 +1995,8 @@ static void reada_walk_down(struct btrfs_root *root,
  */
 static int check_child_node(struct btrfs_root *root,
 			    struct extent_buffer *parent, int slot,
-			    struct extent_buffer *child)
+			    struct extent_buffer *child,
+			    struct check_report *report)
 {
 	struct btrfs_key parent_key;
 	struct btrfs_key child_key;
@@ -1683,21 +2010,21 @@ static int check_child_node(struct btrfs_root *root,
 
 	if (memcmp(&parent_key, &child_key, sizeof(parent_key))) {
 		ret = -EINVAL;
-		fprintf(stderr,
+		report_error(report,
 			"Wrong key of child node/leaf, wanted: (%llu, %u, %llu), have: (%llu, %u, %llu)\n",
 			parent_key.objectid, parent_key.type, parent_key.offset,
 			child_key.objectid, child_key.type, child_key.offset);
 	}
 	if (btrfs_header_bytenr(child) != btrfs_node_blockptr(parent, slot)) {
 		ret = -EINVAL;
-		fprintf(stderr, "Wrong block of child node/leaf, wanted: %llu, have: %llu\n",
+		report_error(report, "Wrong block of child node/leaf, wanted: %llu, have: %llu\n",
 			btrfs_node_blockptr(parent, slot),
 			btrfs_header_bytenr(child));
 	}
 	if (btrfs_node_ptr_generation(parent, slot) !=
 	    btrfs_header_generation(child)) {
 		ret = -EINVAL;
-		fprintf(stderr, "Wrong generation of child node/leaf, wanted: %llu, have: %llu\n",
+		report_error(report, "Wrong generation of child node/leaf, wanted: %llu, have: %llu\n",
 			btrfs_header_generation(child),
 			btrfs_node_ptr_generation(parent, slot));
 	}
@@ -1780,7 +2107,7 @@ static int walk_down_tree(struct btrfs_root *root, struct btrfs_path *path,
 				btrfs_node_key_to_cpu(path->nodes[*level],
 						      &node_key,
 						      path->slots[*level]);
-				btrfs_add_corrupt_extent_record(root->fs_info,
+				btrfs_add_corrupt_block(wc->corrupt_blocks,
 						&node_key,
 						path->nodes[*level]->start,
 						root->leafsize, *level);
@@ -1789,8 +2116,10 @@ static int walk_down_tree(struct btrfs_root *root, struct btrfs_path *path,
 			}
 		}
 
-		ret = check_child_node(root, cur, path->slots[*level], next);
+		ret = check_child_node(root, cur, path->slots[*level], next,
+				       wc->report);
 		if (ret) {
+			free_extent_buffer(next);
 			err = ret;
 			goto out;
 		}
@@ -1805,6 +2134,7 @@ static int walk_down_tree(struct btrfs_root *root, struct btrfs_path *path,
 			goto out;
 		}
 
+		check_progress_add(1, next->len);
 		*level = *level - 1;
 		free_extent_buffer(path->nodes[*level]);
 		path->nodes[*level] = next;
@@ -2153,7 +2483,7 @@ static int repair_inode_backrefs(struct btrfs_root *root,
 				break;
 			repaired++;
 			list_del(&backref->list);
-			free(backref);
+			free_inode_backref(backref);
 		}
 
 		if (!delete && !backref->found_dir_index &&
@@ -2169,7 +2499,7 @@ static int repair_inode_backrefs(struct btrfs_root *root,
 				if (!backref->errors &&
 				    backref->found_inode_ref) {
 					list_del(&backref->list);
-					free(backref);
+					free_inode_backref(backref);
 				}
 			}
 		}
@@ -2304,7 +2634,7 @@ static int reset_nlink(struct btrfs_trans_handle *trans,
 		      backref->found_dir_item &&
 		      backref->found_inode_ref)) {
 			list_del(&backref->list);
-			free(backref);
+			free_inode_backref(backref);
 		} else {
 			rec->found_link++;
 		}
@@ -2869,6 +3199,17 @@ static int check_inode_recs(struct btrfs_root *root,
 			continue;
 		}
 
+		/*
+		 * The record may still be in a shared node other roots have
+		 * yet to consume, don't let the errors found here leak there.
+		 */
+		if (rec->refs > 1) {
+			struct inode_record *clone = clone_inode_rec(rec);
+
+			free_inode_rec(rec);
+			rec = clone;
+		}
+
 		if (rec->errors & I_ERR_NO_ORPHAN_ITEM) {
 			ret = check_orphan_item(root, rec->ino);
 			if (ret == 0)
@@ -3336,68 +3677,64 @@ out_free_path:
 	return ret;
 }
 
-static int check_fs_root(struct btrfs_root *root,
-			 struct cache_tree *root_cache,
-			 struct walk_control *wc)
+/* We may not have checked the root block, lets do that now */
+static int check_root_block(struct btrfs_root *root)
+{
+	enum btrfs_tree_block_status status;
+
+	if (btrfs_is_leaf(root->node))
+		status = btrfs_check_leaf(root, NULL, root->node);
+	else
+		status = btrfs_check_node(root, NULL, root->node);
+	if (status != BTRFS_TREE_BLOCK_CLEAN)
+		return -EIO;
+	return 0;
+}
+
+/*
+ * Collect the inode and root records of all the blocks of @root into
+ * @root_node, going through the shared nodes for blocks shared with other
+ * roots.  Nothing but the shared nodes and the records is modified, several
+ * roots may be walked in parallel.
+ */
+static int walk_fs_root(struct btrfs_root *root, struct shared_node *root_node,
+			struct walk_control *wc)
 {
 	int ret = 0;
-	int err = 0;
 	int wret;
 	int level;
 	struct btrfs_path path;
-	struct shared_node root_node;
-	struct root_record *rec;
 	struct btrfs_root_item *root_item = &root->root_item;
-	struct cache_tree corrupt_blocks;
 	struct orphan_data_extent *orphan;
-	struct orphan_data_extent *tmp;
-	enum btrfs_tree_block_status status;
-
-	/*
-	 * Reuse the corrupt_block cache tree to record corrupted tree block
-	 *
-	 * Unlike the usage in extent tree check, here we do it in a per
-	 * fs/subvol tree base.
-	 */
-	cache_tree_init(&corrupt_blocks);
-	root->fs_info->corrupt_blocks = &corrupt_blocks;
-
-	if (root->root_key.objectid != BTRFS_TREE_RELOC_OBJECTID) {
-		rec = get_root_rec(root_cache, root->root_key.objectid);
-		if (btrfs_root_refs(root_item) > 0)
-			rec->found_root_item = 1;
-	}
+	struct orphan_data_extent *copy;
 
 	btrfs_init_path(&path);
-	memset(&root_node, 0, sizeof(root_node));
-	cache_tree_init(&root_node.root_cache);
-	cache_tree_init(&root_node.inode_cache);
+	memset(root_node, 0, sizeof(*root_node));
+	cache_tree_init(&root_node->root_cache);
+	cache_tree_init(&root_node->inode_cache);
 
-	/* Move the orphan extent record to corresponding inode_record */
-	list_for_each_entry_safe(orphan, tmp,
-				 &root->orphan_data_extents, list) {
+	/*
+	 * Copy the orphan extent records to corresponding inode_record, the
+	 * originals are freed once the root is checked.
+	 */
+	list_for_each_entry(orphan, &root->orphan_data_extents, list) {
 		struct inode_record *inode;
 
-		inode = get_inode_rec(&root_node.inode_cache, orphan->objectid,
-				      1);
+		inode = get_inode_rec(&root_node->inode_cache,
+				      orphan->objectid, 1);
 		inode->errors |= I_ERR_FILE_EXTENT_ORPHAN;
-		list_move(&orphan->list, &inode->orphan_extents);
+		copy = malloc(sizeof(*copy));
+		BUG_ON(!copy);
+		memcpy(copy, orphan, sizeof(*copy));
+		list_add(&copy->list, &inode->orphan_extents);
 	}
 
 	level = btrfs_header_level(root->node);
 	memset(wc->nodes, 0, sizeof(wc->nodes));
-	wc->nodes[level] = &root_node;
+	wc->nodes[level] = root_node;
 	wc->active_node = level;
 	wc->root_level = level;
 
-	/* We may not have checked the root block, lets do that now */
-	if (btrfs_is_leaf(root->node))
-		status = btrfs_check_leaf(root, NULL, root->node);
-	else
-		status = btrfs_check_node(root, NULL, root->node);
-	if (status != BTRFS_TREE_BLOCK_CLEAN)
-		return -EIO;
-
 	if (btrfs_root_refs(root_item) > 0 ||
 	    btrfs_disk_key_objectid(&root_item->drop_progress) == 0) {
 		path.nodes[level] = root->node;
@@ -3434,14 +3771,25 @@ static int check_fs_root(struct btrfs_root *root,
 	}
 skip_walking:
 	btrfs_release_path(&path);
+	abort_shared_nodes(wc);
+	return ret;
+}
+
+/* report the corrupted blocks and check the records collected for @root */
+static int finish_fs_root(struct btrfs_root *root,
+			  struct cache_tree *root_cache,
+			  struct shared_node *root_node,
+			  struct cache_tree *corrupt_blocks, int ret)
+{
+	int err;
 
-	if (!cache_tree_empty(&corrupt_blocks)) {
+	if (!cache_tree_empty(corrupt_blocks)) {
 		struct cache_extent *cache;
 		struct btrfs_corrupt_block *corrupt;
 
 		printf("The following tree block(s) is corrupted in tree %llu:\n",
 		       root->root_key.objectid);
-		cache = first_cache_extent(&corrupt_blocks);
+		cache = first_cache_extent(corrupt_blocks);
 		while (cache) {
 			corrupt = container_of(cache,
 					       struct btrfs_corrupt_block,
@@ -3455,7 +3803,7 @@ skip_walking:
 		if (repair) {
 			printf("Try to repair the btree for root %llu\n",
 			       root->root_key.objectid);
-			ret = repair_btree(root, &corrupt_blocks);
+			ret = repair_btree(root, corrupt_blocks);
 			if (ret < 0)
 				fprintf(stderr, "Failed to repair btree: %s\n",
 					strerror(-ret));
@@ -3465,26 +3813,68 @@ skip_walking:
 		}
 	}
 
-	err = merge_root_recs(root, &root_node.root_cache, root_cache);
+	err = merge_root_recs(root, &root_node->root_cache, root_cache);
 	if (err < 0)
 		ret = err;
 
-	if (root_node.current) {
-		root_node.current->checked = 1;
-		maybe_free_inode_rec(&root_node.inode_cache,
-				root_node.current);
+	if (root_node->current) {
+		root_node->current->checked = 1;
+		maybe_free_inode_rec(&root_node->inode_cache,
+				root_node->current);
 	}
 
-	err = check_inode_recs(root, &root_node.inode_cache);
+	err = check_inode_recs(root, &root_node->inode_cache);
 	if (!ret)
 		ret = err;
 
-	free_corrupt_blocks_tree(&corrupt_blocks);
+	free_corrupt_blocks_tree(corrupt_blocks);
 	root->fs_info->corrupt_blocks = NULL;
 	free_orphan_data_extents(&root->orphan_data_extents);
 	return ret;
 }
 
+static void found_fs_root(struct btrfs_root *root,
+			  struct cache_tree *root_cache)
+{
+	struct root_record *rec;
+
+	if (root->root_key.objectid != BTRFS_TREE_RELOC_OBJECTID) {
+		rec = get_root_rec(root_cache, root->root_key.objectid);
+		if (btrfs_root_refs(&root->root_item) > 0)
+			rec->found_root_item = 1;
+	}
+}
+
+static int check_fs_root(struct btrfs_root *root,
+			 struct cache_tree *root_cache,
+			 struct walk_control *wc)
+{
+	int ret;
+	struct shared_node root_node;
+	struct cache_tree corrupt_blocks;
+
+	/*
+	 * Reuse the corrupt_block cache tree to record corrupted tree block
+	 *
+	 * Unlike the usage in extent tree check, here we do it in a per
+	 * fs/subvol tree base.
+	 */
+	cache_tree_init(&corrupt_blocks);
+	root->fs_info->corrupt_blocks = &corrupt_blocks;
+	wc->corrupt_blocks = &corrupt_blocks;
+	wc->report = NULL;
+
+	found_fs_root(root, root_cache);
+	if (check_root_block(root)) {
+		root->fs_info->corrupt_blocks = NULL;
+		return -EIO;
+	}
+
+	ret = walk_fs_root(root, &root_node, wc);
+	return finish_fs_root(root, root_cache, &root_node, &corrupt_blocks,
+			      ret);
+}
+
 static int fs_root_objectid(u64 objectid)
 {
 	if (objectid == BTRFS_TREE_RELOC_OBJECTID ||
@@ -3493,31 +3883,767 @@ static int fs_root_objectid(u64 objectid)
 	return is_fstree(objectid);
 }
 
-static int check_fs_roots(struct btrfs_root *root,
-			  struct cache_tree *root_cache)
+/*
+ * What the serial check would find walking @root, the corrupted blocks and
+ * the errors are reported when the root gets its turn.
+ */
+struct fs_root_job {
+	struct btrfs_root *root;
+	struct shared_node root_node;
+	struct cache_tree corrupt_blocks;
+	struct check_report report;
+	int walked;
+	int ret;
+};
+
+struct fs_root_walk {
+	struct fs_root_job *jobs;
+	int nr_jobs;
+	int next;
+	struct shared_cache *shared;
+};
+
+static void *fs_root_walker(void *data)
 {
-	struct btrfs_path path;
-	struct btrfs_key key;
+	struct fs_root_walk *walk = data;
+	struct fs_root_job *job;
 	struct walk_control wc;
-	struct extent_buffer *leaf, *tree_node;
-	struct btrfs_root *tmp_root;
-	struct btrfs_root *tree_root = root->fs_info->tree_root;
-	int ret;
-	int err = 0;
+	int i;
 
-	/*
-	 * Just in case we made any changes to the extent tree that weren't
-	 * reflected into the free space cache yet.
-	 */
-	if (repair)
-		reset_cached_block_groups(root->fs_info);
 	memset(&wc, 0, sizeof(wc));
-	cache_tree_init(&wc.shared);
-	btrfs_init_path(&path);
-
-again:
-	key.offset = 0;
-	key.objectid = 0;
+	wc.shared = walk->shared;
+	while (1) {
+		i = __atomic_fetch_add(&walk->next, 1, __ATOMIC_RELAXED);
+		if (i >= walk->nr_jobs)
+			break;
+		job = &walk->jobs[i];
+		job->ret = check_root_block(job->root);
+		if (job->ret)
+			continue;
+		wc.failed = 0;
+		wc.corrupt_blocks = &job->corrupt_blocks;
+		wc.report = &job->report;
+		job->ret = walk_fs_root(job->root, &job->root_node, &wc);
+		job->walked = 1;
+		if (wc.failed)
+			job->ret = -EDEADLK;
+	}
+	return NULL;
+}
+
+static void free_fs_root_jobs(struct fs_root_walk *walk, int first)
+{
+	struct fs_root_job *job;
+	int i;
+
+	for (i = first; i < walk->nr_jobs; i++) {
+		job = &walk->jobs[i];
+		free_inode_recs_tree(&job->root_node.root_cache);
+		free_inode_recs_tree(&job->root_node.inode_cache);
+		free_corrupt_blocks_tree(&job->corrupt_blocks);
+		free_report(&job->report);
+		if (job->root->root_key.objectid == BTRFS_TREE_RELOC_OBJECTID)
+			btrfs_free_fs_root(job->root);
+	}
+	free(walk->jobs);
+	walk->jobs = NULL;
+	walk->nr_jobs = 0;
+}
+
+static int add_fs_root_job(struct fs_root_walk *walk, struct btrfs_root *root)
+{
+	struct fs_root_job *jobs;
+	struct fs_root_job *job;
+
+	jobs = realloc(walk->jobs, (walk->nr_jobs + 1) * sizeof(*jobs));
+	if (!jobs)
+		return -ENOMEM;
+	walk->jobs = jobs;
+	job = &jobs[walk->nr_jobs++];
+	memset(job, 0, sizeof(*job));
+	job->root = root;
+	cache_tree_init(&job->root_node.root_cache);
+	cache_tree_init(&job->root_node.inode_cache);
+	cache_tree_init(&job->corrupt_blocks);
+	return 0;
+}
+
+static int read_fs_root_jobs(struct btrfs_fs_info *fs_info,
+			     struct fs_root_walk *walk, u64 first_root)
+{
+	struct btrfs_root *tree_root = fs_info->tree_root;
+	struct btrfs_root *tmp_root;
+	struct extent_buffer *leaf;
+	struct btrfs_path path;
+	struct btrfs_key key;
+	int ret;
+
+	btrfs_init_path(&path);
+	key.offset = 0;
+	key.objectid = first_root;
+	key.type = BTRFS_ROOT_ITEM_KEY;
+	ret = btrfs_search_slot(NULL, tree_root, &key, &path, 0, 0);
+	if (ret < 0)
+		goto out;
+	while (1) {
+		leaf = path.nodes[0];
+		if (path.slots[0] >= btrfs_header_nritems(leaf)) {
+			ret = btrfs_next_leaf(tree_root, &path);
+			if (ret)
+				break;
+			leaf = path.nodes[0];
+		}
+		btrfs_item_key_to_cpu(leaf, &key, path.slots[0]);
+		if (key.type == BTRFS_ROOT_ITEM_KEY &&
+		    fs_root_objectid(key.objectid)) {
+			if (key.objectid == BTRFS_TREE_RELOC_OBJECTID) {
+				tmp_root = btrfs_read_fs_root_no_cache(
+						fs_info, &key);
+			} else {
+				key.offset = (u64)-1;
+				tmp_root = btrfs_read_fs_root(fs_info, &key);
+			}
+			if (IS_ERR(tmp_root)) {
+				ret = PTR_ERR(tmp_root);
+				break;
+			}
+			ret = add_fs_root_job(walk, tmp_root);
+			if (ret) {
+				if (key.objectid == BTRFS_TREE_RELOC_OBJECTID)
+					btrfs_free_fs_root(tmp_root);
+				break;
+			}
+		}
+		path.slots[0]++;
+	}
+out:
+	btrfs_release_path(&path);
+	return ret < 0 ? ret : 0;
+}
+
+/*
+ * Collect the records of the fs roots from @first_root on with @nr_threads
+ * walkers sharing @shared, the roots are then checked one by one in the usual
+ * order by check_fs_roots().  Returns 0 with the walked roots in @walk, or non
+ * zero if the walkers could not run or got stuck waiting for each other, and
+ * the roots have to be checked serially.
+ *
+ * The errors of the walk are kept in the jobs, only the messages of the tree
+ * block reads and checks are printed as they happen.
+ */
+static int walk_fs_roots_parallel(struct btrfs_fs_info *fs_info,
+				  int nr_threads, u64 first_root,
+				  struct shared_cache *shared,
+				  struct fs_root_walk *walk)
+{
+	pthread_t *threads;
+	int nr_started = 0;
+	int ret;
+	int i;
+
+	memset(walk, 0, sizeof(*walk));
+	walk->shared = shared;
+	fs_info->corrupt_blocks = NULL;
+	threads = calloc(nr_threads, sizeof(*threads));
+	if (!threads)
+		return -ENOMEM;
+
+	ret = read_fs_root_jobs(fs_info, walk, first_root);
+	if (!ret) {
+		for (i = 0; i < min(nr_threads, walk->nr_jobs); i++) {
+			if (pthread_create(&threads[i], NULL, fs_root_walker,
+					   walk))
+				break;
+			nr_started++;
+		}
+		if (!nr_started)
+			fs_root_walker(walk);
+		for (i = 0; i < nr_started; i++)
+			pthread_join(threads[i], NULL);
+		for (i = 0; i < walk->nr_jobs; i++) {
+			if (walk->jobs[i].ret == -EDEADLK)
+				ret = -EDEADLK;
+		}
+	}
+
+	free(threads);
+	if (ret) {
+		free_fs_root_jobs(walk, 0);
+		free_shared_cache(shared);
+	}
+	return ret;
+}
+
+/* check a root whose records were collected by walk_fs_roots_parallel() */
+static int check_walked_fs_root(struct fs_root_job *job,
+				struct cache_tree *root_cache)
+{
+	struct btrfs_root *root = job->root;
+
+	found_fs_root(root, root_cache);
+	print_report(&job->report);
+	if (!job->walked)
+		return job->ret;
+
+	root->fs_info->corrupt_blocks = &job->corrupt_blocks;
+	return finish_fs_root(root, root_cache, &job->root_node,
+			      &job->corrupt_blocks, job->ret);
+}
+
+/*
+ * A read only check of a big filesystem can take many hours, so the progress
+ * may be saved to a checkpoint file with --checkpoint and picked up again with
+ * --resume.  The file records the phases that are done, how far the fs roots
+ * got, the counters printed at the end and the root records, which are only
+ * checked in the last phase.  The extent records are not saved, the extent
+ * phase is redone unless it completed, but the orphan data extents it found
+ * for the fs roots still to be checked are.
+ */
+#define CHECKPOINT_VERSION	2
+#define CHECKPOINT_INTERVAL	60
+
+/* phases that are done */
+#define CHECKPOINT_EXTENTS		(1ULL << 0)
+#define CHECKPOINT_ROOT_ITEMS		(1ULL << 1)
+#define CHECKPOINT_FREE_SPACE		(1ULL << 2)
+#define CHECKPOINT_FS_ROOTS		(1ULL << 3)
+#define CHECKPOINT_CSUMS		(1ULL << 4)
+
+/* results of the phases done so far */
+#define CHECKPOINT_EXTENT_ERRORS	(1ULL << 0)
+#define CHECKPOINT_FS_ROOT_ERRORS	(1ULL << 1)
+#define CHECKPOINT_TRANSID_ERRORS	(1ULL << 2)
+#define CHECKPOINT_OLD_BACKREF		(1ULL << 3)
+
+#define CHECKPOINT_COUNTERS	8
+
+struct checkpoint_header {
+	u8 magic[8];
+	__le32 version;
+	u8 fsid[BTRFS_FSID_SIZE];
+	__le64 generation;
+	__le64 tree_root;
+	__le64 phases;
+	__le64 results;
+	__le64 next_root;
+	__le64 counters[CHECKPOINT_COUNTERS];
+	__le64 nr_root_recs;
+	__le64 nr_orphan_extents;
+} __attribute__ ((__packed__));
+
+struct checkpoint_root_rec {
+	__le64 objectid;
+	__le32 found_ref;
+	u8 found_root_item;
+	__le32 nr_backrefs;
+} __attribute__ ((__packed__));
+
+/* the name follows */
+struct checkpoint_root_backref {
+	__le64 ref_root;
+	__le64 dir;
+	__le64 index;
+	__le32 errors;
+	__le16 namelen;
+	u8 found;
+} __attribute__ ((__packed__));
+
+/* follow the root records */
+struct checkpoint_orphan_extent {
+	__le64 root;
+	__le64 objectid;
+	__le64 offset;
+	__le64 disk_bytenr;
+	__le64 disk_len;
+} __attribute__ ((__packed__));
+
+#define CHECKPOINT_DIR_ITEM	(1 << 0)
+#define CHECKPOINT_DIR_INDEX	(1 << 1)
+#define CHECKPOINT_BACK_REF	(1 << 2)
+#define CHECKPOINT_FORWARD_REF	(1 << 3)
+#define CHECKPOINT_REACHABLE	(1 << 4)
+
+static const char checkpoint_magic[8] = "BTRFSCKP";
+
+static struct {
+	const char *path;
+	u64 phases;
+	u64 results;
+	u64 next_root;
+	time_t written;
+} checkpoint;
+
+static u64 *checkpoint_counters[CHECKPOINT_COUNTERS] = {
+	&bytes_used, &total_csum_bytes, &total_btree_bytes,
+	&total_fs_tree_bytes, &total_extent_tree_bytes, &btree_space_waste,
+	&data_bytes_allocated, &data_bytes_referenced,
+};
+
+struct checkpoint_buf {
+	char *data;
+	size_t len;
+	size_t size;
+};
+
+static void *checkpoint_buf_add(struct checkpoint_buf *buf, size_t len)
+{
+	char *data;
+	size_t size;
+
+	if (buf->len + len > buf->size) {
+		size = max_t(size_t, buf->size * 2, buf->len + len + 4096);
+		data = realloc(buf->data, size);
+		if (!data)
+			return NULL;
+		buf->data = data;
+		buf->size = size;
+	}
+	data = buf->data + buf->len;
+	memset(data, 0, len);
+	buf->len += len;
+	return data;
+}
+
+static int fill_checkpoint(struct btrfs_fs_info *info,
+			   struct cache_tree *root_cache,
+			   struct checkpoint_buf *buf)
+{
+	struct checkpoint_header *header;
+	struct checkpoint_root_rec *crec;
+	struct checkpoint_root_backref *cback;
+	struct checkpoint_orphan_extent *corphan;
+	struct cache_extent *cache;
+	struct root_record *rec;
+	struct root_backref *backref;
+	struct orphan_data_extent *orphan;
+	struct btrfs_root *root;
+	struct rb_node *node;
+	u64 nr_root_recs = 0;
+	u64 nr_orphan_extents = 0;
+	u32 nr_backrefs;
+	size_t rec_offset;
+	__le32 *csum;
+	int i;
+
+	header = checkpoint_buf_add(buf, sizeof(*header));
+	if (!header)
+		return -ENOMEM;
+	memcpy(header->magic, checkpoint_magic, sizeof(header->magic));
+	header->version = cpu_to_le32(CHECKPOINT_VERSION);
+	memcpy(header->fsid, info->super_copy->fsid, BTRFS_FSID_SIZE);
+	header->generation =
+		cpu_to_le64(btrfs_super_generation(info->super_copy));
+	header->tree_root = cpu_to_le64(info->tree_root->node->start);
+	header->phases = cpu_to_le64(checkpoint.phases);
+	header->results = cpu_to_le64(checkpoint.results);
+	header->next_root = cpu_to_le64(checkpoint.next_root);
+	for (i = 0; i < CHECKPOINT_COUNTERS; i++)
+		header->counters[i] = cpu_to_le64(*checkpoint_counters[i]);
+
+	/* the records are added by offset, the buffer moves as it grows */
+	cache = first_cache_extent(root_cache);
+	while (cache) {
+		rec = container_of(cache, struct root_record, cache);
+		rec_offset = buf->len;
+		crec = checkpoint_buf_add(buf, sizeof(*crec));
+		if (!crec)
+			return -ENOMEM;
+		crec->objectid = cpu_to_le64(rec->objectid);
+		crec->found_ref = cpu_to_le32(rec->found_ref);
+		crec->found_root_item = rec->found_root_item;
+		nr_backrefs = 0;
+		list_for_each_entry(backref, &rec->backrefs, list) {
+			cback = checkpoint_buf_add(buf, sizeof(*cback) +
+						   backref->namelen);
+			if (!cback)
+				return -ENOMEM;
+			cback->ref_root = cpu_to_le64(backref->ref_root);
+			cback->dir = cpu_to_le64(backref->dir);
+			cback->index = cpu_to_le64(backref->index);
+			cback->errors = cpu_to_le32(backref->errors);
+			cback->namelen = cpu_to_le16(backref->namelen);
+			if (backref->found_dir_item)
+				cback->found |= CHECKPOINT_DIR_ITEM;
+			if (backref->found_dir_index)
+				cback->found |= CHECKPOINT_DIR_INDEX;
+			if (backref->found_back_ref)
+				cback->found |= CHECKPOINT_BACK_REF;
+			if (backref->found_forward_ref)
+				cback->found |= CHECKPOINT_FORWARD_REF;
+			if (backref->reachable)
+				cback->found |= CHECKPOINT_REACHABLE;
+			memcpy(cback + 1, backref->name, backref->namelen);
+			nr_backrefs++;
+		}
+		crec = (struct checkpoint_root_rec *)(buf->data + rec_offset);
+		crec->nr_backrefs = cpu_to_le32(nr_backrefs);
+		nr_root_recs++;
+		cache = next_cache_extent(cache);
+	}
+
+	/* the orphans of the roots checked already are freed */
+	for (node = rb_first(&info->fs_root_tree); node; node = rb_next(node)) {
+		root = rb_entry(node, struct btrfs_root, rb_node);
+		list_for_each_entry(orphan, &root->orphan_data_extents, list) {
+			corphan = checkpoint_buf_add(buf, sizeof(*corphan));
+			if (!corphan)
+				return -ENOMEM;
+			corphan->root = cpu_to_le64(orphan->root);
+			corphan->objectid = cpu_to_le64(orphan->objectid);
+			corphan->offset = cpu_to_le64(orphan->offset);
+			corphan->disk_bytenr = cpu_to_le64(orphan->disk_bytenr);
+			corphan->disk_len = cpu_to_le64(orphan->disk_len);
+			nr_orphan_extents++;
+		}
+	}
+	header = (struct checkpoint_header *)buf->data;
+	header->nr_root_recs = cpu_to_le64(nr_root_recs);
+	header->nr_orphan_extents = cpu_to_le64(nr_orphan_extents);
+
+	csum = checkpoint_buf_add(buf, sizeof(*csum));
+	if (!csum)
+		return -ENOMEM;
+	*csum = cpu_to_le32(crc32c(~(u32)0, (u8 *)buf->data,
+				   buf->len - sizeof(*csum)));
+	return 0;
+}
+
+/*
+ * Save the progress to the checkpoint file, a new file is written and renamed
+ * over the old one so an interrupted write leaves the last checkpoint intact.
+ * Failing to write it is only a warning, the check goes on.
+ */
+static void write_checkpoint(struct btrfs_fs_info *info,
+			     struct cache_tree *root_cache)
+{
+	struct checkpoint_buf buf = { NULL, 0, 0 };
+	char tmp[PATH_MAX];
+	size_t done = 0;
+	ssize_t ret;
+	int fd = -1;
+	int err;
+
+	if (!checkpoint.path)
+		return;
+	if (!list_empty(&info->recow_ebs))
+		checkpoint.results |= CHECKPOINT_TRANSID_ERRORS;
+	if (found_old_backref)
+		checkpoint.results |= CHECKPOINT_OLD_BACKREF;
+
+	err = fill_checkpoint(info, root_cache, &buf);
+	if (err)
+		goto out;
+	if (snprintf(tmp, sizeof(tmp), "%s.tmp", checkpoint.path) >=
+	    sizeof(tmp)) {
+		err = -ENAMETOOLONG;
+		goto out;
+	}
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0) {
+		err = -errno;
+		goto out;
+	}
+	while (done < buf.len) {
+		ret = write(fd, buf.data + done, buf.len - done);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			err = -errno;
+			goto out;
+		}
+		done += ret;
+	}
+	if (fsync(fd) || rename(tmp, checkpoint.path))
+		err = -errno;
+out:
+	if (fd >= 0) {
+		close(fd);
+		if (err)
+			unlink(tmp);
+	}
+	if (err)
+		fprintf(stderr, "WARNING: cannot write checkpoint %s: %s\n",
+			checkpoint.path, strerror(-err));
+	checkpoint.written = time(NULL);
+	free(buf.data);
+}
+
+static void *checkpoint_get(char **pos, char *end, size_t len)
+{
+	char *p = *pos;
+
+	if (end - p < len)
+		return NULL;
+	*pos += len;
+	return p;
+}
+
+static int load_root_recs(char **pos, char *end, u64 nr_root_recs,
+			  struct cache_tree *root_cache)
+{
+	struct checkpoint_root_rec *crec;
+	struct checkpoint_root_backref *cback;
+	struct root_record *rec;
+	struct root_backref *backref;
+	u32 nr_backrefs;
+	u16 namelen;
+	char *name;
+
+	while (nr_root_recs--) {
+		crec = checkpoint_get(pos, end, sizeof(*crec));
+		if (!crec)
+			return -EUCLEAN;
+		rec = get_root_rec(root_cache, le64_to_cpu(crec->objectid));
+		rec->found_ref = le32_to_cpu(crec->found_ref);
+		rec->found_root_item = crec->found_root_item;
+		nr_backrefs = le32_to_cpu(crec->nr_backrefs);
+		while (nr_backrefs--) {
+			cback = checkpoint_get(pos, end, sizeof(*cback));
+			if (!cback)
+				return -EUCLEAN;
+			namelen = le16_to_cpu(cback->namelen);
+			name = checkpoint_get(pos, end, namelen);
+			if (!name)
+				return -EUCLEAN;
+			backref = get_root_backref(rec,
+					le64_to_cpu(cback->ref_root),
+					le64_to_cpu(cback->dir),
+					le64_to_cpu(cback->index),
+					name, namelen);
+			backref->errors = le32_to_cpu(cback->errors);
+			backref->found_dir_item =
+				!!(cback->found & CHECKPOINT_DIR_ITEM);
+			backref->found_dir_index =
+				!!(cback->found & CHECKPOINT_DIR_INDEX);
+			backref->found_back_ref =
+				!!(cback->found & CHECKPOINT_BACK_REF);
+			backref->found_forward_ref =
+				!!(cback->found & CHECKPOINT_FORWARD_REF);
+			backref->reachable =
+				!!(cback->found & CHECKPOINT_REACHABLE);
+		}
+	}
+	return 0;
+}
+
+/* hand the orphan data extents back to their roots */
+static int load_orphan_extents(struct btrfs_fs_info *info, char **pos,
+			       char *end, u64 nr_orphan_extents)
+{
+	struct checkpoint_orphan_extent *corphan;
+	struct orphan_data_extent *orphan;
+	struct btrfs_root *root;
+	struct btrfs_key key;
+
+	while (nr_orphan_extents--) {
+		corphan = checkpoint_get(pos, end, sizeof(*corphan));
+		if (!corphan)
+			return -EUCLEAN;
+		key.objectid = le64_to_cpu(corphan->root);
+		key.type = BTRFS_ROOT_ITEM_KEY;
+		key.offset = (u64)-1;
+		root = btrfs_read_fs_root(info, &key);
+		if (IS_ERR(root) || !root)
+			return -EUCLEAN;
+
+		orphan = malloc(sizeof(*orphan));
+		if (!orphan)
+			return -ENOMEM;
+		INIT_LIST_HEAD(&orphan->list);
+		orphan->root = key.objectid;
+		orphan->objectid = le64_to_cpu(corphan->objectid);
+		orphan->offset = le64_to_cpu(corphan->offset);
+		orphan->disk_bytenr = le64_to_cpu(corphan->disk_bytenr);
+		orphan->disk_len = le64_to_cpu(corphan->disk_len);
+		list_add_tail(&orphan->list, &root->orphan_data_extents);
+	}
+	return 0;
+}
+
+static void free_all_orphan_extents(struct btrfs_fs_info *info)
+{
+	struct btrfs_root *root;
+	struct rb_node *node;
+
+	for (node = rb_first(&info->fs_root_tree); node; node = rb_next(node)) {
+		root = rb_entry(node, struct btrfs_root, rb_node);
+		free_orphan_data_extents(&root->orphan_data_extents);
+	}
+}
+
+/*
+ * Pick up the progress saved in @path.  The checkpoint is refused unless it
+ * was taken of this very filesystem at the same generation and tree root, the
+ * results would not match anything otherwise.
+ */
+static int load_checkpoint(struct btrfs_fs_info *info, const char *path,
+			   struct cache_tree *root_cache)
+{
+	struct checkpoint_header *header;
+	struct stat st;
+	char *data = NULL;
+	char *pos;
+	char *end;
+	size_t done = 0;
+	ssize_t ret;
+	u32 csum;
+	int fd;
+	int err = 0;
+	int i;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st)) {
+		err = -errno;
+		goto out;
+	}
+	data = malloc(st.st_size);
+	if (!data) {
+		err = -ENOMEM;
+		goto out;
+	}
+	while (done < st.st_size) {
+		ret = read(fd, data + done, st.st_size - done);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0) {
+			err = ret ? -errno : -EUCLEAN;
+			goto out;
+		}
+		done += ret;
+	}
+
+	err = -EUCLEAN;
+	pos = data;
+	end = data + st.st_size;
+	if (st.st_size < sizeof(*header) + sizeof(csum))
+		goto out;
+	end -= sizeof(csum);
+	csum = get_unaligned_le32(end);
+	if (csum != crc32c(~(u32)0, (u8 *)data, end - data))
+		goto out;
+	header = checkpoint_get(&pos, end, sizeof(*header));
+	if (memcmp(header->magic, checkpoint_magic, sizeof(header->magic)) ||
+	    le32_to_cpu(header->version) != CHECKPOINT_VERSION)
+		goto out;
+
+	if (memcmp(header->fsid, info->super_copy->fsid, BTRFS_FSID_SIZE)) {
+		fprintf(stderr,
+			"ERROR: checkpoint %s was taken of another filesystem\n",
+			path);
+		err = -ESTALE;
+		goto out_quiet;
+	}
+	if (le64_to_cpu(header->generation) !=
+	    btrfs_super_generation(info->super_copy) ||
+	    le64_to_cpu(header->tree_root) != info->tree_root->node->start) {
+		fprintf(stderr,
+	"ERROR: the filesystem changed since checkpoint %s was taken at generation %llu\n",
+			path,
+			(unsigned long long)le64_to_cpu(header->generation));
+		err = -ESTALE;
+		goto out_quiet;
+	}
+
+	err = load_root_recs(&pos, end, le64_to_cpu(header->nr_root_recs),
+			     root_cache);
+	if (!err)
+		err = load_orphan_extents(info, &pos, end,
+				le64_to_cpu(header->nr_orphan_extents));
+	if (!err && pos != end)
+		err = -EUCLEAN;
+	if (err) {
+		free_root_recs_tree(root_cache);
+		free_all_orphan_extents(info);
+		goto out;
+	}
+	checkpoint.phases = le64_to_cpu(header->phases);
+	checkpoint.results = le64_to_cpu(header->results);
+	checkpoint.next_root = le64_to_cpu(header->next_root);
+	for (i = 0; i < CHECKPOINT_COUNTERS; i++)
+		*checkpoint_counters[i] = le64_to_cpu(header->counters[i]);
+	if (checkpoint.results & CHECKPOINT_OLD_BACKREF)
+		found_old_backref = 1;
+out:
+	if (err == -EUCLEAN)
+		fprintf(stderr, "ERROR: checkpoint %s is corrupted\n", path);
+	else if (err)
+		fprintf(stderr, "ERROR: cannot read checkpoint %s: %s\n",
+			path, strerror(-err));
+out_quiet:
+	if (fd >= 0)
+		close(fd);
+	free(data);
+	return err;
+}
+
+/*
+ * Called before an fs root when every root before @objectid has been checked
+ * and none of their shared nodes is waiting for the roots still to come, so
+ * the root records are all there is to save.  They can be many, the
+ * checkpoint is only written now and then.
+ */
+static void checkpoint_fs_roots(struct btrfs_fs_info *info,
+				struct cache_tree *root_cache, u64 objectid,
+				int err)
+{
+	if (!checkpoint.path)
+		return;
+	checkpoint.next_root = objectid;
+	if (err)
+		checkpoint.results |= CHECKPOINT_FS_ROOT_ERRORS;
+	if (time(NULL) - checkpoint.written >= CHECKPOINT_INTERVAL)
+		write_checkpoint(info, root_cache);
+}
+
+/* @phase is done, save the progress */
+static void checkpoint_phase(struct btrfs_fs_info *info,
+			     struct cache_tree *root_cache, u64 phase)
+{
+	checkpoint.phases |= phase;
+	write_checkpoint(info, root_cache);
+}
+
+/*
+ * With more than one check thread the fs roots are walked in parallel first,
+ * the reports are still printed root by root in tree root order.  Should
+ * the walkers get stuck waiting for each other, the roots are checked
+ * serially.
+ */
+static int check_fs_roots(struct btrfs_root *root,
+			  struct cache_tree *root_cache)
+{
+	struct btrfs_path path;
+	struct btrfs_key key;
+	struct walk_control wc;
+	struct shared_cache shared;
+	struct fs_root_walk walk;
+	struct extent_buffer *leaf, *tree_node;
+	struct btrfs_root *tmp_root;
+	struct btrfs_root *tree_root = root->fs_info->tree_root;
+	int nr_walked = 0;
+	int ret;
+	int err = !!(checkpoint.results & CHECKPOINT_FS_ROOT_ERRORS);
+
+	/*
+	 * Just in case we made any changes to the extent tree that weren't
+	 * reflected into the free space cache yet.
+	 */
+	if (repair)
+		reset_cached_block_groups(root->fs_info);
+	memset(&wc, 0, sizeof(wc));
+	init_shared_cache(&shared);
+	wc.shared = &shared;
+	btrfs_init_path(&path);
+
+	memset(&walk, 0, sizeof(walk));
+	if (check_threads > 1 && !repair &&
+	    walk_fs_roots_parallel(root->fs_info, check_threads,
+				   checkpoint.next_root, &shared, &walk))
+		memset(&walk, 0, sizeof(walk));
+
+again:
+	key.offset = 0;
+	key.objectid = checkpoint.next_root;
 	key.type = BTRFS_ROOT_ITEM_KEY;
 	ret = btrfs_search_slot(NULL, tree_root, &key, &path, 0, 0);
 	if (ret < 0) {
@@ -3544,6 +4670,20 @@ again:
 		btrfs_item_key_to_cpu(leaf, &key, path.slots[0]);
 		if (key.type == BTRFS_ROOT_ITEM_KEY &&
 		    fs_root_objectid(key.objectid)) {
+			if (!walk.nr_jobs && cache_tree_empty(&shared.tree))
+				checkpoint_fs_roots(root->fs_info, root_cache,
+						    key.objectid, err);
+			if (nr_walked < walk.nr_jobs) {
+				tmp_root = walk.jobs[nr_walked].root;
+				ret = check_walked_fs_root(
+						&walk.jobs[nr_walked++],
+						root_cache);
+				if (ret)
+					err = 1;
+				if (key.objectid == BTRFS_TREE_RELOC_OBJECTID)
+					btrfs_free_fs_root(tmp_root);
+				goto next;
+			}
 			if (key.objectid == BTRFS_TREE_RELOC_OBJECTID) {
 				tmp_root = btrfs_read_fs_root_no_cache(
 						root->fs_info, &key);
@@ -3576,9 +4716,10 @@ next:
 	}
 out:
 	btrfs_release_path(&path);
+	free_fs_root_jobs(&walk, nr_walked);
 	if (err)
-		free_extent_cache_tree(&wc.shared);
-	if (!cache_tree_empty(&wc.shared))
+		free_shared_cache(&shared);
+	if (!cache_tree_empty(&shared.tree))
 		fprintf(stderr, "warning line %d\n", __LINE__);
 
 	return err;
@@ -3698,6 +4839,85 @@ out:
 	return err;
 }
 
+/*
+ * Extent records are allocated with room for one backref of their kind, the
+ * first such backref is kept there and only further ones come from the
+ * backref pools.  Most extents are referenced just once.
+ */
+static struct extent_record *alloc_extent_rec(int metadata)
+{
+	struct extent_record *rec;
+
+	if (metadata)
+		rec = mem_pool_alloc(&tree_extent_rec_pool);
+	else
+		rec = mem_pool_alloc(&data_extent_rec_pool);
+	if (!rec)
+		return NULL;
+	rec->inline_ref_data = !metadata;
+	rec->inline_ref_used = 0;
+	return rec;
+}
+
+static void free_extent_rec(struct extent_record *rec)
+{
+	if (rec->inline_ref_data)
+		mem_pool_free(&data_extent_rec_pool, rec);
+	else
+		mem_pool_free(&tree_extent_rec_pool, rec);
+}
+
+static void *alloc_extent_backref(struct extent_record *rec, int is_data)
+{
+	if (!rec->inline_ref_used && rec->inline_ref_data == is_data) {
+		rec->inline_ref_used = 1;
+		inline_extent_backrefs++;
+		return rec->inline_ref;
+	}
+	if (is_data)
+		return mem_pool_alloc(&data_backref_pool);
+	return mem_pool_alloc(&tree_backref_pool);
+}
+
+static void free_extent_backref(struct extent_record *rec,
+				struct extent_backref *back)
+{
+	if ((void *)back == (void *)rec->inline_ref)
+		rec->inline_ref_used = 0;
+	else if (back->is_data)
+		mem_pool_free(&data_backref_pool, back);
+	else
+		mem_pool_free(&tree_backref_pool, back);
+}
+
+/*
+ * Move all the backrefs of @src over to @dst, which is about to replace it.
+ * A backref kept inside @src has to be copied out first.
+ */
+static int move_extent_backrefs(struct extent_record *src,
+				struct extent_record *dst)
+{
+	struct extent_backref *back;
+	struct extent_backref *copy;
+	size_t size;
+
+	if (src->inline_ref_used) {
+		back = (struct extent_backref *)src->inline_ref;
+		copy = alloc_extent_backref(dst, back->is_data);
+		if (!copy)
+			return -ENOMEM;
+		if (back->is_data)
+			size = sizeof(struct data_backref);
+		else
+			size = sizeof(struct tree_backref);
+		memcpy(copy, back, size);
+		list_replace(&back->list, &copy->list);
+		src->inline_ref_used = 0;
+	}
+	list_splice_init(&src->backrefs, &dst->backrefs);
+	return 0;
+}
+
 static int free_all_extent_backrefs(struct extent_record *rec)
 {
 	struct extent_backref *back;
@@ -3706,7 +4926,7 @@ static int free_all_extent_backrefs(struct extent_record *rec)
 		cur = rec->backrefs.next;
 		back = list_entry(cur, struct extent_backref, list);
 		list_del(cur);
-		free(back);
+		free_extent_backref(rec, back);
 	}
 	return 0;
 }
@@ -3724,7 +4944,7 @@ static void free_extent_record_cache(struct btrfs_fs_info *fs_info,
 		rec = container_of(cache, struct extent_record, cache);
 		remove_cache_extent(extent_cache, cache);
 		free_all_extent_backrefs(rec);
-		free(rec);
+		free_extent_rec(rec);
 	}
 }
 
@@ -3738,7 +4958,7 @@ static int maybe_free_extent_rec(struct cache_tree *extent_cache,
 		remove_cache_extent(extent_cache, &rec->cache);
 		free_all_extent_backrefs(rec);
 		list_del_init(&rec->list);
-		free(rec);
+		free_extent_rec(rec);
 	}
 	return 0;
 }
@@ -4218,7 +5438,11 @@ static struct tree_backref *find_tree_backref(struct extent_record *rec,
 static struct tree_backref *alloc_tree_backref(struct extent_record *rec,
 						u64 parent, u64 root)
 {
-	struct tree_backref *ref = malloc(sizeof(*ref));
+	struct tree_backref *ref;
+
+	ref = alloc_extent_backref(rec, 0);
+	if (!ref)
+		return NULL;
 	memset(&ref->node, 0, sizeof(ref->node));
 	if (parent > 0) {
 		ref->parent = parent;
@@ -4274,7 +5498,11 @@ static struct data_backref *alloc_data_backref(struct extent_record *rec,
 						u64 owner, u64 offset,
 						u64 max_size)
 {
-	struct data_backref *ref = malloc(sizeof(*ref));
+	struct data_backref *ref;
+
+	ref = alloc_extent_backref(rec, 1);
+	if (!ref)
+		return NULL;
 	memset(&ref->node, 0, sizeof(ref->node));
 	ref->node.is_data = 1;
 
@@ -4337,7 +5565,7 @@ static int add_extent_rec(struct cache_tree *extent_cache,
 				 * our current extent record but does not have
 				 * the same objectid.
 				 */
-				tmp = malloc(sizeof(*tmp));
+				tmp = alloc_extent_rec(metadata);
 				if (!tmp)
 					return -ENOMEM;
 				tmp->start = start;
@@ -4384,7 +5612,9 @@ static int add_extent_rec(struct cache_tree *extent_cache,
 		maybe_free_extent_rec(extent_cache, rec);
 		return ret;
 	}
-	rec = malloc(sizeof(*rec));
+	rec = alloc_extent_rec(metadata);
+	if (!rec)
+		return -ENOMEM;
 	rec->start = start;
 	rec->max_size = max_size;
 	rec->nr = max(nr, max_size);
@@ -4458,8 +5688,11 @@ static int add_tree_backref(struct cache_tree *extent_cache, u64 bytenr,
 	}
 
 	back = find_tree_backref(rec, parent, root);
-	if (!back)
+	if (!back) {
 		back = alloc_tree_backref(rec, parent, root);
+		if (!back)
+			return -ENOMEM;
+	}
 
 	if (found_ref) {
 		if (back->node.found_ref) {
@@ -4517,9 +5750,12 @@ static int add_data_backref(struct cache_tree *extent_cache, u64 bytenr,
 	 */
 	back = find_data_backref(rec, parent, root, owner, offset, found_ref,
 				 bytenr, max_size);
-	if (!back)
+	if (!back) {
 		back = alloc_data_backref(rec, parent, root, owner, offset,
 					  max_size);
+		if (!back)
+			return -ENOMEM;
+	}
 
 	if (found_ref) {
 		BUG_ON(num_refs != 1);
@@ -4544,21 +5780,296 @@ static int add_data_backref(struct cache_tree *extent_cache, u64 bytenr,
 				(unsigned long long)offset,
 				(unsigned long)num_refs);
 		}
-		back->num_refs = num_refs;
-		back->node.found_extent_tree = 1;
+		back->num_refs = num_refs;
+		back->node.found_extent_tree = 1;
+	}
+	maybe_free_extent_rec(extent_cache, rec);
+	return 0;
+}
+
+/*
+ * Elevator for the tree block reads of the extent scan.  Every pending block
+ * is mapped to the device and physical offset it is read from, and each
+ * device has a queue of nodes and one of leaves sorted by offset.  The
+ * devices are served in turn, each sweeping up from its head and starting
+ * over from its lowest offset at the end, nodes before leaves so more of the
+ * tree is known ahead.  Blocks not mapping to any device get a queue of
+ * their own, sorted by bytenr.
+ */
+#define SCHED_LOOKAHEAD		32
+#define SCHED_WINDOW		(16 * 1024 * 1024)
+
+struct sched_block {
+	struct cache_extent cache;
+	struct rb_node node;
+	u64 physical;
+	int queue;
+	int is_node;
+};
+
+struct sched_queue {
+	u64 devid;
+	struct rb_root blocks[2];
+	u64 head;
+};
+
+struct block_sched {
+	struct btrfs_fs_info *fs_info;
+	struct cache_tree blocks;
+	struct sched_queue *queues;
+	int nr_queues;
+	int next_queue;
+	u64 nr_blocks[2];
+};
+
+static struct block_sched *block_sched;
+
+static struct block_sched *alloc_block_sched(struct btrfs_fs_info *fs_info)
+{
+	struct block_sched *sched;
+
+	sched = calloc(1, sizeof(*sched));
+	if (!sched)
+		return NULL;
+	sched->fs_info = fs_info;
+	cache_tree_init(&sched->blocks);
+	return sched;
+}
+
+static void free_sched_blocks(struct block_sched *sched)
+{
+	struct cache_extent *cache;
+	struct sched_block *block;
+	int i;
+
+	while ((cache = first_cache_extent(&sched->blocks))) {
+		block = container_of(cache, struct sched_block, cache);
+		remove_cache_extent(&sched->blocks, cache);
+		free(block);
+	}
+	for (i = 0; i < sched->nr_queues; i++) {
+		sched->queues[i].blocks[0] = RB_ROOT;
+		sched->queues[i].blocks[1] = RB_ROOT;
+		sched->queues[i].head = 0;
+	}
+	sched->nr_blocks[0] = 0;
+	sched->nr_blocks[1] = 0;
+}
+
+static void free_block_sched(struct block_sched *sched)
+{
+	if (!sched)
+		return;
+	free_sched_blocks(sched);
+	free(sched->queues);
+	free(sched);
+}
+
+/* index of the queue of device @devid, (u64)-1 for unmapped blocks */
+static int sched_queue(struct block_sched *sched, u64 devid)
+{
+	struct sched_queue *queues;
+	int i;
+
+	for (i = 0; i < sched->nr_queues; i++) {
+		if (sched->queues[i].devid == devid)
+			return i;
+	}
+	queues = realloc(sched->queues, (i + 1) * sizeof(*queues));
+	if (!queues)
+		return -ENOMEM;
+	sched->queues = queues;
+	queues[i].devid = devid;
+	queues[i].blocks[0] = RB_ROOT;
+	queues[i].blocks[1] = RB_ROOT;
+	queues[i].head = 0;
+	sched->nr_queues++;
+	return i;
+}
+
+static int compare_sched_block(struct rb_node *node1, struct rb_node *node2)
+{
+	struct sched_block *block1;
+	struct sched_block *block2;
+
+	block1 = rb_entry(node1, struct sched_block, node);
+	block2 = rb_entry(node2, struct sched_block, node);
+	if (block1->physical > block2->physical)
+		return -1;
+	if (block1->physical < block2->physical)
+		return 1;
+	if (block1->cache.start > block2->cache.start)
+		return -1;
+	if (block1->cache.start < block2->cache.start)
+		return 1;
+	return 0;
+}
+
+static int compare_sched_offset(struct rb_node *node, void *data)
+{
+	struct sched_block *block = rb_entry(node, struct sched_block, node);
+	u64 physical = *(u64 *)data;
+
+	if (block->physical > physical)
+		return -1;
+	if (block->physical < physical)
+		return 1;
+	return 0;
+}
+
+static int block_sched_add(struct block_sched *sched, u64 bytenr, u32 size,
+			   int is_node)
+{
+	struct btrfs_multi_bio *multi = NULL;
+	struct sched_block *block;
+	u64 length = size;
+	u64 devid = (u64)-1;
+	u64 physical = bytenr;
+	int ret;
+
+	ret = btrfs_map_block(&sched->fs_info->mapping_tree, READ, bytenr,
+			      &length, &multi, 0, NULL);
+	if (!ret && multi->num_stripes && multi->stripes[0].dev) {
+		devid = multi->stripes[0].dev->devid;
+		physical = multi->stripes[0].physical;
+	}
+	kfree(multi);
+
+	block = malloc(sizeof(*block));
+	if (!block)
+		return -ENOMEM;
+	ret = sched_queue(sched, devid);
+	if (ret < 0) {
+		free(block);
+		return ret;
+	}
+	block->cache.start = bytenr;
+	block->cache.size = size;
+	block->physical = physical;
+	block->queue = ret;
+	block->is_node = is_node;
+	ret = insert_cache_extent(&sched->blocks, &block->cache);
+	if (ret) {
+		free(block);
+		return ret;
+	}
+	rb_insert(&sched->queues[block->queue].blocks[is_node], &block->node,
+		  compare_sched_block);
+	sched->nr_blocks[is_node]++;
+	return 0;
+}
+
+static void block_sched_del(struct block_sched *sched, u64 bytenr, u32 size)
+{
+	struct cache_extent *cache;
+	struct sched_block *block;
+
+	cache = lookup_cache_extent(&sched->blocks, bytenr, size);
+	if (!cache)
+		return;
+	block = container_of(cache, struct sched_block, cache);
+	remove_cache_extent(&sched->blocks, cache);
+	rb_erase(&block->node,
+		 &sched->queues[block->queue].blocks[block->is_node]);
+	sched->nr_blocks[block->is_node]--;
+	free(block);
+}
+
+/* the first block at or past the head of @queue, wrapping around */
+static struct sched_block *sched_next_block(struct sched_queue *queue,
+					    int is_node)
+{
+	struct rb_node *node;
+	struct rb_node *next = NULL;
+
+	node = rb_search(&queue->blocks[is_node], &queue->head,
+			 compare_sched_offset, &next);
+	if (!node)
+		node = next;
+	if (!node)
+		node = rb_first(&queue->blocks[is_node]);
+	if (!node)
+		return NULL;
+	return rb_entry(node, struct sched_block, node);
+}
+
+/* add the blocks just past the head of @queue to be read ahead */
+static int sched_lookahead(struct sched_queue *queue, struct block_info *bits,
+			   int nr, int bits_nr)
+{
+	struct sched_block *block;
+	struct rb_node *node;
+	int left = SCHED_LOOKAHEAD;
+	int is_node;
+
+	for (is_node = 1; is_node >= 0; is_node--) {
+		block = sched_next_block(queue, is_node);
+		node = block ? &block->node : NULL;
+		while (node && left && nr < bits_nr) {
+			block = rb_entry(node, struct sched_block, node);
+			if (block->physical < queue->head ||
+			    block->physical - queue->head >= SCHED_WINDOW)
+				break;
+			if (block->cache.start != bits[0].start) {
+				bits[nr].start = block->cache.start;
+				bits[nr].size = block->cache.size;
+				nr++;
+				left--;
+			}
+			node = rb_next(node);
+		}
 	}
-	maybe_free_extent_rec(extent_cache, rec);
-	return 0;
+	return nr;
+}
+
+/*
+ * Fill @bits with the block to check next, followed by the blocks to read
+ * ahead on every device, at most SCHED_LOOKAHEAD of them each and no further
+ * than SCHED_WINDOW bytes past its head.
+ */
+static int block_sched_pick(struct block_sched *sched,
+			    struct block_info *bits, int bits_nr)
+{
+	struct sched_queue *queue = NULL;
+	struct sched_block *block;
+	int is_node = sched->nr_blocks[1] > 0;
+	int first = 0;
+	int nr;
+	int i;
+
+	if (!sched->nr_blocks[0] && !sched->nr_blocks[1])
+		return 0;
+	for (i = 0; i < sched->nr_queues; i++) {
+		first = (sched->next_queue + i) % sched->nr_queues;
+		queue = &sched->queues[first];
+		if (!RB_EMPTY_ROOT(&queue->blocks[is_node]))
+			break;
+	}
+	block = sched_next_block(queue, is_node);
+	queue->head = block->physical;
+	bits[0].start = block->cache.start;
+	bits[0].size = block->cache.size;
+	nr = 1;
+	sched->next_queue = (first + 1) % sched->nr_queues;
+
+	for (i = 0; i < sched->nr_queues && nr < bits_nr; i++) {
+		queue = &sched->queues[(first + i) % sched->nr_queues];
+		nr = sched_lookahead(queue, bits, nr, bits_nr);
+	}
+	return nr;
 }
 
 static int add_pending(struct cache_tree *pending,
-		       struct cache_tree *seen, u64 bytenr, u32 size)
+		       struct cache_tree *seen, u64 bytenr, u32 size,
+		       int is_node)
 {
 	int ret;
 	ret = add_cache_extent(seen, bytenr, size);
 	if (ret)
 		return ret;
 	add_cache_extent(pending, bytenr, size);
+	if (block_sched)
+		return block_sched_add(block_sched, bytenr, size, is_node);
 	return 0;
 }
 
@@ -4572,6 +6083,15 @@ static int pick_next_pending(struct cache_tree *pending,
 	struct cache_extent *cache;
 	int ret;
 
+	/* anything the elevator failed to queue is picked below */
+	if (block_sched) {
+		ret = block_sched_pick(block_sched, bits, bits_nr);
+		if (ret) {
+			*reada_bits = 0;
+			return ret;
+		}
+	}
+
 	cache = search_cache_extent(reada, 0);
 	if (cache) {
 		bits[0].start = cache->start;
@@ -4953,20 +6473,88 @@ process_device_extent_item(struct device_extent_tree *dev_extent_cache,
 	return ret;
 }
 
-static int process_extent_item(struct btrfs_root *root,
-			       struct cache_tree *extent_cache,
-			       struct extent_buffer *eb, int slot)
+/*
+ * The leaves of the extent cross-check are parsed into a list of leaf_refs
+ * first, which run_next_block() then applies to the record caches.  Parsing
+ * only looks at the leaf, so it can be done ahead of time by other threads
+ * while the caches are still only touched by run_next_block().
+ */
+enum leaf_ref_type {
+	LEAF_REF_EXTENT,	/* extent or metadata item */
+	LEAF_REF_TREE,		/* tree block backref */
+	LEAF_REF_DATA,		/* data backref */
+	LEAF_REF_FILE_EXTENT,	/* file extent, the owner depends on the leaf */
+	LEAF_REF_ITEM,		/* item processed when the refs are applied */
+	LEAF_REF_CORRUPT,	/* unknown inline ref type @owner */
+	LEAF_REF_OVERRUN,	/* inline refs past the end of the item */
+};
+
+struct leaf_ref {
+	u8 type;
+	u8 metadata;
+	u8 data;
+	u32 slot;
+	u64 bytenr;
+	u64 parent;
+	u64 root;
+	u64 owner;
+	u64 offset;
+	u64 refs;
+	u64 num_bytes;
+	u64 ref_bytes;
+};
+
+struct leaf_refs {
+	struct leaf_ref *refs;
+	int nr;
+	int size;
+	u64 csum_bytes;
+};
+
+static void reset_leaf_refs(struct leaf_refs *refs)
+{
+	refs->nr = 0;
+	refs->csum_bytes = 0;
+}
+
+static void free_leaf_refs(struct leaf_refs *refs)
+{
+	free(refs->refs);
+	memset(refs, 0, sizeof(*refs));
+}
+
+static struct leaf_ref *add_leaf_ref(struct leaf_refs *refs, int type)
+{
+	struct leaf_ref *ref;
+
+	if (refs->nr == refs->size) {
+		int size = refs->size ? refs->size * 2 : 64;
+
+		ref = realloc(refs->refs, size * sizeof(*ref));
+		if (!ref)
+			return NULL;
+		refs->refs = ref;
+		refs->size = size;
+	}
+	ref = &refs->refs[refs->nr++];
+	memset(ref, 0, sizeof(*ref));
+	ref->type = type;
+	return ref;
+}
+
+static int parse_extent_item(struct btrfs_root *root, struct extent_buffer *eb,
+			     int slot, struct leaf_refs *refs)
 {
 	struct btrfs_extent_item *ei;
 	struct btrfs_extent_inline_ref *iref;
 	struct btrfs_extent_data_ref *dref;
 	struct btrfs_shared_data_ref *sref;
 	struct btrfs_key key;
+	struct leaf_ref *ref;
 	unsigned long end;
 	unsigned long ptr;
 	int type;
 	u32 item_size = btrfs_item_size_nr(eb, slot);
-	u64 refs = 0;
 	u64 offset;
 	u64 num_bytes;
 	int metadata = 0;
@@ -4980,25 +6568,25 @@ static int process_extent_item(struct btrfs_root *root,
 		num_bytes = key.offset;
 	}
 
+	/* old style extent items are left to process_extent_item_v0() */
 	if (item_size < sizeof(*ei)) {
-#ifdef BTRFS_COMPAT_EXTENT_TREE_V0
-		struct btrfs_extent_item_v0 *ei0;
-		BUG_ON(item_size != sizeof(*ei0));
-		ei0 = btrfs_item_ptr(eb, slot, struct btrfs_extent_item_v0);
-		refs = btrfs_extent_refs_v0(eb, ei0);
-#else
-		BUG();
-#endif
-		return add_extent_rec(extent_cache, NULL, 0, key.objectid,
-				      num_bytes, refs, 0, 0, 0, metadata, 1,
-				      num_bytes);
+		ref = add_leaf_ref(refs, LEAF_REF_ITEM);
+		if (!ref)
+			return -ENOMEM;
+		ref->slot = slot;
+		return 0;
 	}
 
 	ei = btrfs_item_ptr(eb, slot, struct btrfs_extent_item);
-	refs = btrfs_extent_refs(eb, ei);
-
-	add_extent_rec(extent_cache, NULL, 0, key.objectid, num_bytes,
-		       refs, 0, 0, 0, metadata, 1, num_bytes);
+	ref = add_leaf_ref(refs, LEAF_REF_EXTENT);
+	if (!ref)
+		return -ENOMEM;
+	ref->bytenr = key.objectid;
+	ref->num_bytes = num_bytes;
+	ref->refs = btrfs_extent_refs(eb, ei);
+	ref->metadata = metadata;
+	ref->data = !metadata && !(btrfs_extent_flags(eb, ei) &
+				   BTRFS_EXTENT_FLAG_TREE_BLOCK);
 
 	ptr = (unsigned long)(ei + 1);
 	if (btrfs_extent_flags(eb, ei) & BTRFS_EXTENT_FLAG_TREE_BLOCK &&
@@ -5012,45 +6600,398 @@ static int process_extent_item(struct btrfs_root *root,
 		offset = btrfs_extent_inline_ref_offset(eb, iref);
 		switch (type) {
 		case BTRFS_TREE_BLOCK_REF_KEY:
-			add_tree_backref(extent_cache, key.objectid,
-					 0, offset, 0);
+			ref = add_leaf_ref(refs, LEAF_REF_TREE);
+			if (!ref)
+				return -ENOMEM;
+			ref->root = offset;
 			break;
 		case BTRFS_SHARED_BLOCK_REF_KEY:
-			add_tree_backref(extent_cache, key.objectid,
-					 offset, 0, 0);
+			ref = add_leaf_ref(refs, LEAF_REF_TREE);
+			if (!ref)
+				return -ENOMEM;
+			ref->parent = offset;
 			break;
 		case BTRFS_EXTENT_DATA_REF_KEY:
 			dref = (struct btrfs_extent_data_ref *)(&iref->offset);
-			add_data_backref(extent_cache, key.objectid, 0,
-					btrfs_extent_data_ref_root(eb, dref),
-					btrfs_extent_data_ref_objectid(eb,
-								       dref),
-					btrfs_extent_data_ref_offset(eb, dref),
-					btrfs_extent_data_ref_count(eb, dref),
-					0, num_bytes);
+			ref = add_leaf_ref(refs, LEAF_REF_DATA);
+			if (!ref)
+				return -ENOMEM;
+			ref->root = btrfs_extent_data_ref_root(eb, dref);
+			ref->owner = btrfs_extent_data_ref_objectid(eb, dref);
+			ref->offset = btrfs_extent_data_ref_offset(eb, dref);
+			ref->refs = btrfs_extent_data_ref_count(eb, dref);
 			break;
 		case BTRFS_SHARED_DATA_REF_KEY:
 			sref = (struct btrfs_shared_data_ref *)(iref + 1);
-			add_data_backref(extent_cache, key.objectid, offset,
-					0, 0, 0,
-					btrfs_shared_data_ref_count(eb, sref),
-					0, num_bytes);
+			ref = add_leaf_ref(refs, LEAF_REF_DATA);
+			if (!ref)
+				return -ENOMEM;
+			ref->parent = offset;
+			ref->refs = btrfs_shared_data_ref_count(eb, sref);
 			break;
 		default:
-			fprintf(stderr, "corrupt extent record: key %Lu %u %Lu\n",
-				key.objectid, key.type, num_bytes);
-			goto out;
+			ref = add_leaf_ref(refs, LEAF_REF_CORRUPT);
+			if (!ref)
+				return -ENOMEM;
+			ref->bytenr = key.objectid;
+			ref->owner = key.type;
+			ref->num_bytes = num_bytes;
+			return 0;
 		}
+		ref->bytenr = key.objectid;
+		ref->num_bytes = num_bytes;
 		ptr += btrfs_extent_inline_ref_size(type);
 	}
-	WARN_ON(ptr > end);
-out:
+	if (ptr > end && !add_leaf_ref(refs, LEAF_REF_OVERRUN))
+		return -ENOMEM;
+	return 0;
+}
+
+/*
+ * With --mem-limit the data extent references don't go into the extent cache
+ * while the trees are walked.  They are spilled to an external sort instead,
+ * and check_extent_refs() loads them back one group of overlapping extents at
+ * a time, replaying them in the order they were found.  The records of the
+ * tree blocks stay in memory, they are needed during the walk.
+ */
+struct spilled_data_ref {
+	u64 bytenr;
+	u64 seq;
+	u64 parent;
+	u64 root;
+	u64 owner;
+	u64 offset;
+	u64 refs;
+	u64 num_bytes;
+	u32 type;
+	u32 pad;
+};
+
+struct data_ref_spill {
+	struct ext_sort *sort;
+	u64 seq;
+	struct spilled_data_ref next;
+	int has_next;
+	int finished;
+	struct spilled_data_ref *group;
+	int nr_group;
+	int max_group;
+};
+
+static struct data_ref_spill *data_spill;
+static u64 spilled_data_refs;
+static u64 spilled_data_runs;
+
+static int cmp_spilled_data_ref(const void *a, const void *b)
+{
+	const struct spilled_data_ref *ra = a;
+	const struct spilled_data_ref *rb = b;
+
+	if (ra->bytenr != rb->bytenr)
+		return ra->bytenr < rb->bytenr ? -1 : 1;
+	if (ra->seq != rb->seq)
+		return ra->seq < rb->seq ? -1 : 1;
+	return 0;
+}
+
+static int cmp_spilled_data_ref_seq(const void *a, const void *b)
+{
+	const struct spilled_data_ref *ra = a;
+	const struct spilled_data_ref *rb = b;
+
+	if (ra->seq != rb->seq)
+		return ra->seq < rb->seq ? -1 : 1;
+	return 0;
+}
+
+static struct data_ref_spill *alloc_data_ref_spill(u64 limit)
+{
+	struct data_ref_spill *spill;
+
+	spill = calloc(1, sizeof(*spill));
+	if (!spill)
+		return NULL;
+	spill->sort = ext_sort_init(sizeof(struct spilled_data_ref), limit,
+				    cmp_spilled_data_ref);
+	if (!spill->sort) {
+		free(spill);
+		return NULL;
+	}
+	return spill;
+}
+
+static void free_data_ref_spill(struct data_ref_spill *spill)
+{
+	u64 nr_passes;
+
+	if (!spill)
+		return;
+	ext_sort_stats(spill->sort, &spilled_data_refs, &spilled_data_runs,
+		       &nr_passes);
+	ext_sort_free(spill->sort);
+	free(spill->group);
+	free(spill);
+}
+
+/* spill @ref, with the owner @parent and @root already worked out */
+static int spill_data_ref(struct data_ref_spill *spill, struct leaf_ref *ref,
+			  u64 parent, u64 root)
+{
+	struct spilled_data_ref rec;
+	int ret;
+
+	memset(&rec, 0, sizeof(rec));
+	rec.bytenr = ref->bytenr;
+	rec.seq = spill->seq++;
+	rec.parent = parent;
+	rec.root = root;
+	rec.owner = ref->owner;
+	rec.offset = ref->offset;
+	rec.refs = ref->refs;
+	rec.num_bytes = ref->num_bytes;
+	rec.type = ref->type;
+	ret = ext_sort_add(spill->sort, &rec);
+	if (ret)
+		fprintf(stderr, "failed to spill data extent references: %s\n",
+			strerror(-ret));
+	return ret;
+}
+
+/* done spilling, check_extent_refs() can start loading the refs */
+static int finish_data_ref_spill(struct data_ref_spill *spill)
+{
+	int ret;
+
+	spill->finished = 1;
+	ret = ext_sort_done(spill->sort);
+	if (!ret)
+		ret = ext_sort_next(spill->sort, &spill->next);
+	if (ret < 0) {
+		fprintf(stderr, "failed to sort data extent references: %s\n",
+			strerror(-ret));
+		return ret;
+	}
+	spill->has_next = ret;
+	return 0;
+}
+
+/* replay the next group of spilled refs of overlapping extents */
+static int load_spilled_data_refs(struct data_ref_spill *spill,
+				  struct cache_tree *extent_cache)
+{
+	struct spilled_data_ref *ref;
+	u64 end = 0;
+	int ret;
+	int i;
+
+	spill->nr_group = 0;
+	while (spill->has_next &&
+	       (!spill->nr_group || spill->next.bytenr < end)) {
+		if (spill->nr_group == spill->max_group) {
+			int max = spill->max_group ? spill->max_group * 2 : 64;
+
+			ref = realloc(spill->group, max * sizeof(*ref));
+			if (!ref)
+				return -ENOMEM;
+			spill->group = ref;
+			spill->max_group = max;
+		}
+		ref = &spill->group[spill->nr_group++];
+		*ref = spill->next;
+		end = max(end, ref->bytenr + max_t(u64, ref->num_bytes, 1));
+
+		ret = ext_sort_next(spill->sort, &spill->next);
+		if (ret < 0) {
+			fprintf(stderr,
+				"failed to read data extent references: %s\n",
+				strerror(-ret));
+			return ret;
+		}
+		spill->has_next = ret;
+	}
+
+	qsort(spill->group, spill->nr_group, sizeof(*spill->group),
+	      cmp_spilled_data_ref_seq);
+	for (i = 0; i < spill->nr_group; i++) {
+		ref = &spill->group[i];
+		switch (ref->type) {
+		case LEAF_REF_EXTENT:
+			add_extent_rec(extent_cache, NULL, 0, ref->bytenr,
+				       ref->num_bytes, ref->refs, 0, 0, 0, 0,
+				       1, ref->num_bytes);
+			break;
+		case LEAF_REF_DATA:
+			add_data_backref(extent_cache, ref->bytenr,
+					 ref->parent, ref->root, ref->owner,
+					 ref->offset, ref->refs, 0,
+					 ref->num_bytes);
+			break;
+		case LEAF_REF_FILE_EXTENT:
+			add_data_backref(extent_cache, ref->bytenr,
+					 ref->parent, ref->root, ref->owner,
+					 ref->offset, 1, 1, ref->num_bytes);
+			break;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Load the refs check_extent_refs() didn't get to because the check bailed
+ * out early, like they would have been without spilling.
+ */
+static void drain_data_ref_spill(struct data_ref_spill *spill,
+				 struct cache_tree *extent_cache)
+{
+	if (!spill->finished && finish_data_ref_spill(spill))
+		return;
+	while (spill->has_next &&
+	       !load_spilled_data_refs(spill, extent_cache))
+		;
+}
+
+static int process_extent_item_v0(struct btrfs_root *root,
+				  struct cache_tree *extent_cache,
+				  struct extent_buffer *eb, int slot)
+{
+#ifdef BTRFS_COMPAT_EXTENT_TREE_V0
+	struct btrfs_extent_item_v0 *ei0;
+#endif
+	struct btrfs_key key;
+	u64 refs = 0;
+	u64 num_bytes;
+	int metadata = 0;
+
+	btrfs_item_key_to_cpu(eb, &key, slot);
+
+	if (key.type == BTRFS_METADATA_ITEM_KEY) {
+		metadata = 1;
+		num_bytes = root->leafsize;
+	} else {
+		num_bytes = key.offset;
+	}
+
+#ifdef BTRFS_COMPAT_EXTENT_TREE_V0
+	BUG_ON(btrfs_item_size_nr(eb, slot) != sizeof(*ei0));
+	ei0 = btrfs_item_ptr(eb, slot, struct btrfs_extent_item_v0);
+	refs = btrfs_extent_refs_v0(eb, ei0);
+#else
+	BUG();
+#endif
+	return add_extent_rec(extent_cache, NULL, 0, key.objectid,
+			      num_bytes, refs, 0, 0, 0, metadata, 1,
+			      num_bytes);
+}
+
+/*
+ * Parse the items of the extent cross-check leaf @buf into @refs, items that
+ * don't describe extent references are left for run_next_block().
+ */
+static int parse_leaf_refs(struct btrfs_root *root, struct extent_buffer *buf,
+			   struct leaf_refs *refs)
+{
+	struct btrfs_file_extent_item *fi;
+	struct btrfs_key key;
+	struct leaf_ref *ref;
+	int nritems = btrfs_header_nritems(buf);
+	int ret;
+	int i;
+
+	reset_leaf_refs(refs);
+	for (i = 0; i < nritems; i++) {
+		btrfs_item_key_to_cpu(buf, &key, i);
+		switch (key.type) {
+		case BTRFS_EXTENT_ITEM_KEY:
+		case BTRFS_METADATA_ITEM_KEY:
+			ret = parse_extent_item(root, buf, i, refs);
+			if (ret)
+				return ret;
+			continue;
+		case BTRFS_EXTENT_CSUM_KEY:
+			refs->csum_bytes += btrfs_item_size_nr(buf, i);
+			continue;
+		case BTRFS_CHUNK_ITEM_KEY:
+		case BTRFS_DEV_ITEM_KEY:
+		case BTRFS_BLOCK_GROUP_ITEM_KEY:
+		case BTRFS_DEV_EXTENT_KEY:
+		case BTRFS_EXTENT_REF_V0_KEY:
+		case BTRFS_ORPHAN_ITEM_KEY:
+			ref = add_leaf_ref(refs, LEAF_REF_ITEM);
+			if (!ref)
+				return -ENOMEM;
+			ref->slot = i;
+			continue;
+		case BTRFS_TREE_BLOCK_REF_KEY:
+			ref = add_leaf_ref(refs, LEAF_REF_TREE);
+			if (!ref)
+				return -ENOMEM;
+			ref->bytenr = key.objectid;
+			ref->root = key.offset;
+			continue;
+		case BTRFS_SHARED_BLOCK_REF_KEY:
+			ref = add_leaf_ref(refs, LEAF_REF_TREE);
+			if (!ref)
+				return -ENOMEM;
+			ref->bytenr = key.objectid;
+			ref->parent = key.offset;
+			continue;
+		case BTRFS_EXTENT_DATA_REF_KEY: {
+			struct btrfs_extent_data_ref *dref;
+
+			dref = btrfs_item_ptr(buf, i,
+					      struct btrfs_extent_data_ref);
+			ref = add_leaf_ref(refs, LEAF_REF_DATA);
+			if (!ref)
+				return -ENOMEM;
+			ref->bytenr = key.objectid;
+			ref->root = btrfs_extent_data_ref_root(buf, dref);
+			ref->owner = btrfs_extent_data_ref_objectid(buf, dref);
+			ref->offset = btrfs_extent_data_ref_offset(buf, dref);
+			ref->refs = btrfs_extent_data_ref_count(buf, dref);
+			ref->num_bytes = root->sectorsize;
+			continue;
+		}
+		case BTRFS_SHARED_DATA_REF_KEY: {
+			struct btrfs_shared_data_ref *sref;
+
+			sref = btrfs_item_ptr(buf, i,
+					      struct btrfs_shared_data_ref);
+			ref = add_leaf_ref(refs, LEAF_REF_DATA);
+			if (!ref)
+				return -ENOMEM;
+			ref->bytenr = key.objectid;
+			ref->parent = key.offset;
+			ref->refs = btrfs_shared_data_ref_count(buf, sref);
+			ref->num_bytes = root->sectorsize;
+			continue;
+		}
+		case BTRFS_EXTENT_DATA_KEY:
+			break;
+		default:
+			continue;
+		}
+		fi = btrfs_item_ptr(buf, i, struct btrfs_file_extent_item);
+		if (btrfs_file_extent_type(buf, fi) ==
+		    BTRFS_FILE_EXTENT_INLINE)
+			continue;
+		if (btrfs_file_extent_disk_bytenr(buf, fi) == 0)
+			continue;
+		ref = add_leaf_ref(refs, LEAF_REF_FILE_EXTENT);
+		if (!ref)
+			return -ENOMEM;
+		ref->bytenr = btrfs_file_extent_disk_bytenr(buf, fi);
+		ref->owner = key.objectid;
+		ref->offset = key.offset - btrfs_file_extent_offset(buf, fi);
+		ref->num_bytes = btrfs_file_extent_disk_num_bytes(buf, fi);
+		ref->ref_bytes = btrfs_file_extent_num_bytes(buf, fi);
+	}
 	return 0;
 }
 
 static int check_cache_range(struct btrfs_root *root,
 			     struct btrfs_block_group_cache *cache,
-			     u64 offset, u64 bytes)
+			     u64 offset, u64 bytes,
+			     struct check_report *report)
 {
 	struct btrfs_free_space *entry;
 	u64 *logical;
@@ -5102,7 +7043,8 @@ static int check_cache_range(struct btrfs_root *root,
 				/* Check the left side */
 				ret = check_cache_range(root, cache,
 							offset,
-							logical[nr] - offset);
+							logical[nr] - offset,
+							report);
 				if (ret) {
 					kfree(logical);
 					return ret;
@@ -5120,20 +7062,22 @@ static int check_cache_range(struct btrfs_root *root,
 
 	entry = btrfs_find_free_space(cache->free_space_ctl, offset, bytes);
 	if (!entry) {
-		fprintf(stderr, "There is no free space entry for %Lu-%Lu\n",
-			offset, offset+bytes);
+		report_error(report,
+			     "There is no free space entry for %Lu-%Lu\n",
+			     offset, offset+bytes);
 		return -EINVAL;
 	}
 
 	if (entry->offset != offset) {
-		fprintf(stderr, "Wanted offset %Lu, found %Lu\n", offset,
-			entry->offset);
+		report_error(report, "Wanted offset %Lu, found %Lu\n", offset,
+			     entry->offset);
 		return -EINVAL;
 	}
 
 	if (entry->bytes != bytes) {
-		fprintf(stderr, "Wanted bytes %Lu, found %Lu for off %Lu\n",
-			bytes, entry->bytes, offset);
+		report_error(report,
+			     "Wanted bytes %Lu, found %Lu for off %Lu\n",
+			     bytes, entry->bytes, offset);
 		return -EINVAL;
 	}
 
@@ -5143,7 +7087,8 @@ static int check_cache_range(struct btrfs_root *root,
 }
 
 static int verify_space_cache(struct btrfs_root *root,
-			      struct btrfs_block_group_cache *cache)
+			      struct btrfs_block_group_cache *cache,
+			      struct check_report *report)
 {
 	struct btrfs_path *path;
 	struct extent_buffer *leaf;
@@ -5197,7 +7142,7 @@ static int verify_space_cache(struct btrfs_root *root,
 		}
 
 		ret = check_cache_range(root, cache, last,
-					key.objectid - last);
+					key.objectid - last, report);
 		if (ret)
 			break;
 		if (key.type == BTRFS_EXTENT_ITEM_KEY)
@@ -5210,27 +7155,157 @@ static int verify_space_cache(struct btrfs_root *root,
 	if (last < cache->key.objectid + cache->key.offset)
 		ret = check_cache_range(root, cache, last,
 					cache->key.objectid +
-					cache->key.offset - last);
+					cache->key.offset - last, report);
+
+out:
+	btrfs_free_path(path);
+
+	if (!ret &&
+	    !RB_EMPTY_ROOT(&cache->free_space_ctl->free_space_offset)) {
+		report_error(report, "There are still entries left in the "
+			     "space cache\n");
+		ret = -EINVAL;
+	}
+
+	return ret;
+}
+
+/*
+ * With -j the block groups are verified by the check threads, each one
+ * loading the cache of a block group into the block group's own free space
+ * ctl and searching the extent tree read only.  The verdicts and the errors
+ * are kept in the jobs and printed in block group order once all are done.
+ */
+struct space_cache_job {
+	struct btrfs_block_group_cache *cache;
+	struct check_report report;
+	u64 nsec;
+	int ret;
+};
+
+struct space_cache_walk {
+	struct btrfs_root *root;
+	struct space_cache_job *jobs;
+	int nr_jobs;
+	int next;
+};
+
+/*
+ * The block groups whose cache took much longer than the average, and at
+ * least 10ms, to verify, printed with the phase times.
+ */
+#define SPACE_CACHE_OUTLIERS		5
+#define SPACE_CACHE_OUTLIER_FACTOR	4
+#define SPACE_CACHE_OUTLIER_NSEC	(10 * 1000000ULL)
+
+static struct {
+	u64 objectid;
+	u64 nsec;
+} space_cache_outliers[SPACE_CACHE_OUTLIERS];
+static int nr_space_cache_outliers;
+
+/* returns 1 if the cache was loaded and is wrong, 0 otherwise */
+static int check_block_group_cache(struct btrfs_root *root,
+				   struct space_cache_job *job)
+{
+	struct btrfs_block_group_cache *cache = job->cache;
+	u64 start = check_clock_nsec();
+	int ret = 0;
+
+	check_progress_add(1, cache->key.offset);
+	if (load_free_space_cache(root->fs_info, cache) &&
+	    verify_space_cache(root, cache, &job->report)) {
+		report_error(&job->report,
+			     "cache appears valid but isnt %Lu\n",
+			     cache->key.objectid);
+		ret = 1;
+	}
+	job->nsec = check_clock_nsec() - start;
+	return ret;
+}
+
+static void *space_cache_worker(void *data)
+{
+	struct space_cache_walk *walk = data;
+	struct space_cache_job *job;
+	int i;
+
+	while (1) {
+		i = __atomic_fetch_add(&walk->next, 1, __ATOMIC_RELAXED);
+		if (i >= walk->nr_jobs)
+			break;
+		job = &walk->jobs[i];
+		job->ret = check_block_group_cache(walk->root, job);
+	}
+	return NULL;
+}
+
+static void check_space_cache_parallel(struct space_cache_walk *walk,
+				       int nr_threads)
+{
+	pthread_t *threads;
+	int nr_started = 0;
+	int i;
+
+	threads = calloc(nr_threads, sizeof(*threads));
+	for (i = 0; threads && i < min(nr_threads, walk->nr_jobs); i++) {
+		if (pthread_create(&threads[i], NULL, space_cache_worker,
+				   walk))
+			break;
+		nr_started++;
+	}
+	if (!nr_started)
+		space_cache_worker(walk);
+	for (i = 0; i < nr_started; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+}
+
+static void find_space_cache_outliers(struct space_cache_walk *walk)
+{
+	struct space_cache_job *job;
+	u64 total = 0;
+	u64 limit;
+	int i, j;
 
-out:
-	btrfs_free_path(path);
+	nr_space_cache_outliers = 0;
+	for (i = 0; i < walk->nr_jobs; i++)
+		total += walk->jobs[i].nsec;
+	if (walk->nr_jobs < 2)
+		return;
+	limit = max(total / walk->nr_jobs * SPACE_CACHE_OUTLIER_FACTOR,
+		    SPACE_CACHE_OUTLIER_NSEC);
 
-	if (!ret &&
-	    !RB_EMPTY_ROOT(&cache->free_space_ctl->free_space_offset)) {
-		fprintf(stderr, "There are still entries left in the space "
-			"cache\n");
-		ret = -EINVAL;
+	/* keep the slowest ones above the limit, slowest first */
+	for (i = 0; i < walk->nr_jobs; i++) {
+		job = &walk->jobs[i];
+		if (job->nsec <= limit)
+			continue;
+		for (j = nr_space_cache_outliers; j > 0; j--) {
+			if (space_cache_outliers[j - 1].nsec >= job->nsec)
+				break;
+			if (j < SPACE_CACHE_OUTLIERS)
+				space_cache_outliers[j] =
+					space_cache_outliers[j - 1];
+		}
+		if (j >= SPACE_CACHE_OUTLIERS)
+			continue;
+		space_cache_outliers[j].objectid = job->cache->key.objectid;
+		space_cache_outliers[j].nsec = job->nsec;
+		if (nr_space_cache_outliers < SPACE_CACHE_OUTLIERS)
+			nr_space_cache_outliers++;
 	}
-
-	return ret;
 }
 
 static int check_space_cache(struct btrfs_root *root)
 {
 	struct btrfs_block_group_cache *cache;
+	struct space_cache_walk walk;
+	struct space_cache_job *jobs;
 	u64 start = BTRFS_SUPER_INFO_OFFSET + BTRFS_SUPER_INFO_SIZE;
-	int ret;
+	int parallel;
 	int error = 0;
+	int i;
 
 	if (btrfs_super_cache_generation(root->fs_info->super_copy) != -1ULL &&
 	    btrfs_super_generation(root->fs_info->super_copy) !=
@@ -5240,6 +7315,8 @@ static int check_space_cache(struct btrfs_root *root)
 		return 0;
 	}
 
+	memset(&walk, 0, sizeof(walk));
+	walk.root = root;
 	while (1) {
 		cache = btrfs_lookup_first_block_group(root->fs_info, start);
 		if (!cache)
@@ -5248,37 +7325,105 @@ static int check_space_cache(struct btrfs_root *root)
 		start = cache->key.objectid + cache->key.offset;
 		if (!cache->free_space_ctl) {
 			if (btrfs_init_free_space_ctl(cache,
-						      root->sectorsize)) {
-				ret = -ENOMEM;
+						      root->sectorsize))
 				break;
-			}
 		} else {
 			btrfs_remove_free_space_cache(cache);
 		}
 
-		ret = load_free_space_cache(root->fs_info, cache);
-		if (!ret)
-			continue;
-
-		ret = verify_space_cache(root, cache);
-		if (ret) {
-			fprintf(stderr, "cache appears valid but isnt %Lu\n",
-				cache->key.objectid);
-			error++;
-		}
-	}
-
+		jobs = realloc(walk.jobs, (walk.nr_jobs + 1) * sizeof(*jobs));
+		if (!jobs)
+			break;
+		walk.jobs = jobs;
+		memset(&jobs[walk.nr_jobs], 0, sizeof(*jobs));
+		jobs[walk.nr_jobs++].cache = cache;
+	}
+
+	parallel = check_threads > 1 && !repair && walk.nr_jobs > 1;
+	if (parallel)
+		check_space_cache_parallel(&walk, check_threads);
+	for (i = 0; i < walk.nr_jobs; i++) {
+		if (!parallel)
+			walk.jobs[i].ret = check_block_group_cache(root,
+							&walk.jobs[i]);
+		print_report(&walk.jobs[i].report);
+		error += walk.jobs[i].ret;
+	}
+	find_space_cache_outliers(&walk);
+	free(walk.jobs);
 	return error ? -EINVAL : 0;
 }
 
-static int check_extent_csums(struct btrfs_root *root, u64 bytenr,
-			u64 num_bytes, unsigned long leaf_offset,
-			struct extent_buffer *eb) {
+/*
+ * With --check-data-csum the data extents are read and verified by the check
+ * threads while the main thread walks the csum tree.  Every csum item is a
+ * job, the mismatches found are kept with it and printed by the main thread
+ * in the order of the csum tree, so the output is the same as when checking
+ * alone.  Without threads the jobs are simply run as they are added.
+ */
+#define CSUM_PIPELINE_DEPTH	64
+
+struct csum_mismatch {
+	int mirror;
+	u64 bytenr;
+	u32 csum;
+	u32 csum_expected;
+};
+
+struct csum_job {
+	struct list_head list;
+	struct list_head queue;
+	u64 bytenr;
+	u64 num_bytes;
+	int done;
+	int ret;
+	int nr_mismatches;
+	struct csum_mismatch *mismatches;
+	/* the csums of the item, copied out of the leaf */
+	char csums[0];
+};
+
+struct csum_pipeline {
+	struct btrfs_root *root;
+	/* all the jobs in csum tree order */
+	struct list_head jobs;
+	int nr_jobs;
+	pthread_mutex_t lock;
+	pthread_cond_t work_cond;
+	pthread_cond_t done_cond;
+	struct list_head queue;
+	int stop;
+	pthread_t *threads;
+	int nr_threads;
+};
+
+static int add_csum_mismatch(struct csum_job *job, int mirror, u64 bytenr,
+			     u32 csum, u32 csum_expected)
+{
+	struct csum_mismatch *mismatches;
+	struct csum_mismatch *mismatch;
+
+	mismatches = realloc(job->mismatches,
+			     (job->nr_mismatches + 1) * sizeof(*mismatches));
+	if (!mismatches)
+		return -ENOMEM;
+	job->mismatches = mismatches;
+	mismatch = &mismatches[job->nr_mismatches++];
+	mismatch->mirror = mirror;
+	mismatch->bytenr = bytenr;
+	mismatch->csum = csum;
+	mismatch->csum_expected = csum_expected;
+	return 0;
+}
 
+static int check_extent_csums(struct btrfs_root *root, struct csum_job *job)
+{
+	u64 bytenr = job->bytenr;
+	u64 num_bytes = job->num_bytes;
 	u64 offset = 0;
 	u16 csum_size = btrfs_super_csum_size(root->fs_info->super_copy);
 	char *data;
-	unsigned long csum_offset;
+	u32 *csums;
 	u32 csum;
 	u32 csum_expected;
 	u64 read_len;
@@ -5292,8 +7437,12 @@ static int check_extent_csums(struct btrfs_root *root, u64 bytenr,
 		return -EINVAL;
 
 	data = malloc(num_bytes);
-	if (!data)
+	csums = malloc(num_bytes / root->sectorsize * sizeof(*csums));
+	if (!data || !csums) {
+		free(data);
+		free(csums);
 		return -ENOMEM;
+	}
 
 	while (offset < num_bytes) {
 		mirror = 0;
@@ -5305,24 +7454,24 @@ again:
 		if (ret)
 			goto out;
 		data_checked = 0;
+		btrfs_csum_data_many(data + offset, read_len, root->sectorsize,
+				     csums);
 		/* verify every 4k data's checksum */
 		while (data_checked < read_len) {
-			csum = ~(u32)0;
 			tmp = offset + data_checked;
+			csum = csums[data_checked / root->sectorsize];
 
-			csum = btrfs_csum_data(NULL, (char *)data + tmp,
-					       csum, root->sectorsize);
-			btrfs_csum_final(csum, (char *)&csum);
-
-			csum_offset = leaf_offset +
-				 tmp / root->sectorsize * csum_size;
-			read_extent_buffer(eb, (char *)&csum_expected,
-					   csum_offset, csum_size);
+			csum_expected = 0;
+			memcpy(&csum_expected,
+			       job->csums + tmp / root->sectorsize * csum_size,
+			       csum_size);
 			/* try another mirror */
 			if (csum != csum_expected) {
-				fprintf(stderr, "mirror %d bytenr %llu csum %u expected csum %u\n",
-						mirror, bytenr + tmp,
-						csum, csum_expected);
+				ret = add_csum_mismatch(job, mirror,
+							bytenr + tmp, csum,
+							csum_expected);
+				if (ret)
+					goto out;
 				num_copies = btrfs_num_copies(
 						&root->fs_info->mapping_tree,
 						bytenr, num_bytes);
@@ -5337,9 +7486,146 @@ again:
 	}
 out:
 	free(data);
+	free(csums);
 	return ret;
 }
 
+static void *csum_pipeline_worker(void *data)
+{
+	struct csum_pipeline *pipe = data;
+	struct csum_job *job;
+	int ret;
+
+	pthread_mutex_lock(&pipe->lock);
+	while (1) {
+		while (!pipe->stop && list_empty(&pipe->queue))
+			pthread_cond_wait(&pipe->work_cond, &pipe->lock);
+		if (pipe->stop)
+			break;
+		job = list_first_entry(&pipe->queue, struct csum_job, queue);
+		list_del_init(&job->queue);
+		pthread_mutex_unlock(&pipe->lock);
+		ret = check_extent_csums(pipe->root, job);
+		pthread_mutex_lock(&pipe->lock);
+		job->ret = ret;
+		job->done = 1;
+		pthread_cond_broadcast(&pipe->done_cond);
+	}
+	pthread_mutex_unlock(&pipe->lock);
+	return NULL;
+}
+
+static void csum_pipeline_init(struct csum_pipeline *pipe,
+			       struct btrfs_root *root, int nr_threads)
+{
+	memset(pipe, 0, sizeof(*pipe));
+	pipe->root = root;
+	INIT_LIST_HEAD(&pipe->jobs);
+	INIT_LIST_HEAD(&pipe->queue);
+	pthread_mutex_init(&pipe->lock, NULL);
+	pthread_cond_init(&pipe->work_cond, NULL);
+	pthread_cond_init(&pipe->done_cond, NULL);
+
+	if (nr_threads <= 1)
+		return;
+	pipe->threads = calloc(nr_threads, sizeof(*pipe->threads));
+	if (!pipe->threads)
+		return;
+	while (pipe->nr_threads < nr_threads) {
+		if (pthread_create(&pipe->threads[pipe->nr_threads], NULL,
+				   csum_pipeline_worker, pipe))
+			break;
+		pipe->nr_threads++;
+	}
+}
+
+static void free_csum_job(struct csum_job *job)
+{
+	free(job->mismatches);
+	free(job);
+}
+
+/* stop the workers and drop the jobs not reported */
+static void csum_pipeline_exit(struct csum_pipeline *pipe)
+{
+	struct csum_job *job;
+	int i;
+
+	pthread_mutex_lock(&pipe->lock);
+	pipe->stop = 1;
+	pthread_cond_broadcast(&pipe->work_cond);
+	pthread_mutex_unlock(&pipe->lock);
+	for (i = 0; i < pipe->nr_threads; i++)
+		pthread_join(pipe->threads[i], NULL);
+	free(pipe->threads);
+	while (!list_empty(&pipe->jobs)) {
+		job = list_first_entry(&pipe->jobs, struct csum_job, list);
+		list_del(&job->list);
+		free_csum_job(job);
+	}
+	pthread_mutex_destroy(&pipe->lock);
+	pthread_cond_destroy(&pipe->work_cond);
+	pthread_cond_destroy(&pipe->done_cond);
+}
+
+/* queue the data of the csum item at @slot of @leaf to be verified */
+static int csum_pipeline_add(struct csum_pipeline *pipe,
+			     struct extent_buffer *leaf, int slot,
+			     u64 bytenr, u64 num_bytes)
+{
+	struct csum_job *job;
+	u32 item_size = btrfs_item_size_nr(leaf, slot);
+
+	job = calloc(1, sizeof(*job) + item_size);
+	if (!job)
+		return -ENOMEM;
+	job->bytenr = bytenr;
+	job->num_bytes = num_bytes;
+	INIT_LIST_HEAD(&job->queue);
+	read_extent_buffer(leaf, job->csums, btrfs_item_ptr_offset(leaf, slot),
+			   item_size);
+	list_add_tail(&job->list, &pipe->jobs);
+	pipe->nr_jobs++;
+
+	if (!pipe->nr_threads) {
+		job->ret = check_extent_csums(pipe->root, job);
+		job->done = 1;
+		return 0;
+	}
+	pthread_mutex_lock(&pipe->lock);
+	list_add_tail(&job->queue, &pipe->queue);
+	pthread_cond_signal(&pipe->work_cond);
+	pthread_mutex_unlock(&pipe->lock);
+	return 0;
+}
+
+/*
+ * Hand back the oldest job once it is done, NULL if there is none.  Unless
+ * @wait is set or the pipeline is full, NULL is also returned while the oldest
+ * job is still running.
+ */
+static struct csum_job *csum_pipeline_next(struct csum_pipeline *pipe,
+					   int wait)
+{
+	struct csum_job *job;
+
+	if (list_empty(&pipe->jobs))
+		return NULL;
+	job = list_first_entry(&pipe->jobs, struct csum_job, list);
+	pthread_mutex_lock(&pipe->lock);
+	if (!job->done && !wait && pipe->nr_jobs < CSUM_PIPELINE_DEPTH)
+		job = NULL;
+	else
+		while (!job->done)
+			pthread_cond_wait(&pipe->done_cond, &pipe->lock);
+	pthread_mutex_unlock(&pipe->lock);
+	if (job) {
+		list_del(&job->list);
+		pipe->nr_jobs--;
+	}
+	return job;
+}
+
 static int check_extent_exists(struct btrfs_root *root, u64 bytenr,
 			       u64 num_bytes)
 {
@@ -5484,17 +7770,80 @@ out:
 	return ret;
 }
 
+/* csummed data ranges, each contiguous one must be covered by extents */
+struct csum_range {
+	u64 offset;
+	u64 num_bytes;
+};
+
+static int check_csum_range(struct btrfs_root *root, struct csum_range *range,
+			    u64 bytenr, u64 data_len)
+{
+	int ret = 0;
+
+	if (!range->num_bytes) {
+		range->offset = bytenr;
+	} else if (bytenr != range->offset + range->num_bytes) {
+		ret = check_extent_exists(root, range->offset,
+					  range->num_bytes);
+		if (ret) {
+			fprintf(stderr, "Csum exists for %Lu-%Lu but "
+				"there is no extent record\n",
+				range->offset, range->offset + range->num_bytes);
+			ret = 1;
+		}
+		range->offset = bytenr;
+		range->num_bytes = 0;
+	}
+	range->num_bytes += data_len;
+	return ret;
+}
+
+/*
+ * Print what the verified jobs found, in csum tree order.  Returns non zero
+ * if the data of a job could not be read, which ends the check of the csums.
+ */
+static int report_csum_jobs(struct csum_pipeline *pipe,
+			    struct csum_range *range, int *errors, int wait)
+{
+	struct csum_mismatch *mismatch;
+	struct csum_job *job;
+	int ret;
+	int i;
+
+	while ((job = csum_pipeline_next(pipe, wait))) {
+		for (i = 0; i < job->nr_mismatches; i++) {
+			mismatch = &job->mismatches[i];
+			fprintf(stderr, "mirror %d bytenr %llu csum %u expected csum %u\n",
+				mismatch->mirror,
+				(unsigned long long)mismatch->bytenr,
+				mismatch->csum, mismatch->csum_expected);
+		}
+		ret = job->ret;
+		if (!ret)
+			*errors += check_csum_range(pipe->root, range,
+						    job->bytenr,
+						    job->num_bytes);
+		check_progress_add(job->num_bytes / pipe->root->sectorsize,
+				   job->num_bytes);
+		free_csum_job(job);
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
 static int check_csums(struct btrfs_root *root)
 {
 	struct btrfs_path *path;
 	struct extent_buffer *leaf;
 	struct btrfs_key key;
-	u64 offset = 0, num_bytes = 0;
+	struct csum_pipeline pipe;
+	struct csum_range range = { 0, 0 };
 	u16 csum_size = btrfs_super_csum_size(root->fs_info->super_copy);
 	int errors = 0;
 	int ret;
 	u64 data_len;
-	unsigned long leaf_offset;
 
 	root = root->fs_info->csum_root;
 	if (!extent_buffer_uptodate(root->node)) {
@@ -5521,6 +7870,7 @@ static int check_csums(struct btrfs_root *root)
 		path->slots[0]--;
 	ret = 0;
 
+	csum_pipeline_init(&pipe, root, check_data_csum ? check_threads : 0);
 	while (1) {
 		if (path->slots[0] >= btrfs_header_nritems(path->nodes[0])) {
 			ret = btrfs_next_leaf(root, path);
@@ -5542,30 +7892,26 @@ static int check_csums(struct btrfs_root *root)
 
 		data_len = (btrfs_item_size_nr(leaf, path->slots[0]) /
 			      csum_size) * root->sectorsize;
-		if (!check_data_csum)
-			goto skip_csum_check;
-		leaf_offset = btrfs_item_ptr_offset(leaf, path->slots[0]);
-		ret = check_extent_csums(root, key.offset, data_len,
-					 leaf_offset, leaf);
+		if (!check_data_csum) {
+			errors += check_csum_range(root, &range, key.offset,
+						   data_len);
+			check_progress_add(data_len / root->sectorsize,
+					   data_len);
+			path->slots[0]++;
+			continue;
+		}
+		ret = csum_pipeline_add(&pipe, leaf, path->slots[0],
+					key.offset, data_len);
 		if (ret)
 			break;
-skip_csum_check:
-		if (!num_bytes) {
-			offset = key.offset;
-		} else if (key.offset != offset + num_bytes) {
-			ret = check_extent_exists(root, offset, num_bytes);
-			if (ret) {
-				fprintf(stderr, "Csum exists for %Lu-%Lu but "
-					"there is no extent record\n",
-					offset, offset+num_bytes);
-				errors++;
-			}
-			offset = key.offset;
-			num_bytes = 0;
-		}
-		num_bytes += data_len;
+		ret = report_csum_jobs(&pipe, &range, &errors, 0);
+		if (ret)
+			goto out;
 		path->slots[0]++;
 	}
+	report_csum_jobs(&pipe, &range, &errors, 1);
+out:
+	csum_pipeline_exit(&pipe);
 
 	btrfs_free_path(path);
 	return errors;
@@ -5612,50 +7958,423 @@ static int calc_extent_flag(struct btrfs_root *root,
 			   struct root_item_record *ri,
 			   u64 *flags)
 {
-	struct extent_record *rec;
+	struct extent_record *rec;
+	struct cache_extent *cache;
+	struct tree_backref *tback;
+	u64 owner = 0;
+
+	cache = lookup_cache_extent(extent_cache, buf->start, 1);
+	/* we have added this extent before */
+	BUG_ON(!cache);
+	rec = container_of(cache, struct extent_record, cache);
+
+	/*
+	 * Except file/reloc tree, we can not have
+	 * FULL BACKREF MODE
+	 */
+	if (ri->objectid < BTRFS_FIRST_FREE_OBJECTID)
+		goto normal;
+	/*
+	 * root node
+	 */
+	if (buf->start == ri->bytenr)
+		goto normal;
+
+	if (btrfs_header_flag(buf, BTRFS_HEADER_FLAG_RELOC))
+		goto full_backref;
+
+	owner = btrfs_header_owner(buf);
+	if (owner == ri->objectid)
+		goto normal;
+
+	tback = find_tree_backref(rec, 0, owner);
+	if (!tback)
+		goto full_backref;
+normal:
+	*flags = 0;
+	if (rec->flag_block_full_backref != -1 &&
+	    rec->flag_block_full_backref != 0)
+		rec->bad_full_backref = 1;
+	return 0;
+full_backref:
+	*flags |= BTRFS_BLOCK_FLAG_FULL_BACKREF;
+	if (rec->flag_block_full_backref != -1 &&
+	    rec->flag_block_full_backref != 1)
+		rec->bad_full_backref = 1;
+	return 0;
+}
+
+/*
+ * With more than one check thread, the leaves waiting in the pending tree are
+ * read and parsed ahead by worker threads.  run_next_block() picks up the
+ * parsed refs once it gets to the leaf and applies them in the usual order,
+ * so the output stays the same.  The jobs tree is only touched by the main
+ * thread, the queue and the job states are protected by @lock.
+ */
+#define LEAF_PIPELINE_DEPTH	1024
+#define LEAF_PIPELINE_BATCH	32
+
+enum leaf_job_state {
+	LEAF_JOB_QUEUED,
+	LEAF_JOB_RUNNING,
+	LEAF_JOB_DONE,
+};
+
+struct leaf_job {
+	struct cache_extent cache;
+	struct list_head list;
+	u64 gen;
+	enum leaf_job_state state;
+	/* the parsed leaf, NULL if it could not be read ahead */
+	struct extent_buffer *eb;
+	struct leaf_refs refs;
+};
+
+struct leaf_pipeline {
+	struct btrfs_root *root;
+	/* refs of the leaves parsed by run_next_block() itself */
+	struct leaf_refs refs;
+	struct cache_tree jobs;
+	int nr_jobs;
+	u64 cursor;
+	pthread_mutex_t lock;
+	pthread_cond_t work_cond;
+	pthread_cond_t done_cond;
+	struct list_head queue;
+	int stop;
+	pthread_t *threads;
+	int nr_threads;
+};
+
+static void free_leaf_job(struct leaf_job *job)
+{
+	free_extent_buffer(job->eb);
+	free_leaf_refs(&job->refs);
+	free(job);
+}
+
+static void run_leaf_jobs(struct leaf_pipeline *pipe, struct leaf_job **jobs,
+			  int nr)
+{
+	struct btrfs_root *root = pipe->root;
+	struct tree_block_ptr ptrs[LEAF_PIPELINE_BATCH];
+	struct extent_buffer *eb;
+	struct leaf_job *job;
+	int i;
+
+	for (i = 0; i < nr; i++) {
+		ptrs[i].bytenr = jobs[i]->cache.start;
+		ptrs[i].gen = jobs[i]->gen;
+	}
+	read_tree_blocks(root, ptrs, nr, root->leafsize);
+
+	/* only silent checks here, anything else is left to the main thread */
+	for (i = 0; i < nr; i++) {
+		job = jobs[i];
+		eb = btrfs_find_tree_block(root, job->cache.start,
+					   job->cache.size);
+		if (eb && extent_buffer_uptodate(eb) &&
+		    (!job->gen || btrfs_header_generation(eb) == job->gen) &&
+		    btrfs_is_leaf(eb) &&
+		    !parse_leaf_refs(root, eb, &job->refs)) {
+			job->eb = eb;
+			eb = NULL;
+		}
+		free_extent_buffer(eb);
+	}
+
+	pthread_mutex_lock(&pipe->lock);
+	for (i = 0; i < nr; i++)
+		jobs[i]->state = LEAF_JOB_DONE;
+	pthread_cond_broadcast(&pipe->done_cond);
+	pthread_mutex_unlock(&pipe->lock);
+}
+
+static void *leaf_pipeline_worker(void *data)
+{
+	struct leaf_pipeline *pipe = data;
+	struct leaf_job *jobs[LEAF_PIPELINE_BATCH];
+	struct leaf_job *job;
+	int nr;
+
+	pthread_mutex_lock(&pipe->lock);
+	while (1) {
+		while (!pipe->stop && list_empty(&pipe->queue))
+			pthread_cond_wait(&pipe->work_cond, &pipe->lock);
+		if (pipe->stop)
+			break;
+		nr = 0;
+		while (nr < LEAF_PIPELINE_BATCH && !list_empty(&pipe->queue)) {
+			job = list_first_entry(&pipe->queue, struct leaf_job,
+					       list);
+			list_del_init(&job->list);
+			job->state = LEAF_JOB_RUNNING;
+			jobs[nr++] = job;
+		}
+		pthread_mutex_unlock(&pipe->lock);
+		run_leaf_jobs(pipe, jobs, nr);
+		pthread_mutex_lock(&pipe->lock);
+	}
+	pthread_mutex_unlock(&pipe->lock);
+	return NULL;
+}
+
+static void leaf_pipeline_init(struct leaf_pipeline *pipe,
+			       struct btrfs_root *root, int nr_threads)
+{
+	memset(pipe, 0, sizeof(*pipe));
+	pipe->root = root;
+	cache_tree_init(&pipe->jobs);
+	pthread_mutex_init(&pipe->lock, NULL);
+	pthread_cond_init(&pipe->work_cond, NULL);
+	pthread_cond_init(&pipe->done_cond, NULL);
+	INIT_LIST_HEAD(&pipe->queue);
+
+	/* repair changes the trees under the readers */
+	if (nr_threads <= 1 || repair)
+		return;
+	pipe->threads = calloc(nr_threads, sizeof(*pipe->threads));
+	if (!pipe->threads)
+		return;
+	while (pipe->nr_threads < nr_threads) {
+		if (pthread_create(&pipe->threads[pipe->nr_threads], NULL,
+				   leaf_pipeline_worker, pipe))
+			break;
+		pipe->nr_threads++;
+	}
+}
+
+/* take @job out of the pipeline, waiting for a worker still parsing it */
+static void leaf_pipeline_remove(struct leaf_pipeline *pipe,
+				 struct leaf_job *job)
+{
+	pthread_mutex_lock(&pipe->lock);
+	if (job->state == LEAF_JOB_QUEUED)
+		list_del_init(&job->list);
+	else
+		while (job->state != LEAF_JOB_DONE)
+			pthread_cond_wait(&pipe->done_cond, &pipe->lock);
+	pthread_mutex_unlock(&pipe->lock);
+	remove_cache_extent(&pipe->jobs, &job->cache);
+	pipe->nr_jobs--;
+}
+
+static void leaf_pipeline_drop_jobs(struct leaf_pipeline *pipe)
+{
+	struct cache_extent *cache;
+	struct leaf_job *job;
+
+	while ((cache = first_cache_extent(&pipe->jobs))) {
+		job = container_of(cache, struct leaf_job, cache);
+		leaf_pipeline_remove(pipe, job);
+		free_leaf_job(job);
+	}
+	pipe->cursor = 0;
+}
+
+static void leaf_pipeline_exit(struct leaf_pipeline *pipe)
+{
+	int i;
+
+	leaf_pipeline_drop_jobs(pipe);
+	pthread_mutex_lock(&pipe->lock);
+	pipe->stop = 1;
+	pthread_cond_broadcast(&pipe->work_cond);
+	pthread_mutex_unlock(&pipe->lock);
+	for (i = 0; i < pipe->nr_threads; i++)
+		pthread_join(pipe->threads[i], NULL);
+	free(pipe->threads);
+	free_leaf_refs(&pipe->refs);
+	pthread_mutex_destroy(&pipe->lock);
+	pthread_cond_destroy(&pipe->work_cond);
+	pthread_cond_destroy(&pipe->done_cond);
+}
+
+/*
+ * Add a job for the leaf at @bytenr to @queue, returns 1 if there is one
+ * already.
+ */
+static int leaf_pipeline_add(struct leaf_pipeline *pipe, u64 bytenr,
+			     u64 size, struct cache_tree *extent_cache,
+			     struct list_head *queue)
+{
+	struct cache_extent *rec_cache;
+	struct extent_record *rec;
+	struct leaf_job *job;
+
+	if (lookup_cache_extent(&pipe->jobs, bytenr, size))
+		return 1;
+	job = calloc(1, sizeof(*job));
+	if (!job)
+		return -ENOMEM;
+	job->cache.start = bytenr;
+	job->cache.size = size;
+	job->state = LEAF_JOB_QUEUED;
+	rec_cache = lookup_cache_extent(extent_cache, bytenr, size);
+	if (rec_cache) {
+		rec = container_of(rec_cache, struct extent_record, cache);
+		job->gen = rec->parent_generation;
+	}
+	insert_cache_extent(&pipe->jobs, &job->cache);
+	list_add_tail(&job->list, queue);
+	pipe->nr_jobs++;
+	return 0;
+}
+
+/*
+ * With the elevator the leaves are processed in the order of each device
+ * queue, queue an even share of the jobs from the head of every device.
+ */
+static void leaf_pipeline_fill_sched(struct leaf_pipeline *pipe,
+				     struct block_sched *sched,
+				     struct cache_tree *extent_cache,
+				     struct list_head *queue)
+{
+	struct sched_block *first;
+	struct sched_block *block;
+	struct rb_node *node;
+	int share;
+	int nr;
+	int ret;
+	int i;
+
+	share = LEAF_PIPELINE_DEPTH / max(sched->nr_queues, 1);
+	for (i = 0; i < sched->nr_queues; i++) {
+		first = sched_next_block(&sched->queues[i], 0);
+		block = first;
+		nr = 0;
+		while (block && nr < share &&
+		       pipe->nr_jobs < LEAF_PIPELINE_DEPTH) {
+			ret = leaf_pipeline_add(pipe, block->cache.start,
+						block->cache.size,
+						extent_cache, queue);
+			if (ret < 0)
+				return;
+			if (!ret)
+				nr++;
+			node = rb_next(&block->node);
+			if (!node)
+				node = rb_first(&sched->queues[i].blocks[0]);
+			block = rb_entry(node, struct sched_block, node);
+			if (block == first)
+				break;
+		}
+	}
+}
+
+/*
+ * Queue the leaves of @pending for the workers.  The pending leaves are
+ * processed in bytenr order, so queue them from where the last fill stopped
+ * and wrap around once for the leaves added behind the cursor since.
+ */
+static void leaf_pipeline_fill(struct leaf_pipeline *pipe,
+			       struct cache_tree *pending,
+			       struct cache_tree *extent_cache)
+{
 	struct cache_extent *cache;
-	struct tree_backref *tback;
-	u64 owner = 0;
+	LIST_HEAD(queue);
+	int wrapped = 0;
+	int ret;
 
-	cache = lookup_cache_extent(extent_cache, buf->start, 1);
-	/* we have added this extent before */
-	BUG_ON(!cache);
-	rec = container_of(cache, struct extent_record, cache);
+	if (!pipe->nr_threads || pipe->nr_jobs >= LEAF_PIPELINE_DEPTH / 2)
+		return;
 
-	/*
-	 * Except file/reloc tree, we can not have
-	 * FULL BACKREF MODE
-	 */
-	if (ri->objectid < BTRFS_FIRST_FREE_OBJECTID)
-		goto normal;
-	/*
-	 * root node
-	 */
-	if (buf->start == ri->bytenr)
-		goto normal;
+	if (block_sched) {
+		leaf_pipeline_fill_sched(pipe, block_sched, extent_cache,
+					 &queue);
+		goto queue;
+	}
+	cache = search_cache_extent(pending, pipe->cursor);
+	while (pipe->nr_jobs < LEAF_PIPELINE_DEPTH) {
+		if (!cache) {
+			if (wrapped++)
+				break;
+			cache = search_cache_extent(pending, 0);
+			continue;
+		}
+		ret = leaf_pipeline_add(pipe, cache->start, cache->size,
+					extent_cache, &queue);
+		if (ret < 0)
+			break;
+		if (!ret)
+			pipe->cursor = cache->start + cache->size;
+		cache = next_cache_extent(cache);
+	}
+queue:
+	if (list_empty(&queue))
+		return;
+	pthread_mutex_lock(&pipe->lock);
+	list_splice_tail(&queue, &pipe->queue);
+	pthread_cond_broadcast(&pipe->work_cond);
+	pthread_mutex_unlock(&pipe->lock);
+}
 
-	if (btrfs_header_flag(buf, BTRFS_HEADER_FLAG_RELOC))
-		goto full_backref;
+/* the job of the leaf at @bytenr once run_next_block() gets there, if any */
+static struct leaf_job *leaf_pipeline_take(struct leaf_pipeline *pipe,
+					   u64 bytenr, u32 size)
+{
+	struct cache_extent *cache;
+	struct leaf_job *job;
 
-	owner = btrfs_header_owner(buf);
-	if (owner == ri->objectid)
-		goto normal;
+	cache = lookup_cache_extent(&pipe->jobs, bytenr, size);
+	if (!cache)
+		return NULL;
+	job = container_of(cache, struct leaf_job, cache);
+	leaf_pipeline_remove(pipe, job);
+	return job;
+}
 
-	tback = find_tree_backref(rec, 0, owner);
-	if (!tback)
-		goto full_backref;
-normal:
-	*flags = 0;
-	if (rec->flag_block_full_backref != -1 &&
-	    rec->flag_block_full_backref != 0)
-		rec->bad_full_backref = 1;
-	return 0;
-full_backref:
-	*flags |= BTRFS_BLOCK_FLAG_FULL_BACKREF;
-	if (rec->flag_block_full_backref != -1 &&
-	    rec->flag_block_full_backref != 1)
-		rec->bad_full_backref = 1;
-	return 0;
+/* the items of an extent cross-check leaf not parsed into leaf_refs */
+static void process_leaf_item(struct btrfs_root *root,
+			      struct extent_buffer *buf, int slot, u64 owner,
+			      struct cache_tree *extent_cache,
+			      struct cache_tree *chunk_cache,
+			      struct rb_root *dev_cache,
+			      struct block_group_tree *block_group_cache,
+			      struct device_extent_tree *dev_extent_cache)
+{
+	struct btrfs_key key;
+	struct bad_item *bad;
+
+	btrfs_item_key_to_cpu(buf, &key, slot);
+	switch (key.type) {
+	case BTRFS_EXTENT_ITEM_KEY:
+	case BTRFS_METADATA_ITEM_KEY:
+		process_extent_item_v0(root, extent_cache, buf, slot);
+		break;
+	case BTRFS_CHUNK_ITEM_KEY:
+		process_chunk_item(chunk_cache, &key, buf, slot);
+		break;
+	case BTRFS_DEV_ITEM_KEY:
+		process_device_item(dev_cache, &key, buf, slot);
+		break;
+	case BTRFS_BLOCK_GROUP_ITEM_KEY:
+		process_block_group_item(block_group_cache, &key, buf, slot);
+		break;
+	case BTRFS_DEV_EXTENT_KEY:
+		process_device_extent_item(dev_extent_cache, &key, buf, slot);
+		break;
+	case BTRFS_EXTENT_REF_V0_KEY:
+#ifdef BTRFS_COMPAT_EXTENT_TREE_V0
+		process_extent_ref_v0(extent_cache, buf, slot);
+#else
+		BUG();
+#endif
+		break;
+	case BTRFS_ORPHAN_ITEM_KEY:
+		if (key.objectid == BTRFS_ORPHAN_OBJECTID)
+			break;
+		if (!owner)
+			break;
+		bad = malloc(sizeof(struct bad_item));
+		if (!bad)
+			break;
+		INIT_LIST_HEAD(&bad->list);
+		memcpy(&bad->key, &key, sizeof(struct btrfs_key));
+		bad->root_id = owner;
+		list_add_tail(&bad->list, &delete_items);
+		break;
+	}
 }
 
 static int run_next_block(struct btrfs_root *root,
@@ -5671,10 +8390,14 @@ static int run_next_block(struct btrfs_root *root,
 			  struct rb_root *dev_cache,
 			  struct block_group_tree *block_group_cache,
 			  struct device_extent_tree *dev_extent_cache,
-			  struct root_item_record *ri)
+			  struct root_item_record *ri,
+			  struct leaf_pipeline *pipe)
 {
 	struct extent_buffer *buf;
 	struct extent_record *rec = NULL;
+	struct leaf_job *job;
+	struct leaf_refs *refs;
+	struct leaf_ref *ref;
 	u64 bytenr;
 	u32 size;
 	u64 parent;
@@ -5689,6 +8412,7 @@ static int run_next_block(struct btrfs_root *root,
 	struct cache_extent *cache;
 	int reada_bits;
 
+	leaf_pipeline_fill(pipe, pending, extent_cache);
 	nritems = pick_next_pending(pending, reada, nodes, *last, bits,
 				    bits_nr, &reada_bits);
 	if (nritems == 0)
@@ -5725,6 +8449,9 @@ static int run_next_block(struct btrfs_root *root,
 		remove_cache_extent(nodes, cache);
 		free(cache);
 	}
+	if (block_sched)
+		block_sched_del(block_sched, bytenr, size);
+	job = leaf_pipeline_take(pipe, bytenr, size);
 	cache = lookup_cache_extent(extent_cache, bytenr, size);
 	if (cache) {
 		rec = container_of(cache, struct extent_record, cache);
@@ -5738,6 +8465,7 @@ static int run_next_block(struct btrfs_root *root,
 				    extent_cache, bytenr, size);
 		goto out;
 	}
+	check_progress_add(1, size);
 
 	nritems = btrfs_header_nritems(buf);
 
@@ -5804,125 +8532,83 @@ static int run_next_block(struct btrfs_root *root,
 
 	if (btrfs_is_leaf(buf)) {
 		btree_space_waste += btrfs_leaf_free_space(root, buf);
-		for (i = 0; i < nritems; i++) {
-			struct btrfs_file_extent_item *fi;
-			btrfs_item_key_to_cpu(buf, &key, i);
-			if (key.type == BTRFS_EXTENT_ITEM_KEY) {
-				process_extent_item(root, extent_cache, buf,
-						    i);
-				continue;
-			}
-			if (key.type == BTRFS_METADATA_ITEM_KEY) {
-				process_extent_item(root, extent_cache, buf,
-						    i);
-				continue;
-			}
-			if (key.type == BTRFS_EXTENT_CSUM_KEY) {
-				total_csum_bytes +=
-					btrfs_item_size_nr(buf, i);
-				continue;
-			}
-			if (key.type == BTRFS_CHUNK_ITEM_KEY) {
-				process_chunk_item(chunk_cache, &key, buf, i);
-				continue;
-			}
-			if (key.type == BTRFS_DEV_ITEM_KEY) {
-				process_device_item(dev_cache, &key, buf, i);
-				continue;
-			}
-			if (key.type == BTRFS_BLOCK_GROUP_ITEM_KEY) {
-				process_block_group_item(block_group_cache,
-					&key, buf, i);
-				continue;
-			}
-			if (key.type == BTRFS_DEV_EXTENT_KEY) {
-				process_device_extent_item(dev_extent_cache,
-					&key, buf, i);
-				continue;
-
-			}
-			if (key.type == BTRFS_EXTENT_REF_V0_KEY) {
-#ifdef BTRFS_COMPAT_EXTENT_TREE_V0
-				process_extent_ref_v0(extent_cache, buf, i);
-#else
-				BUG();
-#endif
-				continue;
-			}
-
-			if (key.type == BTRFS_TREE_BLOCK_REF_KEY) {
-				add_tree_backref(extent_cache, key.objectid, 0,
-						 key.offset, 0);
-				continue;
-			}
-			if (key.type == BTRFS_SHARED_BLOCK_REF_KEY) {
-				add_tree_backref(extent_cache, key.objectid,
-						 key.offset, 0, 0);
-				continue;
-			}
-			if (key.type == BTRFS_EXTENT_DATA_REF_KEY) {
-				struct btrfs_extent_data_ref *ref;
-				ref = btrfs_item_ptr(buf, i,
-						struct btrfs_extent_data_ref);
-				add_data_backref(extent_cache,
-					key.objectid, 0,
-					btrfs_extent_data_ref_root(buf, ref),
-					btrfs_extent_data_ref_objectid(buf,
-								       ref),
-					btrfs_extent_data_ref_offset(buf, ref),
-					btrfs_extent_data_ref_count(buf, ref),
-					0, root->sectorsize);
+		if (job && job->eb == buf && job->gen == gen) {
+			refs = &job->refs;
+		} else {
+			refs = &pipe->refs;
+			ret = parse_leaf_refs(root, buf, refs);
+			if (ret)
+				goto out;
+		}
+		total_csum_bytes += refs->csum_bytes;
+		for (i = 0; i < refs->nr; i++) {
+			ref = &refs->refs[i];
+			switch (ref->type) {
+			case LEAF_REF_EXTENT:
+				if (data_spill && ref->data) {
+					ret = spill_data_ref(data_spill, ref,
+							     0, 0);
+					if (ret)
+						goto out;
+					continue;
+				}
+				add_extent_rec(extent_cache, NULL, 0,
+					       ref->bytenr, ref->num_bytes,
+					       ref->refs, 0, 0, 0,
+					       ref->metadata, 1,
+					       ref->num_bytes);
 				continue;
-			}
-			if (key.type == BTRFS_SHARED_DATA_REF_KEY) {
-				struct btrfs_shared_data_ref *ref;
-				ref = btrfs_item_ptr(buf, i,
-						struct btrfs_shared_data_ref);
-				add_data_backref(extent_cache,
-					key.objectid, key.offset, 0, 0, 0,
-					btrfs_shared_data_ref_count(buf, ref),
-					0, root->sectorsize);
+			case LEAF_REF_TREE:
+				add_tree_backref(extent_cache, ref->bytenr,
+						 ref->parent, ref->root, 0);
 				continue;
-			}
-			if (key.type == BTRFS_ORPHAN_ITEM_KEY) {
-				struct bad_item *bad;
-
-				if (key.objectid == BTRFS_ORPHAN_OBJECTID)
-					continue;
-				if (!owner)
-					continue;
-				bad = malloc(sizeof(struct bad_item));
-				if (!bad)
+			case LEAF_REF_DATA:
+				if (data_spill) {
+					ret = spill_data_ref(data_spill, ref,
+							     ref->parent,
+							     ref->root);
+					if (ret)
+						goto out;
 					continue;
-				INIT_LIST_HEAD(&bad->list);
-				memcpy(&bad->key, &key,
-				       sizeof(struct btrfs_key));
-				bad->root_id = owner;
-				list_add_tail(&bad->list, &delete_items);
+				}
+				add_data_backref(extent_cache, ref->bytenr,
+						 ref->parent, ref->root,
+						 ref->owner, ref->offset,
+						 ref->refs, 0, ref->num_bytes);
 				continue;
-			}
-			if (key.type != BTRFS_EXTENT_DATA_KEY)
+			case LEAF_REF_FILE_EXTENT:
+				break;
+			case LEAF_REF_CORRUPT:
+				fprintf(stderr, "corrupt extent record: key %Lu %u %Lu\n",
+					ref->bytenr, (u32)ref->owner,
+					ref->num_bytes);
 				continue;
-			fi = btrfs_item_ptr(buf, i,
-					    struct btrfs_file_extent_item);
-			if (btrfs_file_extent_type(buf, fi) ==
-			    BTRFS_FILE_EXTENT_INLINE)
+			case LEAF_REF_OVERRUN:
+				WARN_ON(1);
 				continue;
-			if (btrfs_file_extent_disk_bytenr(buf, fi) == 0)
+			case LEAF_REF_ITEM:
+				process_leaf_item(root, buf, ref->slot, owner,
+						  extent_cache, chunk_cache,
+						  dev_cache, block_group_cache,
+						  dev_extent_cache);
 				continue;
+			}
 
-			data_bytes_allocated +=
-				btrfs_file_extent_disk_num_bytes(buf, fi);
+			data_bytes_allocated += ref->num_bytes;
 			if (data_bytes_allocated < root->sectorsize) {
 				abort();
 			}
-			data_bytes_referenced +=
-				btrfs_file_extent_num_bytes(buf, fi);
-			add_data_backref(extent_cache,
-				btrfs_file_extent_disk_bytenr(buf, fi),
-				parent, owner, key.objectid, key.offset -
-				btrfs_file_extent_offset(buf, fi), 1, 1,
-				btrfs_file_extent_disk_num_bytes(buf, fi));
+			data_bytes_referenced += ref->ref_bytes;
+			if (data_spill) {
+				ret = spill_data_ref(data_spill, ref, parent,
+						     owner);
+				if (ret)
+					goto out;
+				continue;
+			}
+			add_data_backref(extent_cache, ref->bytenr, parent,
+					 owner, ref->owner, ref->offset, 1, 1,
+					 ref->num_bytes);
 		}
 	} else {
 		int level;
@@ -5952,9 +8638,9 @@ static int run_next_block(struct btrfs_root *root,
 			add_tree_backref(extent_cache, ptr, parent, owner, 1);
 
 			if (level > 1) {
-				add_pending(nodes, seen, ptr, size);
+				add_pending(nodes, seen, ptr, size, 1);
 			} else {
-				add_pending(pending, seen, ptr, size);
+				add_pending(pending, seen, ptr, size, 0);
 			}
 		}
 		btree_space_waste += (BTRFS_NODEPTRS_PER_BLOCK(root) -
@@ -5971,6 +8657,8 @@ static int run_next_block(struct btrfs_root *root,
 	    !btrfs_header_flag(buf, BTRFS_HEADER_FLAG_RELOC))
 		found_old_backref = 1;
 out:
+	if (job)
+		free_leaf_job(job);
 	free_extent_buffer(buf);
 	return ret;
 }
@@ -5983,9 +8671,9 @@ static int add_root_to_pending(struct extent_buffer *buf,
 			       u64 objectid)
 {
 	if (btrfs_header_level(buf) > 0)
-		add_pending(nodes, seen, buf->start, buf->len);
+		add_pending(nodes, seen, buf->start, buf->len, 1);
 	else
-		add_pending(pending, seen, buf->start, buf->len);
+		add_pending(pending, seen, buf->start, buf->len, 0);
 	add_extent_rec(extent_cache, NULL, 0, buf->start, buf->len,
 		       0, 1, 1, 0, 1, 0, buf->len);
 
@@ -6042,7 +8730,7 @@ static int free_extent_hook(struct btrfs_trans_handle *trans,
 
 		if (!back->node.found_extent_tree && back->node.found_ref) {
 			list_del(&back->node.list);
-			free(back);
+			free_extent_backref(rec, &back->node);
 		}
 	} else {
 		struct tree_backref *back;
@@ -6061,7 +8749,7 @@ static int free_extent_hook(struct btrfs_trans_handle *trans,
 		}
 		if (!back->node.found_extent_tree && back->node.found_ref) {
 			list_del(&back->node.list);
-			free(back);
+			free_extent_backref(rec, &back->node);
 		}
 	}
 	maybe_free_extent_rec(extent_cache, rec);
@@ -6727,7 +9415,8 @@ static int process_duplicates(struct btrfs_root *root,
 	good->owner_ref_checked = 0;
 	good->num_duplicates = 0;
 	good->refs = rec->refs;
-	list_splice_init(&rec->backrefs, &good->backrefs);
+	ret = move_extent_backrefs(rec, good);
+	BUG_ON(ret);
 	while (1) {
 		cache = lookup_cache_extent(extent_cache, good->start,
 					    good->nr);
@@ -6757,13 +9446,14 @@ static int process_duplicates(struct btrfs_root *root,
 		 * just add it to this extent and carry on like we did above.
 		 */
 		good->refs += tmp->refs;
-		list_splice_init(&tmp->backrefs, &good->backrefs);
+		ret = move_extent_backrefs(tmp, good);
+		BUG_ON(ret);
 		remove_cache_extent(extent_cache, &tmp->cache);
-		free(tmp);
+		free_extent_rec(tmp);
 	}
 	ret = insert_cache_extent(extent_cache, &good->cache);
 	BUG_ON(ret);
-	free(rec);
+	free_extent_rec(rec);
 	return good->num_duplicates ? 0 : 1;
 }
 
@@ -6855,13 +9545,13 @@ out:
 		list_del_init(&tmp->list);
 		if (tmp == rec)
 			continue;
-		free(tmp);
+		free_extent_rec(tmp);
 	}
 
 	while (!list_empty(&rec->dups)) {
 		tmp = list_entry(rec->dups.next, struct extent_record, list);
 		list_del_init(&tmp->list);
-		free(tmp);
+		free_extent_rec(tmp);
 	}
 
 	btrfs_free_path(path);
@@ -7397,6 +10087,15 @@ static int check_extent_refs(struct btrfs_root *root,
 
 		fixed = 0;
 		recorded = 0;
+		/* spilled refs in front of the first cached record go first */
+		while (data_spill && data_spill->has_next) {
+			cache = search_cache_extent(extent_cache, 0);
+			if (cache && cache->start < data_spill->next.bytenr)
+				break;
+			ret = load_spilled_data_refs(data_spill, extent_cache);
+			if (ret)
+				return ret;
+		}
 		cache = search_cache_extent(extent_cache, 0);
 		if (!cache)
 			break;
@@ -7486,7 +10185,7 @@ static int check_extent_refs(struct btrfs_root *root,
 					   rec->start,
 					   rec->start + rec->max_size - 1,
 					   GFP_NOFS);
-		free(rec);
+		free_extent_rec(rec);
 	}
 repair_abort:
 	if (repair) {
@@ -7818,7 +10517,8 @@ static int deal_root_from_list(struct list_head *list,
 			       struct cache_tree *chunk_cache,
 			       struct rb_root *dev_cache,
 			       struct block_group_tree *block_group_cache,
-			       struct device_extent_tree *dev_extent_cache)
+			       struct device_extent_tree *dev_extent_cache,
+			       struct leaf_pipeline *pipe)
 {
 	int ret = 0;
 	u64 last;
@@ -7848,7 +10548,7 @@ static int deal_root_from_list(struct list_head *list,
 					     pending, seen, reada, nodes,
 					     extent_cache, chunk_cache,
 					     dev_cache, block_group_cache,
-					     dev_extent_cache, rec);
+					     dev_extent_cache, rec, pipe);
 			if (ret != 0)
 				break;
 		}
@@ -7862,7 +10562,7 @@ static int deal_root_from_list(struct list_head *list,
 		ret = run_next_block(root, bits, bits_nr, &last, pending, seen,
 				     reada, nodes, extent_cache, chunk_cache,
 				     dev_cache, block_group_cache,
-				     dev_extent_cache, NULL);
+				     dev_extent_cache, NULL, pipe);
 		if (ret != 0) {
 			if (ret > 0)
 				ret = 0;
@@ -7885,6 +10585,7 @@ static int check_chunks_and_extents(struct btrfs_root *root)
 	struct cache_tree nodes;
 	struct extent_io_tree excluded_extents;
 	struct cache_tree corrupt_blocks;
+	struct leaf_pipeline pipe;
 	struct btrfs_path path;
 	struct btrfs_key key;
 	struct btrfs_key found_key;
@@ -7929,6 +10630,26 @@ static int check_chunks_and_extents(struct btrfs_root *root)
 		perror("malloc");
 		exit(1);
 	}
+	leaf_pipeline_init(&pipe, root, check_threads);
+	/*
+	 * The scan stops at the first block that fails check_block(), so the
+	 * order decides which blocks are counted on a damaged filesystem.  It
+	 * is logical unless asked for, not picked by the kind of disks.
+	 */
+	if (io_order == IO_ORDER_PHYSICAL) {
+		block_sched = alloc_block_sched(root->fs_info);
+		if (!block_sched) {
+			perror("malloc");
+			exit(1);
+		}
+	}
+	if (mem_limit) {
+		data_spill = alloc_data_ref_spill(mem_limit / 2);
+		if (!data_spill) {
+			perror("malloc");
+			exit(1);
+		}
+	}
 
 again:
 	root1 = root->fs_info->tree_root;
@@ -8009,7 +10730,7 @@ again:
 	ret = deal_root_from_list(&normal_trees, root, bits, bits_nr, &pending,
 				  &seen, &reada, &nodes, &extent_cache,
 				  &chunk_cache, &dev_cache, &block_group_cache,
-				  &dev_extent_cache);
+				  &dev_extent_cache, &pipe);
 	if (ret < 0) {
 		if (ret == -EAGAIN)
 			goto loop;
@@ -8018,13 +10739,19 @@ again:
 	ret = deal_root_from_list(&dropping_trees, root, bits, bits_nr,
 				  &pending, &seen, &reada, &nodes,
 				  &extent_cache, &chunk_cache, &dev_cache,
-				  &block_group_cache, &dev_extent_cache);
+				  &block_group_cache, &dev_extent_cache, &pipe);
 	if (ret < 0) {
 		if (ret == -EAGAIN)
 			goto loop;
 		goto out;
 	}
 
+	if (data_spill) {
+		ret = finish_data_ref_spill(data_spill);
+		if (ret < 0)
+			goto out;
+	}
+
 	err = check_chunks(&chunk_cache, &block_group_cache,
 			   &dev_extent_cache, NULL, NULL, NULL, 0);
 	if (err) {
@@ -8054,6 +10781,13 @@ out:
 		root->fs_info->corrupt_blocks = NULL;
 		root->fs_info->excluded_extents = NULL;
 	}
+	leaf_pipeline_exit(&pipe);
+	free_block_sched(block_sched);
+	block_sched = NULL;
+	if (data_spill)
+		drain_data_ref_spill(data_spill, &extent_cache);
+	free_data_ref_spill(data_spill);
+	data_spill = NULL;
 	free(bits);
 	free_chunk_cache_tree(&chunk_cache);
 	free_device_cache_tree(&dev_cache);
@@ -8065,6 +10799,9 @@ out:
 	free_extent_cache_tree(&nodes);
 	return ret;
 loop:
+	leaf_pipeline_drop_jobs(&pipe);
+	if (block_sched)
+		free_sched_blocks(block_sched);
 	free_corrupt_blocks_tree(root->fs_info->corrupt_blocks);
 	free_extent_cache_tree(&seen);
 	free_extent_cache_tree(&pending);
@@ -8608,25 +11345,28 @@ static int zero_log_tree(struct btrfs_root *root)
 	return ret;
 }
 
+/* size of the buffer data is read into to rebuild its checksums */
+#define POPULATE_CSUM_BATCH	(1024 * 1024)
+
 static int populate_csum(struct btrfs_trans_handle *trans,
 			 struct btrfs_root *csum_root, char *buf, u64 start,
 			 u64 len)
 {
 	u64 offset = 0;
-	u64 sectorsize;
+	u64 read_len;
 	int ret = 0;
 
 	while (offset < len) {
-		sectorsize = csum_root->sectorsize;
+		read_len = min_t(u64, len - offset, POPULATE_CSUM_BATCH);
 		ret = read_extent_data(csum_root, buf, start + offset,
-				       &sectorsize, 0);
+				       &read_len, 0);
 		if (ret)
 			break;
-		ret = btrfs_csum_file_block(trans, csum_root, start + len,
-					    start + offset, buf, sectorsize);
+		ret = btrfs_csum_file_blocks(trans, csum_root, start + len,
+					     start + offset, buf, read_len);
 		if (ret)
 			break;
-		offset += sectorsize;
+		offset += read_len;
 	}
 	return ret;
 }
@@ -8648,7 +11388,7 @@ static int fill_csum_tree_from_one_fs_root(struct btrfs_trans_handle *trans,
 	path = btrfs_alloc_path();
 	if (!path)
 		return -ENOMEM;
-	buf = malloc(cur_root->fs_info->csum_root->sectorsize);
+	buf = malloc(POPULATE_CSUM_BATCH);
 	if (!buf) {
 		ret = -ENOMEM;
 		goto out;
@@ -8790,7 +11530,7 @@ static int fill_csum_tree_from_extent(struct btrfs_trans_handle *trans,
 		return ret;
 	}
 
-	buf = malloc(csum_root->sectorsize);
+	buf = malloc(POPULATE_CSUM_BATCH);
 	if (!buf) {
 		btrfs_free_path(path);
 		return -ENOMEM;
@@ -9196,6 +11936,324 @@ out:
 	return bad_roots;
 }
 
+/*
+ * Time spent in the phases of the check and the blocks and bytes they went
+ * through, printed with --mem-limit, --mem-stats and the progress options.
+ */
+#define MAX_CHECK_PHASES	8
+
+static struct {
+	const char *name;
+	u64 nsec;
+	u64 blocks;
+	u64 bytes;
+} check_phases[MAX_CHECK_PHASES];
+static int nr_check_phases;
+static u64 check_phase_start;
+/* bytes the running phase is expected to go through, 0 if unknown */
+static u64 check_phase_work;
+static pthread_mutex_t check_phase_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * With -p and --progress-log a thread reports the progress of the running
+ * phase every second.  The terminal output goes to a copy of stderr taken
+ * up front, so it does not end up with the output captured while the fs
+ * roots are walked in parallel.
+ */
+#define PROGRESS_PERIOD_MS	1000
+/* without a terminal, a progress line every that many periods */
+#define PROGRESS_LINE_PERIODS	10
+
+static struct {
+	struct task_info *task;
+	struct btrfs_fs_info *info;
+	FILE *out;
+	int tty;
+	FILE *log;
+	int stopped;
+	u64 start;
+	u64 periods;
+	int phase;
+	u64 last_blocks;
+	u64 last_nsec;
+} check_progress;
+
+/*
+ * The work of the extent phase are the tree blocks, what the superblock
+ * counts as used less the data.
+ */
+static u64 metadata_bytes_used(struct btrfs_fs_info *info)
+{
+	struct btrfs_space_info *sinfo;
+	u64 used = btrfs_super_bytes_used(info->super_copy);
+	u64 data = 0;
+
+	list_for_each_entry(sinfo, &info->space_info, list) {
+		if ((sinfo->flags & BTRFS_BLOCK_GROUP_DATA) &&
+		    !(sinfo->flags & BTRFS_BLOCK_GROUP_METADATA))
+			data += sinfo->bytes_used;
+	}
+	return data < used ? used - data : used;
+}
+
+static u64 block_groups_bytes(struct btrfs_fs_info *info)
+{
+	struct btrfs_space_info *sinfo;
+	u64 total = 0;
+
+	list_for_each_entry(sinfo, &info->space_info, list)
+		total += sinfo->total_bytes;
+	return total;
+}
+
+/*
+ * End the running phase and start timing @name, which should go through
+ * @work bytes.  NULL just ends the running phase.
+ */
+static void start_check_phase(const char *name, u64 work)
+{
+	u64 now = check_clock_nsec();
+	u64 blocks;
+	u64 bytes;
+	int i;
+
+	pthread_mutex_lock(&check_phase_lock);
+	blocks = __atomic_exchange_n(&progress_blocks, 0, __ATOMIC_RELAXED);
+	bytes = __atomic_exchange_n(&progress_bytes, 0, __ATOMIC_RELAXED);
+	if (nr_check_phases && check_phase_start) {
+		i = nr_check_phases - 1;
+		check_phases[i].nsec += now - check_phase_start;
+		check_phases[i].blocks += blocks;
+		check_phases[i].bytes += bytes;
+		if (check_progress.log) {
+			fprintf(check_progress.log,
+	"time=%.1f phase=\"%s\" end=1 seconds=%.2f blocks=%llu bytes=%llu\n",
+				(now - check_progress.start) / 1000000000.0,
+				check_phases[i].name,
+				check_phases[i].nsec / 1000000000.0,
+				(unsigned long long)check_phases[i].blocks,
+				(unsigned long long)check_phases[i].bytes);
+			fflush(check_progress.log);
+		}
+	}
+	check_phase_start = 0;
+	if (name && nr_check_phases < MAX_CHECK_PHASES) {
+		check_phases[nr_check_phases++].name = name;
+		check_phase_start = now;
+		check_phase_work = work;
+	}
+	pthread_mutex_unlock(&check_phase_lock);
+}
+
+static void print_check_progress(u64 now)
+{
+	struct extent_io_tree *tree = &check_progress.info->extent_cache;
+	const char *name = check_phases[nr_check_phases - 1].name;
+	u64 elapsed = now - check_phase_start;
+	u64 blocks = __atomic_load_n(&progress_blocks, __ATOMIC_RELAXED);
+	u64 bytes = __atomic_load_n(&progress_bytes, __ATOMIC_RELAXED);
+	u64 hits = __atomic_load_n(&tree->cache_hits, __ATOMIC_RELAXED);
+	u64 misses = __atomic_load_n(&tree->cache_misses, __ATOMIC_RELAXED);
+	u64 rate = 0;
+	u64 left = 0;
+	int percent = -1;
+	char size[32];
+
+	if (check_progress.phase != nr_check_phases) {
+		check_progress.phase = nr_check_phases;
+		check_progress.last_blocks = 0;
+		check_progress.last_nsec = check_phase_start;
+	}
+	if (now > check_progress.last_nsec)
+		rate = (blocks - check_progress.last_blocks) * 1000000000ULL /
+			(now - check_progress.last_nsec);
+	check_progress.last_blocks = blocks;
+	check_progress.last_nsec = now;
+	if (check_phase_work) {
+		percent = min_t(u64, bytes * 100 / check_phase_work, 100);
+		if (bytes && bytes < check_phase_work)
+			left = (double)elapsed / 1000000000.0 *
+				(check_phase_work - bytes) / bytes;
+	}
+
+	if (check_progress.log) {
+		fprintf(check_progress.log,
+"time=%.1f phase=\"%s\" blocks=%llu bytes=%llu blocks_per_sec=%llu cache_hits=%llu cache_misses=%llu",
+			(now - check_progress.start) / 1000000000.0, name,
+			(unsigned long long)blocks, (unsigned long long)bytes,
+			(unsigned long long)rate, (unsigned long long)hits,
+			(unsigned long long)misses);
+		if (percent >= 0)
+			fprintf(check_progress.log, " percent=%d seconds_left=%llu",
+				percent, (unsigned long long)left);
+		fprintf(check_progress.log, "\n");
+		fflush(check_progress.log);
+	}
+
+	if (!check_progress.out || (!check_progress.tty &&
+	    check_progress.periods % PROGRESS_LINE_PERIODS))
+		return;
+	pretty_size_snprintf(bytes, size, sizeof(size), UNITS_DEFAULT);
+	fprintf(check_progress.out,
+		"%s%s: %llu blocks, %s, %llu blocks/s, cache hits %llu%%",
+		check_progress.tty ? "\r" : "", name,
+		(unsigned long long)blocks, size, (unsigned long long)rate,
+		(unsigned long long)(hits + misses ?
+				     hits * 100 / (hits + misses) : 0));
+	if (percent >= 0)
+		fprintf(check_progress.out, ", %d%% done, %llu:%02llu:%02llu left",
+			percent, (unsigned long long)left / 3600,
+			(unsigned long long)left / 60 % 60,
+			(unsigned long long)left % 60);
+	fprintf(check_progress.out, check_progress.tty ? "\033[K" : "\n");
+	fflush(check_progress.out);
+}
+
+static void *check_progress_thread(void *data)
+{
+	int state;
+
+	while (1) {
+		task_period_wait(check_progress.task);
+		/* don't get cancelled with the lock held */
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &state);
+		pthread_mutex_lock(&check_phase_lock);
+		if (!check_progress.stopped && check_phase_start) {
+			check_progress.periods++;
+			print_check_progress(check_clock_nsec());
+		}
+		pthread_mutex_unlock(&check_phase_lock);
+		pthread_setcancelstate(state, NULL);
+	}
+	return NULL;
+}
+
+static int start_check_progress(struct btrfs_fs_info *info, int progress,
+				const char *log_path)
+{
+	int fd;
+
+	check_progress.info = info;
+	check_progress.start = check_clock_nsec();
+	if (log_path) {
+		check_progress.log = fopen(log_path, "a");
+		if (!check_progress.log) {
+			fprintf(stderr, "ERROR: cannot open %s: %s\n",
+				log_path, strerror(errno));
+			return -errno;
+		}
+	}
+	if (progress) {
+		fd = dup(STDERR_FILENO);
+		if (fd >= 0)
+			check_progress.out = fdopen(fd, "w");
+		if (!check_progress.out) {
+			if (fd >= 0)
+				close(fd);
+			fprintf(stderr, "ERROR: cannot set up the progress output\n");
+			return -EIO;
+		}
+		check_progress.tty = isatty(fd);
+	}
+	/* the timer is set up before the thread so task_stop sees it */
+	check_progress.task = task_init(check_progress_thread, NULL, NULL);
+	if (!check_progress.task ||
+	    task_period_start(check_progress.task, PROGRESS_PERIOD_MS) ||
+	    task_start(check_progress.task)) {
+		fprintf(stderr, "WARNING: cannot start the progress reporter\n");
+		if (check_progress.task)
+			task_period_stop(check_progress.task);
+		task_deinit(check_progress.task);
+		check_progress.task = NULL;
+	}
+	return 0;
+}
+
+static void stop_check_progress(void)
+{
+	int stopped;
+
+	pthread_mutex_lock(&check_phase_lock);
+	stopped = check_progress.stopped;
+	check_progress.stopped = 1;
+	pthread_mutex_unlock(&check_phase_lock);
+	if (stopped)
+		return;
+	/*
+	 * The task is not freed, the detached thread may look at it until
+	 * it is cancelled.
+	 */
+	task_stop(check_progress.task);
+	if (check_progress.out) {
+		if (check_progress.tty && check_progress.periods)
+			fprintf(check_progress.out, "\n");
+		fclose(check_progress.out);
+		check_progress.out = NULL;
+	}
+	if (check_progress.log) {
+		fclose(check_progress.log);
+		check_progress.log = NULL;
+	}
+}
+
+static void print_check_phases(void)
+{
+	struct rusage ru;
+	char size[32];
+	double sec;
+	int i;
+
+	printf("phase times:\n");
+	for (i = 0; i < nr_check_phases; i++) {
+		sec = check_phases[i].nsec / 1000000000.0;
+		pretty_size_snprintf(check_phases[i].bytes, size, sizeof(size),
+				     UNITS_DEFAULT);
+		printf("  %-12s %9.2fs %12llu blocks %12s %10.0f blocks/s\n",
+		       check_phases[i].name, sec,
+		       (unsigned long long)check_phases[i].blocks, size,
+		       sec > 0 ? check_phases[i].blocks / sec : 0.0);
+	}
+	if (getrusage(RUSAGE_SELF, &ru) == 0)
+		printf("peak memory: %ld KiB\n", ru.ru_maxrss);
+	if (mem_limit)
+		printf("spilled data extent refs: %llu in %llu runs\n",
+		       (unsigned long long)spilled_data_refs,
+		       (unsigned long long)spilled_data_runs);
+	if (nr_space_cache_outliers) {
+		printf("slowest block group caches:");
+		for (i = 0; i < nr_space_cache_outliers; i++)
+			printf(" %llu %.3fs", (unsigned long long)
+			       space_cache_outliers[i].objectid,
+			       space_cache_outliers[i].nsec / 1000000000.0);
+		printf("\n");
+	}
+}
+
+static void print_pool_stats(struct mem_pool *pool)
+{
+	printf("  %-20s %12llu %6zu %10llu\n", pool->name,
+	       (unsigned long long)pool->peak_objs, pool->obj_size,
+	       (unsigned long long)(pool->peak_chunks * pool->chunk_size) >> 10);
+}
+
+static void print_mem_stats(void)
+{
+	printf("peak record memory:\n");
+	printf("  %-20s %12s %6s %10s\n", "type", "records", "size", "KiB");
+	print_pool_stats(&tree_extent_rec_pool);
+	print_pool_stats(&data_extent_rec_pool);
+	print_pool_stats(&tree_backref_pool);
+	print_pool_stats(&data_backref_pool);
+	print_pool_stats(&inode_rec_pool);
+	print_pool_stats(&inode_backref_pool);
+	printf("  %llu extent backrefs kept inside their records\n",
+	       (unsigned long long)inline_extent_backrefs);
+	printf("  %llu distinct inode backref names in %llu lookups, %llu KiB\n",
+	       (unsigned long long)nr_inode_names,
+	       (unsigned long long)inode_name_lookups,
+	       (unsigned long long)inode_name_bytes >> 10);
+}
+
 const char * const cmd_check_usage[] = {
 	"btrfs check [options] <device>",
 	"Check an unmounted btrfs filesystem.",
@@ -9209,6 +12267,18 @@ const char * const cmd_check_usage[] = {
 	"--qgroup-report             print a report on qgroup consistency",
 	"--subvol-extents <subvolid> print subvolume extents and sharing state",
 	"--tree-root <bytenr>        use the given bytenr for the tree root",
+	"--cache-size <size>         limit the tree block cache to <size> bytes",
+	"--io-depth <depth>          tree block reads kept in flight per device",
+	"--io-order <order>          read the tree blocks in logical or physical",
+	"                            order",
+	"--mem-limit <size>          spill data extent references to disk to",
+	"                            keep memory use around <size> bytes",
+	"--mem-stats                 print the memory used by the records",
+	"--checkpoint <file>         save the progress of the check to <file>",
+	"--resume <file>             resume the check saved to <file>",
+	"-p|--progress               show the progress of the check",
+	"--progress-log <file>       append the progress of the check to <file>",
+	"-j <threads>                check the trees with <threads> threads",
 	NULL
 };
 
@@ -9226,12 +12296,20 @@ int cmd_check(int argc, char **argv)
 	int init_csum_tree = 0;
 	int readonly = 0;
 	int qgroup_report = 0;
+	u64 cache_size = 0;
+	unsigned int io_depth = 0;
+	const char *resume_path = NULL;
+	const char *progress_log = NULL;
+	int progress = 0;
 	enum btrfs_open_ctree_flags ctree_flags = OPEN_CTREE_EXCLUSIVE;
 
 	while(1) {
 		int c;
 		enum { OPT_REPAIR = 257, OPT_INIT_CSUM, OPT_INIT_EXTENT,
-			OPT_CHECK_CSUM, OPT_READONLY };
+			OPT_CHECK_CSUM, OPT_READONLY, OPT_CACHE_SIZE,
+			OPT_IO_DEPTH, OPT_MEM_LIMIT, OPT_MEM_STATS,
+			OPT_IO_ORDER, OPT_CHECKPOINT, OPT_RESUME,
+			OPT_PROGRESS_LOG };
 		static const struct option long_options[] = {
 			{ "super", required_argument, NULL, 's' },
 			{ "repair", no_argument, NULL, OPT_REPAIR },
@@ -9243,10 +12321,22 @@ int cmd_check(int argc, char **argv)
 			{ "subvol-extents", required_argument, NULL, 'E' },
 			{ "qgroup-report", no_argument, NULL, 'Q' },
 			{ "tree-root", required_argument, NULL, 'r' },
+			{ "cache-size", required_argument, NULL,
+				OPT_CACHE_SIZE },
+			{ "io-depth", required_argument, NULL, OPT_IO_DEPTH },
+			{ "mem-limit", required_argument, NULL, OPT_MEM_LIMIT },
+			{ "mem-stats", no_argument, NULL, OPT_MEM_STATS },
+			{ "io-order", required_argument, NULL, OPT_IO_ORDER },
+			{ "checkpoint", required_argument, NULL,
+				OPT_CHECKPOINT },
+			{ "resume", required_argument, NULL, OPT_RESUME },
+			{ "progress", no_argument, NULL, 'p' },
+			{ "progress-log", required_argument, NULL,
+				OPT_PROGRESS_LOG },
 			{ NULL, 0, NULL, 0}
 		};
 
-		c = getopt_long(argc, argv, "as:br:", long_options, NULL);
+		c = getopt_long(argc, argv, "as:br:j:p", long_options, NULL);
 		if (c < 0)
 			break;
 		switch(c) {
@@ -9275,6 +12365,11 @@ int cmd_check(int argc, char **argv)
 			case 'r':
 				tree_root_bytenr = arg_strtou64(optarg);
 				break;
+			case 'j':
+				check_threads = arg_strtou64(optarg);
+				if (check_threads < 1)
+					check_threads = 1;
+				break;
 			case '?':
 			case 'h':
 				usage(cmd_check_usage);
@@ -9301,6 +12396,43 @@ int cmd_check(int argc, char **argv)
 			case OPT_CHECK_CSUM:
 				check_data_csum = 1;
 				break;
+			case OPT_CACHE_SIZE:
+				cache_size = parse_size(optarg);
+				break;
+			case OPT_IO_DEPTH:
+				io_depth = arg_strtou64(optarg);
+				break;
+			case OPT_MEM_LIMIT:
+				mem_limit = parse_size(optarg);
+				break;
+			case OPT_MEM_STATS:
+				mem_stats = 1;
+				break;
+			case OPT_IO_ORDER:
+				if (!strcmp(optarg, "logical")) {
+					io_order = IO_ORDER_LOGICAL;
+				} else if (!strcmp(optarg, "physical")) {
+					io_order = IO_ORDER_PHYSICAL;
+				} else {
+					fprintf(stderr,
+						"ERROR: unknown io order '%s'\n",
+						optarg);
+					exit(1);
+				}
+				break;
+			case OPT_CHECKPOINT:
+				checkpoint.path = optarg;
+				break;
+			case OPT_RESUME:
+				checkpoint.path = optarg;
+				resume_path = optarg;
+				break;
+			case 'p':
+				progress = 1;
+				break;
+			case OPT_PROGRESS_LOG:
+				progress_log = optarg;
+				break;
 		}
 	}
 	argc = argc - optind;
@@ -9313,9 +12445,18 @@ int cmd_check(int argc, char **argv)
 		fprintf(stderr, "Repair options are not compatible with --readonly\n");
 		exit(1);
 	}
+	if (mem_limit && repair) {
+		fprintf(stderr, "Repair options are not compatible with --mem-limit\n");
+		exit(1);
+	}
+	if (checkpoint.path && repair) {
+		fprintf(stderr, "Repair options are not compatible with --checkpoint and --resume\n");
+		exit(1);
+	}
 
 	radix_tree_init();
 	cache_tree_init(&root_cache);
+	init_record_pools();
 
 	if((ret = check_mounted(argv[optind])) < 0) {
 		fprintf(stderr, "Could not check mount status: %s\n", strerror(-ret));
@@ -9339,6 +12480,14 @@ int cmd_check(int argc, char **argv)
 	}
 
 	root = info->fs_root;
+	/* a quarter of the memory limit goes to the tree block cache */
+	if (mem_limit && !cache_size)
+		cache_size = max_t(u64, mem_limit / 4, 1024 * 1024);
+	if (cache_size)
+		extent_io_tree_init_cache_max(&info->extent_cache, cache_size);
+	if (io_depth && btrfs_set_io_depth(info, io_depth))
+		fprintf(stderr, "WARNING: cannot set up io depth %u\n",
+			io_depth);
 
 	/*
 	 * repair mode will force us to commit transaction which
@@ -9361,7 +12510,7 @@ int cmd_check(int argc, char **argv)
 	if (qgroup_report) {
 		printf("Print quota groups for %s\nUUID: %s\n", argv[optind],
 		       uuidbuf);
-		ret = qgroup_verify_all(info);
+		ret = qgroup_verify_all(info, check_threads);
 		if (ret == 0)
 			print_qgroup_report(1);
 		goto close_out;
@@ -9434,31 +12583,62 @@ int cmd_check(int argc, char **argv)
 		goto close_out;
 	}
 
-	fprintf(stderr, "checking extents\n");
-	ret = check_chunks_and_extents(root);
-	if (ret)
+	if (progress || progress_log) {
+		ret = start_check_progress(info, progress, progress_log);
+		if (ret)
+			goto close_out;
+	}
+
+	if (resume_path) {
+		ret = load_checkpoint(info, resume_path, &root_cache);
+		if (ret) {
+			ret = 1;
+			goto close_out;
+		}
+		fprintf(stderr, "resuming the check from %s\n", resume_path);
+	}
+
+	if (!(checkpoint.phases & CHECKPOINT_EXTENTS)) {
+		fprintf(stderr, "checking extents\n");
+		start_check_phase("extents", metadata_bytes_used(info));
+		ret = check_chunks_and_extents(root);
+		release_extent_rec_pools();
+		if (ret)
+			checkpoint.results |= CHECKPOINT_EXTENT_ERRORS;
+		checkpoint_phase(info, &root_cache, CHECKPOINT_EXTENTS);
+	}
+	if (checkpoint.results & CHECKPOINT_EXTENT_ERRORS)
 		fprintf(stderr, "Errors found in extent allocation tree or chunk allocation\n");
 
-	ret = repair_root_items(info);
-	if (ret < 0)
-		goto close_out;
-	if (repair) {
-		fprintf(stderr, "Fixed %d roots.\n", ret);
-		ret = 0;
-	} else if (ret > 0) {
-		fprintf(stderr,
-		       "Found %d roots with an outdated root item.\n",
-		       ret);
-		fprintf(stderr,
-			"Please run a filesystem check with the option --repair to fix them.\n");
-		ret = 1;
-		goto close_out;
+	if (!(checkpoint.phases & CHECKPOINT_ROOT_ITEMS)) {
+		ret = repair_root_items(info);
+		if (ret < 0)
+			goto close_out;
+		if (repair) {
+			fprintf(stderr, "Fixed %d roots.\n", ret);
+			ret = 0;
+		} else if (ret > 0) {
+			fprintf(stderr,
+			       "Found %d roots with an outdated root item.\n",
+			       ret);
+			fprintf(stderr,
+				"Please run a filesystem check with the option --repair to fix them.\n");
+			if (checkpoint.path)
+				unlink(checkpoint.path);
+			ret = 1;
+			goto close_out;
+		}
+		checkpoint_phase(info, &root_cache, CHECKPOINT_ROOT_ITEMS);
 	}
 
-	fprintf(stderr, "checking free space cache\n");
-	ret = check_space_cache(root);
-	if (ret)
-		goto out;
+	if (!(checkpoint.phases & CHECKPOINT_FREE_SPACE)) {
+		fprintf(stderr, "checking free space cache\n");
+		start_check_phase("free space", block_groups_bytes(info));
+		ret = check_space_cache(root);
+		if (ret)
+			goto out;
+		checkpoint_phase(info, &root_cache, CHECKPOINT_FREE_SPACE);
+	}
 
 	/*
 	 * We used to have to have these hole extents in between our real
@@ -9468,17 +12648,29 @@ int cmd_check(int argc, char **argv)
 	 */
 	no_holes = btrfs_fs_incompat(root->fs_info,
 				     BTRFS_FEATURE_INCOMPAT_NO_HOLES);
-	fprintf(stderr, "checking fs roots\n");
-	ret = check_fs_roots(root, &root_cache);
-	if (ret)
-		goto out;
+	if (!(checkpoint.phases & CHECKPOINT_FS_ROOTS)) {
+		fprintf(stderr, "checking fs roots\n");
+		start_check_phase("fs roots", total_fs_tree_bytes);
+		ret = check_fs_roots(root, &root_cache);
+		release_inode_rec_pools();
+		if (ret)
+			goto out;
+		checkpoint_phase(info, &root_cache, CHECKPOINT_FS_ROOTS);
+	}
 
-	fprintf(stderr, "checking csums\n");
-	ret = check_csums(root);
-	if (ret)
-		goto out;
+	if (!(checkpoint.phases & CHECKPOINT_CSUMS)) {
+		fprintf(stderr, "checking csums\n");
+		start_check_phase("csums", total_csum_bytes /
+				  btrfs_super_csum_size(info->super_copy) *
+				  root->sectorsize);
+		ret = check_csums(root);
+		if (ret)
+			goto out;
+		checkpoint_phase(info, &root_cache, CHECKPOINT_CSUMS);
+	}
 
 	fprintf(stderr, "checking root refs\n");
+	start_check_phase("root refs", 0);
 	ret = check_root_refs(root, &root_cache);
 	if (ret)
 		goto out;
@@ -9507,16 +12699,23 @@ int cmd_check(int argc, char **argv)
 	if (info->quota_enabled) {
 		int err;
 		fprintf(stderr, "checking quota groups\n");
-		err = qgroup_verify_all(info);
+		start_check_phase("quota groups", 0);
+		err = qgroup_verify_all(info, repair ? 1 : check_threads);
 		if (err)
 			goto out;
 	}
 
-	if (!list_empty(&root->fs_info->recow_ebs)) {
+	if (!list_empty(&root->fs_info->recow_ebs) ||
+	    (checkpoint.results & CHECKPOINT_TRANSID_ERRORS)) {
 		fprintf(stderr, "Transid errors in file system\n");
 		ret = 1;
 	}
 out:
+	start_check_phase(NULL, 0);
+	stop_check_progress();
+	/* the check ran to its end, there is nothing left to resume */
+	if (checkpoint.path)
+		unlink(checkpoint.path);
 	print_qgroup_report(0);
 	if (found_old_backref) { /*
 		 * there was a disk format change when mixed
@@ -9543,10 +12742,19 @@ out:
 	printf("file data blocks allocated: %llu\n referenced %llu\n",
 		(unsigned long long)data_bytes_allocated,
 		(unsigned long long)data_bytes_referenced);
+	printf("tree block cache hits %llu misses %llu evictions %llu\n",
+	       (unsigned long long)info->extent_cache.cache_hits,
+	       (unsigned long long)info->extent_cache.cache_misses,
+	       (unsigned long long)info->extent_cache.cache_evictions);
+	if (mem_limit || mem_stats || progress || progress_log)
+		print_check_phases();
+	if (mem_stats)
+		print_mem_stats();
 	printf("%s\n", PACKAGE_STRING);
 
 	free_root_recs_tree(&root_cache);
 close_out:
+	stop_check_progress();
 	close_ctree(root);
 err_out:
 	return ret;
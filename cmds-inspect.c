@@ -18,6 +18,7 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <stdint.h>
+#include <ctype.h>
 #include <sys/ioctl.h>
 #include <errno.h>
 
@@ -26,6 +27,7 @@
 #include "utils.h"
 #include "ctree.h"
 #include "send-utils.h"
+#include "rbtree-utils.h"
 
 #include "commands.h"
 #include "btrfs-list.h"
@@ -35,23 +37,36 @@ static const char * const inspect_cmd_group_usage[] = {
 	NULL
 };
 
+static int ino_paths_ioctl(int fd, u64 inum,
+			   struct btrfs_data_container *fspath, u64 size)
+{
+	struct btrfs_ioctl_ino_path_args ipa;
+
+	memset(fspath, 0, sizeof(*fspath));
+	ipa.inum = inum;
+	ipa.size = size;
+	ipa.fspath = ptr_to_u64(fspath);
+
+	return ioctl(fd, BTRFS_IOC_INO_PATHS, &ipa);
+}
+
+static char *fspath_elem(struct btrfs_data_container *fspath, int i)
+{
+	return (char *)(unsigned long)((u64)(unsigned long)fspath->val +
+				       fspath->val[i]);
+}
+
 static int __ino_to_path_fd(u64 inum, int fd, int verbose, const char *prepend)
 {
 	int ret;
 	int i;
-	struct btrfs_ioctl_ino_path_args ipa;
 	struct btrfs_data_container *fspath;
 
 	fspath = malloc(4096);
 	if (!fspath)
 		return -ENOMEM;
 
-	memset(fspath, 0, sizeof(*fspath));
-	ipa.inum = inum;
-	ipa.size = 4096;
-	ipa.fspath = ptr_to_u64(fspath);
-
-	ret = ioctl(fd, BTRFS_IOC_INO_PATHS, &ipa);
+	ret = ino_paths_ioctl(fd, inum, fspath, 4096);
 	if (ret) {
 		printf("ioctl ret=%d, error: %s\n", ret, strerror(errno));
 		goto out;
@@ -65,11 +80,8 @@ static int __ino_to_path_fd(u64 inum, int fd, int verbose, const char *prepend)
 			fspath->elem_cnt, fspath->elem_missed);
 
 	for (i = 0; i < fspath->elem_cnt; ++i) {
-		u64 ptr;
-		char *str;
-		ptr = (u64)(unsigned long)fspath->val;
-		ptr += fspath->val[i];
-		str = (char *)(unsigned long)ptr;
+		char *str = fspath_elem(fspath, i);
+
 		if (prepend)
 			printf("%s/%s\n", prepend, str);
 		else
@@ -81,11 +93,536 @@ out:
 	return !!ret;
 }
 
+/*
+ * Batch mode of inode-resolve and logical-resolve: the inodes or logical
+ * addresses are read from a file, sorted and resolved with the filesystem
+ * opened once.  Each subvolume is looked up and opened once, and each inode
+ * resolved to its paths once, through the path cache.
+ */
+struct path_cache_entry {
+	struct rb_node rb_node;
+	u64 root;
+	u64 inum;		/* 0 for the subvolume itself */
+	int err;
+
+	/* subvolume: its path and an open fd */
+	char *path;
+	int fd;
+	DIR *dirstream;
+
+	/* inode: its paths in the subvolume */
+	char **paths;
+	int nr_paths;
+};
+
+struct resolve_batch {
+	const char *path;
+	int fd;
+	DIR *dirstream;
+	int json;
+	struct rb_root path_cache;
+	struct btrfs_data_container *fspath;
+	int errors;
+};
+
+#define BATCH_FSPATH_SIZE	4096
+
+static int comp_path_cache(struct path_cache_entry *e1,
+			   struct path_cache_entry *e2)
+{
+	if (e1->root != e2->root)
+		return e1->root < e2->root ? -1 : 1;
+	if (e1->inum != e2->inum)
+		return e1->inum < e2->inum ? -1 : 1;
+	return 0;
+}
+
+static int comp_path_cache_key(struct rb_node *node, void *key)
+{
+	return comp_path_cache(rb_entry(node, struct path_cache_entry,
+					rb_node), key);
+}
+
+static int comp_path_cache_nodes(struct rb_node *node1, struct rb_node *node2)
+{
+	return comp_path_cache_key(node1, rb_entry(node2,
+				   struct path_cache_entry, rb_node));
+}
+
+static struct path_cache_entry *path_cache_search(struct resolve_batch *batch,
+						  u64 root, u64 inum)
+{
+	struct path_cache_entry key;
+	struct rb_node *node;
+
+	key.root = root;
+	key.inum = inum;
+	node = rb_search(&batch->path_cache, &key, comp_path_cache_key, NULL);
+	return node ? rb_entry(node, struct path_cache_entry, rb_node) : NULL;
+}
+
+static struct path_cache_entry *path_cache_add(struct resolve_batch *batch,
+					       u64 root, u64 inum)
+{
+	struct path_cache_entry *entry;
+
+	entry = calloc(1, sizeof(*entry));
+	if (!entry)
+		return NULL;
+	entry->root = root;
+	entry->inum = inum;
+	entry->fd = -1;
+	rb_insert(&batch->path_cache, &entry->rb_node, comp_path_cache_nodes);
+	return entry;
+}
+
+static void free_path_cache_entry(struct rb_node *node)
+{
+	struct path_cache_entry *entry;
+	int i;
+
+	entry = rb_entry(node, struct path_cache_entry, rb_node);
+	if (entry->fd >= 0)
+		close_file_or_dir(entry->fd, entry->dirstream);
+	for (i = 0; i < entry->nr_paths; i++)
+		free(entry->paths[i]);
+	free(entry->paths);
+	free(entry->path);
+	free(entry);
+}
+
+FREE_RB_BASED_TREE(path_cache, free_path_cache_entry);
+
+/*
+ * The subvolume @root below the path given, opened unless it is the one of
+ * the path given.
+ */
+static struct path_cache_entry *lookup_subvol(struct resolve_batch *batch,
+					      u64 root)
+{
+	struct path_cache_entry *entry;
+	char *name;
+	int ret;
+
+	entry = path_cache_search(batch, root, 0);
+	if (entry)
+		return entry;
+	entry = path_cache_add(batch, root, 0);
+	if (!entry)
+		return NULL;
+
+	name = btrfs_list_path_for_root(batch->fd, root);
+	if (IS_ERR(name)) {
+		entry->err = PTR_ERR(name);
+		return entry;
+	}
+	if (!name) {
+		entry->path = strdup(batch->path);
+		if (!entry->path)
+			entry->err = -ENOMEM;
+		return entry;
+	}
+
+	ret = asprintf(&entry->path, "%s/%s", batch->path, name);
+	free(name);
+	if (ret < 0) {
+		entry->path = NULL;
+		entry->err = -ENOMEM;
+		return entry;
+	}
+	entry->fd = open_file_or_dir(entry->path, &entry->dirstream);
+	if (entry->fd < 0)
+		entry->err = -errno;
+	return entry;
+}
+
+static int subvol_fd(struct resolve_batch *batch,
+		     struct path_cache_entry *subvol)
+{
+	return subvol->fd >= 0 ? subvol->fd : batch->fd;
+}
+
+static struct path_cache_entry *lookup_inode(struct resolve_batch *batch,
+					     struct path_cache_entry *subvol,
+					     u64 inum)
+{
+	struct btrfs_data_container *fspath = batch->fspath;
+	struct path_cache_entry *entry;
+	int i;
+
+	entry = path_cache_search(batch, subvol->root, inum);
+	if (entry)
+		return entry;
+	entry = path_cache_add(batch, subvol->root, inum);
+	if (!entry)
+		return NULL;
+
+	if (ino_paths_ioctl(subvol_fd(batch, subvol), inum, fspath,
+			    BATCH_FSPATH_SIZE)) {
+		entry->err = -errno;
+		return entry;
+	}
+	if (fspath->elem_missed)
+		fprintf(stderr,
+			"WARNING: inode %llu: %u paths not resolved\n",
+			(unsigned long long)inum, fspath->elem_missed);
+	entry->paths = calloc(fspath->elem_cnt, sizeof(*entry->paths));
+	if (!entry->paths && fspath->elem_cnt) {
+		entry->err = -ENOMEM;
+		return entry;
+	}
+	for (i = 0; i < fspath->elem_cnt; i++) {
+		entry->paths[i] = strdup(fspath_elem(fspath, i));
+		if (!entry->paths[i]) {
+			entry->err = -ENOMEM;
+			break;
+		}
+		entry->nr_paths++;
+	}
+	return entry;
+}
+
+/* the characters of @str escaped for a JSON string */
+static void print_json_chars(const char *str)
+{
+	const unsigned char *c;
+
+	for (c = (const unsigned char *)str; *c; c++) {
+		if (*c == '"' || *c == '\\')
+			printf("\\%c", *c);
+		else if (*c < 0x20)
+			printf("\\u%04x", *c);
+		else
+			putchar(*c);
+	}
+}
+
+/* tabs, newlines and backslashes are escaped to keep one path per line */
+static void print_tsv_chars(const char *str)
+{
+	for (; *str; str++) {
+		if (*str == '\t')
+			printf("\\t");
+		else if (*str == '\n')
+			printf("\\n");
+		else if (*str == '\\')
+			printf("\\\\");
+		else
+			putchar(*str);
+	}
+}
+
+/* one line of results, @subvol and @path are NULL if paths aren't resolved */
+static void print_resolved(struct resolve_batch *batch, const u64 *logical,
+			   u64 inum, u64 offset, u64 root, const char *subvol,
+			   const char *path)
+{
+	if (batch->json) {
+		printf("{");
+		if (logical)
+			printf("\"logical\": %llu, ",
+			       (unsigned long long)*logical);
+		printf("\"inode\": %llu", (unsigned long long)inum);
+		if (logical)
+			printf(", \"offset\": %llu, \"root\": %llu",
+			       (unsigned long long)offset,
+			       (unsigned long long)root);
+		if (path) {
+			printf(", \"path\": \"");
+			print_json_chars(subvol);
+			putchar('/');
+			print_json_chars(path);
+			putchar('"');
+		}
+		printf("}\n");
+		return;
+	}
+
+	if (logical)
+		printf("%llu\t", (unsigned long long)*logical);
+	printf("%llu", (unsigned long long)inum);
+	if (logical)
+		printf("\t%llu\t%llu", (unsigned long long)offset,
+		       (unsigned long long)root);
+	if (path) {
+		putchar('\t');
+		print_tsv_chars(subvol);
+		putchar('/');
+		print_tsv_chars(path);
+	}
+	printf("\n");
+}
+
+static int comp_u64(const void *a, const void *b)
+{
+	u64 v1 = *(const u64 *)a;
+	u64 v2 = *(const u64 *)b;
+
+	return v1 < v2 ? -1 : v1 > v2;
+}
+
+/*
+ * Read the numbers of @file, '-' for stdin, the first word of each line.
+ * Empty lines and lines starting with '#' are skipped, invalid ones are
+ * reported and counted in batch->errors.  They are returned sorted without
+ * duplicates.
+ */
+static int read_batch(struct resolve_batch *batch, const char *file,
+		      u64 **ret_values, unsigned long *ret_nr)
+{
+	FILE *f = stdin;
+	char *line = NULL;
+	size_t line_size = 0;
+	unsigned long lineno = 0;
+	unsigned long alloc = 0;
+	unsigned long nr = 0;
+	unsigned long i;
+	u64 *values = NULL;
+	u64 *tmp;
+	char *word;
+	char *end;
+	u64 value;
+	int ret = 0;
+
+	if (strcmp(file, "-")) {
+		f = fopen(file, "r");
+		if (!f) {
+			fprintf(stderr, "ERROR: can't open '%s': %s\n", file,
+				strerror(errno));
+			return -errno;
+		}
+	}
+
+	while (getline(&line, &line_size, f) >= 0) {
+		lineno++;
+		for (word = line; isspace(*word); word++)
+			;
+		if (!*word || *word == '#')
+			continue;
+		for (end = word; *end && !isspace(*end); end++)
+			;
+		*end = '\0';
+
+		errno = 0;
+		value = strtoull(word, &end, 0);
+		if (*end || word[0] == '-' || errno) {
+			fprintf(stderr, "ERROR: %s:%lu: '%s' is not a valid "
+				"numeric value\n", file, lineno, word);
+			batch->errors++;
+			continue;
+		}
+		if (nr == alloc) {
+			alloc = max(alloc * 2, 1024UL);
+			tmp = realloc(values, alloc * sizeof(*values));
+			if (!tmp) {
+				ret = -ENOMEM;
+				goto out;
+			}
+			values = tmp;
+		}
+		values[nr++] = value;
+	}
+	if (ferror(f)) {
+		fprintf(stderr, "ERROR: reading '%s': %s\n", file,
+			strerror(errno));
+		ret = -EIO;
+		goto out;
+	}
+
+	qsort(values, nr, sizeof(*values), comp_u64);
+	for (i = 1, alloc = min(nr, 1UL); i < nr; i++)
+		if (values[i] != values[alloc - 1])
+			values[alloc++] = values[i];
+	*ret_values = values;
+	*ret_nr = alloc;
+	values = NULL;
+out:
+	free(values);
+	free(line);
+	if (f != stdin)
+		fclose(f);
+	return ret;
+}
+
+static int init_batch(struct resolve_batch *batch, const char *path, int json)
+{
+	memset(batch, 0, sizeof(*batch));
+	batch->path = path;
+	batch->json = json;
+	batch->path_cache = RB_ROOT;
+	batch->fd = open_file_or_dir(path, &batch->dirstream);
+	if (batch->fd < 0) {
+		fprintf(stderr, "ERROR: can't access '%s'\n", path);
+		return 1;
+	}
+	batch->fspath = malloc(BATCH_FSPATH_SIZE);
+	if (!batch->fspath) {
+		fprintf(stderr, "ERROR: not enough memory\n");
+		close_file_or_dir(batch->fd, batch->dirstream);
+		return 1;
+	}
+	return 0;
+}
+
+static void fini_batch(struct resolve_batch *batch)
+{
+	free_path_cache_tree(&batch->path_cache);
+	free(batch->fspath);
+	close_file_or_dir(batch->fd, batch->dirstream);
+}
+
+static int inode_resolve_batch(const char *file, const char *path, int json)
+{
+	struct resolve_batch batch;
+	struct path_cache_entry top;
+	struct path_cache_entry *entry;
+	u64 *inums = NULL;
+	unsigned long nr = 0;
+	unsigned long i;
+	int j;
+	int ret;
+
+	if (init_batch(&batch, path, json))
+		return 1;
+	ret = read_batch(&batch, file, &inums, &nr);
+	if (ret)
+		goto out;
+
+	/* the inodes are in the subvolume of the path given */
+	memset(&top, 0, sizeof(top));
+	top.fd = -1;
+	for (i = 0; i < nr; i++) {
+		entry = lookup_inode(&batch, &top, inums[i]);
+		if (!entry) {
+			ret = -ENOMEM;
+			break;
+		}
+		if (entry->err) {
+			fprintf(stderr, "ERROR: inode %llu: %s\n",
+				(unsigned long long)inums[i],
+				strerror(-entry->err));
+			batch.errors++;
+			continue;
+		}
+		for (j = 0; j < entry->nr_paths; j++)
+			print_resolved(&batch, NULL, inums[i], 0, 0, path,
+				       entry->paths[j]);
+	}
+out:
+	if (ret == -ENOMEM)
+		fprintf(stderr, "ERROR: not enough memory\n");
+	free(inums);
+	fini_batch(&batch);
+	return ret || batch.errors;
+}
+
+static int logical_resolve_batch(const char *file, const char *path,
+				 int json, int getpath, u64 size)
+{
+	struct resolve_batch batch;
+	struct btrfs_ioctl_logical_ino_args loi;
+	struct btrfs_data_container *inodes = NULL;
+	struct path_cache_entry *subvol;
+	struct path_cache_entry *entry;
+	u64 *logicals = NULL;
+	unsigned long nr = 0;
+	unsigned long i;
+	int j;
+	int k;
+	int ret;
+
+	if (init_batch(&batch, path, json))
+		return 1;
+	ret = read_batch(&batch, file, &logicals, &nr);
+	if (ret)
+		goto out;
+	inodes = malloc(size);
+	if (!inodes) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	for (i = 0; i < nr && !ret; i++) {
+		memset(inodes, 0, sizeof(*inodes));
+		loi.logical = logicals[i];
+		loi.size = size;
+		loi.inodes = ptr_to_u64(inodes);
+		if (ioctl(batch.fd, BTRFS_IOC_LOGICAL_INO, &loi)) {
+			fprintf(stderr, "ERROR: logical %llu: %s\n",
+				(unsigned long long)logicals[i],
+				strerror(errno));
+			batch.errors++;
+			continue;
+		}
+		if (inodes->elem_missed)
+			fprintf(stderr,
+		"WARNING: logical %llu: %u inodes not resolved, increase -s\n",
+				(unsigned long long)logicals[i],
+				inodes->elem_missed / 3);
+
+		for (j = 0; j < inodes->elem_cnt; j += 3) {
+			u64 inum = inodes->val[j];
+			u64 offset = inodes->val[j + 1];
+			u64 root = inodes->val[j + 2];
+
+			if (!getpath) {
+				print_resolved(&batch, &logicals[i], inum,
+					       offset, root, NULL, NULL);
+				continue;
+			}
+			subvol = lookup_subvol(&batch, root);
+			if (!subvol) {
+				ret = -ENOMEM;
+				break;
+			}
+			if (subvol->err) {
+				fprintf(stderr,
+			"ERROR: logical %llu: can't access subvolume %llu: %s\n",
+					(unsigned long long)logicals[i],
+					(unsigned long long)root,
+					strerror(-subvol->err));
+				batch.errors++;
+				continue;
+			}
+			entry = lookup_inode(&batch, subvol, inum);
+			if (!entry) {
+				ret = -ENOMEM;
+				break;
+			}
+			if (entry->err) {
+				fprintf(stderr,
+			"ERROR: logical %llu: inode %llu root %llu: %s\n",
+					(unsigned long long)logicals[i],
+					(unsigned long long)inum,
+					(unsigned long long)root,
+					strerror(-entry->err));
+				batch.errors++;
+				continue;
+			}
+			for (k = 0; k < entry->nr_paths; k++)
+				print_resolved(&batch, &logicals[i], inum,
+					       offset, root, subvol->path,
+					       entry->paths[k]);
+		}
+	}
+out:
+	if (ret == -ENOMEM)
+		fprintf(stderr, "ERROR: not enough memory\n");
+	free(inodes);
+	free(logicals);
+	fini_batch(&batch);
+	return ret || batch.errors;
+}
+
 static const char * const cmd_inode_resolve_usage[] = {
-	"btrfs inspect-internal inode-resolve [-v] <inode> <path>",
+	"btrfs inspect-internal inode-resolve [-v] {<inode>|-f <file> [-j]} <path>",
 	"Get file system paths for the given inode",
 	"",
-	"-v   verbose mode",
+	"-v       verbose mode",
+	"-f file  resolve the inodes listed in file, one per line, '-' reads",
+	"         stdin. They are sorted and each path is printed on a tab",
+	"         separated line: inode, path",
+	"-j       print JSON lines instead of tab separated ones, with -f",
 	NULL
 };
 
@@ -93,12 +630,14 @@ static int cmd_inode_resolve(int argc, char **argv)
 {
 	int fd;
 	int verbose = 0;
+	int json = 0;
+	char *batch_file = NULL;
 	int ret;
 	DIR *dirstream = NULL;
 
 	optind = 1;
 	while (1) {
-		int c = getopt(argc, argv, "v");
+		int c = getopt(argc, argv, "vf:j");
 		if (c < 0)
 			break;
 
@@ -106,12 +645,23 @@ static int cmd_inode_resolve(int argc, char **argv)
 		case 'v':
 			verbose = 1;
 			break;
+		case 'f':
+			batch_file = optarg;
+			break;
+		case 'j':
+			json = 1;
+			break;
 		default:
 			usage(cmd_inode_resolve_usage);
 		}
 	}
 
-	if (check_argc_exact(argc - optind, 2))
+	if (batch_file) {
+		if (verbose || check_argc_exact(argc - optind, 1))
+			usage(cmd_inode_resolve_usage);
+		return inode_resolve_batch(batch_file, argv[optind], json);
+	}
+	if (json || check_argc_exact(argc - optind, 2))
 		usage(cmd_inode_resolve_usage);
 
 	fd = open_file_or_dir(argv[optind+1], &dirstream);
@@ -128,13 +678,17 @@ static int cmd_inode_resolve(int argc, char **argv)
 }
 
 static const char * const cmd_logical_resolve_usage[] = {
-	"btrfs inspect-internal logical-resolve [-Pv] [-s bufsize] <logical> <path>",
+	"btrfs inspect-internal logical-resolve [-Pv] [-s bufsize] {<logical>|-f <file> [-j]} <path>",
 	"Get file system paths for the given logical address",
 	"-P          skip the path resolving and print the inodes instead",
 	"-v          verbose mode",
 	"-s bufsize  set inode container's size. This is used to increase inode",
 	"            container's size in case it is not enough to read all the ",
 	"            resolved results. The max value one can set is 64k",
+	"-f file     resolve the logical addresses listed in file, one per line,",
+	"            '-' reads stdin. They are sorted and each path is printed on",
+	"            a tab separated line: logical, inode, offset, root, path",
+	"-j          print JSON lines instead of tab separated ones, with -f",
 	NULL
 };
 
@@ -145,6 +699,8 @@ static int cmd_logical_resolve(int argc, char **argv)
 	int i;
 	int verbose = 0;
 	int getpath = 1;
+	int json = 0;
+	char *batch_file = NULL;
 	int bytes_left;
 	struct btrfs_ioctl_logical_ino_args loi;
 	struct btrfs_data_container *inodes;
@@ -155,7 +711,7 @@ static int cmd_logical_resolve(int argc, char **argv)
 
 	optind = 1;
 	while (1) {
-		int c = getopt(argc, argv, "Pvs:");
+		int c = getopt(argc, argv, "Pvs:f:j");
 		if (c < 0)
 			break;
 
@@ -169,15 +725,27 @@ static int cmd_logical_resolve(int argc, char **argv)
 		case 's':
 			size = arg_strtou64(optarg);
 			break;
+		case 'f':
+			batch_file = optarg;
+			break;
+		case 'j':
+			json = 1;
+			break;
 		default:
 			usage(cmd_logical_resolve_usage);
 		}
 	}
 
-	if (check_argc_exact(argc - optind, 2))
+	size = min(size, (u64)64 * 1024);
+	if (batch_file) {
+		if (verbose || check_argc_exact(argc - optind, 1))
+			usage(cmd_logical_resolve_usage);
+		return logical_resolve_batch(batch_file, argv[optind], json,
+					     getpath, size);
+	}
+	if (json || check_argc_exact(argc - optind, 2))
 		usage(cmd_logical_resolve_usage);
 
-	size = min(size, (u64)64 * 1024);
 	inodes = malloc(size);
 	if (!inodes)
 		return 1;
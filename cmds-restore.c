@@ -443,7 +443,7 @@ static enum loop_response ask_to_continue(const char *file)
 	       "on ? (y/N/a): ", file);
 again:
 	ret = fgets(buf, 2, stdin);
-	if (*ret == '\n' || tolower(*ret) == 'n')
+	if (!ret || *ret == '\n' || tolower(*ret) == 'n')
 		return LOOP_STOP;
 	if (tolower(*ret) == 'a')
 		return LOOP_DONTASK;
@@ -1406,6 +1406,7 @@ const char * const cmd_restore_usage[] = {
 	"                     you have to use following syntax (possibly quoted):",
 	"                     ^/(|home(|/username(|/Desktop(|/.*))))$",
 	"-c                   ignore case (--path-regex only)",
+	"--cache-size <size>  limit the tree block cache to <size> bytes",
 	NULL
 };
 
@@ -1417,6 +1418,7 @@ int cmd_restore(int argc, char **argv)
 	u64 tree_location = 0;
 	u64 fs_location = 0;
 	u64 root_objectid = 0;
+	u64 cache_size = 0;
 	int len;
 	int ret;
 	int super_mirror = 0;
@@ -1431,6 +1433,7 @@ int cmd_restore(int argc, char **argv)
 		int opt;
 		static const struct option long_options[] = {
 			{ "path-regex", required_argument, NULL, 256},
+			{ "cache-size", required_argument, NULL, 257},
 			{ "dry-run", no_argument, NULL, 'D'},
 			{ "metadata", no_argument, NULL, 'm'},
 			{ "symlinks", no_argument, NULL, 'S'},
@@ -1507,6 +1510,9 @@ int cmd_restore(int argc, char **argv)
 			case 256:
 				match_regstr = optarg;
 				break;
+			case 257:
+				cache_size = parse_size(optarg);
+				break;
 			case 'x':
 				get_xattrs = 1;
 				break;
@@ -1537,6 +1543,9 @@ int cmd_restore(int argc, char **argv)
 	root = open_fs(argv[optind], tree_location, super_mirror, list_roots);
 	if (root == NULL)
 		return 1;
+	if (cache_size)
+		extent_io_tree_init_cache_max(&root->fs_info->extent_cache,
+					      cache_size);
 
 	if (list_roots)
 		goto out;
@@ -1608,6 +1617,11 @@ int cmd_restore(int argc, char **argv)
 
 	ret = search_dir(root, &key, dir_name, "", mreg);
 
+	if (verbose)
+		printf("tree block cache hits %llu misses %llu evictions %llu\n",
+		       (unsigned long long)root->fs_info->extent_cache.cache_hits,
+		       (unsigned long long)root->fs_info->extent_cache.cache_misses,
+		       (unsigned long long)root->fs_info->extent_cache.cache_evictions);
 out:
 	if (mreg)
 		regfree(mreg);
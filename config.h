@@ -19,6 +19,12 @@
 /* Define to 1 if you have the <inttypes.h> header file. */
 #define HAVE_INTTYPES_H 1
 
+/* Define to 1 if you have the <linux/io_uring.h> header file. */
+/* #undef HAVE_LINUX_IO_URING_H */
+
+/* btrfs-image supports lz4 */
+/* #undef HAVE_LZ4 */
+
 /* Define to 1 if you have the <memory.h> header file. */
 #define HAVE_MEMORY_H 1
 
@@ -46,6 +52,9 @@
 /* Define to 1 if you have the <unistd.h> header file. */
 #define HAVE_UNISTD_H 1
 
+/* btrfs-image supports zstd */
+/* #undef HAVE_ZSTD */
+
 /* Define to the address where bug reports for this package should be sent. */
 #define PACKAGE_BUGREPORT "linux-btrfs@vger.kernel.org"
 
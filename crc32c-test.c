@@ -0,0 +1,178 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+/*
+ * Verify every crc32c implementation usable on this CPU against the table
+ * driven one and report their throughput, both over one large buffer and
+ * over 4KiB sectors checksummed in batches.  Also check that the suffixes
+ * computed by crc32c_le_suffix bring the crc where they should.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "kerncompat.h"
+#include "crc32c.h"
+
+#define BUF_SIZE	(1024 * 1024)
+#define SECTORSIZE	4096
+#define NR_SECTORS	(BUF_SIZE / SECTORSIZE)
+#define BENCH_MSEC	200
+
+static unsigned char *buf;
+
+static u64 now_nsec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* data rate in GB/s of @bytes processed in @nsec */
+static double rate(u64 bytes, u64 nsec)
+{
+	return (double)bytes / (double)nsec;
+}
+
+static int verify(const struct crc32c_calls *ref,
+		  const struct crc32c_calls *algo)
+{
+	u32 crcs[NR_SECTORS];
+	size_t len;
+	size_t start;
+	u32 expected;
+	u32 crc;
+	int i;
+
+	for (i = 0; i < 2000; i++) {
+		start = rand() % 64;
+		len = rand() % (BUF_SIZE - 64);
+		if (i < 64)
+			len = i;
+		expected = ref->crc(~(u32)0, buf + start, len);
+		crc = algo->crc(~(u32)0, buf + start, len);
+		if (crc != expected) {
+			fprintf(stderr, "%s: crc of %zu bytes at %zu is %08x expected %08x\n",
+				algo->name, len, start, crc, expected);
+			return 1;
+		}
+	}
+
+	algo->crc_many(~(u32)0, buf, SECTORSIZE, NR_SECTORS, crcs);
+	for (i = 0; i < NR_SECTORS; i++) {
+		expected = ref->crc(~(u32)0, buf + i * SECTORSIZE, SECTORSIZE);
+		if (crcs[i] != expected) {
+			fprintf(stderr, "%s: sector %d crc %08x expected %08x\n",
+				algo->name, i, crcs[i], expected);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static int verify_suffix(const struct crc32c_calls *ref)
+{
+	unsigned char suffix[4];
+	size_t len;
+	u32 target;
+	u32 crc;
+	u32 val;
+	int i;
+
+	for (i = 0; i < 2000; i++) {
+		len = rand() % 256;
+		target = rand() ^ ((u32)rand() << 16);
+		crc = ref->crc(~1U, buf, len);
+		val = crc32c_le_suffix(crc, target);
+		suffix[0] = val;
+		suffix[1] = val >> 8;
+		suffix[2] = val >> 16;
+		suffix[3] = val >> 24;
+		crc = ref->crc(crc, suffix, sizeof(suffix));
+		if (crc != target) {
+			fprintf(stderr, "suffix of %zu bytes gives %08x expected %08x\n",
+				len, crc, target);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static void bench(const struct crc32c_calls *algo)
+{
+	u32 crcs[NR_SECTORS];
+	u64 start, elapsed;
+	u64 loops = 0;
+	volatile u32 crc;
+
+	start = now_nsec();
+	do {
+		crc = algo->crc(~(u32)0, buf, BUF_SIZE);
+		loops++;
+		elapsed = now_nsec() - start;
+	} while (elapsed < BENCH_MSEC * 1000000ULL);
+	printf("crc32c %-8s %6.2f GB/s", algo->name,
+	       rate(loops * BUF_SIZE, elapsed));
+	(void)crc;
+
+	loops = 0;
+	start = now_nsec();
+	do {
+		algo->crc_many(~(u32)0, buf, SECTORSIZE, NR_SECTORS, crcs);
+		loops++;
+		elapsed = now_nsec() - start;
+	} while (elapsed < BENCH_MSEC * 1000000ULL);
+	printf("   4KiB sectors %6.2f GB/s\n", rate(loops * BUF_SIZE, elapsed));
+}
+
+int main(int argc, char **argv)
+{
+	const struct crc32c_calls *ref;
+	const struct crc32c_calls *algo;
+	int ret = 0;
+	int i;
+
+	buf = malloc(BUF_SIZE);
+	if (!buf) {
+		fprintf(stderr, "not enough memory\n");
+		return 1;
+	}
+	srand(42);
+	for (i = 0; i < BUF_SIZE; i++)
+		buf[i] = rand();
+
+	crc32c_optimization_init();
+	/* the table driven version is the last one */
+	for (ref = crc32c_algos; ref->name; ref++)
+		;
+	ref--;
+	if (verify_suffix(ref))
+		ret = 1;
+
+	for (algo = crc32c_algos; algo->name; algo++) {
+		if (!algo->valid())
+			continue;
+		if (verify(ref, algo)) {
+			ret = 1;
+			continue;
+		}
+		bench(algo);
+	}
+	free(buf);
+	return ret;
+}
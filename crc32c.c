@@ -17,10 +17,35 @@
 #include <sys/types.h>
 #include <sys/wait.h>
 
+#define CRC32C_POLY		0x82f63b78
+
 u32 __crc32c_le(u32 crc, unsigned char const *data, size_t length);
-static u32 (*crc_function)(u32 crc, unsigned char const *data, size_t length) = __crc32c_le;
+static const struct crc32c_calls *crc32c_call;
+
+static int crc32c_sw_valid(void)
+{
+	return 1;
+}
+
+/* checksum @nr blocks of @blocksize bytes one after another */
+static void crc32c_many_serial(u32 (*fn)(u32, unsigned char const *, size_t),
+			       u32 seed, unsigned char const *data,
+			       size_t blocksize, int nr, u32 *crcs)
+{
+	int i;
+
+	for (i = 0; i < nr; i++, data += blocksize)
+		crcs[i] = fn(seed, data, blocksize);
+}
+
+static void crc32c_sw_many(u32 seed, unsigned char const *data,
+			   size_t blocksize, int nr, u32 *crcs)
+{
+	crc32c_many_serial(__crc32c_le, seed, data, blocksize, nr, crcs);
+}
 
 #ifdef __x86_64__
+#include <immintrin.h>
 
 /*
  * Based on a posting to lkml by Austin Zhang <austin.zhang@intel.com>
@@ -42,6 +67,7 @@ static u32 (*crc_function)(u32 crc, unsigned char const *data, size_t length) =
 
 static int crc32c_probed = 0;
 static int crc32c_intel_available = 0;
+static int crc32c_pclmul_available = 0;
 
 static uint32_t crc32c_intel_le_hw_byte(uint32_t crc, unsigned char const *data,
 					unsigned long length)
@@ -109,24 +135,198 @@ static void crc32c_intel_probe(void)
 
 		do_cpuid(&eax, &ebx, &ecx, &edx);
 		crc32c_intel_available = (ecx & (1 << 20)) != 0;
+		crc32c_pclmul_available = crc32c_intel_available &&
+					  (ecx & (1 << 1)) != 0;
 		crc32c_probed = 1;
 	}
 }
 
-void crc32c_optimization_init(void)
+static int crc32c_intel_valid(void)
 {
 	crc32c_intel_probe();
-	if (crc32c_intel_available)
-		crc_function = crc32c_intel;
+	return crc32c_intel_available;
 }
-#else
 
-void crc32c_optimization_init(void)
+static int crc32c_pclmul_valid(void)
+{
+	crc32c_intel_probe();
+	return crc32c_pclmul_available;
+}
+
+static void crc32c_intel_many(u32 seed, unsigned char const *data,
+			      size_t blocksize, int nr, u32 *crcs)
+{
+	crc32c_many_serial(crc32c_intel, seed, data, blocksize, nr, crcs);
+}
+
+/*
+ * The crc32 instruction has a latency of 3 cycles but can start a new one
+ * every cycle, so the buffer is cut into three streams that are checksummed
+ * side by side, as the kernel's crc32c-pcl-intel does.  The partial crcs of
+ * the first two streams are then shifted over the bytes that follow them by
+ * a carry-less multiply with x^(8 * n - 33) mod P and folded into the last
+ * one.  The -33 accounts for the extra x of the reflected multiply and the
+ * x^32 applied by the crc32 instruction that does the reduction.
+ */
+#define CRC32C_LONG		8192
+#define CRC32C_SHORT		256
+
+static u32 crc32c_long_k[2];
+static u32 crc32c_short_k[2];
+
+/* x^n mod P, bit-reflected like the crcs themselves */
+static u32 crc32c_xpow(u64 n)
+{
+	u32 p = 1U << 31;
+
+	while (n--)
+		p = (p & 1) ? (p >> 1) ^ CRC32C_POLY : p >> 1;
+	return p;
+}
+
+static void crc32c_pclmul_init(void)
+{
+	crc32c_long_k[0] = crc32c_xpow(CRC32C_LONG * 16 - 33);
+	crc32c_long_k[1] = crc32c_xpow(CRC32C_LONG * 8 - 33);
+	crc32c_short_k[0] = crc32c_xpow(CRC32C_SHORT * 16 - 33);
+	crc32c_short_k[1] = crc32c_xpow(CRC32C_SHORT * 8 - 33);
+}
+
+static inline u64 crc32c_load64(unsigned char const *data)
+{
+	u64 val;
+
+	memcpy(&val, data, sizeof(val));
+	return val;
+}
+
+__attribute__((target("sse4.2,pclmul")))
+static inline u64 crc32c_clmul(u32 crc, u32 k)
+{
+	__m128i res;
+
+	res = _mm_clmulepi64_si128(_mm_cvtsi32_si128(crc),
+				   _mm_cvtsi32_si128(k), 0);
+	return _mm_cvtsi128_si64(res);
+}
+
+/* checksum 3 * @block bytes at @data, continuing from @crc */
+__attribute__((target("sse4.2,pclmul")))
+static u64 crc32c_3way(u64 crc, unsigned char const *data, size_t block,
+		       const u32 *k)
+{
+	unsigned char const *b = data + block;
+	unsigned char const *c = b + block;
+	u64 crc1 = 0;
+	u64 crc2 = 0;
+	size_t i;
+
+	for (i = 0; i < block - 8; i += 8) {
+		crc = _mm_crc32_u64(crc, crc32c_load64(data + i));
+		crc1 = _mm_crc32_u64(crc1, crc32c_load64(b + i));
+		crc2 = _mm_crc32_u64(crc2, crc32c_load64(c + i));
+	}
+	crc = _mm_crc32_u64(crc, crc32c_load64(data + i));
+	crc1 = _mm_crc32_u64(crc1, crc32c_load64(b + i));
+
+	return _mm_crc32_u64(crc2, crc32c_clmul(crc, k[0]) ^
+			     crc32c_clmul(crc1, k[1]) ^
+			     crc32c_load64(c + i));
+}
+
+__attribute__((target("sse4.2,pclmul")))
+static u32 crc32c_pclmul(u32 crc, unsigned char const *data, size_t length)
 {
+	u64 crc0 = crc;
+
+	for (; length >= 3 * CRC32C_LONG; length -= 3 * CRC32C_LONG) {
+		crc0 = crc32c_3way(crc0, data, CRC32C_LONG, crc32c_long_k);
+		data += 3 * CRC32C_LONG;
+	}
+	for (; length >= 3 * CRC32C_SHORT; length -= 3 * CRC32C_SHORT) {
+		crc0 = crc32c_3way(crc0, data, CRC32C_SHORT, crc32c_short_k);
+		data += 3 * CRC32C_SHORT;
+	}
+	for (; length >= 8; length -= 8, data += 8)
+		crc0 = _mm_crc32_u64(crc0, crc32c_load64(data));
+	while (length--)
+		crc0 = _mm_crc32_u8(crc0, *data++);
+	return crc0;
 }
 
+/*
+ * Blocks are independent of each other, so three of them can be run
+ * through the crc32 unit at the same time without any recombination.
+ */
+__attribute__((target("sse4.2,pclmul")))
+static void crc32c_pclmul_many(u32 seed, unsigned char const *data,
+			       size_t blocksize, int nr, u32 *crcs)
+{
+	unsigned char const *b;
+	unsigned char const *c;
+	u64 crc0, crc1, crc2;
+	size_t i;
+
+	if (blocksize % 8) {
+		crc32c_many_serial(crc32c_pclmul, seed, data, blocksize, nr,
+				   crcs);
+		return;
+	}
+
+	for (; nr >= 3; nr -= 3, crcs += 3, data += 3 * blocksize) {
+		b = data + blocksize;
+		c = b + blocksize;
+		crc0 = crc1 = crc2 = seed;
+		for (i = 0; i < blocksize; i += 8) {
+			crc0 = _mm_crc32_u64(crc0, crc32c_load64(data + i));
+			crc1 = _mm_crc32_u64(crc1, crc32c_load64(b + i));
+			crc2 = _mm_crc32_u64(crc2, crc32c_load64(c + i));
+		}
+		crcs[0] = crc0;
+		crcs[1] = crc1;
+		crcs[2] = crc2;
+	}
+	crc32c_many_serial(crc32c_pclmul, seed, data, blocksize, nr, crcs);
+}
 #endif /* __x86_64__ */
 
+/* best first, the table driven version always works */
+const struct crc32c_calls crc32c_algos[] = {
+#ifdef __x86_64__
+	{ .crc = crc32c_pclmul, .crc_many = crc32c_pclmul_many,
+	  .valid = crc32c_pclmul_valid, .name = "pclmul" },
+	{ .crc = crc32c_intel, .crc_many = crc32c_intel_many,
+	  .valid = crc32c_intel_valid, .name = "sse4.2" },
+#endif
+	{ .crc = __crc32c_le, .crc_many = crc32c_sw_many,
+	  .valid = crc32c_sw_valid, .name = "sw" },
+	{ .name = NULL }
+};
+
+void crc32c_optimization_init(void)
+{
+	const struct crc32c_calls *algo;
+
+#ifdef __x86_64__
+	crc32c_pclmul_init();
+#endif
+	for (algo = crc32c_algos; algo->name; algo++)
+		if (algo->valid())
+			break;
+	crc32c_call = algo;
+}
+
+/*
+ * Force the implementation used from now on, meant for testing and
+ * benchmarking.
+ */
+void crc32c_set_algo(const struct crc32c_calls *algo)
+{
+	if (!crc32c_call)
+		crc32c_optimization_init();
+	crc32c_call = algo;
+}
+
 /*
  * This is the CRC-32C table
  * Generated with:
@@ -218,5 +418,40 @@ u32 __crc32c_le(u32 crc, unsigned char const *data, size_t length)
 
 u32 crc32c_le(u32 crc, unsigned char const *data, size_t length)
 {
-	return crc_function(crc, data, length);
+	if (!crc32c_call)
+		crc32c_optimization_init();
+	return crc32c_call->crc(crc, data, length);
+}
+
+/*
+ * Checksum @nr consecutive blocks of @blocksize bytes at @data, each one
+ * starting from @seed, into @crcs.
+ */
+void crc32c_le_many(u32 seed, unsigned char const *data, size_t blocksize,
+		    int nr, u32 *crcs)
+{
+	if (!crc32c_call)
+		crc32c_optimization_init();
+	crc32c_call->crc_many(seed, data, blocksize, nr, crcs);
+}
+
+/*
+ * Return the 4 bytes, as a little endian u32, that checksummed after data
+ * whose crc is @crc give @target.  The crc is linear: checksumming 4 bytes
+ * is xoring them into the crc and shifting it by 32 bits, so the shift is
+ * undone from @target and the crc xored out of what is left.  A shift of
+ * one bit moves the low bit out and xors in the polynomial when it was set,
+ * which the top bit of the result tells as the polynomial has it.
+ */
+u32 crc32c_le_suffix(u32 crc, u32 target)
+{
+	int i;
+
+	for (i = 0; i < 32; i++) {
+		if (target & 0x80000000)
+			target = ((target ^ CRC32C_POLY) << 1) | 1;
+		else
+			target <<= 1;
+	}
+	return target ^ crc;
 }
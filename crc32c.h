@@ -25,8 +25,22 @@
 #include <btrfs/kerncompat.h>
 #endif /* BTRFS_FLAT_INCLUDES */
 
+struct crc32c_calls {
+	u32 (*crc)(u32 crc, unsigned char const *data, size_t length);
+	void (*crc_many)(u32 seed, unsigned char const *data, size_t blocksize,
+			 int nr, u32 *crcs);
+	int (*valid)(void);
+	const char *name;
+};
+
+extern const struct crc32c_calls crc32c_algos[];
+
 u32 crc32c_le(u32 seed, unsigned char const *data, size_t length);
+void crc32c_le_many(u32 seed, unsigned char const *data, size_t blocksize,
+		    int nr, u32 *crcs);
+u32 crc32c_le_suffix(u32 crc, u32 target);
 void crc32c_optimization_init(void);
+void crc32c_set_algo(const struct crc32c_calls *algo);
 
 #define crc32c(seed, data, length) crc32c_le(seed, (unsigned char const *)data, length)
 #define btrfs_crc32c crc32c
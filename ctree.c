@@ -977,6 +977,8 @@ void reada_for_search(struct btrfs_root *root, struct btrfs_path *path,
 	u64 nread = 0;
 	int direction = path->reada;
 	struct extent_buffer *eb;
+	struct tree_block_ptr ptrs[130];
+	int nr_ptrs = 0;
 	u32 nr;
 	u32 blocksize;
 	u32 nscan = 0;
@@ -998,6 +1000,9 @@ void reada_for_search(struct btrfs_root *root, struct btrfs_path *path,
 
 	highest_read = search;
 	lowest_read = search;
+	ptrs[nr_ptrs].bytenr = search;
+	ptrs[nr_ptrs].gen = btrfs_node_ptr_generation(node, slot);
+	nr_ptrs++;
 
 	nritems = btrfs_header_nritems(node);
 	nr = slot;
@@ -1020,8 +1025,9 @@ void reada_for_search(struct btrfs_root *root, struct btrfs_path *path,
 		if ((search >= lowest_read && search <= highest_read) ||
 		    (search < lowest_read && lowest_read - search <= 32768) ||
 		    (search > highest_read && search - highest_read <= 32768)) {
-			readahead_tree_block(root, search, blocksize,
-				     btrfs_node_ptr_generation(node, nr));
+			ptrs[nr_ptrs].bytenr = search;
+			ptrs[nr_ptrs].gen = btrfs_node_ptr_generation(node, nr);
+			nr_ptrs++;
 			nread += blocksize;
 		}
 		nscan++;
@@ -1035,6 +1041,7 @@ void reada_for_search(struct btrfs_root *root, struct btrfs_path *path,
 		if (search > highest_read)
 			highest_read = search;
 	}
+	read_tree_blocks(root, ptrs, nr_ptrs, blocksize);
 }
 
 int btrfs_find_item(struct btrfs_root *fs_root, struct btrfs_path *found_path,
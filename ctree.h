@@ -885,6 +885,8 @@ static inline u64 btrfs_qgroup_subvid(u64 qgroupid)
 #define BTRFS_QGROUP_STATUS_FLAG_RESCAN		(1ULL << 1)
 #define BTRFS_QGROUP_STATUS_FLAG_INCONSISTENT	(1ULL << 2)
 
+#define BTRFS_QGROUP_STATUS_VERSION        1
+
 struct btrfs_qgroup_status_item {
 	__le64 version;
 	__le64 generation;
@@ -953,6 +955,8 @@ struct btrfs_extent_ops {
 
 struct btrfs_device;
 struct btrfs_fs_devices;
+struct async_io_ctx;
+struct metadump_image;
 struct btrfs_fs_info {
 	u8 fsid[BTRFS_FSID_SIZE];
 	u8 *new_fsid;
@@ -1023,6 +1027,11 @@ struct btrfs_fs_info {
 	struct cache_tree *fsck_extent_cache;
 	struct cache_tree *corrupt_blocks;
 
+	/* engine for read_tree_blocks(), NULL reads synchronously */
+	struct async_io_ctx *async_io;
+
+	/* the indexed image the blocks are read from, NULL for devices */
+	struct metadump_image *metadump;
 };
 
 /*
@@ -2465,6 +2474,9 @@ int btrfs_insert_inline_extent(struct btrfs_trans_handle *trans,
 int btrfs_csum_file_block(struct btrfs_trans_handle *trans,
 			  struct btrfs_root *root, u64 alloc_end,
 			  u64 bytenr, char *data, size_t len);
+int btrfs_csum_file_blocks(struct btrfs_trans_handle *trans,
+			   struct btrfs_root *root, u64 alloc_end,
+			   u64 bytenr, char *data, size_t len);
 int btrfs_csum_truncate(struct btrfs_trans_handle *trans,
 			struct btrfs_root *root, struct btrfs_path *path,
 			u64 isize);
@@ -2483,12 +2495,12 @@ static inline int is_fstree(u64 rootid)
 }
 
 /* inode.c */
-int check_dir_conflict(struct btrfs_root *root, char *name, int namelen,
-		u64 dir, u64 index);
+int check_dir_conflict(struct btrfs_root *root, const char *name,
+		int namelen, u64 dir, u64 index);
 int btrfs_new_inode(struct btrfs_trans_handle *trans, struct btrfs_root *root,
 		u64 ino, u32 mode);
 int btrfs_add_link(struct btrfs_trans_handle *trans, struct btrfs_root *root,
-		   u64 ino, u64 parent_ino, char *name, int namelen,
+		   u64 ino, u64 parent_ino, const char *name, int namelen,
 		   u8 type, u64 *index, int add_backref);
 int btrfs_unlink(struct btrfs_trans_handle *trans, struct btrfs_root *root,
 		 u64 ino, u64 parent_ino, u64 index, const char *name,
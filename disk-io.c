@@ -18,10 +18,13 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <pthread.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <limits.h>
+#include <sys/uio.h>
 #include <uuid/uuid.h>
 #include "kerncompat.h"
 #include "radix-tree.h"
@@ -33,6 +36,8 @@
 #include "utils.h"
 #include "print-tree.h"
 #include "rbtree-utils.h"
+#include "async-io.h"
+#include "metadump.h"
 
 /* specified errno for check_tree_block */
 #define BTRFS_BAD_BYTENR		(-1)
@@ -121,6 +126,21 @@ void btrfs_csum_final(u32 crc, char *result)
 	*(__le32 *)result = ~cpu_to_le32(crc);
 }
 
+/*
+ * Compute the final checksums of the @len / @sectorsize sectors at @data in
+ * one go, @csums receives them in their on-disk byte order.
+ */
+void btrfs_csum_data_many(char *data, size_t len, u32 sectorsize, u32 *csums)
+{
+	int nr = len / sectorsize;
+	int i;
+
+	crc32c_le_many(~(u32)0, (unsigned char const *)data, sectorsize, nr,
+		       csums);
+	for (i = 0; i < nr; i++)
+		btrfs_csum_final(csums[i], (char *)&csums[i]);
+}
+
 static int __csum_tree_block_size(struct extent_buffer *buf, u16 csum_size,
 				  int verify, int silent)
 {
@@ -187,6 +207,10 @@ struct extent_buffer *btrfs_find_create_tree_block(struct btrfs_root *root,
 				   blocksize);
 }
 
+/*
+ * Only a hint to the kernel, the caller goes on without waiting.  Batches of
+ * blocks the caller is about to use go through read_tree_blocks() instead.
+ */
 void readahead_tree_block(struct btrfs_root *root, u64 bytenr, u32 blocksize,
 			  u64 parent_transid)
 {
@@ -195,12 +219,15 @@ void readahead_tree_block(struct btrfs_root *root, u64 bytenr, u32 blocksize,
 	struct btrfs_multi_bio *multi = NULL;
 	struct btrfs_device *device;
 
+	if (root->fs_info->metadump)
+		return;
+
 	eb = btrfs_find_tree_block(root, bytenr, blocksize);
 	if (!(eb && btrfs_buffer_uptodate(eb, parent_transid)) &&
 	    !btrfs_map_block(&root->fs_info->mapping_tree, READ,
 			     bytenr, &length, &multi, 0, NULL)) {
 		device = multi->stripes[0].dev;
-		device->total_ios++;
+		__atomic_add_fetch(&device->total_ios, 1, __ATOMIC_RELAXED);
 		blocksize = min(blocksize, (u32)(64 * 1024));
 		readahead(device->fd, multi->stripes[0].physical, blocksize);
 	}
@@ -209,6 +236,269 @@ void readahead_tree_block(struct btrfs_root *root, u64 bytenr, u32 blocksize,
 	kfree(multi);
 }
 
+/* upper bound of the bytes read by a single merged request */
+#define READ_TREE_BLOCKS_MAX_BYTES	(1024 * 1024)
+
+struct tree_block_io {
+	struct extent_buffer *eb;
+	struct btrfs_device *device;
+	u64 physical;
+	u64 gen;
+};
+
+static int cmp_tree_block_io(const void *a, const void *b)
+{
+	const struct tree_block_io *ta = a;
+	const struct tree_block_io *tb = b;
+
+	if (ta->device->devid < tb->device->devid)
+		return -1;
+	if (ta->device->devid > tb->device->devid)
+		return 1;
+	if (ta->physical < tb->physical)
+		return -1;
+	if (ta->physical > tb->physical)
+		return 1;
+	return 0;
+}
+
+/* a physically contiguous run of blocks read with one request */
+struct tree_block_run {
+	struct tree_block_io *io;
+	int nr;
+	int rank;
+};
+
+/* interleave the runs of the devices so they all get requests in flight */
+static int cmp_tree_block_run(const void *a, const void *b)
+{
+	const struct tree_block_run *ra = a;
+	const struct tree_block_run *rb = b;
+
+	if (ra->rank != rb->rank)
+		return ra->rank < rb->rank ? -1 : 1;
+	return cmp_tree_block_io(ra->io, rb->io);
+}
+
+/* blocks of a completed run that validate are marked uptodate */
+static void verify_tree_block_run(struct btrfs_root *root,
+				  struct tree_block_run *run,
+				  struct async_io_req *req)
+{
+	u16 csum_size = btrfs_super_csum_size(root->fs_info->super_copy);
+	ssize_t total = 0;
+	int i;
+
+	for (i = 0; i < run->nr; i++)
+		total += run->io[i].eb->len;
+	if (req->ret != total)
+		return;
+
+	for (i = 0; i < run->nr; i++) {
+		struct tree_block_io *io = &run->io[i];
+		struct extent_buffer *eb = io->eb;
+
+		eb->fd = io->device->fd;
+		eb->dev_bytenr = io->physical;
+		if (verify_tree_block_csum_silent(eb, csum_size) ||
+		    check_tree_block(root, eb))
+			continue;
+		if (io->gen && btrfs_header_generation(eb) != io->gen)
+			continue;
+		btrfs_set_buffer_uptodate(eb);
+	}
+}
+
+/*
+ * Tree blocks may be read from several threads at once, reading and
+ * validating one buffer is serialized by the lock its block number hashes to.
+ */
+#define TREE_BLOCK_READ_LOCK_BITS	8
+#define TREE_BLOCK_READ_LOCKS		(1 << TREE_BLOCK_READ_LOCK_BITS)
+
+static pthread_mutex_t tree_block_read_locks[TREE_BLOCK_READ_LOCKS] = {
+	[0 ... TREE_BLOCK_READ_LOCKS - 1] = PTHREAD_MUTEX_INITIALIZER
+};
+
+static int tree_block_read_lock_slot(u64 bytenr, u32 blocksize)
+{
+	return ((bytenr / blocksize) * 0x9E3779B97F4A7C15ULL) >>
+		(64 - TREE_BLOCK_READ_LOCK_BITS);
+}
+
+static pthread_mutex_t *tree_block_read_lock(u64 bytenr, u32 blocksize)
+{
+	return &tree_block_read_locks[tree_block_read_lock_slot(bytenr,
+								blocksize)];
+}
+
+/*
+ * Read a batch of tree blocks into the extent buffer cache.  The blocks are
+ * mapped to their first stripe, sorted by device and physical offset and
+ * physically adjacent blocks are fetched with one preadv() call.  With an
+ * io depth set by btrfs_set_io_depth() the requests of all devices are kept
+ * in flight concurrently.
+ *
+ * Nothing is returned to the caller, blocks that could not be read or do not
+ * validate are simply left out of the cache so the following read_tree_block()
+ * goes through the regular path with mirror retries and error reporting.
+ *
+ * The read locks of the batch are taken with trylock, a block whose lock
+ * another thread holds is left to that thread, and each lock is taken once
+ * however many blocks of the batch hash to it.
+ */
+void read_tree_blocks(struct btrfs_root *root, struct tree_block_ptr *ptrs,
+		      int nr, u32 blocksize)
+{
+	struct btrfs_fs_info *info = root->fs_info;
+	struct tree_block_io *io = NULL;
+	struct tree_block_run *runs = NULL;
+	struct async_io_req *reqs = NULL;
+	struct iovec *iov = NULL;
+	u8 locked[TREE_BLOCK_READ_LOCKS] = { 0 };
+	int nr_io = 0;
+	int nr_runs = 0;
+	int rank = 0;
+	int start;
+	int i;
+
+	if (info->on_restoring || info->metadump)
+		return;
+	/* don't read ahead more than the cache can hold onto */
+	if ((u64)nr * blocksize > info->extent_cache.max_cache_size / 2)
+		nr = info->extent_cache.max_cache_size / 2 / blocksize;
+	if (nr <= 0)
+		return;
+
+	io = calloc(nr, sizeof(*io));
+	runs = calloc(nr, sizeof(*runs));
+	reqs = calloc(nr, sizeof(*reqs));
+	iov = calloc(nr, sizeof(*iov));
+	if (!io || !runs || !reqs || !iov)
+		goto out;
+
+	for (i = 0; i < nr; i++) {
+		struct btrfs_multi_bio *multi = NULL;
+		struct extent_buffer *eb;
+		u64 length = blocksize;
+		int slot;
+		int ret;
+
+		eb = btrfs_find_create_tree_block(root, ptrs[i].bytenr,
+						  blocksize);
+		if (!eb)
+			continue;
+		/*
+		 * Leave cached and in-use buffers alone, as well as those
+		 * some other thread is reading right now.
+		 */
+		slot = tree_block_read_lock_slot(eb->start, eb->len);
+		if (extent_buffer_uptodate(eb) ||
+		    __atomic_load_n(&eb->refs, __ATOMIC_RELAXED) > 1 ||
+		    (!locked[slot] &&
+		     pthread_mutex_trylock(&tree_block_read_locks[slot]))) {
+			free_extent_buffer(eb);
+			continue;
+		}
+		locked[slot] = 1;
+		ret = btrfs_map_block(&info->mapping_tree, READ,
+				      ptrs[i].bytenr, &length, &multi, 0, NULL);
+		if (ret || length < blocksize ||
+		    multi->stripes[0].dev->fd <= 0) {
+			kfree(multi);
+			free_extent_buffer(eb);
+			continue;
+		}
+		io[nr_io].eb = eb;
+		io[nr_io].device = multi->stripes[0].dev;
+		io[nr_io].physical = multi->stripes[0].physical;
+		io[nr_io].gen = ptrs[i].gen;
+		nr_io++;
+		kfree(multi);
+	}
+
+	qsort(io, nr_io, sizeof(*io), cmp_tree_block_io);
+	for (i = 0; i < nr_io; i++) {
+		iov[i].iov_base = io[i].eb->data;
+		iov[i].iov_len = io[i].eb->len;
+	}
+
+	start = 0;
+	for (i = 1; i <= nr_io; i++) {
+		struct tree_block_io *prev = &io[i - 1];
+
+		if (i < nr_io && io[i].device == prev->device &&
+		    io[i].physical == prev->physical + prev->eb->len &&
+		    i - start < IOV_MAX &&
+		    (u64)(i - start + 1) * blocksize <=
+		    READ_TREE_BLOCKS_MAX_BYTES)
+			continue;
+		if (nr_runs && runs[nr_runs - 1].io->device != io[start].device)
+			rank = 0;
+		runs[nr_runs].io = io + start;
+		runs[nr_runs].nr = i - start;
+		runs[nr_runs].rank = rank++;
+		nr_runs++;
+		start = i;
+	}
+	qsort(runs, nr_runs, sizeof(*runs), cmp_tree_block_run);
+
+	for (i = 0; i < nr_runs; i++) {
+		reqs[i].fd = runs[i].io->device->fd;
+		reqs[i].iov = iov + (runs[i].io - io);
+		reqs[i].iovcnt = runs[i].nr;
+		reqs[i].offset = runs[i].io->physical;
+		reqs[i].ret = -EIO;
+		__atomic_add_fetch(&runs[i].io->device->total_ios, 1,
+				   __ATOMIC_RELAXED);
+	}
+	if (info->async_io) {
+		/* on failure leave the blocks to read_tree_block() */
+		if (async_io_submit_wait(info->async_io, reqs, nr_runs))
+			nr_runs = 0;
+	} else {
+		for (i = 0; i < nr_runs; i++)
+			reqs[i].ret = preadv(reqs[i].fd, reqs[i].iov,
+					     reqs[i].iovcnt, reqs[i].offset);
+	}
+	for (i = 0; i < nr_runs; i++)
+		verify_tree_block_run(root, &runs[i], &reqs[i]);
+
+	for (i = 0; i < nr_io; i++)
+		free_extent_buffer(io[i].eb);
+	for (i = 0; i < TREE_BLOCK_READ_LOCKS; i++) {
+		if (locked[i])
+			pthread_mutex_unlock(&tree_block_read_locks[i]);
+	}
+out:
+	free(io);
+	free(runs);
+	free(reqs);
+	free(iov);
+}
+
+/*
+ * Keep up to @depth tree block reads in flight per device in
+ * read_tree_blocks(), a depth of 1 or less reads them one at a time.
+ */
+int btrfs_set_io_depth(struct btrfs_fs_info *fs_info, unsigned int depth)
+{
+	struct btrfs_device *device;
+	unsigned int nr_devices = 0;
+
+	async_io_exit(fs_info->async_io);
+	fs_info->async_io = NULL;
+	if (depth <= 1)
+		return 0;
+
+	list_for_each_entry(device, &fs_info->fs_devices->devices, dev_list)
+		nr_devices++;
+	fs_info->async_io = async_io_init(depth * max(nr_devices, 1U));
+	if (!fs_info->async_io)
+		return -ENOMEM;
+	return 0;
+}
+
 static int verify_parent_transid(struct extent_io_tree *io_tree,
 				 struct extent_buffer *eb, u64 parent_transid,
 				 int ignore)
@@ -228,7 +518,8 @@ static int verify_parent_transid(struct extent_io_tree *io_tree,
 	       (unsigned long long)parent_transid,
 	       (unsigned long long)btrfs_header_generation(eb));
 	if (ignore) {
-		eb->flags |= EXTENT_BAD_TRANSID;
+		__atomic_or_fetch(&eb->flags, EXTENT_BAD_TRANSID,
+				  __ATOMIC_RELAXED);
 		printk("Ignoring transid failure\n");
 		return 0;
 	}
@@ -241,15 +532,123 @@ out:
 }
 
 
+/*
+ * Read @len bytes at @logical from a RAID5/6 full stripe, rebuilding them
+ * from parity.  Stripes on missing devices or that fail to read count as
+ * lost.  Mirror 2 rebuilds the data from P and mirror 3 from Q even when the
+ * data stripe itself could be read, so a stale or corrupted copy can be
+ * worked around.  Returns the number of bytes copied into @buf, which stops
+ * at the end of the data stripe, or -EIO.
+ */
+static int read_raid56(struct btrfs_fs_info *info, char *buf, u64 logical,
+		       u64 len, int mirror, struct btrfs_multi_bio *multi,
+		       u64 stripe_len, u64 *raid_map)
+{
+	int num_stripes = multi->num_stripes;
+	u64 profile = BTRFS_BLOCK_GROUP_RAID5;
+	int max_failed = 1;
+	int failed[2] = { -1, -1 };
+	int nr_failed = 0;
+	int target = -1;
+	int p_stripe;
+	void **pointers;
+	char *stripes;
+	ssize_t ret;
+	int i;
+
+	if (raid_map[num_stripes - 1] == BTRFS_RAID6_Q_STRIPE) {
+		profile = BTRFS_BLOCK_GROUP_RAID6;
+		max_failed = 2;
+	}
+	p_stripe = num_stripes - max_failed;
+
+	pointers = kmalloc(sizeof(*pointers) * num_stripes, GFP_NOFS);
+	stripes = malloc(num_stripes * stripe_len);
+	if (!pointers || !stripes) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	for (i = 0; i < num_stripes; i++) {
+		struct btrfs_device *device = multi->stripes[i].dev;
+
+		pointers[i] = stripes + i * stripe_len;
+		if (raid_map[i] < BTRFS_RAID5_P_STRIPE &&
+		    logical >= raid_map[i] &&
+		    logical < raid_map[i] + stripe_len)
+			target = i;
+
+		ret = -1;
+		if (device->fd > 0) {
+			ret = pread64(device->fd, pointers[i], stripe_len,
+				      multi->stripes[i].physical);
+			__atomic_add_fetch(&device->total_ios, 1,
+					   __ATOMIC_RELAXED);
+		}
+		if (ret != stripe_len) {
+			if (nr_failed == max_failed) {
+				ret = -EIO;
+				goto out;
+			}
+			failed[nr_failed++] = i;
+		}
+	}
+	if (target < 0) {
+		ret = -EIO;
+		goto out;
+	}
+
+	if (failed[0] != target && failed[1] != target) {
+		if (nr_failed == max_failed) {
+			ret = -EIO;
+			goto out;
+		}
+		failed[nr_failed++] = target;
+	}
+	/* leave P out as well so the data has to come from Q */
+	if (mirror == 3 && profile == BTRFS_BLOCK_GROUP_RAID6 &&
+	    failed[0] != p_stripe && failed[1] != p_stripe) {
+		if (nr_failed == max_failed) {
+			ret = -EIO;
+			goto out;
+		}
+		failed[nr_failed++] = p_stripe;
+	}
+
+	ret = raid56_recov(num_stripes, stripe_len, profile, failed[0],
+			   failed[1], pointers);
+	if (ret) {
+		ret = -EIO;
+		goto out;
+	}
+
+	len = min(len, raid_map[target] + stripe_len - logical);
+	memcpy(buf, pointers[target] + (logical - raid_map[target]), len);
+	ret = len;
+out:
+	kfree(pointers);
+	free(stripes);
+	return ret;
+}
+
 int read_whole_eb(struct btrfs_fs_info *info, struct extent_buffer *eb, int mirror)
 {
 	unsigned long offset = 0;
 	struct btrfs_multi_bio *multi = NULL;
 	struct btrfs_device *device;
+	u64 *raid_map = NULL;
 	int ret = 0;
 	u64 read_len;
 	unsigned long bytes_left = eb->len;
 
+	if (info->metadump) {
+		eb->fd = -1;
+		eb->dev_bytenr = eb->start;
+		ret = metadump_read(info->metadump, eb->start, eb->data,
+				    eb->len);
+		return ret ? -EIO : 0;
+	}
+
 	while (bytes_left) {
 		read_len = bytes_left;
 		device = NULL;
@@ -258,12 +657,27 @@ int read_whole_eb(struct btrfs_fs_info *info, struct extent_buffer *eb, int mirr
 		    eb->start != BTRFS_SUPER_INFO_OFFSET) {
 			ret = btrfs_map_block(&info->mapping_tree, READ,
 					      eb->start + offset, &read_len, &multi,
-					      mirror, NULL);
+					      mirror, &raid_map);
 			if (ret) {
 				printk("Couldn't map the block %Lu\n", eb->start + offset);
 				kfree(multi);
 				return -EIO;
 			}
+			if (raid_map) {
+				ret = read_raid56(info, eb->data + offset,
+						  eb->start + offset, bytes_left,
+						  mirror, multi, read_len,
+						  raid_map);
+				kfree(multi);
+				kfree(raid_map);
+				multi = NULL;
+				raid_map = NULL;
+				if (ret < 0)
+					return -EIO;
+				offset += ret;
+				bytes_left -= ret;
+				continue;
+			}
 			device = multi->stripes[0].dev;
 
 			if (device->fd == 0) {
@@ -272,7 +686,8 @@ int read_whole_eb(struct btrfs_fs_info *info, struct extent_buffer *eb, int mirr
 			}
 
 			eb->fd = device->fd;
-			device->total_ios++;
+			__atomic_add_fetch(&device->total_ios, 1,
+					   __ATOMIC_RELAXED);
 			eb->dev_bytenr = multi->stripes[0].physical;
 			kfree(multi);
 			multi = NULL;
@@ -285,7 +700,8 @@ int read_whole_eb(struct btrfs_fs_info *info, struct extent_buffer *eb, int mirr
 
 			eb->fd = device->fd;
 			eb->dev_bytenr = eb->start;
-			device->total_ios++;
+			__atomic_add_fetch(&device->total_ios, 1,
+					   __ATOMIC_RELAXED);
 		}
 
 		if (read_len > bytes_left)
@@ -310,13 +726,22 @@ struct extent_buffer *read_tree_block(struct btrfs_root *root, u64 bytenr,
 	int good_mirror = 0;
 	int num_copies;
 	int ignore = 0;
+	pthread_mutex_t *lock;
 
 	eb = btrfs_find_create_tree_block(root, bytenr, blocksize);
 	if (!eb)
 		return ERR_PTR(-ENOMEM);
 
 	if (btrfs_buffer_uptodate(eb, parent_transid))
-		return eb;
+		goto hit;
+
+	lock = tree_block_read_lock(eb->start, eb->len);
+	pthread_mutex_lock(lock);
+	if (btrfs_buffer_uptodate(eb, parent_transid)) {
+		pthread_mutex_unlock(lock);
+		goto hit;
+	}
+	__atomic_add_fetch(&eb->tree->cache_misses, 1, __ATOMIC_RELAXED);
 
 	while (1) {
 		ret = read_whole_eb(root->fs_info, eb, mirror_num);
@@ -324,13 +749,17 @@ struct extent_buffer *read_tree_block(struct btrfs_root *root, u64 bytenr,
 		    check_tree_block(root, eb) == 0 &&
 		    verify_parent_transid(eb->tree, eb, parent_transid, ignore)
 		    == 0) {
-			if (eb->flags & EXTENT_BAD_TRANSID &&
-			    list_empty(&eb->recow)) {
-				list_add_tail(&eb->recow,
-					      &root->fs_info->recow_ebs);
-				eb->refs++;
+			if (eb->flags & EXTENT_BAD_TRANSID) {
+				pthread_mutex_lock(&eb->tree->lock);
+				if (list_empty(&eb->recow)) {
+					list_add_tail(&eb->recow,
+						&root->fs_info->recow_ebs);
+					extent_buffer_get(eb);
+				}
+				pthread_mutex_unlock(&eb->tree->lock);
 			}
 			btrfs_set_buffer_uptodate(eb);
+			pthread_mutex_unlock(lock);
 			return eb;
 		}
 		if (ignore) {
@@ -362,8 +791,13 @@ struct extent_buffer *read_tree_block(struct btrfs_root *root, u64 bytenr,
 			continue;
 		}
 	}
-	free_extent_buffer(eb);
+	pthread_mutex_unlock(lock);
+	free_extent_buffer_nocache(eb);
 	return ERR_PTR(ret);
+
+hit:
+	__atomic_add_fetch(&eb->tree->cache_hits, 1, __ATOMIC_RELAXED);
+	return eb;
 }
 
 int read_extent_data(struct btrfs_root *root, char *data,
@@ -376,6 +810,19 @@ int read_extent_data(struct btrfs_root *root, char *data,
 	int ret = 0;
 	u64 max_len = *len;
 
+	/*
+	 * The images only have the data of the space caches, the rest reads
+	 * as zeroes as once restored.
+	 */
+	if (info->metadump) {
+		ret = metadump_read(info->metadump, logical, data, *len);
+		if (ret == -ENOENT) {
+			memset(data, 0, *len);
+			ret = 0;
+		}
+		return ret;
+	}
+
 	ret = btrfs_map_block(&info->mapping_tree, READ, logical, len,
 			      &multi, mirror, NULL);
 	if (ret) {
@@ -811,6 +1258,8 @@ struct btrfs_root *btrfs_read_fs_root(struct btrfs_fs_info *fs_info,
 
 void btrfs_free_fs_info(struct btrfs_fs_info *fs_info)
 {
+	async_io_exit(fs_info->async_io);
+	metadump_close(fs_info->metadump);
 	free(fs_info->tree_root);
 	free(fs_info->extent_root);
 	free(fs_info->chunk_root);
@@ -1184,6 +1633,44 @@ int btrfs_setup_chunk_tree_and_device_map(struct btrfs_fs_info *fs_info)
 	return 0;
 }
 
+/*
+ * Set up @fs_info to read its blocks from the indexed image @fp instead of
+ * devices, the image can only be read.
+ */
+static int open_metadump(struct btrfs_fs_info *fs_info, int fp,
+			 const char *path, u64 sb_bytenr,
+			 enum btrfs_open_ctree_flags flags)
+{
+	struct btrfs_super_block *sb = fs_info->super_copy;
+	int ret;
+
+	if (flags & OPEN_CTREE_WRITES) {
+		fprintf(stderr, "ERROR: %s is an image, it can only be read\n",
+			path);
+		return -EROFS;
+	}
+	if (sb_bytenr != BTRFS_SUPER_INFO_OFFSET) {
+		fprintf(stderr,
+			"ERROR: an image only has the primary super block\n");
+		return -EINVAL;
+	}
+
+	fs_info->metadump = metadump_open(fp);
+	if (!fs_info->metadump) {
+		fprintf(stderr, "ERROR: cannot open the image %s\n", path);
+		return -EIO;
+	}
+	ret = metadump_read(fs_info->metadump, BTRFS_SUPER_INFO_OFFSET, sb,
+			    sizeof(*sb));
+	if (ret || btrfs_super_bytenr(sb) != BTRFS_SUPER_INFO_OFFSET ||
+	    btrfs_super_magic(sb) != BTRFS_MAGIC) {
+		fprintf(stderr, "ERROR: no valid super block in the image %s\n",
+			path);
+		return -EIO;
+	}
+	return btrfs_open_image_devices(path, sb, &fs_info->fs_devices);
+}
+
 static struct btrfs_fs_info *__open_ctree_fd(int fp, const char *path,
 					     u64 sb_bytenr,
 					     u64 root_tree_bytenr,
@@ -1215,34 +1702,51 @@ static struct btrfs_fs_info *__open_ctree_fd(int fp, const char *path,
 	if (flags & OPEN_CTREE_IGNORE_FSID_MISMATCH)
 		fs_info->ignore_fsid_mismatch = 1;
 
-	ret = btrfs_scan_fs_devices(fp, path, &fs_devices, sb_bytenr,
-				    (flags & OPEN_CTREE_RECOVER_SUPER),
-				    (flags & OPEN_CTREE_NO_DEVICES));
-	if (ret)
-		goto out;
-
-	fs_info->fs_devices = fs_devices;
-	if (flags & OPEN_CTREE_WRITES)
-		oflags = O_RDWR;
-	else
-		oflags = O_RDONLY;
+	disk_super = fs_info->super_copy;
+	ret = metadump_probe(fp);
+	if (ret > 0) {
+		ret = open_metadump(fs_info, fp, path, sb_bytenr, flags);
+		fs_devices = fs_info->fs_devices;
+		if (ret && fs_devices)
+			goto out_devices;
+		if (ret)
+			goto out;
+	} else {
+		if (ret < 0) {
+			fprintf(stderr,
+	"ERROR: %s is an image without index, restore it with btrfs-image -r\n",
+				path);
+			goto out;
+		}
+		ret = btrfs_scan_fs_devices(fp, path, &fs_devices, sb_bytenr,
+					    (flags & OPEN_CTREE_RECOVER_SUPER),
+					    (flags & OPEN_CTREE_NO_DEVICES));
+		if (ret)
+			goto out;
 
-	if (flags & OPEN_CTREE_EXCLUSIVE)
-		oflags |= O_EXCL;
+		fs_info->fs_devices = fs_devices;
+		if (flags & OPEN_CTREE_WRITES)
+			oflags = O_RDWR;
+		else
+			oflags = O_RDONLY;
 
-	ret = btrfs_open_devices(fs_devices, oflags);
-	if (ret)
-		goto out;
+		if (flags & OPEN_CTREE_EXCLUSIVE)
+			oflags |= O_EXCL;
 
-	disk_super = fs_info->super_copy;
-	if (!(flags & OPEN_CTREE_RECOVER_SUPER))
-		ret = btrfs_read_dev_super(fs_devices->latest_bdev,
-					   disk_super, sb_bytenr, 1);
-	else
-		ret = btrfs_read_dev_super(fp, disk_super, sb_bytenr, 0);
-	if (ret) {
-		printk("No valid btrfs found\n");
-		goto out_devices;
+		ret = btrfs_open_devices(fs_devices, oflags);
+		if (ret)
+			goto out;
+
+		if (!(flags & OPEN_CTREE_RECOVER_SUPER))
+			ret = btrfs_read_dev_super(fs_devices->latest_bdev,
+						   disk_super, sb_bytenr, 1);
+		else
+			ret = btrfs_read_dev_super(fp, disk_super, sb_bytenr,
+						   0);
+		if (ret) {
+			printk("No valid btrfs found\n");
+			goto out_devices;
+		}
 	}
 
 	if (btrfs_super_flags(disk_super) & BTRFS_SUPER_FLAG_CHANGING_FSID &&
@@ -66,6 +66,12 @@ static inline u64 btrfs_sb_offset(int mirror)
 
 struct btrfs_device;
 
+/* location and expected generation of a tree block, see read_tree_blocks() */
+struct tree_block_ptr {
+	u64 bytenr;
+	u64 gen;
+};
+
 int read_whole_eb(struct btrfs_fs_info *info, struct extent_buffer *eb, int mirror);
 struct extent_buffer *read_tree_block(struct btrfs_root *root, u64 bytenr,
 				      u32 blocksize, u64 parent_transid);
@@ -73,6 +79,9 @@ int read_extent_data(struct btrfs_root *root, char *data, u64 logical,
 		     u64 *len, int mirror);
 void readahead_tree_block(struct btrfs_root *root, u64 bytenr, u32 blocksize,
 			  u64 parent_transid);
+void read_tree_blocks(struct btrfs_root *root, struct tree_block_ptr *ptrs,
+		      int nr, u32 blocksize);
+int btrfs_set_io_depth(struct btrfs_fs_info *fs_info, unsigned int depth);
 struct extent_buffer *btrfs_find_create_tree_block(struct btrfs_root *root,
 						   u64 bytenr, u32 blocksize);
 
@@ -123,6 +132,7 @@ int wait_on_tree_block_writeback(struct btrfs_root *root,
 				 struct extent_buffer *buf);
 u32 btrfs_csum_data(struct btrfs_root *root, char *data, u32 seed, size_t len);
 void btrfs_csum_final(u32 crc, char *result);
+void btrfs_csum_data_many(char *data, size_t len, u32 sectorsize, u32 *csums);
 
 int btrfs_commit_transaction(struct btrfs_trans_handle *trans,
 			     struct btrfs_root *root);
@@ -138,6 +148,31 @@ int write_and_map_eb(struct btrfs_trans_handle *trans, struct btrfs_root *root,
 		     struct extent_buffer *eb);
 
 /* raid6.c */
+struct raid6_calls {
+	void (*gen_syndrome)(int disks, size_t bytes, void **ptrs);
+	int (*valid)(void);
+	const char *name;
+};
+
+struct raid6_recov_calls {
+	void (*data2)(size_t bytes, u8 *p, u8 *q, u8 *dp, u8 *dq,
+		      u8 pbmul_coef, u8 qmul_coef);
+	void (*datap)(size_t bytes, u8 *p, u8 *q, u8 *dq, u8 qmul_coef);
+	int (*valid)(void);
+	const char *name;
+};
+
+extern const struct raid6_calls raid6_gen_algos[];
+extern const struct raid6_recov_calls raid6_recov_algos[];
+
+void raid6_set_algos(const struct raid6_calls *gen,
+		     const struct raid6_recov_calls *recov);
 void raid6_gen_syndrome(int disks, size_t bytes, void **ptrs);
+void raid5_gen_result(int disks, size_t bytes, int dest, void **ptrs);
+int raid6_recov_data2(int disks, size_t bytes, int faila, int failb,
+		      void **ptrs);
+int raid6_recov_datap(int disks, size_t bytes, int faila, void **ptrs);
+int raid56_recov(int disks, size_t bytes, u64 profile, int faila, int failb,
+		 void **ptrs);
 
 #endif
@@ -0,0 +1,499 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+/*
+ * Sort fixed size records within a memory limit.  Records are collected in a
+ * buffer of half the limit, every full buffer is sorted and appended as a run
+ * to an unlinked temporary file in $TMPDIR, and the runs are merged back with
+ * as many merge passes as needed, each pass merging groups of runs into a
+ * second file.  The other half of the limit buffers the reads and writes of
+ * the merge.  Nothing is written if all the records fit in the buffer.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "kerncompat.h"
+#include "ext-sort.h"
+
+#define EXT_SORT_MAX_FANIN	64
+#define EXT_SORT_MIN_IOBUF	(16 * 1024)
+
+struct ext_sort_run {
+	off_t offset;
+	u64 nr;
+};
+
+/* buffered reader of one run */
+struct ext_sort_reader {
+	char *buf;
+	size_t nr_buf;
+	size_t next;
+	off_t offset;
+	u64 left;
+};
+
+struct ext_sort_merge {
+	int fd;
+	struct ext_sort_reader *readers;
+	size_t iobuf_recs;
+	char *recs;
+	int *heap;
+	int nr;
+	int nr_heap;
+};
+
+struct ext_sort {
+	size_t rec_size;
+	size_t mem_limit;
+	int (*cmp)(const void *, const void *);
+
+	/* records not written out yet */
+	char *buf;
+	size_t nr_buf;
+	size_t max_buf;
+	size_t next_buf;
+
+	/* the runs live in fds[cur], merge passes write to the other file */
+	int fds[2];
+	int cur;
+	off_t end;
+	struct ext_sort_run *runs;
+	int nr_runs;
+	int max_runs;
+
+	struct ext_sort_merge *merge;
+
+	u64 nr_recs;
+	u64 total_runs;
+	u64 nr_passes;
+};
+
+struct ext_sort *ext_sort_init(size_t rec_size, size_t mem_limit,
+			       int (*cmp)(const void *, const void *))
+{
+	struct ext_sort *es;
+
+	es = calloc(1, sizeof(*es));
+	if (!es)
+		return NULL;
+	es->rec_size = rec_size;
+	es->mem_limit = mem_limit;
+	es->cmp = cmp;
+	es->fds[0] = -1;
+	es->fds[1] = -1;
+	es->max_buf = max_t(size_t, mem_limit / 2 / rec_size, 16);
+	es->buf = malloc(es->max_buf * rec_size);
+	if (!es->buf) {
+		free(es);
+		return NULL;
+	}
+	return es;
+}
+
+static void free_merge(struct ext_sort_merge *m)
+{
+	int i;
+
+	if (!m)
+		return;
+	for (i = 0; i < m->nr; i++)
+		free(m->readers[i].buf);
+	free(m->readers);
+	free(m->recs);
+	free(m->heap);
+	free(m);
+}
+
+void ext_sort_free(struct ext_sort *es)
+{
+	if (!es)
+		return;
+	free_merge(es->merge);
+	if (es->fds[0] >= 0)
+		close(es->fds[0]);
+	if (es->fds[1] >= 0)
+		close(es->fds[1]);
+	free(es->runs);
+	free(es->buf);
+	free(es);
+}
+
+static int create_spill_file(void)
+{
+	const char *dir = getenv("TMPDIR");
+	char *path;
+	int fd;
+
+	if (!dir || !*dir)
+		dir = "/tmp";
+	path = malloc(strlen(dir) + sizeof("/btrfs-sort-XXXXXX"));
+	if (!path)
+		return -ENOMEM;
+	sprintf(path, "%s/btrfs-sort-XXXXXX", dir);
+	fd = mkstemp(path);
+	if (fd < 0)
+		fd = -errno;
+	else
+		unlink(path);
+	free(path);
+	return fd;
+}
+
+static int write_full(int fd, const char *buf, size_t len, off_t offset)
+{
+	ssize_t ret;
+
+	while (len) {
+		ret = pwrite(fd, buf, len, offset);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0)
+			return -errno;
+		if (ret == 0)
+			return -ENOSPC;
+		buf += ret;
+		len -= ret;
+		offset += ret;
+	}
+	return 0;
+}
+
+static int read_full(int fd, char *buf, size_t len, off_t offset)
+{
+	ssize_t ret;
+
+	while (len) {
+		ret = pread(fd, buf, len, offset);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0)
+			return -errno;
+		if (ret == 0)
+			return -EIO;
+		buf += ret;
+		len -= ret;
+		offset += ret;
+	}
+	return 0;
+}
+
+static int add_run(struct ext_sort_run **runs, int *nr_runs, int *max_runs,
+		   off_t offset, u64 nr)
+{
+	struct ext_sort_run *tmp;
+
+	if (*nr_runs == *max_runs) {
+		int max = *max_runs ? *max_runs * 2 : 16;
+
+		tmp = realloc(*runs, max * sizeof(*tmp));
+		if (!tmp)
+			return -ENOMEM;
+		*runs = tmp;
+		*max_runs = max;
+	}
+	(*runs)[*nr_runs].offset = offset;
+	(*runs)[*nr_runs].nr = nr;
+	(*nr_runs)++;
+	return 0;
+}
+
+static int write_buf_run(struct ext_sort *es)
+{
+	size_t len = es->nr_buf * es->rec_size;
+	int ret;
+
+	if (es->fds[es->cur] < 0) {
+		ret = create_spill_file();
+		if (ret < 0)
+			return ret;
+		es->fds[es->cur] = ret;
+	}
+	qsort(es->buf, es->nr_buf, es->rec_size, es->cmp);
+	ret = write_full(es->fds[es->cur], es->buf, len, es->end);
+	if (ret)
+		return ret;
+	ret = add_run(&es->runs, &es->nr_runs, &es->max_runs, es->end,
+		      es->nr_buf);
+	if (ret)
+		return ret;
+	es->end += len;
+	es->total_runs++;
+	es->nr_buf = 0;
+	return 0;
+}
+
+int ext_sort_add(struct ext_sort *es, const void *rec)
+{
+	int ret;
+
+	if (es->nr_buf == es->max_buf) {
+		ret = write_buf_run(es);
+		if (ret)
+			return ret;
+	}
+	memcpy(es->buf + es->nr_buf * es->rec_size, rec, es->rec_size);
+	es->nr_buf++;
+	es->nr_recs++;
+	return 0;
+}
+
+static void *merge_rec(struct ext_sort *es, struct ext_sort_merge *m, int i)
+{
+	return m->recs + i * es->rec_size;
+}
+
+static int merge_less(struct ext_sort *es, struct ext_sort_merge *m,
+		      int a, int b)
+{
+	int ret = es->cmp(merge_rec(es, m, a), merge_rec(es, m, b));
+
+	return ret < 0 || (ret == 0 && a < b);
+}
+
+static void merge_sift_down(struct ext_sort *es, struct ext_sort_merge *m,
+			    int pos)
+{
+	int child;
+	int tmp;
+
+	while ((child = pos * 2 + 1) < m->nr_heap) {
+		if (child + 1 < m->nr_heap &&
+		    merge_less(es, m, m->heap[child + 1], m->heap[child]))
+			child++;
+		if (!merge_less(es, m, m->heap[child], m->heap[pos]))
+			break;
+		tmp = m->heap[pos];
+		m->heap[pos] = m->heap[child];
+		m->heap[child] = tmp;
+		pos = child;
+	}
+}
+
+/* read the next record of run @i, 1 if there is one */
+static int merge_read(struct ext_sort *es, struct ext_sort_merge *m, int i)
+{
+	struct ext_sort_reader *rd = &m->readers[i];
+	size_t nr;
+	int ret;
+
+	if (rd->next == rd->nr_buf) {
+		if (!rd->left)
+			return 0;
+		nr = min_t(u64, rd->left, m->iobuf_recs);
+		ret = read_full(m->fd, rd->buf, nr * es->rec_size, rd->offset);
+		if (ret)
+			return ret;
+		rd->offset += nr * es->rec_size;
+		rd->left -= nr;
+		rd->nr_buf = nr;
+		rd->next = 0;
+	}
+	memcpy(merge_rec(es, m, i), rd->buf + rd->next * es->rec_size,
+	       es->rec_size);
+	rd->next++;
+	return 1;
+}
+
+/* records per read buffer when merging @nr runs */
+static size_t merge_iobuf_recs(struct ext_sort *es, int nr)
+{
+	size_t size = es->mem_limit / 2 / (nr + 1);
+
+	return max_t(size_t, size, EXT_SORT_MIN_IOBUF) / es->rec_size;
+}
+
+static struct ext_sort_merge *open_merge(struct ext_sort *es,
+					 struct ext_sort_run *runs, int nr,
+					 int *err)
+{
+	struct ext_sort_merge *m;
+	int ret = -ENOMEM;
+	int i;
+
+	m = calloc(1, sizeof(*m));
+	if (!m)
+		goto fail;
+	m->fd = es->fds[es->cur];
+	m->iobuf_recs = merge_iobuf_recs(es, nr);
+	m->readers = calloc(nr, sizeof(*m->readers));
+	m->recs = malloc(nr * es->rec_size);
+	m->heap = malloc(nr * sizeof(*m->heap));
+	if (!m->readers || !m->recs || !m->heap)
+		goto fail;
+	m->nr = nr;
+	for (i = 0; i < nr; i++) {
+		m->readers[i].buf = malloc(m->iobuf_recs * es->rec_size);
+		if (!m->readers[i].buf)
+			goto fail;
+		m->readers[i].offset = runs[i].offset;
+		m->readers[i].left = runs[i].nr;
+		ret = merge_read(es, m, i);
+		if (ret < 0)
+			goto fail;
+		if (ret)
+			m->heap[m->nr_heap++] = i;
+	}
+	for (i = m->nr_heap / 2 - 1; i >= 0; i--)
+		merge_sift_down(es, m, i);
+	return m;
+fail:
+	free_merge(m);
+	*err = ret;
+	return NULL;
+}
+
+static int merge_next(struct ext_sort *es, struct ext_sort_merge *m, void *rec)
+{
+	int top;
+	int ret;
+
+	if (!m->nr_heap)
+		return 0;
+	top = m->heap[0];
+	memcpy(rec, merge_rec(es, m, top), es->rec_size);
+	ret = merge_read(es, m, top);
+	if (ret < 0)
+		return ret;
+	if (!ret)
+		m->heap[0] = m->heap[--m->nr_heap];
+	merge_sift_down(es, m, 0);
+	return 1;
+}
+
+/* merge groups of runs into the other spill file, which then holds the runs */
+static int merge_pass(struct ext_sort *es)
+{
+	struct ext_sort_run *runs = NULL;
+	struct ext_sort_merge *m;
+	size_t out_recs = merge_iobuf_recs(es, EXT_SORT_MAX_FANIN);
+	size_t nr_out;
+	int nr_runs = 0;
+	int max_runs = 0;
+	int out_fd = es->fds[!es->cur];
+	off_t end = 0;
+	off_t start;
+	int ret = 0;
+	int i;
+
+	if (out_fd < 0) {
+		out_fd = create_spill_file();
+		if (out_fd < 0)
+			return out_fd;
+		es->fds[!es->cur] = out_fd;
+	}
+	/* the record buffer is empty by now and buffers the writes */
+	out_recs = min(out_recs, es->max_buf);
+	for (i = 0; i < es->nr_runs; i += EXT_SORT_MAX_FANIN) {
+		m = open_merge(es, es->runs + i,
+			       min(es->nr_runs - i, EXT_SORT_MAX_FANIN), &ret);
+		if (!m)
+			goto out;
+		start = end;
+		nr_out = 0;
+		while ((ret = merge_next(es, m, es->buf +
+					 nr_out * es->rec_size)) > 0) {
+			if (++nr_out < out_recs)
+				continue;
+			ret = write_full(out_fd, es->buf,
+					 nr_out * es->rec_size, end);
+			if (ret)
+				break;
+			end += nr_out * es->rec_size;
+			nr_out = 0;
+		}
+		if (!ret && nr_out) {
+			ret = write_full(out_fd, es->buf,
+					 nr_out * es->rec_size, end);
+			end += nr_out * es->rec_size;
+		}
+		free_merge(m);
+		if (!ret)
+			ret = add_run(&runs, &nr_runs, &max_runs, start,
+				      (end - start) / es->rec_size);
+		if (ret)
+			goto out;
+	}
+
+	/* the old runs are all merged, give their space back */
+	if (ftruncate(es->fds[es->cur], 0) < 0) {
+		ret = -errno;
+		goto out;
+	}
+	free(es->runs);
+	es->runs = runs;
+	es->nr_runs = nr_runs;
+	es->max_runs = max_runs;
+	es->cur = !es->cur;
+	es->end = end;
+	es->nr_passes++;
+	return 0;
+out:
+	free(runs);
+	return ret;
+}
+
+/* done adding records, from now on ext_sort_next() returns them sorted */
+int ext_sort_done(struct ext_sort *es)
+{
+	int ret;
+
+	if (!es->nr_runs) {
+		qsort(es->buf, es->nr_buf, es->rec_size, es->cmp);
+		es->next_buf = 0;
+		return 0;
+	}
+	if (es->nr_buf) {
+		ret = write_buf_run(es);
+		if (ret)
+			return ret;
+	}
+	while (es->nr_runs > EXT_SORT_MAX_FANIN) {
+		ret = merge_pass(es);
+		if (ret)
+			return ret;
+	}
+	free(es->buf);
+	es->buf = NULL;
+	es->merge = open_merge(es, es->runs, es->nr_runs, &ret);
+	if (!es->merge)
+		return ret;
+	es->nr_passes++;
+	return 0;
+}
+
+/* copy the next record to @rec, returns 1 if there was one, 0 at the end */
+int ext_sort_next(struct ext_sort *es, void *rec)
+{
+	if (es->merge)
+		return merge_next(es, es->merge, rec);
+	if (!es->buf || es->next_buf == es->nr_buf)
+		return 0;
+	memcpy(rec, es->buf + es->next_buf * es->rec_size, es->rec_size);
+	es->next_buf++;
+	return 1;
+}
+
+void ext_sort_stats(struct ext_sort *es, u64 *nr_recs, u64 *nr_runs,
+		    u64 *nr_passes)
+{
+	*nr_recs = es->nr_recs;
+	*nr_runs = es->total_runs;
+	*nr_passes = es->nr_passes;
+}
@@ -0,0 +1,33 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+#ifndef __BTRFS_EXT_SORT_H__
+#define __BTRFS_EXT_SORT_H__
+
+#include "kerncompat.h"
+
+struct ext_sort;
+
+struct ext_sort *ext_sort_init(size_t rec_size, size_t mem_limit,
+			       int (*cmp)(const void *, const void *));
+void ext_sort_free(struct ext_sort *es);
+int ext_sort_add(struct ext_sort *es, const void *rec);
+int ext_sort_done(struct ext_sort *es);
+int ext_sort_next(struct ext_sort *es, void *rec);
+void ext_sort_stats(struct ext_sort *es, u64 *nr_recs, u64 *nr_runs,
+		    u64 *nr_passes);
+
+#endif
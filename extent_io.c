@@ -27,15 +27,43 @@
 #include "list.h"
 #include "ctree.h"
 #include "volumes.h"
+#include "metadump.h"
+
+/*
+ * Clean extent buffers without references are kept in the cache until
+ * it grows beyond this size, a quarter of the physical memory by default.
+ */
+static u64 default_cache_max(void)
+{
+	long pages = sysconf(_SC_PHYS_PAGES);
+	long page_size = sysconf(_SC_PAGESIZE);
+
+	if (pages <= 0 || page_size <= 0)
+		return 256 * 1024 * 1024;
+	return (u64)pages * page_size / 4;
+}
 
 void extent_io_tree_init(struct extent_io_tree *tree)
 {
 	cache_tree_init(&tree->state);
 	cache_tree_init(&tree->cache);
 	INIT_LIST_HEAD(&tree->lru);
+	pthread_mutex_init(&tree->lock, NULL);
 	tree->cache_size = 0;
+	tree->max_cache_size = default_cache_max();
+	tree->cache_hits = 0;
+	tree->cache_misses = 0;
+	tree->cache_evictions = 0;
 }
 
+void extent_io_tree_init_cache_max(struct extent_io_tree *tree,
+				   u64 max_cache_size)
+{
+	tree->max_cache_size = max_cache_size;
+}
+
+static void free_extent_buffer_final(struct extent_buffer *eb);
+
 static struct extent_state *alloc_extent_state(void)
 {
 	struct extent_state *state;
@@ -72,13 +100,18 @@ void extent_io_tree_cleanup(struct extent_io_tree *tree)
 
 	while(!list_empty(&tree->lru)) {
 		eb = list_entry(tree->lru.next, struct extent_buffer, lru);
-		fprintf(stderr, "extent buffer leak: "
-			"start %llu len %u\n",
-			(unsigned long long)eb->start, eb->len);
-		free_extent_buffer(eb);
+		if (eb->refs) {
+			fprintf(stderr, "extent buffer leak: "
+				"start %llu len %u\n",
+				(unsigned long long)eb->start, eb->len);
+			free_extent_buffer_nocache(eb);
+		} else {
+			free_extent_buffer_final(eb);
+		}
 	}
 
 	cache_tree_free_extents(&tree->state, free_extent_state_func);
+	pthread_mutex_destroy(&tree->lock);
 }
 
 static inline void update_extent_state(struct extent_state *state)
@@ -573,25 +606,92 @@ struct extent_buffer *btrfs_clone_extent_buffer(struct extent_buffer *src)
 	return new;
 }
 
-void free_extent_buffer(struct extent_buffer *eb)
+static void free_extent_buffer_final(struct extent_buffer *eb)
 {
-	if (!eb || IS_ERR(eb))
-		return;
+	struct extent_io_tree *tree = eb->tree;
+
+	BUG_ON(eb->refs);
+	list_del_init(&eb->lru);
+	if (!(eb->flags & EXTENT_BUFFER_DUMMY)) {
+		BUG_ON(tree->cache_size < eb->len);
+		remove_cache_extent(&tree->cache, &eb->cache_node);
+		tree->cache_size -= eb->len;
+	}
+	free(eb);
+}
+
+/* called with the tree lock held for buffers that are in a tree */
+static void __free_extent_buffer(struct extent_buffer *eb, int nocache)
+{
+	int refs;
 
-	eb->refs--;
-	BUG_ON(eb->refs < 0);
-	if (eb->refs == 0) {
-		struct extent_io_tree *tree = eb->tree;
+	refs = __atomic_sub_fetch(&eb->refs, 1, __ATOMIC_ACQ_REL);
+	BUG_ON(refs < 0);
+	if (refs == 0) {
 		BUG_ON(eb->flags & EXTENT_DIRTY);
-		list_del_init(&eb->lru);
 		list_del_init(&eb->recow);
-		if (!(eb->flags & EXTENT_BUFFER_DUMMY)) {
-			BUG_ON(tree->cache_size < eb->len);
-			remove_cache_extent(&tree->cache, &eb->cache_node);
-			tree->cache_size -= eb->len;
+		if (nocache || (eb->flags & EXTENT_BUFFER_DUMMY))
+			free_extent_buffer_final(eb);
+	}
+}
+
+static void free_extent_buffer_internal(struct extent_buffer *eb, int nocache)
+{
+	struct extent_io_tree *tree;
+
+	if (!eb || IS_ERR(eb))
+		return;
+
+	tree = eb->tree;
+	if (tree)
+		pthread_mutex_lock(&tree->lock);
+	__free_extent_buffer(eb, nocache);
+	if (tree)
+		pthread_mutex_unlock(&tree->lock);
+}
+
+/*
+ * Drop a reference, the buffer stays in the cache once the last reference
+ * is gone and may be evicted later if the cache grows too large.
+ */
+void free_extent_buffer(struct extent_buffer *eb)
+{
+	free_extent_buffer_internal(eb, 0);
+}
+
+/*
+ * Drop a reference and free the buffer right away when it was the last one,
+ * used for buffers whose contents should not be reused (eg. failed reads).
+ */
+void free_extent_buffer_nocache(struct extent_buffer *eb)
+{
+	free_extent_buffer_internal(eb, 1);
+}
+
+/*
+ * Evict clean unreferenced buffers from the head of the lru list until the
+ * cache fits into max_cache_size again.  Buffers still in use are moved to
+ * the tail so the next call does not rescan them, and the number of busy
+ * buffers looked at per call is bounded.
+ */
+static void free_some_buffers(struct extent_io_tree *tree)
+{
+	struct extent_buffer *eb;
+	LIST_HEAD(busy);
+	u32 nrscan = 0;
+
+	while (tree->cache_size > tree->max_cache_size &&
+	       !list_empty(&tree->lru) && nrscan < 64) {
+		eb = list_first_entry(&tree->lru, struct extent_buffer, lru);
+		if (__atomic_load_n(&eb->refs, __ATOMIC_ACQUIRE) == 0) {
+			free_extent_buffer_final(eb);
+			tree->cache_evictions++;
+		} else {
+			list_move_tail(&eb->lru, &busy);
+			nrscan++;
 		}
-		free(eb);
 	}
+	list_splice_tail(&busy, &tree->lru);
 }
 
 struct extent_buffer *find_extent_buffer(struct extent_io_tree *tree,
@@ -600,13 +700,15 @@ struct extent_buffer *find_extent_buffer(struct extent_io_tree *tree,
 	struct extent_buffer *eb = NULL;
 	struct cache_extent *cache;
 
+	pthread_mutex_lock(&tree->lock);
 	cache = lookup_cache_extent(&tree->cache, bytenr, blocksize);
 	if (cache && cache->start == bytenr &&
 	    cache->size == blocksize) {
 		eb = container_of(cache, struct extent_buffer, cache_node);
 		list_move_tail(&eb->lru, &tree->lru);
-		eb->refs++;
+		extent_buffer_get(eb);
 	}
+	pthread_mutex_unlock(&tree->lock);
 	return eb;
 }
 
@@ -616,12 +718,14 @@ struct extent_buffer *find_first_extent_buffer(struct extent_io_tree *tree,
 	struct extent_buffer *eb = NULL;
 	struct cache_extent *cache;
 
+	pthread_mutex_lock(&tree->lock);
 	cache = search_cache_extent(&tree->cache, start);
 	if (cache) {
 		eb = container_of(cache, struct extent_buffer, cache_node);
 		list_move_tail(&eb->lru, &tree->lru);
-		eb->refs++;
+		extent_buffer_get(eb);
 	}
+	pthread_mutex_unlock(&tree->lock);
 	return eb;
 }
 
@@ -631,31 +735,39 @@ struct extent_buffer *alloc_extent_buffer(struct extent_io_tree *tree,
 	struct extent_buffer *eb;
 	struct cache_extent *cache;
 
+	pthread_mutex_lock(&tree->lock);
 	cache = lookup_cache_extent(&tree->cache, bytenr, blocksize);
 	if (cache && cache->start == bytenr &&
 	    cache->size == blocksize) {
 		eb = container_of(cache, struct extent_buffer, cache_node);
 		list_move_tail(&eb->lru, &tree->lru);
-		eb->refs++;
+		extent_buffer_get(eb);
 	} else {
 		int ret;
 
 		if (cache) {
 			eb = container_of(cache, struct extent_buffer,
 					  cache_node);
-			free_extent_buffer(eb);
+			if (__atomic_load_n(&eb->refs, __ATOMIC_ACQUIRE))
+				__free_extent_buffer(eb, 1);
+			else
+				free_extent_buffer_final(eb);
 		}
 		eb = __alloc_extent_buffer(tree, bytenr, blocksize);
 		if (!eb)
-			return NULL;
+			goto out;
 		ret = insert_cache_extent(&tree->cache, &eb->cache_node);
 		if (ret) {
 			free(eb);
-			return NULL;
+			eb = NULL;
+			goto out;
 		}
 		list_add_tail(&eb->lru, &tree->lru);
 		tree->cache_size += blocksize;
+		free_some_buffers(tree);
 	}
+out:
+	pthread_mutex_unlock(&tree->lock);
 	return eb;
 }
 
@@ -702,6 +814,16 @@ int read_data_from_disk(struct btrfs_fs_info *info, void *buf, u64 offset,
 	u64 total_read = 0;
 	int ret;
 
+	/* an image has the space cache extents, the rest reads as zeroes */
+	if (info->metadump) {
+		ret = metadump_read(info->metadump, offset, buf, bytes);
+		if (ret == -ENOENT) {
+			memset(buf, 0, bytes);
+			ret = 0;
+		}
+		return ret;
+	}
+
 	while (bytes_left) {
 		read_len = bytes_left;
 		ret = btrfs_map_block(&info->mapping_tree, READ, offset,
@@ -19,6 +19,8 @@
 #ifndef __BTRFS_EXTENT_IO_H__
 #define __BTRFS_EXTENT_IO_H__
 
+#include <pthread.h>
+
 #if BTRFS_FLAT_INCLUDES
 #include "kerncompat.h"
 #include "extent-cache.h"
@@ -51,11 +53,21 @@
 
 struct btrfs_fs_info;
 
+/*
+ * @lock protects the buffer cache (cache, lru and the counters), so tree
+ * blocks can be looked up and read from several threads.  The extent state
+ * is not protected and is only modified single threaded.
+ */
 struct extent_io_tree {
 	struct cache_tree state;
 	struct cache_tree cache;
 	struct list_head lru;
+	pthread_mutex_t lock;
 	u64 cache_size;
+	u64 max_cache_size;
+	u64 cache_hits;
+	u64 cache_misses;
+	u64 cache_evictions;
 };
 
 struct extent_state {
@@ -81,12 +93,15 @@ struct extent_buffer {
 	char data[];
 };
 
+/* the caller must already hold a reference */
 static inline void extent_buffer_get(struct extent_buffer *eb)
 {
-	eb->refs++;
+	__atomic_add_fetch(&eb->refs, 1, __ATOMIC_RELAXED);
 }
 
 void extent_io_tree_init(struct extent_io_tree *tree);
+void extent_io_tree_init_cache_max(struct extent_io_tree *tree,
+				   u64 max_cache_size);
 void extent_io_tree_cleanup(struct extent_io_tree *tree);
 int set_extent_bits(struct extent_io_tree *tree, u64 start,
 		    u64 end, int bits, gfp_t mask);
@@ -100,16 +115,20 @@ int set_extent_dirty(struct extent_io_tree *tree, u64 start,
 		     u64 end, gfp_t mask);
 int clear_extent_dirty(struct extent_io_tree *tree, u64 start,
 		       u64 end, gfp_t mask);
+/*
+ * The uptodate bit publishes the buffer contents to other threads looking
+ * the buffer up in the cache, hence the release/acquire ordering.
+ */
 static inline int set_extent_buffer_uptodate(struct extent_buffer *eb)
 {
-	eb->flags |= EXTENT_UPTODATE;
+	__atomic_or_fetch(&eb->flags, EXTENT_UPTODATE, __ATOMIC_RELEASE);
 	return 0;
 }
 
 static inline int clear_extent_buffer_uptodate(struct extent_io_tree *tree,
 				struct extent_buffer *eb)
 {
-	eb->flags &= ~EXTENT_UPTODATE;
+	__atomic_and_fetch(&eb->flags, ~EXTENT_UPTODATE, __ATOMIC_RELAXED);
 	return 0;
 }
 
@@ -117,7 +136,7 @@ static inline int extent_buffer_uptodate(struct extent_buffer *eb)
 {
 	if (!eb || IS_ERR(eb))
 		return 0;
-	if (eb->flags & EXTENT_UPTODATE)
+	if (__atomic_load_n(&eb->flags, __ATOMIC_ACQUIRE) & EXTENT_UPTODATE)
 		return 1;
 	return 0;
 }
@@ -132,6 +151,7 @@ struct extent_buffer *alloc_extent_buffer(struct extent_io_tree *tree,
 					  u64 bytenr, u32 blocksize);
 struct extent_buffer *btrfs_clone_extent_buffer(struct extent_buffer *src);
 void free_extent_buffer(struct extent_buffer *eb);
+void free_extent_buffer_nocache(struct extent_buffer *eb);
 int read_extent_from_disk(struct extent_buffer *eb,
 			  unsigned long offset, unsigned long len);
 int write_extent_to_disk(struct extent_buffer *eb);
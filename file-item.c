@@ -167,9 +167,10 @@ fail:
 	return ERR_PTR(ret);
 }
 
-int btrfs_csum_file_block(struct btrfs_trans_handle *trans,
-			  struct btrfs_root *root, u64 alloc_end,
-			  u64 bytenr, char *data, size_t len)
+/* store the final checksum @csum_result of the sector at @bytenr */
+static int insert_sector_csum(struct btrfs_trans_handle *trans,
+			      struct btrfs_root *root, u64 alloc_end,
+			      u64 bytenr, u32 csum_result)
 {
 	int ret = 0;
 	struct btrfs_key file_key;
@@ -180,7 +181,6 @@ int btrfs_csum_file_block(struct btrfs_trans_handle *trans,
 	struct btrfs_csum_item *item;
 	struct extent_buffer *leaf = NULL;
 	u64 csum_offset;
-	u32 csum_result = ~(u32)0;
 	u32 nritems;
 	u32 ins_size;
 	u16 csum_size =
@@ -295,8 +295,6 @@ csum:
 	item = (struct btrfs_csum_item *)((unsigned char *)item +
 					  csum_offset * csum_size);
 found:
-	csum_result = btrfs_csum_data(root, data, csum_result, len);
-	btrfs_csum_final(csum_result, (char *)&csum_result);
 	if (csum_result == 0) {
 		printk("csum result is 0 for block %llu\n",
 		       (unsigned long long)bytenr);
@@ -310,6 +308,46 @@ fail:
 	return ret;
 }
 
+int btrfs_csum_file_block(struct btrfs_trans_handle *trans,
+			  struct btrfs_root *root, u64 alloc_end,
+			  u64 bytenr, char *data, size_t len)
+{
+	u32 csum_result = ~(u32)0;
+
+	csum_result = btrfs_csum_data(root, data, csum_result, len);
+	btrfs_csum_final(csum_result, (char *)&csum_result);
+	return insert_sector_csum(trans, root, alloc_end, bytenr, csum_result);
+}
+
+/*
+ * Like btrfs_csum_file_block() for every sector of the @len bytes at @data,
+ * the checksums are all computed in one batch before being inserted.
+ */
+int btrfs_csum_file_blocks(struct btrfs_trans_handle *trans,
+			   struct btrfs_root *root, u64 alloc_end,
+			   u64 bytenr, char *data, size_t len)
+{
+	int nr = len / root->sectorsize;
+	u32 *csums;
+	int ret = 0;
+	int i;
+
+	csums = malloc(nr * sizeof(*csums));
+	if (!csums)
+		return -ENOMEM;
+
+	btrfs_csum_data_many(data, len, root->sectorsize, csums);
+	for (i = 0; i < nr; i++) {
+		ret = insert_sector_csum(trans, root, alloc_end,
+					 bytenr + (u64)i * root->sectorsize,
+					 csums[i]);
+		if (ret)
+			break;
+	}
+	free(csums);
+	return ret;
+}
+
 /*
  * helper function for csum removal, this expects the
  * key to describe the csum pointed to by the path, and it expects
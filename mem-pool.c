@@ -0,0 +1,281 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+/*
+ * Allocators for the many small records of btrfs check.  A mem_pool hands
+ * out objects of one size from 64KiB chunks, so there is neither a malloc
+ * header nor any rounding per object, and a name_pool keeps a single copy
+ * of every distinct name packed into 16KiB chunks.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "kerncompat.h"
+#include "crc32c.h"
+#include "mem-pool.h"
+
+#define MEM_POOL_CHUNK_SIZE	(64 * 1024)
+#define NAME_POOL_CHUNK_SIZE	(16 * 1024)
+
+/* chunks are chained through their first bytes */
+#define CHUNK_HEADER_SIZE	16
+
+struct name_pool_entry {
+	struct name_pool_entry *next;
+	u32 hash;
+	u16 len;
+	char name[0];
+};
+
+void mem_pool_init(struct mem_pool *pool, const char *name, size_t obj_size,
+		   int locked)
+{
+	memset(pool, 0, sizeof(*pool));
+	pool->name = name;
+	obj_size = max(obj_size, sizeof(void *));
+	pool->obj_size = round_up(obj_size, sizeof(u64));
+	pool->chunk_size = MEM_POOL_CHUNK_SIZE;
+	pool->locked = locked;
+	if (locked)
+		pthread_mutex_init(&pool->lock, NULL);
+}
+
+static int mem_pool_grow(struct mem_pool *pool)
+{
+	char *chunk;
+
+	chunk = malloc(pool->chunk_size);
+	if (!chunk)
+		return -ENOMEM;
+	*(void **)chunk = pool->chunks;
+	pool->chunks = chunk;
+	pool->next_obj = chunk + CHUNK_HEADER_SIZE;
+	pool->chunk_end = chunk + pool->chunk_size;
+	pool->nr_chunks++;
+	if (pool->nr_chunks > pool->peak_chunks)
+		pool->peak_chunks = pool->nr_chunks;
+	return 0;
+}
+
+void *mem_pool_alloc(struct mem_pool *pool)
+{
+	void *obj = NULL;
+
+	if (pool->locked)
+		pthread_mutex_lock(&pool->lock);
+	if (pool->free_objs) {
+		obj = pool->free_objs;
+		pool->free_objs = *(void **)obj;
+	} else if (pool->next_obj + pool->obj_size <= pool->chunk_end ||
+		   mem_pool_grow(pool) == 0) {
+		obj = pool->next_obj;
+		pool->next_obj += pool->obj_size;
+	}
+	if (obj) {
+		pool->nr_objs++;
+		if (pool->nr_objs > pool->peak_objs)
+			pool->peak_objs = pool->nr_objs;
+	}
+	if (pool->locked)
+		pthread_mutex_unlock(&pool->lock);
+	return obj;
+}
+
+void *mem_pool_zalloc(struct mem_pool *pool)
+{
+	void *obj;
+
+	obj = mem_pool_alloc(pool);
+	if (obj)
+		memset(obj, 0, pool->obj_size);
+	return obj;
+}
+
+void mem_pool_free(struct mem_pool *pool, void *obj)
+{
+	if (!obj)
+		return;
+	if (pool->locked)
+		pthread_mutex_lock(&pool->lock);
+	*(void **)obj = pool->free_objs;
+	pool->free_objs = obj;
+	pool->nr_objs--;
+	if (pool->locked)
+		pthread_mutex_unlock(&pool->lock);
+}
+
+/*
+ * Give all the chunks back once every object has been freed, returns
+ * -EBUSY and keeps them if any object is still in use.  The peak counters
+ * are kept for the statistics.
+ */
+int mem_pool_release(struct mem_pool *pool)
+{
+	void *chunk;
+
+	if (pool->nr_objs)
+		return -EBUSY;
+	while (pool->chunks) {
+		chunk = pool->chunks;
+		pool->chunks = *(void **)chunk;
+		free(chunk);
+	}
+	pool->free_objs = NULL;
+	pool->next_obj = NULL;
+	pool->chunk_end = NULL;
+	pool->nr_chunks = 0;
+	return 0;
+}
+
+void name_pool_init(struct name_pool *pool)
+{
+	int i;
+
+	memset(pool, 0, sizeof(*pool));
+	for (i = 0; i < NAME_POOL_SHARDS; i++)
+		pthread_mutex_init(&pool->shards[i].lock, NULL);
+}
+
+void name_pool_free(struct name_pool *pool)
+{
+	struct name_pool_shard *shard;
+	void *chunk;
+	int i;
+
+	for (i = 0; i < NAME_POOL_SHARDS; i++) {
+		shard = &pool->shards[i];
+		while (shard->chunks) {
+			chunk = shard->chunks;
+			shard->chunks = *(void **)chunk;
+			free(chunk);
+		}
+		free(shard->hash);
+		pthread_mutex_destroy(&shard->lock);
+	}
+	memset(pool, 0, sizeof(*pool));
+}
+
+static int name_pool_rehash(struct name_pool_shard *shard)
+{
+	struct name_pool_entry **hash;
+	struct name_pool_entry *entry;
+	u32 size = shard->hash_size ? shard->hash_size * 2 : 256;
+	u32 i;
+
+	hash = calloc(size, sizeof(*hash));
+	if (!hash)
+		return -ENOMEM;
+	for (i = 0; i < shard->hash_size; i++) {
+		while ((entry = shard->hash[i])) {
+			shard->hash[i] = entry->next;
+			entry->next = hash[entry->hash & (size - 1)];
+			hash[entry->hash & (size - 1)] = entry;
+		}
+	}
+	free(shard->hash);
+	shard->hash = hash;
+	shard->hash_size = size;
+	return 0;
+}
+
+static struct name_pool_entry *name_pool_new_entry(
+		struct name_pool_shard *shard, int len)
+{
+	struct name_pool_entry *entry;
+	size_t size = round_up(sizeof(*entry) + len + 1, sizeof(void *));
+	char *chunk;
+
+	if (size > shard->chunk_left) {
+		chunk = malloc(NAME_POOL_CHUNK_SIZE);
+		if (!chunk)
+			return NULL;
+		*(void **)chunk = shard->chunks;
+		shard->chunks = chunk;
+		shard->nr_chunks++;
+		shard->chunk = chunk + CHUNK_HEADER_SIZE;
+		shard->chunk_left = NAME_POOL_CHUNK_SIZE - CHUNK_HEADER_SIZE;
+	}
+	entry = (struct name_pool_entry *)shard->chunk;
+	shard->chunk += size;
+	shard->chunk_left -= size;
+	return entry;
+}
+
+/*
+ * Return the pooled copy of @name, which is nul terminated, or NULL if out of
+ * memory.  The shard is picked by the hash so threads looking up different
+ * names rarely wait for each other.
+ */
+const char *name_pool_intern(struct name_pool *pool, const char *name,
+			     int len)
+{
+	struct name_pool_shard *shard;
+	struct name_pool_entry *entry;
+	u32 hash;
+
+	hash = crc32c(~(u32)0, name, len);
+	shard = &pool->shards[hash % NAME_POOL_SHARDS];
+	hash /= NAME_POOL_SHARDS;
+
+	pthread_mutex_lock(&shard->lock);
+	shard->nr_lookups++;
+	if (shard->hash_size) {
+		entry = shard->hash[hash & (shard->hash_size - 1)];
+		for (; entry; entry = entry->next) {
+			if (entry->hash == hash && entry->len == len &&
+			    !memcmp(entry->name, name, len))
+				goto out;
+		}
+	}
+	if (shard->nr_names >= shard->hash_size &&
+	    name_pool_rehash(shard) && !shard->hash_size) {
+		entry = NULL;
+		goto out;
+	}
+	entry = name_pool_new_entry(shard, len);
+	if (!entry)
+		goto out;
+	entry->hash = hash;
+	entry->len = len;
+	memcpy(entry->name, name, len);
+	entry->name[len] = '\0';
+	entry->next = shard->hash[hash & (shard->hash_size - 1)];
+	shard->hash[hash & (shard->hash_size - 1)] = entry;
+	shard->nr_names++;
+out:
+	pthread_mutex_unlock(&shard->lock);
+	return entry ? entry->name : NULL;
+}
+
+void name_pool_stats(struct name_pool *pool, u64 *nr_names, u64 *nr_lookups,
+		     u64 *bytes)
+{
+	struct name_pool_shard *shard;
+	int i;
+
+	*nr_names = 0;
+	*nr_lookups = 0;
+	*bytes = 0;
+	for (i = 0; i < NAME_POOL_SHARDS; i++) {
+		shard = &pool->shards[i];
+		*nr_names += shard->nr_names;
+		*nr_lookups += shard->nr_lookups;
+		*bytes += shard->nr_chunks * NAME_POOL_CHUNK_SIZE +
+			  (u64)shard->hash_size * sizeof(*shard->hash);
+	}
+}
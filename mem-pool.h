@@ -0,0 +1,80 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+#ifndef __BTRFS_MEM_POOL_H__
+#define __BTRFS_MEM_POOL_H__
+
+#include <pthread.h>
+#include "kerncompat.h"
+
+/*
+ * Fixed size objects carved out of large chunks, freed objects are kept on
+ * a free list for reuse and the chunks are only given back all at once.
+ */
+struct mem_pool {
+	const char *name;
+	size_t obj_size;
+	size_t chunk_size;
+	void *chunks;
+	void *free_objs;
+	char *next_obj;
+	char *chunk_end;
+	int locked;
+	pthread_mutex_t lock;
+
+	u64 nr_objs;
+	u64 peak_objs;
+	u64 nr_chunks;
+	u64 peak_chunks;
+};
+
+#define NAME_POOL_SHARDS	8
+
+struct name_pool_shard {
+	pthread_mutex_t lock;
+	struct name_pool_entry **hash;
+	u32 hash_size;
+	u32 nr_names;
+	char *chunk;
+	size_t chunk_left;
+	void *chunks;
+	u64 nr_chunks;
+	u64 nr_lookups;
+};
+
+/*
+ * Interned strings, every distinct name is stored once and lives until the
+ * pool is freed.
+ */
+struct name_pool {
+	struct name_pool_shard shards[NAME_POOL_SHARDS];
+};
+
+void mem_pool_init(struct mem_pool *pool, const char *name, size_t obj_size,
+		   int locked);
+void *mem_pool_alloc(struct mem_pool *pool);
+void *mem_pool_zalloc(struct mem_pool *pool);
+void mem_pool_free(struct mem_pool *pool, void *obj);
+int mem_pool_release(struct mem_pool *pool);
+
+void name_pool_init(struct name_pool *pool);
+void name_pool_free(struct name_pool *pool);
+const char *name_pool_intern(struct name_pool *pool, const char *name,
+			     int len);
+void name_pool_stats(struct name_pool *pool, u64 *nr_names, u64 *nr_lookups,
+		     u64 *bytes);
+
+#endif
@@ -0,0 +1,655 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+/*
+ * The compression methods of the images of btrfs-image, and the reading of
+ * the blocks of an indexed image so the tools can open it like a device.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <zlib.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#include <lz4hc.h>
+#endif
+#include "kerncompat.h"
+#include "metadump.h"
+
+static size_t zlib_bound(size_t size)
+{
+	return compressBound(size);
+}
+
+static int zlib_errno(int ret)
+{
+	return ret == Z_MEM_ERROR ? -ENOMEM : -EIO;
+}
+
+static int zlib_compress(void **ctx, int level, u8 *dst, size_t *dst_size,
+			 const u8 *src, size_t size)
+{
+	unsigned long len = *dst_size;
+	int ret;
+
+	ret = compress2(dst, &len, src, size, level);
+	if (ret != Z_OK)
+		return zlib_errno(ret);
+	*dst_size = len;
+	return 0;
+}
+
+static int zlib_decompress(u8 *dst, size_t *dst_size, const u8 *src,
+			   size_t size)
+{
+	unsigned long len = *dst_size;
+	int ret;
+
+	ret = uncompress(dst, &len, src, size);
+	if (ret != Z_OK)
+		return zlib_errno(ret);
+	*dst_size = len;
+	return 0;
+}
+
+#ifdef HAVE_ZSTD
+static size_t zstd_bound(size_t size)
+{
+	return ZSTD_compressBound(size);
+}
+
+static int zstd_compress(void **ctx, int level, u8 *dst, size_t *dst_size,
+			 const u8 *src, size_t size)
+{
+	size_t ret;
+
+	if (!*ctx) {
+		*ctx = ZSTD_createCCtx();
+		if (!*ctx)
+			return -ENOMEM;
+	}
+	ret = ZSTD_compressCCtx(*ctx, dst, *dst_size, src, size, level);
+	if (ZSTD_isError(ret))
+		return -EIO;
+	*dst_size = ret;
+	return 0;
+}
+
+static int zstd_decompress(u8 *dst, size_t *dst_size, const u8 *src,
+			   size_t size)
+{
+	size_t ret;
+
+	ret = ZSTD_decompress(dst, *dst_size, src, size);
+	if (ZSTD_isError(ret))
+		return -EIO;
+	*dst_size = ret;
+	return 0;
+}
+
+static void zstd_free_ctx(void *ctx)
+{
+	ZSTD_freeCCtx(ctx);
+}
+#endif
+
+#ifdef HAVE_LZ4
+static size_t lz4_bound(size_t size)
+{
+	return LZ4_compressBound(size);
+}
+
+/* level 1 is the fast compressor, the higher levels are lz4hc's */
+static int lz4_compress(void **ctx, int level, u8 *dst, size_t *dst_size,
+			const u8 *src, size_t size)
+{
+	int ret;
+
+	if (!*ctx) {
+		*ctx = malloc(level > 1 ? LZ4_sizeofStateHC() :
+				LZ4_sizeofState());
+		if (!*ctx)
+			return -ENOMEM;
+	}
+	if (level > 1)
+		ret = LZ4_compress_HC_extStateHC(*ctx, (const char *)src,
+						 (char *)dst, size, *dst_size,
+						 level);
+	else
+		ret = LZ4_compress_fast_extState(*ctx, (const char *)src,
+						 (char *)dst, size, *dst_size,
+						 1);
+	if (ret <= 0)
+		return -EIO;
+	*dst_size = ret;
+	return 0;
+}
+
+static int lz4_decompress(u8 *dst, size_t *dst_size, const u8 *src,
+			  size_t size)
+{
+	int ret;
+
+	ret = LZ4_decompress_safe((const char *)src, (char *)dst, size,
+				  *dst_size);
+	if (ret < 0)
+		return -EIO;
+	*dst_size = ret;
+	return 0;
+}
+#endif
+
+const struct compress_method compress_methods[] = {
+	{
+		.name = "zlib",
+		.type = COMPRESS_ZLIB,
+		.min_level = 1,
+		.max_level = 9,
+		.default_level = 6,
+		.bound = zlib_bound,
+		.compress = zlib_compress,
+		.decompress = zlib_decompress,
+	},
+#ifdef HAVE_ZSTD
+	{
+		.name = "zstd",
+		.type = COMPRESS_ZSTD,
+		.min_level = 1,
+		.max_level = 19,
+		.default_level = 3,
+		.bound = zstd_bound,
+		.compress = zstd_compress,
+		.decompress = zstd_decompress,
+		.free_ctx = zstd_free_ctx,
+	},
+#endif
+#ifdef HAVE_LZ4
+	{
+		.name = "lz4",
+		.type = COMPRESS_LZ4,
+		.min_level = 1,
+		.max_level = 12,
+		.default_level = 1,
+		.bound = lz4_bound,
+		.compress = lz4_compress,
+		.decompress = lz4_decompress,
+		.free_ctx = free,
+	},
+#endif
+};
+
+const int nr_compress_methods = ARRAY_SIZE(compress_methods);
+
+const struct compress_method *find_compress_method(u8 type)
+{
+	int i;
+
+	for (i = 0; i < nr_compress_methods; i++)
+		if (compress_methods[i].type == type)
+			return &compress_methods[i];
+	return NULL;
+}
+
+/* check the method of a cluster header, none is fine too */
+int check_compress_method(u8 type)
+{
+	if (type == COMPRESS_NONE || find_compress_method(type))
+		return 0;
+	fprintf(stderr, "Unsupported compression method %u in the image\n",
+		type);
+	return -EOPNOTSUPP;
+}
+
+/*
+ * Decompress @size bytes of @src into @dst, which holds up to *@dst_size
+ * bytes.  *@dst_size is set to the decompressed size.
+ */
+int decompress_buffer(int type, u8 *dst, size_t *dst_size, const u8 *src,
+		      size_t size)
+{
+	const struct compress_method *method = find_compress_method(type);
+	int ret;
+
+	if (!method)
+		return -EOPNOTSUPP;
+	ret = method->decompress(dst, dst_size, src, size);
+	if (ret)
+		fprintf(stderr, "Error decompressing %s: %d\n", method->name,
+			ret);
+	return ret;
+}
+
+/* the items of a block group, read from the index on first use */
+struct metadump_group {
+	u64 start;
+	u64 end;
+	u64 offset;
+	u32 size;
+	u32 nritems;
+	struct meta_index_item *items;
+};
+
+/* a decompressed item, the next blocks read are often in the same one */
+struct metadump_cached_item {
+	u64 bytenr;
+	u32 len;
+	u64 last_used;
+	u8 *data;
+};
+
+/* up to 32M of items, they are at most MAX_PENDING_SIZE */
+#define METADUMP_CACHED_ITEMS	128
+
+/*
+ * The index and the item cache are shared by all the readers, a single
+ * mutex covers them and the reads of the image.
+ */
+struct metadump_image {
+	int fd;
+	u8 compress;
+	u32 nrgroups;
+	struct metadump_group *groups;
+	pthread_mutex_t mutex;
+	u64 clock;
+	struct metadump_cached_item cache[METADUMP_CACHED_ITEMS];
+	u8 *buf;
+	size_t buf_size;
+};
+
+static int read_image(int fd, void *buf, size_t size, u64 offset)
+{
+	ssize_t ret;
+
+	ret = pread64(fd, buf, size, offset);
+	if (ret < 0)
+		return -errno;
+	return ret == size ? 0 : -EIO;
+}
+
+/* the footer is read into @footer, and what comes before it is @size */
+static int read_footer(int fd, struct meta_index_footer *footer, u64 *size)
+{
+	off_t end;
+
+	end = lseek(fd, 0, SEEK_END);
+	if (end < 0)
+		return -errno;
+	if (end < BLOCK_SIZE + sizeof(*footer))
+		return -EINVAL;
+	*size = end - sizeof(*footer);
+	return read_image(fd, footer, sizeof(*footer), *size);
+}
+
+/*
+ * Whether @fd is an image of btrfs-image: 1 for an indexed one, which
+ * metadump_open() can open, -EINVAL for one without an index and 0 for
+ * anything else.
+ */
+int metadump_probe(int fd)
+{
+	struct meta_cluster_header header;
+	struct meta_index_footer footer;
+	u64 size;
+
+	if (read_image(fd, &header, sizeof(header), 0) ||
+	    le64_to_cpu(header.magic) != HEADER_MAGIC)
+		return 0;
+	if (read_footer(fd, &footer, &size) ||
+	    le64_to_cpu(footer.magic) != INDEX_MAGIC)
+		return -EINVAL;
+	return 1;
+}
+
+/* the buffer for the compressed bytes read from the image */
+static u8 *image_buffer(struct metadump_image *image, size_t size)
+{
+	u8 *buf;
+
+	if (size <= image->buf_size)
+		return image->buf;
+	buf = realloc(image->buf, size);
+	if (!buf)
+		return NULL;
+	image->buf = buf;
+	image->buf_size = size;
+	return buf;
+}
+
+/* read the @size bytes at @offset into @dst of @len bytes decompressed */
+static int read_item(struct metadump_image *image, u8 *dst, size_t len,
+		     u64 offset, u32 size)
+{
+	size_t dst_size = len;
+	u8 *buf;
+	int ret;
+
+	if (image->compress == COMPRESS_NONE) {
+		if (size != len)
+			return -EIO;
+		return read_image(image->fd, dst, len, offset);
+	}
+	buf = image_buffer(image, size);
+	if (!buf)
+		return -ENOMEM;
+	ret = read_image(image->fd, buf, size, offset);
+	if (ret)
+		return ret;
+	ret = decompress_buffer(image->compress, dst, &dst_size, buf, size);
+	if (ret)
+		return ret;
+	return dst_size == len ? 0 : -EIO;
+}
+
+static int load_group(struct metadump_image *image,
+		      struct metadump_group *group)
+{
+	size_t len = group->nritems * sizeof(*group->items);
+	int ret;
+
+	group->items = malloc(len);
+	if (!group->items)
+		return -ENOMEM;
+	ret = read_item(image, (u8 *)group->items, len, group->offset,
+			group->size);
+	if (ret) {
+		fprintf(stderr, "Error reading the index of block group %llu\n",
+			(unsigned long long)group->start);
+		free(group->items);
+		group->items = NULL;
+	}
+	return ret;
+}
+
+/* the item of @group holding @bytenr */
+static struct meta_index_item *group_lookup(struct metadump_image *image,
+					    struct metadump_group *group,
+					    u64 bytenr, int *err)
+{
+	struct meta_index_item *item;
+	u32 lo = 0;
+	u32 hi = group->nritems;
+	u32 mid;
+
+	if (bytenr < group->start || bytenr >= group->end)
+		return NULL;
+	if (!group->items) {
+		*err = load_group(image, group);
+		if (*err)
+			return NULL;
+	}
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (le64_to_cpu(group->items[mid].bytenr) <= bytenr)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (!lo)
+		return NULL;
+	item = &group->items[lo - 1];
+	if (bytenr >= le64_to_cpu(item->bytenr) + le32_to_cpu(item->len))
+		return NULL;
+	return item;
+}
+
+/*
+ * The item holding @bytenr.  It is in the last group starting before it,
+ * or at the end of the group before that when an item crosses the start
+ * of a block group.
+ */
+static struct meta_index_item *image_lookup(struct metadump_image *image,
+					    u64 bytenr, int *err)
+{
+	struct meta_index_item *item;
+	u32 lo = 0;
+	u32 hi = image->nrgroups;
+	u32 mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (image->groups[mid].start <= bytenr)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (!lo)
+		return NULL;
+	item = group_lookup(image, &image->groups[lo - 1], bytenr, err);
+	if (!item && !*err && lo > 1)
+		item = group_lookup(image, &image->groups[lo - 2], bytenr, err);
+	return item;
+}
+
+/* the decompressed data of @item, from the cache or read in it */
+static u8 *cached_item(struct metadump_image *image,
+		       struct meta_index_item *item, int *err)
+{
+	struct metadump_cached_item *cached;
+	struct metadump_cached_item *victim = &image->cache[0];
+	u64 bytenr = le64_to_cpu(item->bytenr);
+	u32 len = le32_to_cpu(item->len);
+	u8 *data;
+	int i;
+
+	for (i = 0; i < METADUMP_CACHED_ITEMS; i++) {
+		cached = &image->cache[i];
+		if (cached->data && cached->bytenr == bytenr) {
+			cached->last_used = ++image->clock;
+			return cached->data;
+		}
+		if (cached->last_used < victim->last_used)
+			victim = cached;
+	}
+
+	data = realloc(victim->data, len);
+	if (!data) {
+		*err = -ENOMEM;
+		return NULL;
+	}
+	victim->data = data;
+	*err = read_item(image, data, len, le64_to_cpu(item->offset),
+			 le32_to_cpu(item->size));
+	if (*err) {
+		fprintf(stderr, "Error reading the item at %llu of the image\n",
+			(unsigned long long)bytenr);
+		free(victim->data);
+		memset(victim, 0, sizeof(*victim));
+		return NULL;
+	}
+	victim->bytenr = bytenr;
+	victim->len = len;
+	victim->last_used = ++image->clock;
+	return data;
+}
+
+/*
+ * Read the @len bytes at @bytenr from the image, -ENOENT if they are not
+ * all in it.
+ */
+int metadump_read(struct metadump_image *image, u64 bytenr, void *buf,
+		  u64 len)
+{
+	struct meta_index_item *item;
+	u64 item_bytenr;
+	u64 copy;
+	u8 *dst = buf;
+	u8 *data;
+	int ret = 0;
+
+	pthread_mutex_lock(&image->mutex);
+	while (len) {
+		item = image_lookup(image, bytenr, &ret);
+		if (!item) {
+			if (!ret)
+				ret = -ENOENT;
+			break;
+		}
+		data = cached_item(image, item, &ret);
+		if (!data)
+			break;
+		item_bytenr = le64_to_cpu(item->bytenr);
+		copy = min(len, item_bytenr + le32_to_cpu(item->len) - bytenr);
+		memcpy(dst, data + (bytenr - item_bytenr), copy);
+		dst += copy;
+		bytenr += copy;
+		len -= copy;
+	}
+	pthread_mutex_unlock(&image->mutex);
+	return ret;
+}
+
+static int read_index(struct metadump_image *image)
+{
+	struct meta_index_footer footer;
+	struct meta_index_header header;
+	struct meta_index_group *table;
+	struct metadump_group *groups;
+	struct metadump_group *group;
+	u64 offset;
+	u64 size;
+	u32 nrgroups;
+	u32 i;
+	int ret;
+
+	ret = read_footer(image->fd, &footer, &size);
+	if (ret)
+		return ret;
+	offset = le64_to_cpu(footer.header);
+	ret = read_image(image->fd, &header, sizeof(header), offset);
+	if (ret)
+		return ret;
+	if (le64_to_cpu(header.magic) != INDEX_MAGIC ||
+	    le64_to_cpu(header.bytenr) != offset) {
+		fprintf(stderr, "bad index header in metadump image\n");
+		return -EIO;
+	}
+	ret = check_compress_method(header.compress);
+	if (ret)
+		return ret;
+	image->compress = header.compress;
+
+	/* the table has to fit between the index header and the footer */
+	nrgroups = le32_to_cpu(header.nrgroups);
+	if (offset + BLOCK_SIZE > size ||
+	    (size - offset - BLOCK_SIZE) / sizeof(*table) < nrgroups) {
+		fprintf(stderr, "bad index header in metadump image\n");
+		return -EIO;
+	}
+	table = calloc(nrgroups, sizeof(*table));
+	groups = calloc(nrgroups, sizeof(*groups));
+	if (!table || !groups) {
+		free(table);
+		free(groups);
+		return -ENOMEM;
+	}
+	image->groups = groups;
+	image->nrgroups = nrgroups;
+
+	ret = read_image(image->fd, table, nrgroups * sizeof(*table),
+			 offset + BLOCK_SIZE);
+	if (ret) {
+		free(table);
+		return ret;
+	}
+	for (i = 0; i < image->nrgroups; i++) {
+		group = &image->groups[i];
+		group->start = le64_to_cpu(table[i].start);
+		group->end = group->start + le64_to_cpu(table[i].length);
+		group->offset = le64_to_cpu(table[i].offset);
+		group->size = le32_to_cpu(table[i].size);
+		group->nritems = le32_to_cpu(table[i].nritems);
+		if (i && group->start <= image->groups[i - 1].start) {
+			fprintf(stderr, "bad index in metadump image\n");
+			ret = -EIO;
+			break;
+		}
+	}
+	free(table);
+	return ret;
+}
+
+/* a delta has the blocks changed since its base only, it can't be opened */
+static int check_not_delta(struct metadump_image *image)
+{
+	struct meta_cluster *cluster;
+	int ret;
+
+	cluster = malloc(BLOCK_SIZE);
+	if (!cluster)
+		return -ENOMEM;
+	ret = read_image(image->fd, cluster, BLOCK_SIZE, 0);
+	if (!ret && le32_to_cpu(cluster->header.nritems) &&
+	    le64_to_cpu(cluster->items[0].bytenr) == DELTA_INFO_BYTENR) {
+		fprintf(stderr,
+			"The image is a delta, restore it over its base\n");
+		ret = -EINVAL;
+	}
+	free(cluster);
+	return ret;
+}
+
+/*
+ * Open the indexed image @fd for metadump_read(), the fd is duplicated.
+ * Only the table of the block groups is read, the index of a block group
+ * is read when one of its blocks is.
+ */
+struct metadump_image *metadump_open(int fd)
+{
+	struct metadump_image *image;
+	int ret;
+
+	image = calloc(1, sizeof(*image));
+	if (!image)
+		return NULL;
+	image->fd = dup(fd);
+	if (image->fd < 0) {
+		free(image);
+		return NULL;
+	}
+	pthread_mutex_init(&image->mutex, NULL);
+
+	ret = check_not_delta(image);
+	if (!ret)
+		ret = read_index(image);
+	if (ret) {
+		metadump_close(image);
+		return NULL;
+	}
+	return image;
+}
+
+void metadump_close(struct metadump_image *image)
+{
+	int i;
+
+	if (!image)
+		return;
+	for (i = 0; i < image->nrgroups; i++)
+		free(image->groups[i].items);
+	for (i = 0; i < METADUMP_CACHED_ITEMS; i++)
+		free(image->cache[i].data);
+	free(image->groups);
+	free(image->buf);
+	pthread_mutex_destroy(&image->mutex);
+	close(image->fd);
+	free(image);
+}
@@ -0,0 +1,148 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+#ifndef __BTRFS_METADUMP_H__
+#define __BTRFS_METADUMP_H__
+
+#include "kerncompat.h"
+#include "ctree.h"
+
+/*
+ * The format of the images of btrfs-image.  An image is a series of
+ * clusters, each a block of item headers followed by the items, compressed
+ * one by one and padded to BLOCK_SIZE.
+ */
+#define HEADER_MAGIC		0xbd5c25e27295668bULL
+#define MAX_PENDING_SIZE	(256 * 1024)
+#define BLOCK_SIZE		1024
+#define BLOCK_MASK		(BLOCK_SIZE - 1)
+
+#define COMPRESS_NONE		0
+#define COMPRESS_ZLIB		1
+#define COMPRESS_ZSTD		2
+#define COMPRESS_LZ4		3
+
+struct meta_cluster_item {
+	__le64 bytenr;
+	__le32 size;
+} __attribute__ ((__packed__));
+
+struct meta_cluster_header {
+	__le64 magic;
+	__le64 bytenr;
+	__le32 nritems;
+	u8 compress;
+} __attribute__ ((__packed__));
+
+/* cluster header + index items + buffers */
+struct meta_cluster {
+	struct meta_cluster_header header;
+	struct meta_cluster_item items[];
+} __attribute__ ((__packed__));
+
+#define ITEMS_PER_CLUSTER ((BLOCK_SIZE - sizeof(struct meta_cluster)) / \
+			   sizeof(struct meta_cluster_item))
+
+/*
+ * A delta image only has the tree blocks newer than base_generation, and
+ * all the blocks of the system chunks so it can be mapped on its own.  Its
+ * first item is this one, at an address no block can have, then comes the
+ * super block as in any image.  It is restored over its base.
+ */
+#define DELTA_INFO_BYTENR	((u64)-1)
+
+struct meta_delta_info {
+	__le64 base_generation;
+	u8 fsid[BTRFS_FSID_SIZE];
+} __attribute__ ((__packed__));
+
+/*
+ * An indexed image has the location of every item after its last cluster:
+ * a header block where the next cluster would start, the table of the
+ * groups, then the items of each group compressed like the clusters.  The
+ * items of a group are those starting in one block group, sorted by bytenr.
+ * The image ends with the footer pointing back to the header.
+ */
+#define INDEX_MAGIC		0x5d1f6a0c3e8b4b27ULL
+
+struct meta_index_item {
+	__le64 bytenr;
+	/* of the item in the image */
+	__le64 offset;
+	/* in the image, and once decompressed */
+	__le32 size;
+	__le32 len;
+} __attribute__ ((__packed__));
+
+struct meta_index_group {
+	__le64 start;
+	/* up to the end of the last item, can go past the block group */
+	__le64 length;
+	/* of the compressed items in the image */
+	__le64 offset;
+	__le32 size;
+	__le32 nritems;
+} __attribute__ ((__packed__));
+
+struct meta_index_header {
+	__le64 magic;
+	__le64 bytenr;
+	__le32 nrgroups;
+	u8 compress;
+} __attribute__ ((__packed__));
+
+struct meta_index_footer {
+	__le64 magic;
+	__le64 header;
+} __attribute__ ((__packed__));
+
+/*
+ * The compression methods of the image, the method is recorded in every
+ * cluster header.  The compress context is per dump thread, it is allocated
+ * on first use and lives as long as the thread.
+ */
+struct compress_method {
+	const char *name;
+	u8 type;
+	int min_level;
+	int max_level;
+	int default_level;
+	size_t (*bound)(size_t size);
+	int (*compress)(void **ctx, int level, u8 *dst, size_t *dst_size,
+			const u8 *src, size_t size);
+	int (*decompress)(u8 *dst, size_t *dst_size, const u8 *src,
+			  size_t size);
+	void (*free_ctx)(void *ctx);
+};
+
+extern const struct compress_method compress_methods[];
+extern const int nr_compress_methods;
+
+const struct compress_method *find_compress_method(u8 type);
+int check_compress_method(u8 type);
+int decompress_buffer(int type, u8 *dst, size_t *dst_size, const u8 *src,
+		      size_t size);
+
+/* read access to the blocks of an indexed image */
+struct metadump_image;
+
+int metadump_probe(int fd);
+struct metadump_image *metadump_open(int fd);
+void metadump_close(struct metadump_image *image);
+int metadump_read(struct metadump_image *image, u64 bytenr, void *buf,
+		  u64 len);
+
+#endif
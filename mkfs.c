@@ -634,6 +634,7 @@ static int add_file_items(struct btrfs_trans_handle *trans,
 	u64 cur_bytes;
 	u64 total_bytes;
 	struct extent_buffer *eb = NULL;
+	char *data = NULL;
 	int fd;
 
 	if (st->st_size == 0)
@@ -678,6 +679,12 @@ static int add_file_items(struct btrfs_trans_handle *trans,
 	}
 	memset(eb, 0, sizeof(*eb) + sectorsize);
 
+	data = malloc(min(total_bytes, 1024ULL * 1024));
+	if (!data) {
+		ret = -ENOMEM;
+		goto end;
+	}
+
 again:
 
 	/*
@@ -693,30 +700,29 @@ again:
 	first_block = key.objectid;
 	bytes_read = 0;
 
-	while (bytes_read < cur_bytes) {
-
-		memset(eb->data, 0, sectorsize);
+	memset(data, 0, cur_bytes);
+	ret_read = pread64(fd, data, cur_bytes, file_pos);
+	if (ret_read == -1) {
+		fprintf(stderr, "%s read failed\n", path_name);
+		ret = -1;
+		goto end;
+	}
 
-		ret_read = pread64(fd, eb->data, sectorsize, file_pos + bytes_read);
-		if (ret_read == -1) {
-			fprintf(stderr, "%s read failed\n", path_name);
-			goto end;
-		}
+	/*
+	 * we're doing the csum before we record the extent, but
+	 * that's ok
+	 */
+	ret = btrfs_csum_file_blocks(trans, root->fs_info->csum_root,
+				     first_block + cur_bytes, first_block,
+				     data, cur_bytes);
+	if (ret)
+		goto end;
 
+	while (bytes_read < cur_bytes) {
+		memcpy(eb->data, data + bytes_read, sectorsize);
 		eb->start = first_block + bytes_read;
 		eb->len = sectorsize;
 
-		/*
-		 * we're doing the csum before we record the extent, but
-		 * that's ok
-		 */
-		ret = btrfs_csum_file_block(trans, root->fs_info->csum_root,
-					    first_block + bytes_read + sectorsize,
-					    first_block + bytes_read,
-					    eb->data, sectorsize);
-		if (ret)
-			goto end;
-
 		ret = write_and_map_eb(trans, root, eb);
 		if (ret) {
 			fprintf(stderr, "output file write failed\n");
@@ -741,6 +747,7 @@ again:
 		goto again;
 
 end:
+	free(data);
 	free(eb);
 	close(fd);
 	return ret;
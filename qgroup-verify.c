@@ -20,6 +20,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <pthread.h>
 #include <uuid/uuid.h>
 #include "kerncompat.h"
 #include "radix-tree.h"
@@ -33,13 +34,12 @@
 #include "qgroup-verify.h"
 
 /*#define QGROUP_VERIFY_DEBUG*/
-static unsigned long tot_extents_scanned = 0;
-
-static void add_bytes(u64 root_objectid, u64 num_bytes, int exclusive);
 
 struct qgroup_count {
 	u64				qgroupid;
 	int				subvol_exists;
+	/* of the per-thread counters */
+	unsigned int			index;
 
 	struct btrfs_disk_key		key;
 	struct btrfs_qgroup_info_item	diskinfo;
@@ -54,25 +54,44 @@ struct counts_tree {
 	unsigned int		num_groups;
 } counts = { .root = RB_ROOT };
 
-struct rb_root by_bytenr = RB_ROOT;
-
 /*
- * List of interior tree blocks. We walk this list after loading the
- * extent tree to resolve implied refs. For each interior node we'll
- * place a shared ref in the ref tree against each child object. This
- * allows the shared ref resolving code to do the actual work later of
- * finding roots to account against.
+ * The refs are split by bytenr in shards with a tree each, so the extent
+ * tree can be scanned and the refs accounted by several threads at once.
+ * Everything is in a single shard when there is only one thread.
+ *
+ * Each shard also has the list of interior tree blocks it found. We walk
+ * these lists after loading the extent tree to resolve implied refs. For
+ * each interior node we'll place a shared ref in the ref tree against each
+ * child object. This allows the shared ref resolving code to do the actual
+ * work later of finding roots to account against.
  *
  * An implied ref is when a tree block has refs on it that may not
  * exist in any of its child nodes. Even though the refs might not
  * exist further down the tree, the fact that our interior node has a
  * ref means we need to account anything below it to all its roots.
  */
-struct ulist *tree_blocks = NULL;	/* unode->val = bytenr, ->aux
-					 * = tree_block pointer */
+struct ref_shard {
+	u64			start;
+	u64			end;
+	struct rb_root		by_bytenr;
+	struct ulist		*tree_blocks;	/* unode->val = bytenr, ->aux
+						 * = tree_block pointer */
+	unsigned long		nr_extents;
+	int			ret;
+};
+
+static struct ref_shard *shards;
+static int nr_shards;
+
+/* how many shards each thread gets, for a fair share of the work */
+#define SHARDS_PER_THREAD	8
+
 struct tree_block {
 	int			level;
+	u64			bytenr;
 	u64			num_bytes;
+	/* the root it is read with when its implied refs are mapped */
+	struct btrfs_root	*root;
 };
 
 struct ref {
@@ -84,6 +103,59 @@ struct ref {
 	struct rb_node		bytenr_node;
 };
 
+/*
+ * A shared ref found below an interior tree block by one of several
+ * threads. They are only put in the shards once all are found.
+ */
+struct implied_ref {
+	u64			bytenr;
+	u64			parent;
+	u64			num_bytes;
+};
+
+/*
+ * The roots resolved for a parent block. All the extents shared through
+ * the same leaf or node resolve to the same roots, so the last sets found
+ * are kept, up to ROOT_SET_MAX_ROOTS roots for each thread.
+ */
+struct root_set {
+	u64			parent;
+	struct ulist		*roots;
+};
+
+#define ROOT_SET_BITS		12
+#define ROOT_SET_SLOTS		(1 << ROOT_SET_BITS)
+#define ROOT_SET_MAX_ROOTS	(256 * 1024)
+
+struct qgroup_walk;
+
+struct qgroup_worker {
+	struct qgroup_walk		*walk;
+	struct implied_ref		*implied;
+	unsigned long			nr_implied;
+	unsigned long			max_implied;
+	/* indexed by qgroup_count->index, added up once all are accounted */
+	struct btrfs_qgroup_info_item	*counts;
+	struct ulist			*roots;
+	struct root_set			*root_sets;
+	unsigned long			nr_cached_roots;
+	int				ret;
+};
+
+struct qgroup_walk {
+	struct btrfs_fs_info	*info;
+	struct qgroup_worker	*workers;
+	int			nr_workers;
+	struct tree_block	**blocks;
+	int			nr_blocks;
+	int			next;
+	int			do_qgroups;
+	u64			search_subvol;
+};
+
+static void add_bytes(struct qgroup_worker *w, u64 root_objectid,
+		      u64 num_bytes, int exclusive);
+
 #ifdef QGROUP_VERIFY_DEBUG
 static void print_ref(struct ref *ref)
 {
@@ -95,17 +167,22 @@ static void print_ref(struct ref *ref)
 static void print_all_refs(void)
 {
 	unsigned long count = 0;
+	unsigned long tot_extents_scanned = 0;
 	struct ref *ref;
 	struct rb_node *node;
+	int i;
 
-	node = rb_first(&by_bytenr);
-	while (node) {
-		ref = rb_entry(node, struct ref, bytenr_node);
+	for (i = 0; i < nr_shards; i++) {
+		tot_extents_scanned += shards[i].nr_extents;
+		node = rb_first(&shards[i].by_bytenr);
+		while (node) {
+			ref = rb_entry(node, struct ref, bytenr_node);
 
-		print_ref(ref);
+			print_ref(ref);
 
-		count++;
-		node = rb_next(node);
+			count++;
+			node = rb_next(node);
+		}
 	}
 
 	printf("%lu extents scanned with %lu refs in total.\n",
@@ -144,10 +221,10 @@ static int compare_ref(struct ref *orig, u64 bytenr, u64 root, u64 parent)
  * insert a new ref into the tree.  returns the existing ref entry
  * if one is already there.
  */
-static struct ref *insert_ref(struct ref *ref)
+static struct ref *insert_ref(struct ref_shard *shard, struct ref *ref)
 {
 	int ret;
-	struct rb_node **p = &by_bytenr.rb_node;
+	struct rb_node **p = &shard->by_bytenr.rb_node;
 	struct rb_node *parent = NULL;
 	struct ref *curr;
 
@@ -165,10 +242,25 @@ static struct ref *insert_ref(struct ref *ref)
 	}
 
 	rb_link_node(&ref->bytenr_node, parent, p);
-	rb_insert_color(&ref->bytenr_node, &by_bytenr);
+	rb_insert_color(&ref->bytenr_node, &shard->by_bytenr);
 	return ref;
 }
 
+/* returns the shard whose range has bytenr */
+static struct ref_shard *find_shard(u64 bytenr)
+{
+	int lo = 0, hi = nr_shards - 1, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi + 1) / 2;
+		if (shards[mid].start <= bytenr)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+	return &shards[lo];
+}
+
 /*
  * Partial search, returns the first ref with matching bytenr. Caller
  * can walk forward from there.
@@ -178,7 +270,7 @@ static struct ref *insert_ref(struct ref *ref)
  */
 static struct ref *find_ref_bytenr(u64 bytenr)
 {
-	struct rb_node *n = by_bytenr.rb_node;
+	struct rb_node *n = find_shard(bytenr)->by_bytenr.rb_node;
 	struct ref *ref;
 
 	while (n) {
@@ -207,9 +299,10 @@ static struct ref *find_ref_bytenr(u64 bytenr)
 	return NULL;
 }
 
-static struct ref *find_ref(u64 bytenr, u64 root, u64 parent)
+static struct ref *find_ref(struct ref_shard *shard, u64 bytenr, u64 root,
+			    u64 parent)
 {
-	struct rb_node *n = by_bytenr.rb_node;
+	struct rb_node *n = shard->by_bytenr.rb_node;
 	struct ref *ref;
 	int ret;
 
@@ -227,9 +320,10 @@ static struct ref *find_ref(u64 bytenr, u64 root, u64 parent)
 	return NULL;
 }
 
-static struct ref *alloc_ref(u64 bytenr, u64 root, u64 parent, u64 num_bytes)
+static struct ref *alloc_ref(struct ref_shard *shard, u64 bytenr, u64 root,
+			     u64 parent, u64 num_bytes)
 {
-	struct ref *ref = find_ref(bytenr, root, parent);
+	struct ref *ref = find_ref(shard, bytenr, root, parent);
 
 	BUG_ON(parent && root);
 
@@ -241,7 +335,7 @@ static struct ref *alloc_ref(u64 bytenr, u64 root, u64 parent, u64 num_bytes)
 			ref->parent = parent;
 			ref->num_bytes = num_bytes;
 
-			insert_ref(ref);
+			insert_ref(shard, ref);
 		}
 	}
 	return ref;
@@ -255,10 +349,14 @@ static void free_ref_node(struct rb_node *node)
 
 FREE_RB_BASED_TREE(ref, free_ref_node);
 
+static void find_parent_roots(struct qgroup_worker *w, struct ulist *roots,
+			      u64 parent);
+
 /*
  * Resolves all the possible roots for the ref at parent.
  */
-static void find_parent_roots(struct ulist *roots, u64 parent)
+static void __find_parent_roots(struct qgroup_worker *w, struct ulist *roots,
+				u64 parent)
 {
 	struct ref *ref;
 	struct rb_node *node;
@@ -269,8 +367,8 @@ static void find_parent_roots(struct ulist *roots, u64 parent)
 	 * For each unresolved root, we recurse
 	 */
 	ref = find_ref_bytenr(parent);
-	node = &ref->bytenr_node;
 	BUG_ON(ref == NULL);
+	node = &ref->bytenr_node;
 	BUG_ON(ref->bytenr != parent);
 
 	{
@@ -290,7 +388,7 @@ static void find_parent_roots(struct ulist *roots, u64 parent)
 		if (ref->root)
 			ulist_add(roots, ref->root, 0, 0);
 		else
-			find_parent_roots(roots, ref->parent);
+			find_parent_roots(w, roots, ref->parent);
 
 		node = rb_next(node);
 		if (node)
@@ -298,6 +396,80 @@ static void find_parent_roots(struct ulist *roots, u64 parent)
 	} while (node && ref->bytenr == parent);
 }
 
+static void add_root_set(struct ulist *roots, struct ulist *set)
+{
+	struct ulist_iterator uiter;
+	struct ulist_node *unode;
+
+	ULIST_ITER_INIT(&uiter);
+	while ((unode = ulist_next(set, &uiter)))
+		ulist_add(roots, unode->val, 0, 0);
+}
+
+/*
+ * Same as __find_parent_roots(), through the cache of the roots of each
+ * parent.
+ */
+static void find_parent_roots(struct qgroup_worker *w, struct ulist *roots,
+			      u64 parent)
+{
+	struct root_set *set;
+	struct ulist *found;
+
+	set = &w->root_sets[(parent * 0x9E3779B97F4A7C15ULL) >>
+			    (64 - ROOT_SET_BITS)];
+	if (set->roots && set->parent == parent) {
+		add_root_set(roots, set->roots);
+		return;
+	}
+
+	found = ulist_alloc(0);
+	if (!found) {
+		__find_parent_roots(w, roots, parent);
+		return;
+	}
+	__find_parent_roots(w, found, parent);
+	add_root_set(roots, found);
+
+	if (set->roots) {
+		w->nr_cached_roots -= set->roots->nnodes;
+		ulist_free(set->roots);
+		set->roots = NULL;
+	}
+	if (w->nr_cached_roots + found->nnodes > ROOT_SET_MAX_ROOTS) {
+		ulist_free(found);
+		return;
+	}
+	w->nr_cached_roots += found->nnodes;
+	set->parent = parent;
+	set->roots = found;
+}
+
+/*
+ * Runs fn for each worker on a thread of its own, they share the work
+ * through walk->next. It all runs here if no thread can be started.
+ */
+static void run_workers(struct qgroup_walk *walk, void *(*fn)(void *))
+{
+	pthread_t *threads = NULL;
+	int nr_started = 0;
+	int i;
+
+	walk->next = 0;
+	if (walk->nr_workers > 1)
+		threads = calloc(walk->nr_workers, sizeof(*threads));
+	for (i = 0; threads && i < walk->nr_workers; i++) {
+		if (pthread_create(&threads[i], NULL, fn, &walk->workers[i]))
+			break;
+		nr_started++;
+	}
+	if (!nr_started)
+		fn(&walk->workers[0]);
+	for (i = 0; i < nr_started; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+}
+
 static void print_subvol_info(u64 subvolid, u64 bytenr, u64 num_bytes,
 			      struct ulist *roots);
 /*
@@ -312,17 +484,20 @@ static void print_subvol_info(u64 subvolid, u64 bytenr, u64 num_bytes,
  * - Walk ref_roots ulist, adding extent bytes to each qgroup count that
  *    cooresponds to a found root.
  */
-static void account_all_refs(int do_qgroups, u64 search_subvol)
+static void account_shard_refs(struct qgroup_worker *w,
+			       struct ref_shard *shard)
 {
 	int exclusive;
 	struct ref *ref;
 	struct rb_node *node;
 	u64 bytenr, num_bytes;
-	struct ulist *roots = ulist_alloc(0);
+	struct ulist *roots = w->roots;
 	struct ulist_iterator uiter;
 	struct ulist_node *unode;
+	int do_qgroups = w->walk->do_qgroups;
+	u64 search_subvol = w->walk->search_subvol;
 
-	node = rb_first(&by_bytenr);
+	node = rb_first(&shard->by_bytenr);
 	while (node) {
 		ulist_reinit(roots);
 
@@ -341,7 +516,7 @@ static void account_all_refs(int do_qgroups, u64 search_subvol)
 			if (ref->root)
 				ulist_add(roots, ref->root, 0, 0);
 			else
-				find_parent_roots(roots, ref->parent);
+				find_parent_roots(w, roots, ref->parent);
 
 			/*
 			 * When we leave this inner loop, node is set
@@ -371,11 +546,51 @@ static void account_all_refs(int do_qgroups, u64 search_subvol)
 			BUG_ON(unode->val == 0ULL);
 			/* We only want to account fs trees */
 			if (is_fstree(unode->val) && do_qgroups)
-				add_bytes(unode->val, num_bytes, exclusive);
+				add_bytes(w, unode->val, num_bytes, exclusive);
 		}
 	}
+}
+
+static void *account_worker(void *data)
+{
+	struct qgroup_worker *w = data;
+	int i;
 
-	ulist_free(roots);
+	while (1) {
+		i = __atomic_fetch_add(&w->walk->next, 1, __ATOMIC_RELAXED);
+		if (i >= nr_shards)
+			break;
+		account_shard_refs(w, &shards[i]);
+	}
+	return NULL;
+}
+
+/*
+ * The shards are accounted by all the workers, each against counters of
+ * its own which are added up at the end. Printing the extents of a
+ * subvolume needs a single worker to keep them in order.
+ */
+static void account_all_refs(struct qgroup_walk *walk)
+{
+	struct btrfs_qgroup_info_item *qg, *wqg;
+	struct qgroup_count *count;
+	struct rb_node *node;
+	int i;
+
+	run_workers(walk, account_worker);
+
+	for (node = rb_first(&counts.root); node; node = rb_next(node)) {
+		count = rb_entry(node, struct qgroup_count, rb_node);
+		qg = &count->info;
+		for (i = 0; i < walk->nr_workers; i++) {
+			wqg = &walk->workers[i].counts[count->index];
+			qg->referenced += wqg->referenced;
+			qg->referenced_compressed +=
+				wqg->referenced_compressed;
+			qg->exclusive += wqg->exclusive;
+			qg->exclusive_compressed += wqg->exclusive_compressed;
+		}
+	}
 }
 
 static u64 resolve_one_root(u64 bytenr)
@@ -398,21 +613,24 @@ static inline u64 unode_bytenr(struct ulist_node *unode)
 	return unode->val;
 }
 
-static int alloc_tree_block(u64 bytenr, u64 num_bytes, int level)
+static int alloc_tree_block(struct ref_shard *shard, u64 bytenr,
+			    u64 num_bytes, int level)
 {
 	struct tree_block *block = calloc(1, sizeof(*block));
 
 	if (block) {
+		block->bytenr = bytenr;
 		block->num_bytes = num_bytes;
 		block->level = level;
-		if (ulist_add(tree_blocks, bytenr, ptr_to_u64(block), 0) >= 0)
+		if (ulist_add(shard->tree_blocks, bytenr, ptr_to_u64(block),
+			      0) >= 0)
 			return 0;
 		free(block);
 	}
 	return -ENOMEM;
 }
 
-static void free_tree_blocks(void)
+static void free_tree_blocks(struct ulist *tree_blocks)
 {
 	struct ulist_iterator uiter;
 	struct ulist_node *unode;
@@ -423,8 +641,7 @@ static void free_tree_blocks(void)
 	ULIST_ITER_INIT(&uiter);
 	while ((unode = ulist_next(tree_blocks, &uiter)))
 		free(unode_tree_block(unode));
-	ulist_free(tree_blocks);	
-	tree_blocks = NULL;
+	ulist_free(tree_blocks);
 }
 
 #ifdef QGROUP_VERIFY_DEBUG
@@ -452,19 +669,53 @@ static void print_all_tree_blocks(void)
 {
 	struct ulist_iterator uiter;
 	struct ulist_node *unode;
-
-	if (!tree_blocks)
-		return;
+	int i;
 
 	printf("Listing all found interior tree nodes:\n");
 
-	ULIST_ITER_INIT(&uiter);
-	while ((unode = ulist_next(tree_blocks, &uiter)))
-		print_tree_block(unode_bytenr(unode), unode_tree_block(unode));
+	for (i = 0; i < nr_shards; i++) {
+		ULIST_ITER_INIT(&uiter);
+		while ((unode = ulist_next(shards[i].tree_blocks, &uiter)))
+			print_tree_block(unode_bytenr(unode),
+					 unode_tree_block(unode));
+	}
 }
 #endif
 
-static int add_refs_for_leaf_items(struct extent_buffer *eb, u64 ref_parent)
+/*
+ * The implied refs go straight to their shard when there is only one
+ * worker, otherwise they are kept by the worker until all are found.
+ */
+static int add_implied_ref(struct qgroup_worker *w, u64 bytenr, u64 parent,
+			   u64 num_bytes)
+{
+	struct implied_ref *implied;
+	unsigned long max;
+
+	if (w->walk->nr_workers == 1) {
+		if (alloc_ref(find_shard(bytenr), bytenr, 0, parent,
+			      num_bytes) == NULL)
+			return ENOMEM;
+		return 0;
+	}
+
+	if (w->nr_implied == w->max_implied) {
+		max = max(w->max_implied * 2, 4096UL);
+		implied = realloc(w->implied, max * sizeof(*implied));
+		if (!implied)
+			return ENOMEM;
+		w->implied = implied;
+		w->max_implied = max;
+	}
+	implied = &w->implied[w->nr_implied++];
+	implied->bytenr = bytenr;
+	implied->parent = parent;
+	implied->num_bytes = num_bytes;
+	return 0;
+}
+
+static int add_refs_for_leaf_items(struct qgroup_worker *w,
+				   struct extent_buffer *eb, u64 ref_parent)
 {
 	int nr, i;
 	int extent_type;
@@ -494,14 +745,14 @@ static int add_refs_for_leaf_items(struct extent_buffer *eb, u64 ref_parent)
 			continue;
 
 		num_bytes = btrfs_file_extent_disk_num_bytes(eb, fi);
-		if (alloc_ref(bytenr, 0, ref_parent, num_bytes) == NULL)
+		if (add_implied_ref(w, bytenr, ref_parent, num_bytes))
 			return ENOMEM;
 	}
 
 	return 0;
 }
 
-static int travel_tree(struct btrfs_fs_info *info, struct btrfs_root *root,
+static int travel_tree(struct qgroup_worker *w, struct btrfs_root *root,
 		       u64 bytenr, u64 num_bytes, u64 ref_parent)
 {
 	int ret, nr, i;
@@ -519,12 +770,12 @@ static int travel_tree(struct btrfs_fs_info *info, struct btrfs_root *root,
 	ret = 0;
 	/* Don't add a ref for our starting tree block to itself */
 	if (bytenr != ref_parent) {
-		if (alloc_ref(bytenr, 0, ref_parent, num_bytes) == NULL)
+		if (add_implied_ref(w, bytenr, ref_parent, num_bytes))
 			return ENOMEM;
 	}
 
 	if (btrfs_is_leaf(eb)) {
-		ret = add_refs_for_leaf_items(eb, ref_parent);
+		ret = add_refs_for_leaf_items(w, eb, ref_parent);
 		goto out;
 	}
 
@@ -540,7 +791,7 @@ static int travel_tree(struct btrfs_fs_info *info, struct btrfs_root *root,
 		new_num_bytes = btrfs_level_size(root,
 						 btrfs_header_level(eb) - 1);
 
-		ret = travel_tree(info, root, new_bytenr, new_num_bytes,
+		ret = travel_tree(w, root, new_bytenr, new_num_bytes,
 				  ref_parent);
 	}
 
@@ -549,50 +800,176 @@ out:
 	return ret;
 }
 
-static int add_refs_for_implied(struct btrfs_fs_info *info, u64 bytenr,
-				struct tree_block *block)
+static int compare_implied_ref(const void *a, const void *b)
+{
+	const struct implied_ref *ia = a;
+	const struct implied_ref *ib = b;
+
+	if (ia->bytenr < ib->bytenr)
+		return -1;
+	if (ia->bytenr > ib->bytenr)
+		return 1;
+	return 0;
+}
+
+static void *implied_refs_worker(void *data)
+{
+	struct qgroup_worker *w = data;
+	struct qgroup_walk *walk = w->walk;
+	struct tree_block *block;
+	int i;
+
+	while (1) {
+		i = __atomic_fetch_add(&walk->next, 1, __ATOMIC_RELAXED);
+		if (i >= walk->nr_blocks)
+			break;
+		block = walk->blocks[i];
+		w->ret = travel_tree(w, block->root, block->bytenr,
+				     block->num_bytes, block->bytenr);
+		if (w->ret)
+			break;
+	}
+	/* sorted so each shard finds its part of them quickly */
+	qsort(w->implied, w->nr_implied, sizeof(*w->implied),
+	      compare_implied_ref);
+	return NULL;
+}
+
+static void *merge_implied_worker(void *data)
+{
+	struct qgroup_worker *w = data;
+	struct qgroup_walk *walk = w->walk;
+	struct implied_ref *implied;
+	struct ref_shard *shard;
+	unsigned long lo, hi, mid;
+	int i, j;
+
+	while (1) {
+		i = __atomic_fetch_add(&walk->next, 1, __ATOMIC_RELAXED);
+		if (i >= nr_shards)
+			break;
+		shard = &shards[i];
+		for (j = 0; j < walk->nr_workers && !shard->ret; j++) {
+			implied = walk->workers[j].implied;
+			lo = 0;
+			hi = walk->workers[j].nr_implied;
+			while (lo < hi) {
+				mid = lo + (hi - lo) / 2;
+				if (implied[mid].bytenr < shard->start)
+					lo = mid + 1;
+				else
+					hi = mid;
+			}
+			for (; lo < walk->workers[j].nr_implied &&
+			     implied[lo].bytenr <= shard->end; lo++) {
+				if (alloc_ref(shard, implied[lo].bytenr, 0,
+					      implied[lo].parent,
+					      implied[lo].num_bytes) == NULL) {
+					shard->ret = ENOMEM;
+					break;
+				}
+			}
+		}
+	}
+	return NULL;
+}
+
+/* the blocks of the highest levels go first, they have the most below */
+static int compare_tree_block_level(const void *a, const void *b)
+{
+	const struct tree_block *ba = *(struct tree_block **)a;
+	const struct tree_block *bb = *(struct tree_block **)b;
+
+	if (ba->level > bb->level)
+		return -1;
+	if (ba->level < bb->level)
+		return 1;
+	if (ba->bytenr < bb->bytenr)
+		return -1;
+	if (ba->bytenr > bb->bytenr)
+		return 1;
+	return 0;
+}
+
+/*
+ * Find the root each interior block is read with. The roots are read
+ * here, btrfs_read_fs_root() can't be called by several threads.
+ */
+static int resolve_tree_block_roots(struct qgroup_walk *walk)
 {
-	int ret;
-	u64 root_id = resolve_one_root(bytenr);
-	struct btrfs_root *root;
 	struct btrfs_key key;
+	struct btrfs_root *root;
+	int i;
 
-	key.objectid = root_id;
 	key.type = BTRFS_ROOT_ITEM_KEY;
 	key.offset = (u64)-1;
+	for (i = 0; i < walk->nr_blocks; i++) {
+		key.objectid = resolve_one_root(walk->blocks[i]->bytenr);
 
-	/*
-	 * XXX: Don't free the root object as we don't know whether it
-	 * came off our fs_info struct or not.
-	 */
-	root = btrfs_read_fs_root(info, &key);
-	if (!root || IS_ERR(root))
-		return ENOENT;
-
-	ret = travel_tree(info, root, bytenr, block->num_bytes, bytenr);
-	if (ret)
-		return ret;
-
+		/*
+		 * XXX: Don't free the root object as we don't know whether it
+		 * came off our fs_info struct or not.
+		 */
+		root = btrfs_read_fs_root(walk->info, &key);
+		if (!root || IS_ERR(root))
+			return ENOENT;
+		walk->blocks[i]->root = root;
+	}
 	return 0;
 }
 
 /*
  * Place shared refs in the ref tree for each child of an interior tree node.
  */
-static int map_implied_refs(struct btrfs_fs_info *info)
+static int map_implied_refs(struct qgroup_walk *walk)
 {
 	int ret = 0;
 	struct ulist_iterator uiter;
 	struct ulist_node *unode;
+	int i;
 
-	ULIST_ITER_INIT(&uiter);
-	while ((unode = ulist_next(tree_blocks, &uiter))) {
-		ret = add_refs_for_implied(info, unode_bytenr(unode),
-					   unode_tree_block(unode));
-		if (ret)
-			goto out;
+	walk->nr_blocks = 0;
+	for (i = 0; i < nr_shards; i++)
+		walk->nr_blocks += shards[i].tree_blocks->nnodes;
+	if (!walk->nr_blocks)
+		return 0;
+	walk->blocks = calloc(walk->nr_blocks, sizeof(*walk->blocks));
+	if (!walk->blocks)
+		return ENOMEM;
+
+	walk->nr_blocks = 0;
+	for (i = 0; i < nr_shards; i++) {
+		ULIST_ITER_INIT(&uiter);
+		while ((unode = ulist_next(shards[i].tree_blocks, &uiter)))
+			walk->blocks[walk->nr_blocks++] =
+				unode_tree_block(unode);
 	}
+	if (walk->nr_workers > 1)
+		qsort(walk->blocks, walk->nr_blocks, sizeof(*walk->blocks),
+		      compare_tree_block_level);
+
+	ret = resolve_tree_block_roots(walk);
+	if (ret)
+		goto out;
+
+	run_workers(walk, implied_refs_worker);
+	for (i = 0; i < walk->nr_workers && !ret; i++)
+		ret = walk->workers[i].ret;
+	if (ret || walk->nr_workers == 1)
+		goto out;
+
+	run_workers(walk, merge_implied_worker);
+	for (i = 0; i < nr_shards && !ret; i++)
+		ret = shards[i].ret;
 out:
+	for (i = 0; i < walk->nr_workers; i++) {
+		free(walk->workers[i].implied);
+		walk->workers[i].implied = NULL;
+		walk->workers[i].nr_implied = 0;
+		walk->workers[i].max_implied = 0;
+	}
+	free(walk->blocks);
+	walk->blocks = NULL;
 	return ret;
 }
 
@@ -618,7 +995,7 @@ static int insert_count(struct qgroup_count *qc)
 		else
 			return EEXIST;
 	}
-	counts.num_groups++;
+	qc->index = counts.num_groups++;
 	rb_link_node(&qc->rb_node, parent, p);
 	rb_insert_color(&qc->rb_node, &counts.root);
 	return 0;
@@ -670,7 +1047,8 @@ static struct qgroup_count *alloc_count(struct btrfs_disk_key *key,
 	return c;
 }
 
-static void add_bytes(u64 root_objectid, u64 num_bytes, int exclusive)
+static void add_bytes(struct qgroup_worker *w, u64 root_objectid,
+		      u64 num_bytes, int exclusive)
 {
 	struct qgroup_count *count = find_count(root_objectid);
 	struct btrfs_qgroup_info_item *qg;
@@ -680,7 +1058,7 @@ static void add_bytes(u64 root_objectid, u64 num_bytes, int exclusive)
 	if (!count)
 		return;
 
-	qg = &count->info;
+	qg = &w->counts[count->index];
 
 	qg->referenced += num_bytes;
 	/*
@@ -771,7 +1149,7 @@ out:
 	return ret;
 }
 
-static int add_inline_refs(struct btrfs_fs_info *info,
+static int add_inline_refs(struct ref_shard *shard,
 			   struct extent_buffer *ei_leaf, int slot,
 			   u64 bytenr, u64 num_bytes, int meta_item)
 {
@@ -819,7 +1197,8 @@ static int add_inline_refs(struct btrfs_fs_info *info,
 			return 1;
 		}
 
-		if (alloc_ref(bytenr, root_obj, parent, num_bytes) == NULL)
+		if (alloc_ref(shard, bytenr, root_obj, parent,
+			      num_bytes) == NULL)
 			return ENOMEM;
 
 		ptr += btrfs_extent_inline_ref_size(type);
@@ -828,7 +1207,7 @@ static int add_inline_refs(struct btrfs_fs_info *info,
 	return 0;
 }
 
-static int add_keyed_ref(struct btrfs_fs_info *info,
+static int add_keyed_ref(struct ref_shard *shard,
 			 struct btrfs_key *key,
 			 struct extent_buffer *leaf, int slot,
 			 u64 bytenr, u64 num_bytes)
@@ -852,7 +1231,7 @@ static int add_keyed_ref(struct btrfs_fs_info *info,
 		return 1;
 	}
 
-	if (alloc_ref(bytenr, root_obj, parent, num_bytes) == NULL)
+	if (alloc_ref(shard, bytenr, root_obj, parent, num_bytes) == NULL)
 		return ENOMEM;
 
 	return 0;
@@ -888,12 +1267,12 @@ static int get_tree_block_level(struct btrfs_key *key,
 }
 
 /*
- * Walk the extent tree, allocating a ref item for every ref and
- * storing it in the bytenr tree.
+ * Walk the extent tree over the range of the shard, allocating a ref
+ * item for every ref and storing it in the bytenr tree of the shard.
  */
-static int scan_extents(struct btrfs_fs_info *info,
-			u64 start, u64 end)
+static int scan_extents(struct btrfs_fs_info *info, struct ref_shard *shard)
 {
+	u64 start = shard->start, end = shard->end;
 	int ret, i, nr, level;
 	struct btrfs_root *root = info->extent_root;
 	struct btrfs_key key;
@@ -933,7 +1312,7 @@ static int scan_extents(struct btrfs_fs_info *info,
 			    key.type == BTRFS_METADATA_ITEM_KEY) {
 				int meta = 0;
 
-				tot_extents_scanned++;
+				shard->nr_extents++;
 
 				bytenr = key.objectid;
 				num_bytes = key.offset;
@@ -942,16 +1321,18 @@ static int scan_extents(struct btrfs_fs_info *info,
 					meta = 1;
 				}
 
-				ret = add_inline_refs(info, leaf, i, bytenr,
+				ret = add_inline_refs(shard, leaf, i, bytenr,
 						      num_bytes, meta);
 				if (ret)
 					goto out;
 
 				level = get_tree_block_level(&key, leaf, i);
 				if (level) {
-					if (alloc_tree_block(bytenr, num_bytes,
-							     level))
-						return ENOMEM;
+					if (alloc_tree_block(shard, bytenr,
+							     num_bytes, level)) {
+						ret = ENOMEM;
+						goto out;
+					}
 				}
 
 				continue;
@@ -971,7 +1352,7 @@ static int scan_extents(struct btrfs_fs_info *info,
 			 */
 			BUG_ON(key.objectid != bytenr);
 
-			ret = add_keyed_ref(info, &key, leaf, i, bytenr,
+			ret = add_keyed_ref(shard, &key, leaf, i, bytenr,
 					    num_bytes);
 			if (ret)
 				goto out;
@@ -995,6 +1376,203 @@ out:
 	return ret;
 }
 
+static void *scan_worker(void *data)
+{
+	struct qgroup_worker *w = data;
+	struct ref_shard *shard;
+	int i;
+
+	while (1) {
+		i = __atomic_fetch_add(&w->walk->next, 1, __ATOMIC_RELAXED);
+		if (i >= nr_shards)
+			break;
+		shard = &shards[i];
+		shard->ret = scan_extents(w->walk->info, shard);
+	}
+	return NULL;
+}
+
+static u64 node_key_objectid(struct extent_buffer *eb, int slot)
+{
+	struct btrfs_key key;
+
+	btrfs_node_key_to_cpu(eb, &key, slot);
+	return key.objectid;
+}
+
+/*
+ * Collect the first objectid of the children of the extent tree root, or of
+ * its grandchildren if that's not enough to cut the tree in want shards.
+ */
+static int collect_extent_keys(struct btrfs_root *root, u64 **keys, int *nr,
+			       int want)
+{
+	struct extent_buffer *eb = root->node;
+	struct extent_buffer *child;
+	int level = btrfs_header_level(eb);
+	int nritems = btrfs_header_nritems(eb);
+	int max = nritems;
+	int i, j;
+
+	if (level >= 2 && nritems < want)
+		max = nritems * BTRFS_NODEPTRS_PER_BLOCK(root);
+	*keys = calloc(max, sizeof(**keys));
+	if (!*keys)
+		return ENOMEM;
+
+	*nr = 0;
+	for (i = 0; i < nritems; i++) {
+		if (max == nritems) {
+			(*keys)[(*nr)++] = node_key_objectid(eb, i);
+			continue;
+		}
+		child = read_tree_block(root, btrfs_node_blockptr(eb, i),
+					btrfs_level_size(root, level - 1),
+					btrfs_node_ptr_generation(eb, i));
+		if (!extent_buffer_uptodate(child)) {
+			free_extent_buffer(child);
+			free(*keys);
+			return EIO;
+		}
+		for (j = 0; j < btrfs_header_nritems(child); j++)
+			(*keys)[(*nr)++] = node_key_objectid(child, j);
+		free_extent_buffer(child);
+	}
+	return 0;
+}
+
+/*
+ * Cut the range of bytenr in about SHARDS_PER_THREAD shards for each
+ * thread, each with a similar number of extent tree leaves. There is
+ * a single shard for one thread, or a small extent tree.
+ */
+static int setup_shards(struct btrfs_fs_info *info, int nr_threads)
+{
+	struct btrfs_root *root = info->extent_root;
+	int want = nr_threads * SHARDS_PER_THREAD;
+	u64 *keys = NULL;
+	u64 start;
+	int nr = 0;
+	int ret;
+	int i;
+
+	if (nr_threads > 1 && btrfs_header_level(root->node) > 0) {
+		ret = collect_extent_keys(root, &keys, &nr, want);
+		if (ret)
+			return ret;
+	}
+
+	want = max(min(nr, want), 1);
+	shards = calloc(want, sizeof(*shards));
+	if (!shards) {
+		free(keys);
+		return ENOMEM;
+	}
+	nr_shards = 1;
+	for (i = 1; i < want; i++) {
+		start = keys[(u64)i * nr / want];
+		if (start > shards[nr_shards - 1].start)
+			shards[nr_shards++].start = start;
+	}
+	free(keys);
+
+	for (i = 0; i < nr_shards; i++) {
+		shards[i].end = i + 1 < nr_shards ?
+				shards[i + 1].start - 1 : (u64)-1;
+		shards[i].by_bytenr = RB_ROOT;
+		shards[i].tree_blocks = ulist_alloc(0);
+		if (!shards[i].tree_blocks)
+			return ENOMEM;
+	}
+	return 0;
+}
+
+static void free_shards(void)
+{
+	int i;
+
+	for (i = 0; i < nr_shards; i++) {
+		free_tree_blocks(shards[i].tree_blocks);
+		free_ref_tree(&shards[i].by_bytenr);
+	}
+	free(shards);
+	shards = NULL;
+	nr_shards = 0;
+}
+
+static int init_walk(struct qgroup_walk *walk, struct btrfs_fs_info *info,
+		     int nr_threads)
+{
+	struct qgroup_worker *w;
+	int i;
+
+	memset(walk, 0, sizeof(*walk));
+	walk->info = info;
+	walk->workers = calloc(nr_threads, sizeof(*walk->workers));
+	if (!walk->workers)
+		return ENOMEM;
+	walk->nr_workers = nr_threads;
+	for (i = 0; i < nr_threads; i++) {
+		w = &walk->workers[i];
+		w->walk = walk;
+		w->counts = calloc(max(counts.num_groups, 1U),
+				   sizeof(*w->counts));
+		w->roots = ulist_alloc(0);
+		w->root_sets = calloc(ROOT_SET_SLOTS, sizeof(*w->root_sets));
+		if (!w->counts || !w->roots || !w->root_sets)
+			return ENOMEM;
+	}
+	return 0;
+}
+
+static void free_walk(struct qgroup_walk *walk)
+{
+	struct qgroup_worker *w;
+	int i, j;
+
+	for (i = 0; i < walk->nr_workers; i++) {
+		w = &walk->workers[i];
+		free(w->implied);
+		free(w->counts);
+		ulist_free(w->roots);
+		for (j = 0; w->root_sets && j < ROOT_SET_SLOTS; j++)
+			ulist_free(w->root_sets[j].roots);
+		free(w->root_sets);
+	}
+	free(walk->workers);
+}
+
+/*
+ * Put all extent refs into the shards, then the implied refs of the
+ * interior tree blocks.
+ */
+static int scan_all_refs(struct qgroup_walk *walk, int nr_threads)
+{
+	int ret;
+	int i;
+
+	ret = setup_shards(walk->info, nr_threads);
+	if (ret) {
+		fprintf(stderr, "ERROR: while scanning extent tree: %d\n", ret);
+		return ret;
+	}
+
+	run_workers(walk, scan_worker);
+	for (i = 0; i < nr_shards; i++) {
+		ret = shards[i].ret;
+		if (ret) {
+			fprintf(stderr,
+				"ERROR: while scanning extent tree: %d\n", ret);
+			return ret;
+		}
+	}
+
+	ret = map_implied_refs(walk);
+	if (ret)
+		fprintf(stderr, "ERROR: while mapping refs: %d\n", ret);
+	return ret;
+}
+
 static void print_fields(u64 bytes, u64 bytes_compressed, char *prefix,
 			 char *type)
 {
@@ -1056,50 +1634,40 @@ void print_qgroup_report(int all)
 	}
 }
 
-int qgroup_verify_all(struct btrfs_fs_info *info)
+int qgroup_verify_all(struct btrfs_fs_info *info, int nr_threads)
 {
+	struct qgroup_walk walk;
 	int ret;
 
 	if (!info->quota_enabled)
 		return 0;
 
-	tree_blocks = ulist_alloc(0);
-	if (!tree_blocks) {
-		fprintf(stderr,
-			"ERROR: Out of memory while allocating ulist.\n");
-		return ENOMEM;
-	}
-
 	ret = load_quota_info(info);
 	if (ret) {
 		fprintf(stderr, "ERROR: Loading qgroups from disk: %d\n", ret);
-		goto out;
+		return ret;
 	}
 
-	/*
-	 * Put all extent refs into our rbtree
-	 */
-	ret = scan_extents(info, 0, ~0ULL);
+	ret = init_walk(&walk, info, max(nr_threads, 1));
 	if (ret) {
-		fprintf(stderr, "ERROR: while scanning extent tree: %d\n", ret);
+		fprintf(stderr, "ERROR: out of memory\n");
 		goto out;
 	}
+	walk.do_qgroups = 1;
 
-	ret = map_implied_refs(info);
-	if (ret) {
-		fprintf(stderr, "ERROR: while mapping refs: %d\n", ret);
+	ret = scan_all_refs(&walk, nr_threads);
+	if (ret)
 		goto out;
-	}
 
-	account_all_refs(1, 0);
+	account_all_refs(&walk);
 
 out:
 	/*
 	 * Don't free the qgroup count records as they will be walked
 	 * later via the print function.
 	 */
-	free_tree_blocks();
-	free_ref_tree(&by_bytenr);
+	free_walk(&walk);
+	free_shards();
 	return ret;
 }
 
@@ -1138,36 +1706,26 @@ static void print_subvol_info(u64 subvolid, u64 bytenr, u64 num_bytes,
 
 int print_extent_state(struct btrfs_fs_info *info, u64 subvol)
 {
+	struct qgroup_walk walk;
 	int ret;
 
-	tree_blocks = ulist_alloc(0);
-	if (!tree_blocks) {
-		fprintf(stderr,
-			"ERROR: Out of memory while allocating ulist.\n");
-		return ENOMEM;
-	}
-
-	/*
-	 * Put all extent refs into our rbtree
-	 */
-	ret = scan_extents(info, 0, ~0ULL);
+	/* the extents are printed as they are accounted, in order */
+	ret = init_walk(&walk, info, 1);
 	if (ret) {
-		fprintf(stderr, "ERROR: while scanning extent tree: %d\n", ret);
+		fprintf(stderr, "ERROR: out of memory\n");
 		goto out;
 	}
+	walk.search_subvol = subvol;
 
-	ret = map_implied_refs(info);
-	if (ret) {
-		fprintf(stderr, "ERROR: while mapping refs: %d\n", ret);
+	ret = scan_all_refs(&walk, 1);
+	if (ret)
 		goto out;
-	}
 
 	printf("Offset\t\tLen\tRoot Refs\tRoots\n");
-	account_all_refs(0, subvol);
+	account_all_refs(&walk);
 
 out:
-	free_tree_blocks();
-	free_ref_tree(&by_bytenr);
+	free_walk(&walk);
+	free_shards();
 	return ret;
 }
-
@@ -22,7 +22,7 @@
 #include "kerncompat.h"
 #include "ctree.h"
 
-int qgroup_verify_all(struct btrfs_fs_info *info);
+int qgroup_verify_all(struct btrfs_fs_info *info, int nr_threads);
 void print_qgroup_report(int all);
 
 int print_extent_state(struct btrfs_fs_info *info, u64 subvol);
@@ -0,0 +1,189 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+/*
+ * Verify every RAID6 syndrome and recovery implementation usable on this
+ * CPU against each other and report their throughput.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "kerncompat.h"
+#include "ctree.h"
+#include "disk-io.h"
+
+#define NDISKS		8
+#define STRIPE_LEN	(64 * 1024)
+#define BENCH_MSEC	200
+
+static void *data[NDISKS];
+static void *ref[NDISKS];
+
+static u64 now_nsec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void fill_data(void)
+{
+	int i, j;
+
+	for (i = 0; i < NDISKS - 2; i++)
+		for (j = 0; j < STRIPE_LEN; j++)
+			((u8 *)data[i])[j] = rand();
+	for (i = 0; i < NDISKS; i++)
+		memset(ref[i], 0, STRIPE_LEN);
+	for (i = 0; i < NDISKS - 2; i++)
+		memcpy(ref[i], data[i], STRIPE_LEN);
+}
+
+static int check_stripes(const char *what, const char *name)
+{
+	int i;
+
+	for (i = 0; i < NDISKS; i++) {
+		if (memcmp(data[i], ref[i], STRIPE_LEN)) {
+			fprintf(stderr, "%s %s: stripe %d mismatch\n",
+				what, name, i);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* data rate in MB/s of @bytes processed in @nsec */
+static double rate(u64 bytes, u64 nsec)
+{
+	return (double)bytes / 1000000.0 / ((double)nsec / 1000000000.0);
+}
+
+static int test_gen(const struct raid6_calls *gen)
+{
+	u64 start, elapsed;
+	u64 loops = 0;
+
+	raid6_set_algos(gen, NULL);
+	memset(data[NDISKS - 2], 0, STRIPE_LEN);
+	memset(data[NDISKS - 1], 0, STRIPE_LEN);
+	raid6_gen_syndrome(NDISKS, STRIPE_LEN, data);
+	if (check_stripes("gen_syndrome", gen->name))
+		return 1;
+
+	start = now_nsec();
+	do {
+		raid6_gen_syndrome(NDISKS, STRIPE_LEN, data);
+		loops++;
+		elapsed = now_nsec() - start;
+	} while (elapsed < BENCH_MSEC * 1000000ULL);
+	printf("gen_syndrome %-8s %8.0f MB/s\n", gen->name,
+	       rate(loops * STRIPE_LEN * (NDISKS - 2), elapsed));
+	return 0;
+}
+
+static void wipe(int stripe)
+{
+	memset(data[stripe], 0x5a, STRIPE_LEN);
+}
+
+static int test_recov(const struct raid6_recov_calls *recov)
+{
+	u64 start, elapsed;
+	u64 loops;
+	int a, b;
+
+	raid6_set_algos(NULL, recov);
+	for (a = 0; a < NDISKS; a++) {
+		for (b = a + 1; b < NDISKS; b++) {
+			wipe(a);
+			wipe(b);
+			raid56_recov(NDISKS, STRIPE_LEN,
+				     BTRFS_BLOCK_GROUP_RAID6, a, b, data);
+			if (check_stripes("recov", recov->name)) {
+				fprintf(stderr, "failed %d and %d\n", a, b);
+				return 1;
+			}
+		}
+		wipe(a);
+		raid56_recov(NDISKS, STRIPE_LEN, BTRFS_BLOCK_GROUP_RAID6,
+			     a, -1, data);
+		if (check_stripes("recov", recov->name)) {
+			fprintf(stderr, "failed %d\n", a);
+			return 1;
+		}
+	}
+
+	loops = 0;
+	start = now_nsec();
+	do {
+		raid6_recov_data2(NDISKS, STRIPE_LEN, 0, 1, data);
+		loops++;
+		elapsed = now_nsec() - start;
+	} while (elapsed < BENCH_MSEC * 1000000ULL);
+	printf("recov data2  %-8s %8.0f MB/s\n", recov->name,
+	       rate(loops * STRIPE_LEN * 2, elapsed));
+
+	loops = 0;
+	start = now_nsec();
+	do {
+		raid6_recov_datap(NDISKS, STRIPE_LEN, 0, data);
+		loops++;
+		elapsed = now_nsec() - start;
+	} while (elapsed < BENCH_MSEC * 1000000ULL);
+	printf("recov datap  %-8s %8.0f MB/s\n", recov->name,
+	       rate(loops * STRIPE_LEN * 2, elapsed));
+	return check_stripes("recov", recov->name);
+}
+
+int main(int argc, char **argv)
+{
+	const struct raid6_calls *gen;
+	const struct raid6_recov_calls *recov;
+	int ret = 0;
+	int i;
+
+	for (i = 0; i < NDISKS; i++) {
+		data[i] = malloc(STRIPE_LEN);
+		ref[i] = malloc(STRIPE_LEN);
+		if (!data[i] || !ref[i]) {
+			fprintf(stderr, "not enough memory\n");
+			return 1;
+		}
+	}
+	srand(42);
+	fill_data();
+	/* reference P/Q from the integer implementation */
+	for (gen = raid6_gen_algos; gen->name; gen++)
+		;
+	raid6_set_algos(gen - 1, NULL);
+	raid6_gen_syndrome(NDISKS, STRIPE_LEN, ref);
+
+	for (gen = raid6_gen_algos; gen->name; gen++) {
+		if (!gen->valid())
+			continue;
+		ret |= test_gen(gen);
+	}
+	for (recov = raid6_recov_algos; recov->name; recov++) {
+		if (!recov->valid())
+			continue;
+		ret |= test_recov(recov);
+	}
+	return ret;
+}
@@ -18,11 +18,19 @@
  * This file was postprocessed using unroll.pl and then ported to userspace
  */
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
+#include <pthread.h>
 #include "kerncompat.h"
 #include "ctree.h"
 #include "disk-io.h"
 
+#if defined(__x86_64__) || defined(__i386__)
+#define RAID6_X86 1
+#include <immintrin.h>
+#endif
+
 /*
  * This is the C data type to use
  */
@@ -71,7 +79,7 @@ static inline __attribute_const__ unative_t MASK(unative_t v)
 }
 
 
-void raid6_gen_syndrome(int disks, size_t bytes, void **ptrs)
+static void raid6_int_gen_syndrome(int disks, size_t bytes, void **ptrs)
 {
 	uint8_t **dptr = (uint8_t **)ptrs;
 	uint8_t *p, *q;
@@ -99,3 +107,570 @@ void raid6_gen_syndrome(int disks, size_t bytes, void **ptrs)
 	}
 }
 
+
+/*
+ * GF(2^8) tables for the recovery routines, generated on first use instead
+ * of at build time like the kernel does.
+ *
+ * raid6_gfmul[a][b]	a * b
+ * raid6_gfexp[i]	2^i
+ * raid6_gfinv[a]	a^-1
+ * raid6_gfexi[i]	(2^i + 1)^-1
+ * raid6_vgfmul[a]	a * b for the low nibble of b in the first 16 bytes and
+ *			for the high nibble in the last 16 bytes (pshufb tables)
+ */
+static u8 raid6_gfmul[256][256];
+static u8 raid6_gfexp[256];
+static u8 raid6_gfinv[256];
+static u8 raid6_gfexi[256];
+static u8 raid6_vgfmul[256][32] __attribute__((aligned(32)));
+static pthread_once_t raid6_tables_once = PTHREAD_ONCE_INIT;
+
+static u8 gfmul(u8 a, u8 b)
+{
+	u8 v = 0;
+
+	while (b) {
+		if (b & 1)
+			v ^= a;
+		a = (a << 1) ^ ((a & 0x80) ? 0x1d : 0);
+		b >>= 1;
+	}
+	return v;
+}
+
+static void raid6_init_tables(void)
+{
+	int i, j;
+	u8 v;
+
+	for (i = 0; i < 256; i++)
+		for (j = 0; j < 256; j++)
+			raid6_gfmul[i][j] = gfmul(i, j);
+
+	v = 1;
+	for (i = 0; i < 256; i++) {
+		raid6_gfexp[i] = v;
+		v = gfmul(v, 2);
+	}
+
+	for (i = 0; i < 256; i++) {
+		/* a^254 == a^-1 in GF(2^8) */
+		v = 1;
+		for (j = 0; j < 254; j++)
+			v = gfmul(v, i);
+		raid6_gfinv[i] = v;
+	}
+
+	for (i = 0; i < 256; i++)
+		raid6_gfexi[i] = raid6_gfinv[raid6_gfexp[i] ^ 1];
+
+	for (i = 0; i < 256; i++) {
+		for (j = 0; j < 16; j++) {
+			raid6_vgfmul[i][j] = gfmul(i, j);
+			raid6_vgfmul[i][j + 16] = gfmul(i, j << 4);
+		}
+	}
+}
+
+/* P and Q for bytes [start, bytes) that the vector loops did not cover */
+static void gen_syndrome_tail(int disks, size_t start, size_t bytes,
+			      void **ptrs)
+{
+	u8 **dptr = (u8 **)ptrs;
+	int z0 = disks - 3;
+	size_t d;
+	int z;
+	u8 wd, wp, wq;
+
+	for (d = start; d < bytes; d++) {
+		wq = wp = dptr[z0][d];
+		for (z = z0 - 1; z >= 0; z--) {
+			wd = dptr[z][d];
+			wp ^= wd;
+			wq = gfmul(wq, 2) ^ wd;
+		}
+		dptr[z0 + 1][d] = wp;
+		dptr[z0 + 2][d] = wq;
+	}
+}
+
+static void raid6_int_2data_recov(size_t bytes, u8 *p, u8 *q, u8 *dp, u8 *dq,
+				  u8 pbmul_coef, u8 qmul_coef)
+{
+	const u8 *pbmul = raid6_gfmul[pbmul_coef];
+	const u8 *qmul = raid6_gfmul[qmul_coef];
+	u8 px, qx, db;
+
+	while (bytes--) {
+		px = *p ^ *dp;
+		qx = qmul[*q ^ *dq];
+		*dq++ = db = pbmul[px] ^ qx;
+		*dp++ = db ^ px;
+		p++;
+		q++;
+	}
+}
+
+static void raid6_int_datap_recov(size_t bytes, u8 *p, u8 *q, u8 *dq,
+				  u8 qmul_coef)
+{
+	const u8 *qmul = raid6_gfmul[qmul_coef];
+
+	while (bytes--) {
+		*p++ ^= *dq = qmul[*q ^ *dq];
+		q++;
+		dq++;
+	}
+}
+
+static int raid6_int_valid(void)
+{
+	return 1;
+}
+
+#ifdef RAID6_X86
+static int raid6_sse2_valid(void)
+{
+	return __builtin_cpu_supports("sse2");
+}
+
+static int raid6_ssse3_valid(void)
+{
+	return __builtin_cpu_supports("ssse3");
+}
+
+static int raid6_avx2_valid(void)
+{
+	return __builtin_cpu_supports("avx2");
+}
+
+/* Same algorithm as the integer version, 2x unrolled over 16 byte lanes */
+__attribute__((target("sse2")))
+static void raid6_sse2_gen_syndrome(int disks, size_t bytes, void **ptrs)
+{
+	u8 **dptr = (u8 **)ptrs;
+	u8 *p, *q;
+	int z, z0;
+	size_t d;
+	const __m128i poly = _mm_set1_epi8(0x1d);
+	const __m128i zero = _mm_setzero_si128();
+	__m128i wd0, wp0, wq0, w20;
+	__m128i wd1, wp1, wq1, w21;
+
+	z0 = disks - 3;
+	p = dptr[z0 + 1];
+	q = dptr[z0 + 2];
+
+	for (d = 0; d + 32 <= bytes; d += 32) {
+		wq0 = wp0 = _mm_loadu_si128((__m128i *)&dptr[z0][d]);
+		wq1 = wp1 = _mm_loadu_si128((__m128i *)&dptr[z0][d + 16]);
+		for (z = z0 - 1; z >= 0; z--) {
+			wd0 = _mm_loadu_si128((__m128i *)&dptr[z][d]);
+			wd1 = _mm_loadu_si128((__m128i *)&dptr[z][d + 16]);
+			wp0 = _mm_xor_si128(wp0, wd0);
+			wp1 = _mm_xor_si128(wp1, wd1);
+			w20 = _mm_and_si128(_mm_cmpgt_epi8(zero, wq0), poly);
+			w21 = _mm_and_si128(_mm_cmpgt_epi8(zero, wq1), poly);
+			wq0 = _mm_add_epi8(wq0, wq0);
+			wq1 = _mm_add_epi8(wq1, wq1);
+			wq0 = _mm_xor_si128(_mm_xor_si128(wq0, w20), wd0);
+			wq1 = _mm_xor_si128(_mm_xor_si128(wq1, w21), wd1);
+		}
+		_mm_storeu_si128((__m128i *)&p[d], wp0);
+		_mm_storeu_si128((__m128i *)&p[d + 16], wp1);
+		_mm_storeu_si128((__m128i *)&q[d], wq0);
+		_mm_storeu_si128((__m128i *)&q[d + 16], wq1);
+	}
+	gen_syndrome_tail(disks, d, bytes, ptrs);
+}
+
+__attribute__((target("avx2")))
+static void raid6_avx2_gen_syndrome(int disks, size_t bytes, void **ptrs)
+{
+	u8 **dptr = (u8 **)ptrs;
+	u8 *p, *q;
+	int z, z0;
+	size_t d;
+	const __m256i poly = _mm256_set1_epi8(0x1d);
+	const __m256i zero = _mm256_setzero_si256();
+	__m256i wd0, wp0, wq0, w20;
+	__m256i wd1, wp1, wq1, w21;
+
+	z0 = disks - 3;
+	p = dptr[z0 + 1];
+	q = dptr[z0 + 2];
+
+	for (d = 0; d + 64 <= bytes; d += 64) {
+		wq0 = wp0 = _mm256_loadu_si256((__m256i *)&dptr[z0][d]);
+		wq1 = wp1 = _mm256_loadu_si256((__m256i *)&dptr[z0][d + 32]);
+		for (z = z0 - 1; z >= 0; z--) {
+			wd0 = _mm256_loadu_si256((__m256i *)&dptr[z][d]);
+			wd1 = _mm256_loadu_si256((__m256i *)&dptr[z][d + 32]);
+			wp0 = _mm256_xor_si256(wp0, wd0);
+			wp1 = _mm256_xor_si256(wp1, wd1);
+			w20 = _mm256_and_si256(_mm256_cmpgt_epi8(zero, wq0),
+					       poly);
+			w21 = _mm256_and_si256(_mm256_cmpgt_epi8(zero, wq1),
+					       poly);
+			wq0 = _mm256_add_epi8(wq0, wq0);
+			wq1 = _mm256_add_epi8(wq1, wq1);
+			wq0 = _mm256_xor_si256(_mm256_xor_si256(wq0, w20), wd0);
+			wq1 = _mm256_xor_si256(_mm256_xor_si256(wq1, w21), wd1);
+		}
+		_mm256_storeu_si256((__m256i *)&p[d], wp0);
+		_mm256_storeu_si256((__m256i *)&p[d + 32], wp1);
+		_mm256_storeu_si256((__m256i *)&q[d], wq0);
+		_mm256_storeu_si256((__m256i *)&q[d + 32], wq1);
+	}
+	gen_syndrome_tail(disks, d, bytes, ptrs);
+}
+
+/* multiply every byte of @x by the constant whose pshufb tables are given */
+__attribute__((target("ssse3")))
+static inline __m128i ssse3_gfmul(__m128i x, __m128i tlo, __m128i thi)
+{
+	const __m128i x0f = _mm_set1_epi8(0x0f);
+	__m128i lo = _mm_and_si128(x, x0f);
+	__m128i hi = _mm_and_si128(_mm_srli_epi16(x, 4), x0f);
+
+	return _mm_xor_si128(_mm_shuffle_epi8(tlo, lo),
+			     _mm_shuffle_epi8(thi, hi));
+}
+
+__attribute__((target("ssse3")))
+static void raid6_ssse3_2data_recov(size_t bytes, u8 *p, u8 *q, u8 *dp,
+				    u8 *dq, u8 pbmul_coef, u8 qmul_coef)
+{
+	const __m128i pb_lo = _mm_load_si128((__m128i *)raid6_vgfmul[pbmul_coef]);
+	const __m128i pb_hi = _mm_load_si128((__m128i *)&raid6_vgfmul[pbmul_coef][16]);
+	const __m128i q_lo = _mm_load_si128((__m128i *)raid6_vgfmul[qmul_coef]);
+	const __m128i q_hi = _mm_load_si128((__m128i *)&raid6_vgfmul[qmul_coef][16]);
+	__m128i px, qx, db;
+	size_t d;
+
+	for (d = 0; d + 16 <= bytes; d += 16) {
+		px = _mm_xor_si128(_mm_loadu_si128((__m128i *)&p[d]),
+				   _mm_loadu_si128((__m128i *)&dp[d]));
+		qx = _mm_xor_si128(_mm_loadu_si128((__m128i *)&q[d]),
+				   _mm_loadu_si128((__m128i *)&dq[d]));
+		qx = ssse3_gfmul(qx, q_lo, q_hi);
+		db = _mm_xor_si128(ssse3_gfmul(px, pb_lo, pb_hi), qx);
+		_mm_storeu_si128((__m128i *)&dq[d], db);
+		_mm_storeu_si128((__m128i *)&dp[d], _mm_xor_si128(db, px));
+	}
+	raid6_int_2data_recov(bytes - d, p + d, q + d, dp + d, dq + d,
+			      pbmul_coef, qmul_coef);
+}
+
+__attribute__((target("ssse3")))
+static void raid6_ssse3_datap_recov(size_t bytes, u8 *p, u8 *q, u8 *dq,
+				    u8 qmul_coef)
+{
+	const __m128i q_lo = _mm_load_si128((__m128i *)raid6_vgfmul[qmul_coef]);
+	const __m128i q_hi = _mm_load_si128((__m128i *)&raid6_vgfmul[qmul_coef][16]);
+	__m128i qx;
+	size_t d;
+
+	for (d = 0; d + 16 <= bytes; d += 16) {
+		qx = _mm_xor_si128(_mm_loadu_si128((__m128i *)&q[d]),
+				   _mm_loadu_si128((__m128i *)&dq[d]));
+		qx = ssse3_gfmul(qx, q_lo, q_hi);
+		_mm_storeu_si128((__m128i *)&dq[d], qx);
+		_mm_storeu_si128((__m128i *)&p[d],
+			_mm_xor_si128(_mm_loadu_si128((__m128i *)&p[d]), qx));
+	}
+	raid6_int_datap_recov(bytes - d, p + d, q + d, dq + d, qmul_coef);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i avx2_gfmul(__m256i x, __m256i tlo, __m256i thi)
+{
+	const __m256i x0f = _mm256_set1_epi8(0x0f);
+	__m256i lo = _mm256_and_si256(x, x0f);
+	__m256i hi = _mm256_and_si256(_mm256_srli_epi16(x, 4), x0f);
+
+	return _mm256_xor_si256(_mm256_shuffle_epi8(tlo, lo),
+				_mm256_shuffle_epi8(thi, hi));
+}
+
+/* the 16 byte table repeated in both 128 bit lanes, pshufb is per lane */
+__attribute__((target("avx2")))
+static inline __m256i avx2_load_table(const u8 *table)
+{
+	return _mm256_broadcastsi128_si256(_mm_load_si128((__m128i *)table));
+}
+
+__attribute__((target("avx2")))
+static void raid6_avx2_2data_recov(size_t bytes, u8 *p, u8 *q, u8 *dp,
+				   u8 *dq, u8 pbmul_coef, u8 qmul_coef)
+{
+	const __m256i pb_lo = avx2_load_table(raid6_vgfmul[pbmul_coef]);
+	const __m256i pb_hi = avx2_load_table(&raid6_vgfmul[pbmul_coef][16]);
+	const __m256i q_lo = avx2_load_table(raid6_vgfmul[qmul_coef]);
+	const __m256i q_hi = avx2_load_table(&raid6_vgfmul[qmul_coef][16]);
+	__m256i px, qx, db;
+	size_t d;
+
+	for (d = 0; d + 32 <= bytes; d += 32) {
+		px = _mm256_xor_si256(_mm256_loadu_si256((__m256i *)&p[d]),
+				      _mm256_loadu_si256((__m256i *)&dp[d]));
+		qx = _mm256_xor_si256(_mm256_loadu_si256((__m256i *)&q[d]),
+				      _mm256_loadu_si256((__m256i *)&dq[d]));
+		qx = avx2_gfmul(qx, q_lo, q_hi);
+		db = _mm256_xor_si256(avx2_gfmul(px, pb_lo, pb_hi), qx);
+		_mm256_storeu_si256((__m256i *)&dq[d], db);
+		_mm256_storeu_si256((__m256i *)&dp[d],
+				    _mm256_xor_si256(db, px));
+	}
+	raid6_int_2data_recov(bytes - d, p + d, q + d, dp + d, dq + d,
+			      pbmul_coef, qmul_coef);
+}
+
+__attribute__((target("avx2")))
+static void raid6_avx2_datap_recov(size_t bytes, u8 *p, u8 *q, u8 *dq,
+				   u8 qmul_coef)
+{
+	const __m256i q_lo = avx2_load_table(raid6_vgfmul[qmul_coef]);
+	const __m256i q_hi = avx2_load_table(&raid6_vgfmul[qmul_coef][16]);
+	__m256i qx;
+	size_t d;
+
+	for (d = 0; d + 32 <= bytes; d += 32) {
+		qx = _mm256_xor_si256(_mm256_loadu_si256((__m256i *)&q[d]),
+				      _mm256_loadu_si256((__m256i *)&dq[d]));
+		qx = avx2_gfmul(qx, q_lo, q_hi);
+		_mm256_storeu_si256((__m256i *)&dq[d], qx);
+		_mm256_storeu_si256((__m256i *)&p[d],
+			_mm256_xor_si256(_mm256_loadu_si256((__m256i *)&p[d]),
+					 qx));
+	}
+	raid6_int_datap_recov(bytes - d, p + d, q + d, dq + d, qmul_coef);
+}
+#endif
+
+/* best first, the integer versions always work */
+const struct raid6_calls raid6_gen_algos[] = {
+#ifdef RAID6_X86
+	{ .gen_syndrome = raid6_avx2_gen_syndrome,
+	  .valid = raid6_avx2_valid, .name = "avx2x2" },
+	{ .gen_syndrome = raid6_sse2_gen_syndrome,
+	  .valid = raid6_sse2_valid, .name = "sse2x2" },
+#endif
+	{ .gen_syndrome = raid6_int_gen_syndrome,
+	  .valid = raid6_int_valid, .name = "int" },
+	{ .name = NULL }
+};
+
+const struct raid6_recov_calls raid6_recov_algos[] = {
+#ifdef RAID6_X86
+	{ .data2 = raid6_avx2_2data_recov, .datap = raid6_avx2_datap_recov,
+	  .valid = raid6_avx2_valid, .name = "avx2" },
+	{ .data2 = raid6_ssse3_2data_recov, .datap = raid6_ssse3_datap_recov,
+	  .valid = raid6_ssse3_valid, .name = "ssse3" },
+#endif
+	{ .data2 = raid6_int_2data_recov, .datap = raid6_int_datap_recov,
+	  .valid = raid6_int_valid, .name = "int" },
+	{ .name = NULL }
+};
+
+static const struct raid6_calls *raid6_call;
+static const struct raid6_recov_calls *raid6_recov_call;
+
+static void raid6_select_algos(void)
+{
+	const struct raid6_calls *gen;
+	const struct raid6_recov_calls *recov;
+
+	raid6_init_tables();
+	for (gen = raid6_gen_algos; gen->name; gen++)
+		if (gen->valid())
+			break;
+	for (recov = raid6_recov_algos; recov->name; recov++)
+		if (recov->valid())
+			break;
+	raid6_call = gen;
+	raid6_recov_call = recov;
+}
+
+static inline void raid6_init(void)
+{
+	pthread_once(&raid6_tables_once, raid6_select_algos);
+}
+
+/*
+ * Force the implementations used by the functions below, NULL keeps the
+ * current choice.  Meant for testing and benchmarking.
+ */
+void raid6_set_algos(const struct raid6_calls *gen,
+		     const struct raid6_recov_calls *recov)
+{
+	raid6_init();
+	if (gen)
+		raid6_call = gen;
+	if (recov)
+		raid6_recov_call = recov;
+}
+
+/*
+ * Generate P and Q of @disks stripes of @bytes each, ptrs[disks - 2] and
+ * ptrs[disks - 1] receive P and Q.
+ */
+void raid6_gen_syndrome(int disks, size_t bytes, void **ptrs)
+{
+	raid6_init();
+	raid6_call->gen_syndrome(disks, bytes, ptrs);
+}
+
+/* rebuild stripe @dest as the XOR of all the other @disks stripes */
+void raid5_gen_result(int disks, size_t bytes, int dest, void **ptrs)
+{
+	unsigned long *d = ptrs[dest];
+	size_t words = bytes / sizeof(unsigned long);
+	size_t i;
+	int j;
+
+	memset(ptrs[dest], 0, bytes);
+	for (j = 0; j < disks; j++) {
+		unsigned long *s = ptrs[j];
+
+		if (j == dest)
+			continue;
+		for (i = 0; i < words; i++)
+			d[i] ^= s[i];
+		for (i = words * sizeof(unsigned long); i < bytes; i++)
+			((u8 *)ptrs[dest])[i] ^= ((u8 *)ptrs[j])[i];
+	}
+}
+
+/*
+ * Recover two failed data stripes @faila < @failb from the others and P/Q,
+ * ptrs[disks - 2] and ptrs[disks - 1] are P and Q.
+ */
+int raid6_recov_data2(int disks, size_t bytes, int faila, int failb,
+		      void **ptrs)
+{
+	u8 *p, *q, *dp, *dq;
+	void *zero;
+
+	if (faila > failb) {
+		int tmp = faila;
+
+		faila = failb;
+		failb = tmp;
+	}
+	zero = calloc(1, bytes);
+	if (!zero)
+		return -ENOMEM;
+	raid6_init();
+
+	p = ptrs[disks - 2];
+	q = ptrs[disks - 1];
+
+	/*
+	 * Compute the syndrome with zero for the missing data stripes, using
+	 * the dead stripes as temporary storage for delta P and delta Q
+	 */
+	dp = ptrs[faila];
+	ptrs[faila] = zero;
+	ptrs[disks - 2] = dp;
+	dq = ptrs[failb];
+	ptrs[failb] = zero;
+	ptrs[disks - 1] = dq;
+
+	raid6_call->gen_syndrome(disks, bytes, ptrs);
+
+	ptrs[faila] = dp;
+	ptrs[failb] = dq;
+	ptrs[disks - 2] = p;
+	ptrs[disks - 1] = q;
+
+	raid6_recov_call->data2(bytes, p, q, dp, dq,
+		raid6_gfexi[failb - faila],
+		raid6_gfinv[raid6_gfexp[faila] ^ raid6_gfexp[failb]]);
+	free(zero);
+	return 0;
+}
+
+/* Recover a failed data stripe @faila and P from the others and Q */
+int raid6_recov_datap(int disks, size_t bytes, int faila, void **ptrs)
+{
+	u8 *p, *q, *dq;
+	void *zero;
+
+	zero = calloc(1, bytes);
+	if (!zero)
+		return -ENOMEM;
+	raid6_init();
+
+	p = ptrs[disks - 2];
+	q = ptrs[disks - 1];
+
+	/* the dead stripe holds delta Q, P is regenerated in place */
+	dq = ptrs[faila];
+	ptrs[faila] = zero;
+	ptrs[disks - 1] = dq;
+
+	raid6_call->gen_syndrome(disks, bytes, ptrs);
+
+	ptrs[faila] = dq;
+	ptrs[disks - 1] = q;
+
+	raid6_recov_call->datap(bytes, p, q, dq,
+				raid6_gfinv[raid6_gfexp[faila]]);
+	free(zero);
+	return 0;
+}
+
+/*
+ * Rebuild up to two failed stripes @faila and @failb (-1 if unused) of a
+ * RAID5 or RAID6 full stripe, the parity stripes are the last one (RAID5) or
+ * two (RAID6) in @ptrs.
+ */
+int raid56_recov(int disks, size_t bytes, u64 profile, int faila, int failb,
+		 void **ptrs)
+{
+	int p_stripe;
+	int q_stripe;
+
+	if (faila > failb) {
+		int tmp = faila;
+
+		faila = failb;
+		failb = tmp;
+	}
+	if (faila < 0) {
+		faila = failb;
+		failb = -1;
+	}
+	if (faila < 0)
+		return 0;
+
+	if (profile & BTRFS_BLOCK_GROUP_RAID5) {
+		if (failb >= 0)
+			return -EIO;
+		raid5_gen_result(disks, bytes, faila, ptrs);
+		return 0;
+	}
+	if (!(profile & BTRFS_BLOCK_GROUP_RAID6))
+		return -EINVAL;
+
+	p_stripe = disks - 2;
+	q_stripe = disks - 1;
+
+	/* only P and/or Q lost, regenerate them */
+	if (faila >= p_stripe) {
+		raid6_gen_syndrome(disks, bytes, ptrs);
+		return 0;
+	}
+	/* one data stripe, with or without Q, P is enough */
+	if (failb < 0 || failb == q_stripe) {
+		raid5_gen_result(disks - 1, bytes, faila, ptrs);
+		if (failb == q_stripe)
+			raid6_gen_syndrome(disks, bytes, ptrs);
+		return 0;
+	}
+	if (failb == p_stripe)
+		return raid6_recov_datap(disks, bytes, faila, ptrs);
+	return raid6_recov_data2(disks, bytes, faila, failb, ptrs);
+}
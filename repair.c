@@ -21,15 +21,14 @@
 #include "utils.h"
 #include "repair.h"
 
-int btrfs_add_corrupt_extent_record(struct btrfs_fs_info *info,
-				    struct btrfs_key *first_key,
-				    u64 start, u64 len, int level)
-
+int btrfs_add_corrupt_block(struct cache_tree *corrupt_blocks,
+			    struct btrfs_key *first_key,
+			    u64 start, u64 len, int level)
 {
 	int ret = 0;
 	struct btrfs_corrupt_block *corrupt;
 
-	if (!info->corrupt_blocks)
+	if (!corrupt_blocks)
 		return 0;
 
 	corrupt = malloc(sizeof(*corrupt));
@@ -41,10 +40,18 @@ int btrfs_add_corrupt_extent_record(struct btrfs_fs_info *info,
 	corrupt->cache.size = len;
 	corrupt->level = level;
 
-	ret = insert_cache_extent(info->corrupt_blocks, &corrupt->cache);
+	ret = insert_cache_extent(corrupt_blocks, &corrupt->cache);
 	if (ret)
 		free(corrupt);
 	BUG_ON(ret && ret != -EEXIST);
 	return ret;
 }
 
+int btrfs_add_corrupt_extent_record(struct btrfs_fs_info *info,
+				    struct btrfs_key *first_key,
+				    u64 start, u64 len, int level)
+{
+	return btrfs_add_corrupt_block(info->corrupt_blocks, first_key,
+				       start, len, level);
+}
+
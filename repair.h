@@ -27,6 +27,9 @@ struct btrfs_corrupt_block {
 	int level;
 };
 
+int btrfs_add_corrupt_block(struct cache_tree *corrupt_blocks,
+			    struct btrfs_key *first_key,
+			    u64 start, u64 len, int level);
 int btrfs_add_corrupt_extent_record(struct btrfs_fs_info *info,
 				    struct btrfs_key *first_key,
 				    u64 start, u64 len, int level);
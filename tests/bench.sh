@@ -0,0 +1,268 @@
+#!/bin/bash
+#
+# time the offline tools on synthetic filesystems and write the results as
+# JSON, to catch performance regressions
+#
+# usage: bench.sh [profile...], all the profiles are run by default
+#
+# BENCH_RUNS   how many times each tool is run, default 3
+# BENCH_OUT    the JSON results, default tests/bench-results.json
+# BENCH_DIR    where the images are made, default tests/bench
+# BENCH_CODECS the btrfs-image -c methods to compare, those not built in are
+#              skipped, default "none zlib:1 zlib:6 zstd:1 zstd:3 lz4:1 lz4:9"
+# BENCH_IO_DEPTHS the btrfs check --io-depth values to compare, default
+#              "1 8 32", the page cache is dropped before those runs when
+#              running as root
+#
+# It's GPL, same as everything else in this tree.
+#
+
+unset TOP
+unset LANG
+LANG=C
+SCRIPT_DIR=$(dirname $(readlink -f $0))
+TOP=$(readlink -f $SCRIPT_DIR/../)
+RESULTS="$TOP/tests/bench-results.txt"
+BENCH_RUNS=${BENCH_RUNS:-3}
+BENCH_OUT=${BENCH_OUT:-$TOP/tests/bench-results.json}
+BENCH_DIR=${BENCH_DIR:-$TOP/tests/bench}
+BENCH_CODECS=${BENCH_CODECS:-none zlib:1 zlib:6 zstd:1 zstd:3 lz4:1 lz4:9}
+BENCH_IO_DEPTHS=${BENCH_IO_DEPTHS:-1 8 32}
+
+source $TOP/tests/common
+
+export TOP
+export RESULTS
+export LANG
+
+# name, size of the image, options of bench-fs
+PROFILES="
+small-files	1g	-i 50000 -s 0:4k
+mixed		2g	-i 10000 -s 0:256k
+reflinks	2g	-i 10000 -s 4k:256k -r 50
+fragmented	2g	-i 2000 -s 64k:1m -f 50
+snapshots	2g	-i 20000 -s 0:64k -n 20 -c 2
+qgroups		2g	-i 20000 -s 0:64k -r 20 -n 20 -c 2 -q
+"
+
+rm -f $RESULTS
+mkdir -p $BENCH_DIR || _fail "unable to create $BENCH_DIR"
+
+check_prereq btrfs
+check_prereq mkfs.btrfs
+check_prereq btrfs-image
+check_prereq btrfs-calc-size
+check_prereq btrfs-debug-tree
+check_prereq btrfs-show-super
+check_prereq bench-fs
+
+image=$BENCH_DIR/bench.img
+dump=$BENCH_DIR/bench.dump
+restored=$BENCH_DIR/restored.img
+restore_dir=$BENCH_DIR/restore
+
+now()
+{
+	date +%s%N
+}
+
+seconds()
+{
+	awk -v ns=$1 'BEGIN { printf "%.3f", ns / 1000000000 }'
+}
+
+json_string()
+{
+	local str=${1//\\/\\\\}
+
+	echo -n "\"${str//\"/\\\"}\""
+}
+
+# the restored files are removed after each run, it is not timed
+cleanup_restore()
+{
+	rm -rf $restore_dir
+	mkdir -p $restore_dir
+}
+
+# time_tool name command..., all the runs are appended to the JSON results,
+# with the size of $output_file when it is set and the rate of $tree_blocks
+# read when it is set.  The page cache is dropped before each run when
+# $drop_caches is set.
+time_tool()
+{
+	local name=$1
+	local times=()
+	local status=0
+	local start
+	local ret
+	local i
+
+	shift
+	echo "    [BENCH]  $profile $name"
+	for ((i = 0; i < BENCH_RUNS; i++)); do
+		[ "$name" = restore ] && cleanup_restore
+		if [ -n "$drop_caches" ]; then
+			sync
+			echo 3 > /proc/sys/vm/drop_caches
+		fi
+		echo "############### $@" >> $RESULTS
+		start=$(now)
+		# restore asks whether to go on with files of many extents
+		if [ "$name" = restore ]; then
+			yes a | "$@" >> $RESULTS 2>&1
+			ret=${PIPESTATUS[1]}
+		else
+			"$@" >> $RESULTS 2>&1
+			ret=$?
+		fi
+		times+=($(( $(now) - start )))
+		[ $ret -ne 0 ] && status=$ret
+	done
+	[ $status -ne 0 ] && echo "    [FAILED] $name exited with $status"
+
+	sorted=($(printf "%s\n" "${times[@]}" | sort -n))
+	echo -n "$tool_sep{\"name\": $(json_string $name)," >> $BENCH_OUT
+	echo -n " \"command\": $(json_string "${*#$TOP/}")," >> $BENCH_OUT
+	echo -n " \"status\": $status, \"seconds\": [" >> $BENCH_OUT
+	sep=
+	for i in "${times[@]}"; do
+		echo -n "$sep$(seconds $i)" >> $BENCH_OUT
+		sep=", "
+	done
+	echo -n "], \"min\": $(seconds ${sorted[0]})," >> $BENCH_OUT
+	echo -n " \"median\": $(seconds ${sorted[$(( BENCH_RUNS / 2 ))]})" >> $BENCH_OUT
+	if [ -n "$output_file" ]; then
+		echo -n ", \"output_bytes\": $(stat -c %s $output_file)" >> $BENCH_OUT
+	fi
+	if [ -n "$tree_blocks" ]; then
+		echo -n ", \"tree_blocks\": $tree_blocks, \"blocks_per_sec\": " >> $BENCH_OUT
+		awk -v blocks=$tree_blocks -v ns=${sorted[$(( BENCH_RUNS / 2 ))]} \
+			'BEGIN { printf "%.0f", blocks * 1000000000 / ns }' >> $BENCH_OUT
+	fi
+	echo -n "}" >> $BENCH_OUT
+	tool_sep=",
+		"
+}
+
+# the codecs of BENCH_CODECS that btrfs-image was built with
+image_codecs()
+{
+	local methods=" "$($TOP/btrfs-image --help 2>&1 | \
+			   sed -n 's/^[[:space:]]*\([a-z0-9]*\): level.*/\1/p' | \
+			   tr '\n' ' ')
+	local codec
+
+	for codec in $BENCH_CODECS; do
+		if [ $codec = none ] || [[ "$methods" =~ " ${codec%%:*} " ]]; then
+			echo $codec
+		fi
+	done
+}
+
+# dump and restore the image with each codec, the dump size is recorded too
+time_image()
+{
+	local codec
+	local name
+	local opt
+
+	# the uncompressed runs keep the names they always had
+	for codec in $(image_codecs); do
+		name=-$codec
+		opt="-c $codec"
+		if [ $codec = none ]; then
+			name=
+			opt="-c 0"
+		fi
+		output_file=$dump
+		time_tool image-dump$name $TOP/btrfs-image $opt $image $dump
+		output_file=
+		time_tool image-restore$name $TOP/btrfs-image -r $dump $restored
+	done
+}
+
+# the tree blocks btrfs check reads, from the tree bytes it reports
+count_tree_blocks()
+{
+	local bytes
+	local nodesize
+
+	bytes=$($TOP/btrfs check $image 2>&1 | \
+		awk '/^total tree bytes:/ { print $4 }')
+	nodesize=$($TOP/btrfs-show-super $image | awk '/^nodesize/ { print $2 }')
+	echo $(( ${bytes:-0} / nodesize ))
+}
+
+# btrfs check at each queue depth, from a cold page cache when possible
+time_io_depth()
+{
+	local depth
+
+	tree_blocks=$(count_tree_blocks)
+	[ $UID -eq 0 ] && drop_caches=1
+	for depth in $BENCH_IO_DEPTHS; do
+		time_tool check-io-depth-$depth $TOP/btrfs check \
+			--io-depth $depth $image
+	done
+	tree_blocks=
+	drop_caches=
+}
+
+run_profile()
+{
+	local size=$1
+	local start
+
+	shift
+	echo "    [BENCH]  $profile generate"
+	rm -f $image
+	run_check truncate -s $size $image
+	run_check $TOP/mkfs.btrfs -f $image
+	start=$(now)
+	run_check $TOP/bench-fs "$@" $image
+	generate=$(seconds $(( $(now) - start )))
+
+	echo "$profile_sep{\"name\": $(json_string $profile)," >> $BENCH_OUT
+	echo "	\"size\": $(json_string $size)," >> $BENCH_OUT
+	echo "	\"options\": $(json_string "$*")," >> $BENCH_OUT
+	echo "	\"image_bytes\": $(du -B1 $image | cut -f1)," >> $BENCH_OUT
+	echo "	\"generate_seconds\": $generate," >> $BENCH_OUT
+	echo -n "	\"tools\": [
+		" >> $BENCH_OUT
+	tool_sep=
+
+	time_tool check $TOP/btrfs check $image
+	time_tool check-data-csum $TOP/btrfs check --check-data-csum $image
+	time_io_depth
+	if [[ " $* " =~ " -q " ]]; then
+		time_tool qgroup-report $TOP/btrfs check --qgroup-report $image
+		time_tool qgroup-report-j4 $TOP/btrfs check -j 4 --qgroup-report $image
+	fi
+	time_tool restore $TOP/btrfs restore -s $image $restore_dir
+	time_image
+	time_tool calc-size $TOP/btrfs-calc-size $image
+	time_tool debug-tree $TOP/btrfs-debug-tree $image
+
+	echo -n "]}" >> $BENCH_OUT
+	profile_sep=",
+"
+	rm -rf $image $dump $restored $restore_dir
+}
+
+echo "{\"version\": $(json_string "$($TOP/btrfs version 2>&1)")," > $BENCH_OUT
+echo "\"date\": $(json_string "$(date -u +%Y-%m-%dT%H:%M:%SZ)")," >> $BENCH_OUT
+echo "\"runs\": $BENCH_RUNS," >> $BENCH_OUT
+echo "\"profiles\": [" >> $BENCH_OUT
+profile_sep=
+
+while read profile size options; do
+	[ -z "$profile" ] && continue
+	if [ $# -gt 0 ] && ! [[ " $* " =~ " $profile " ]]; then
+		continue
+	fi
+	run_profile $size $options
+done <<< "$PROFILES"
+
+echo "]}" >> $BENCH_OUT
+echo "    [BENCH]  results in $BENCH_OUT"
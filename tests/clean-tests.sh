@@ -14,6 +14,7 @@ if ! cd $TOP/tests; then
 fi
 
 find fsck-tests -type f -name '*.restored' $verbose -delete
+rm -f indexed-image.dump
 
 # do not remove, the file could have special permissions set
 echo -n > test.img
@@ -0,0 +1,72 @@
+#!/bin/bash
+# check an image dumped with --index against the filesystem it comes from,
+# the free space caches written by the kernel are read from the image
+
+source $TOP/tests/common
+
+check_prereq btrfs-show-super
+check_prereq btrfs-image
+check_prereq mkfs.btrfs
+check_prereq btrfs
+setup_root_helper
+
+if [ -z $TEST_DEV ]; then
+	echo "\$TEST_DEV not given, use $TOP/test/test.img as fallback" >> \
+		$RESULTS
+	TEST_DEV="$TOP/tests/test.img"
+
+	# Need at least 1G to avoid mixed block group, which extent tree
+	# rebuild doesn't support.
+	run_check truncate -s 1G $TEST_DEV
+fi
+
+if [ -z $TEST_MNT ];then
+	echo "    [NOTRUN] indexed image, need TEST_MNT variant"
+	exit 0
+fi
+
+IMAGE_DUMP="$TOP/tests/indexed-image.dump"
+
+get_super_value()
+{
+	$TOP/btrfs-show-super "$1" | grep "^$2\>" | awk '{print $2}'
+}
+
+# btrfs check, without the lines naming the device or timing the reads
+check_output()
+{
+	echo "############### $TOP/btrfs check $1" >> $RESULTS
+	$SUDO_HELPER $TOP/btrfs check "$1" 2>&1 | tee -a $RESULTS | \
+		grep -v '^Checking filesystem on\|^tree block cache'
+}
+
+test_indexed_image()
+{
+	local expected
+	local output
+
+	run_check $SUDO_HELPER $TOP/mkfs.btrfs -f $TEST_DEV
+	$SUDO_HELPER mount -o space_cache $TEST_DEV $TEST_MNT >> $RESULTS 2>&1 ||
+		_not_run "cannot mount $TEST_DEV"
+	run_check $SUDO_HELPER cp -aR $TOP/Documentation $TEST_MNT
+	run_check $SUDO_HELPER umount $TEST_MNT
+
+	if [ "$(get_super_value $TEST_DEV generation)" != \
+	     "$(get_super_value $TEST_DEV cache_generation)" ]; then
+		_not_run "the kernel did not write a space cache"
+	fi
+
+	rm -f $IMAGE_DUMP
+	run_check $SUDO_HELPER $TOP/btrfs-image --index $TEST_DEV $IMAGE_DUMP
+	run_check $SUDO_HELPER $TOP/btrfs check $TEST_DEV
+	run_check $SUDO_HELPER $TOP/btrfs check $IMAGE_DUMP
+
+	expected=$(check_output $TEST_DEV)
+	output=$(check_output $IMAGE_DUMP)
+	if [ "$output" != "$expected" ]; then
+		_fail "FAIL: btrfs check of the image differs"
+	fi
+	rm -f $IMAGE_DUMP
+}
+
+test_indexed_image
@@ -0,0 +1,319 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+/*
+ * Verify the ulist against the list and rbtree based one it replaced, kept
+ * here as the reference, and compare their speed on small, medium and large
+ * sets.  Both must return the same values in the same order.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "kerncompat.h"
+#include "list.h"
+#include "rbtree.h"
+#include "ulist.h"
+
+struct ref_ulist_node {
+	u64 val;
+	u64 aux;
+	struct list_head list;
+	struct rb_node rb_node;
+};
+
+struct ref_ulist {
+	unsigned long nnodes;
+	struct list_head nodes;
+	struct rb_root root;
+};
+
+static void ref_ulist_init(struct ref_ulist *ulist)
+{
+	INIT_LIST_HEAD(&ulist->nodes);
+	ulist->root = RB_ROOT;
+	ulist->nnodes = 0;
+}
+
+static void ref_ulist_reinit(struct ref_ulist *ulist)
+{
+	struct ref_ulist_node *node;
+	struct ref_ulist_node *next;
+
+	list_for_each_entry_safe(node, next, &ulist->nodes, list)
+		free(node);
+	ref_ulist_init(ulist);
+}
+
+static int ref_ulist_add_merge(struct ref_ulist *ulist, u64 val, u64 aux,
+			       u64 *old_aux)
+{
+	struct rb_node **p = &ulist->root.rb_node;
+	struct rb_node *parent = NULL;
+	struct ref_ulist_node *cur;
+	struct ref_ulist_node *node;
+
+	while (*p) {
+		parent = *p;
+		cur = rb_entry(parent, struct ref_ulist_node, rb_node);
+		if (cur->val < val) {
+			p = &(*p)->rb_right;
+		} else if (cur->val > val) {
+			p = &(*p)->rb_left;
+		} else {
+			if (old_aux)
+				*old_aux = cur->aux;
+			return 0;
+		}
+	}
+	node = malloc(sizeof(*node));
+	if (!node)
+		return -ENOMEM;
+	node->val = val;
+	node->aux = aux;
+	rb_link_node(&node->rb_node, parent, p);
+	rb_insert_color(&node->rb_node, &ulist->root);
+	list_add_tail(&node->list, &ulist->nodes);
+	ulist->nnodes++;
+	return 1;
+}
+
+static struct ref_ulist_node *ref_ulist_next(struct ref_ulist *ulist,
+					     struct list_head **cur_list)
+{
+	if (list_empty(&ulist->nodes))
+		return NULL;
+	if (*cur_list && (*cur_list)->next == &ulist->nodes)
+		return NULL;
+	if (*cur_list)
+		*cur_list = (*cur_list)->next;
+	else
+		*cur_list = ulist->nodes.next;
+	return list_entry(*cur_list, struct ref_ulist_node, list);
+}
+
+static u64 rand_state = 0x2545F4914F6CDD1DULL;
+
+static u64 next_rand(void)
+{
+	rand_state ^= rand_state >> 12;
+	rand_state ^= rand_state << 25;
+	rand_state ^= rand_state >> 27;
+	return rand_state * 0x2545F4914F6CDD1DULL;
+}
+
+/*
+ * A workload adds @nr_adds values drawn among @nr_values, to sets emptied
+ * and refilled @rounds times, a few million adds in all.  Values are
+ * multiples of 4096 like bytenrs.
+ */
+struct workload {
+	const char *name;
+	unsigned long nr_values;
+	unsigned long nr_adds;
+	unsigned long rounds;
+};
+
+static const struct workload workloads[] = {
+	{ "1 of 2",	2,		2,		2000000 },
+	{ "4 of 8",	8,		4,		1000000 },
+	{ "8 of 16",	16,		16,		250000 },
+	{ "64 of 128",	128,		128,		30000 },
+	{ "1k of 4k",	4096,		1024,		4000 },
+	{ "1M of 2M",	2 * 1024 * 1024, 2 * 1024 * 1024, 2 },
+};
+
+static u64 *vals;
+
+static void fill_values(const struct workload *w)
+{
+	unsigned long i;
+
+	for (i = 0; i < w->nr_adds; i++)
+		vals[i] = (next_rand() % w->nr_values) * 4096;
+}
+
+static int verify(const struct workload *w)
+{
+	struct ulist *ulist = ulist_alloc(0);
+	struct ref_ulist ref;
+	struct ulist_iterator uiter;
+	struct ulist_node *node;
+	struct ref_ulist_node *ref_node;
+	u64 old_aux, ref_old_aux;
+	unsigned long i;
+	int ret, ref_ret;
+	int round;
+
+	if (!ulist)
+		return -ENOMEM;
+	ref_ulist_init(&ref);
+	for (round = 0; round < 3; round++) {
+		fill_values(w);
+		for (i = 0; i < w->nr_adds; i++) {
+			old_aux = ref_old_aux = (u64)-1;
+			ret = ulist_add_merge(ulist, vals[i], i, &old_aux, 0);
+			ref_ret = ref_ulist_add_merge(&ref, vals[i], i,
+						      &ref_old_aux);
+			if (ret != ref_ret || old_aux != ref_old_aux) {
+				fprintf(stderr,
+			"%s: add of %llu returned %d aux %llu, expected %d aux %llu\n",
+					w->name, (unsigned long long)vals[i],
+					ret, (unsigned long long)old_aux,
+					ref_ret, (unsigned long long)ref_old_aux);
+				goto fail;
+			}
+		}
+		if (ulist->nnodes != ref.nnodes) {
+			fprintf(stderr, "%s: %lu elements, expected %lu\n",
+				w->name, ulist->nnodes, ref.nnodes);
+			goto fail;
+		}
+
+		/* the iteration sees the elements added while iterating */
+		ULIST_ITER_INIT(&uiter);
+		ref_node = list_entry(ref.nodes.next, struct ref_ulist_node,
+				      list);
+		i = 0;
+		while ((node = ulist_next(ulist, &uiter))) {
+			if (&ref_node->list == &ref.nodes ||
+			    node->val != ref_node->val ||
+			    node->aux != ref_node->aux) {
+				fprintf(stderr, "%s: element %lu differs\n",
+					w->name, i);
+				goto fail;
+			}
+			if (i++ < 4) {
+				ulist_add(ulist, node->val + 1, 0, 0);
+				ref_ulist_add_merge(&ref, node->val + 1, 0,
+						    NULL);
+			}
+			ref_node = list_entry(ref_node->list.next,
+					      struct ref_ulist_node, list);
+		}
+		if (&ref_node->list != &ref.nodes) {
+			fprintf(stderr, "%s: missing elements\n", w->name);
+			goto fail;
+		}
+		ulist_reinit(ulist);
+		ref_ulist_reinit(&ref);
+	}
+	ulist_free(ulist);
+	return 0;
+
+fail:
+	ulist_free(ulist);
+	ref_ulist_reinit(&ref);
+	return 1;
+}
+
+static u64 now_nsec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* each round fills the set, iterates over it and empties it */
+static u64 bench_ulist(const struct workload *w, unsigned long *adds)
+{
+	struct ulist *ulist = ulist_alloc(0);
+	struct ulist_iterator uiter;
+	struct ulist_node *node;
+	u64 start = now_nsec();
+	u64 sum = 0;
+	unsigned long round;
+	unsigned long i;
+
+	*adds = 0;
+	for (round = 0; round < w->rounds; round++) {
+		for (i = 0; i < w->nr_adds; i++)
+			ulist_add(ulist, vals[i], i, 0);
+		ULIST_ITER_INIT(&uiter);
+		while ((node = ulist_next(ulist, &uiter)))
+			sum += node->aux;
+		ulist_reinit(ulist);
+		*adds += w->nr_adds;
+	}
+	ulist_free(ulist);
+	if (sum == 1)
+		printf("\n");
+	return now_nsec() - start;
+}
+
+static u64 bench_ref_ulist(const struct workload *w, unsigned long *adds)
+{
+	struct ref_ulist ref;
+	struct ref_ulist_node *node;
+	struct list_head *cur_list;
+	u64 start = now_nsec();
+	u64 sum = 0;
+	unsigned long round;
+	unsigned long i;
+
+	*adds = 0;
+	ref_ulist_init(&ref);
+	for (round = 0; round < w->rounds; round++) {
+		for (i = 0; i < w->nr_adds; i++)
+			ref_ulist_add_merge(&ref, vals[i], i, NULL);
+		cur_list = NULL;
+		while ((node = ref_ulist_next(&ref, &cur_list)))
+			sum += node->aux;
+		ref_ulist_reinit(&ref);
+		*adds += w->nr_adds;
+	}
+	if (sum == 1)
+		printf("\n");
+	return now_nsec() - start;
+}
+
+int main(int argc, char **argv)
+{
+	const struct workload *w;
+	unsigned long adds, ref_adds;
+	u64 nsec, ref_nsec;
+	unsigned long max_adds = 0;
+	int ret = 0;
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(workloads); i++)
+		max_adds = max(max_adds, workloads[i].nr_adds);
+	vals = malloc(max_adds * sizeof(*vals));
+	if (!vals) {
+		fprintf(stderr, "ERROR: not enough memory\n");
+		return 1;
+	}
+
+	printf("%-12s %14s %14s %8s\n", "set", "ulist ns/add",
+	       "rbtree ns/add", "speedup");
+	for (i = 0; i < ARRAY_SIZE(workloads); i++) {
+		w = &workloads[i];
+		if (verify(w)) {
+			ret = 1;
+			continue;
+		}
+		fill_values(w);
+		nsec = bench_ulist(w, &adds);
+		ref_nsec = bench_ref_ulist(w, &ref_adds);
+		printf("%-12s %14.1f %14.1f %7.2fx\n", w->name,
+		       (double)nsec / adds, (double)ref_nsec / ref_adds,
+		       ((double)ref_nsec / ref_adds) / ((double)nsec / adds));
+	}
+	free(vals);
+	return ret;
+}
@@ -6,10 +6,15 @@
 
 //#include <linux/slab.h>
 #include <stdlib.h>
+#include <string.h>
 #include "kerncompat.h"
 #include "ulist.h"
 #include "ctree.h"
 
+/* what ulist_reinit() keeps: 64 elements and a hash for 128 */
+#define ULIST_KEEP_CHUNKS	3
+#define ULIST_KEEP_HASH		256
+
 /*
  * ulist is a generic data structure to hold a collection of unique u64
  * values. The only operations it supports is adding to the list and
@@ -48,8 +53,9 @@
  */
 void ulist_init(struct ulist *ulist)
 {
-	INIT_LIST_HEAD(&ulist->nodes);
-	ulist->root = RB_ROOT;
+	memset(ulist->chunks, 0, sizeof(ulist->chunks));
+	ulist->hash = NULL;
+	ulist->hash_mask = 0;
 	ulist->nnodes = 0;
 }
 
@@ -62,27 +68,46 @@ void ulist_init(struct ulist *ulist)
  */
 static void ulist_fini(struct ulist *ulist)
 {
-	struct ulist_node *node;
-	struct ulist_node *next;
+	int i;
 
-	list_for_each_entry_safe(node, next, &ulist->nodes, list) {
-		kfree(node);
+	for (i = 0; i < ULIST_MAX_CHUNKS && ulist->chunks[i]; i++) {
+		kfree(ulist->chunks[i]);
+		ulist->chunks[i] = NULL;
 	}
-	ulist->root = RB_ROOT;
-	INIT_LIST_HEAD(&ulist->nodes);
+	kfree(ulist->hash);
+	ulist->hash = NULL;
+	ulist->hash_mask = 0;
 }
 
 /**
  * ulist_reinit - prepare a ulist for reuse
  * @ulist:	ulist to be reused
  *
- * Free up all additional memory allocated for the list elements and reinit
- * the ulist.
+ * Empty the ulist, the memory for its first elements is kept for the next
+ * use and the rest is freed.
  */
 void ulist_reinit(struct ulist *ulist)
 {
-	ulist_fini(ulist);
-	ulist_init(ulist);
+	int i;
+
+	/*
+	 * The first chunks and a small hash are kept for the next use, a
+	 * ulist is often refilled with about as many elements.
+	 */
+	for (i = ULIST_KEEP_CHUNKS; i < ULIST_MAX_CHUNKS && ulist->chunks[i];
+	     i++) {
+		kfree(ulist->chunks[i]);
+		ulist->chunks[i] = NULL;
+	}
+	if (ulist->hash && ulist->hash_mask + 1 > ULIST_KEEP_HASH) {
+		kfree(ulist->hash);
+		ulist->hash = NULL;
+		ulist->hash_mask = 0;
+	} else if (ulist->nnodes > ULIST_INLINE_NODES) {
+		memset(ulist->hash, 0, (ulist->hash_mask + 1) *
+		       sizeof(*ulist->hash));
+	}
+	ulist->nnodes = 0;
 }
 
 /**
@@ -117,42 +142,87 @@ void ulist_free(struct ulist *ulist)
 	kfree(ulist);
 }
 
-static struct ulist_node *ulist_rbtree_search(struct ulist *ulist, u64 val)
+/* chunk @i holds the elements from ULIST_INLINE_NODES << i on */
+static inline int ulist_chunk(unsigned long index)
+{
+	return 63 - __builtin_clzll(index / ULIST_INLINE_NODES);
+}
+
+static struct ulist_node *ulist_node_at(struct ulist *ulist,
+					unsigned long index)
 {
-	struct rb_node *n = ulist->root.rb_node;
-	struct ulist_node *u = NULL;
-
-	while (n) {
-		u = rb_entry(n, struct ulist_node, rb_node);
-		if (u->val < val)
-			n = n->rb_right;
-		else if (u->val > val)
-			n = n->rb_left;
-		else
-			return u;
+	int chunk;
+
+	if (index < ULIST_INLINE_NODES)
+		return &ulist->inline_nodes[index];
+	chunk = ulist_chunk(index);
+	return &ulist->chunks[chunk][index - (ULIST_INLINE_NODES << chunk)];
+}
+
+static inline unsigned long ulist_hash(u64 val)
+{
+	return (val * 0x9E3779B97F4A7C15ULL) >> 32;
+}
+
+static struct ulist_node *ulist_search(struct ulist *ulist, u64 val)
+{
+	struct ulist_node *node;
+	unsigned long slot;
+	unsigned long i;
+
+	if (ulist->nnodes <= ULIST_INLINE_NODES) {
+		for (i = 0; i < ulist->nnodes; i++) {
+			if (ulist->inline_nodes[i].val == val)
+				return &ulist->inline_nodes[i];
+		}
+		return NULL;
+	}
+
+	slot = ulist_hash(val) & ulist->hash_mask;
+	while (ulist->hash[slot]) {
+		node = ulist_node_at(ulist, ulist->hash[slot] - 1);
+		if (node->val == val)
+			return node;
+		slot = (slot + 1) & ulist->hash_mask;
 	}
 	return NULL;
 }
 
-static int ulist_rbtree_insert(struct ulist *ulist, struct ulist_node *ins)
+static void ulist_hash_insert(struct ulist *ulist, unsigned long index)
 {
-	struct rb_node **p = &ulist->root.rb_node;
-	struct rb_node *parent = NULL;
-	struct ulist_node *cur = NULL;
-
-	while (*p) {
-		parent = *p;
-		cur = rb_entry(parent, struct ulist_node, rb_node);
-
-		if (cur->val < ins->val)
-			p = &(*p)->rb_right;
-		else if (cur->val > ins->val)
-			p = &(*p)->rb_left;
-		else
-			return -EEXIST;
+	unsigned long slot;
+
+	slot = ulist_hash(ulist_node_at(ulist, index)->val) & ulist->hash_mask;
+	while (ulist->hash[slot])
+		slot = (slot + 1) & ulist->hash_mask;
+	ulist->hash[slot] = index + 1;
+}
+
+/*
+ * Make room in the hash for one more element past the inline ones, it is
+ * kept at most half full. The elements are hashed when it is replaced by
+ * a bigger one, or once the inline elements are full.
+ */
+static int ulist_grow_hash(struct ulist *ulist, gfp_t gfp_mask)
+{
+	unsigned long size = ulist->hash ? ulist->hash_mask + 1 : 0;
+	unsigned long *hash;
+	unsigned long i;
+
+	if ((ulist->nnodes + 1) * 2 > size) {
+		size = max(size * 2, ULIST_INLINE_NODES * 4UL);
+		hash = kzalloc(size * sizeof(*hash), gfp_mask);
+		if (!hash)
+			return -ENOMEM;
+		kfree(ulist->hash);
+		ulist->hash = hash;
+		ulist->hash_mask = size - 1;
+	} else if (ulist->nnodes > ULIST_INLINE_NODES) {
+		return 0;
 	}
-	rb_link_node(&ins->rb_node, parent, p);
-	rb_insert_color(&ins->rb_node, &ulist->root);
+
+	for (i = 0; i < ulist->nnodes; i++)
+		ulist_hash_insert(ulist, i);
 	return 0;
 }
 
@@ -184,29 +254,44 @@ int ulist_add(struct ulist *ulist, u64 val, u64 aux, gfp_t gfp_mask)
 int ulist_add_merge(struct ulist *ulist, u64 val, u64 aux,
 		    u64 *old_aux, gfp_t gfp_mask)
 {
-	int ret;
+	unsigned long index = ulist->nnodes;
 	struct ulist_node *node;
+	int chunk;
 
-	node = ulist_rbtree_search(ulist, val);
+	node = ulist_search(ulist, val);
 	if (node) {
 		if (old_aux)
 			*old_aux = node->aux;
 		return 0;
 	}
-	node = kmalloc(sizeof(*node), gfp_mask);
-	if (!node)
+
+	if (index < ULIST_INLINE_NODES) {
+		node = &ulist->inline_nodes[index];
+		goto add;
+	}
+
+	chunk = ulist_chunk(index);
+	if (chunk >= ULIST_MAX_CHUNKS)
+		return -ENOMEM;
+	if (!ulist->chunks[chunk]) {
+		ulist->chunks[chunk] = kmalloc((ULIST_INLINE_NODES << chunk) *
+					       sizeof(*node), gfp_mask);
+		if (!ulist->chunks[chunk])
+			return -ENOMEM;
+	}
+	if (ulist_grow_hash(ulist, gfp_mask))
 		return -ENOMEM;
+	node = ulist_node_at(ulist, index);
 
+add:
 	node->val = val;
 	node->aux = aux;
 #ifdef CONFIG_BTRFS_DEBUG
 	node->seqnum = ulist->nnodes;
 #endif
-
-	ret = ulist_rbtree_insert(ulist, node);
-	ASSERT(!ret);
-	list_add_tail(&node->list, &ulist->nodes);
 	ulist->nnodes++;
+	if (index >= ULIST_INLINE_NODES)
+		ulist_hash_insert(ulist, index);
 
 	return 1;
 }
@@ -231,23 +316,12 @@ struct ulist_node *ulist_next(struct ulist *ulist, struct ulist_iterator *uiter)
 {
 	struct ulist_node *node;
 
-	if (list_empty(&ulist->nodes))
-		return NULL;
-	if (uiter->cur_list && uiter->cur_list->next == &ulist->nodes)
+	if (uiter->i >= ulist->nnodes)
 		return NULL;
-	if (uiter->cur_list) {
-		uiter->cur_list = uiter->cur_list->next;
-	} else {
-		uiter->cur_list = ulist->nodes.next;
-#ifdef CONFIG_BTRFS_DEBUG
-		uiter->i = 0;
-#endif
-	}
-	node = list_entry(uiter->cur_list, struct ulist_node, list);
+	node = ulist_node_at(ulist, uiter->i);
 #ifdef CONFIG_BTRFS_DEBUG
 	ASSERT(node->seqnum == uiter->i);
-	ASSERT(uiter->i >= 0 && uiter->i < ulist->nnodes);
-	uiter->i++;
 #endif
+	uiter->i++;
 	return node;
 }
@@ -9,8 +9,6 @@
 #define __ULIST_H__
 
 #include "kerncompat.h"
-#include "list.h"
-#include "rbtree.h"
 
 /*
  * ulist is a generic data structure to hold a collection of unique u64
@@ -20,10 +18,7 @@
  *
  */
 struct ulist_iterator {
-#ifdef CONFIG_BTRFS_DEBUG
-	int i;
-#endif
-	struct list_head *cur_list;  /* hint to start search */
+	unsigned long i;	/* index of the next element */
 };
 
 /*
@@ -36,19 +31,31 @@ struct ulist_node {
 #ifdef CONFIG_BTRFS_DEBUG
 	int seqnum;		/* sequence number this node is added */
 #endif
-
-	struct list_head list;  /* used to link node */
-	struct rb_node rb_node;	/* used to speed up search */
 };
 
+/*
+ * The first ULIST_INLINE_NODES elements are kept in the ulist itself and
+ * searched linearly, the following ones go to chunks that double in size
+ * and are found through a hash. Elements never move once added.
+ */
+#define ULIST_INLINE_NODES	8
+#define ULIST_MAX_CHUNKS	32
+
 struct ulist {
 	/*
 	 * number of elements stored in list
 	 */
 	unsigned long nnodes;
 
-	struct list_head nodes;
-	struct rb_root root;
+	struct ulist_node inline_nodes[ULIST_INLINE_NODES];
+	struct ulist_node *chunks[ULIST_MAX_CHUNKS];
+
+	/*
+	 * open addressing hash of all the elements by val, each slot is the
+	 * index of the element plus one, or 0 when free
+	 */
+	unsigned long *hash;
+	unsigned long hash_mask;
 };
 
 void ulist_init(struct ulist *ulist);
@@ -76,6 +83,6 @@ static inline int ulist_add_merge_ptr(struct ulist *ulist, u64 val, void *aux,
 struct ulist_node *ulist_next(struct ulist *ulist,
 			      struct ulist_iterator *uiter);
 
-#define ULIST_ITER_INIT(uiter) ((uiter)->cur_list = NULL)
+#define ULIST_ITER_INIT(uiter) ((uiter)->i = 0)
 
 #endif
@@ -270,6 +270,25 @@ error:
 	return ret;
 }
 
+/*
+ * The devices of a filesystem opened from the indexed image @path, with
+ * the super block @sb read from it.  The blocks are all read from the
+ * image, the devices are only there for the chunk tree and have no fd.
+ */
+int btrfs_open_image_devices(const char *path, struct btrfs_super_block *sb,
+			     struct btrfs_fs_devices **fs_devices_ret)
+{
+	u64 devid = btrfs_stack_device_id(&sb->dev_item);
+	int ret;
+
+	ret = device_list_add(path, sb, devid, fs_devices_ret);
+	if (ret)
+		return ret;
+	(*fs_devices_ret)->latest_bdev = -1;
+	(*fs_devices_ret)->lowest_bdev = -1;
+	return 0;
+}
+
 /*
  * this uses a pretty simple search, the expectation is that it is
  * called very infrequently and that a given device has a small number
@@ -1676,8 +1695,10 @@ static int read_one_chunk(struct btrfs_root *root, struct btrfs_key *key,
 							NULL);
 		if (!map->stripes[i].dev) {
 			map->stripes[i].dev = fill_missing_device(devid);
-			printf("warning, device %llu is missing\n",
-			       (unsigned long long)devid);
+			/* an image has a single device */
+			if (!root->fs_info->metadump)
+				printf("warning, device %llu is missing\n",
+				       (unsigned long long)devid);
 		}
 
 	}
@@ -1773,8 +1794,9 @@ static int read_one_dev(struct btrfs_root *root,
 
 	device = btrfs_find_device(root, devid, dev_uuid, fs_uuid);
 	if (!device) {
-		printk("warning devid %llu not found already\n",
-			(unsigned long long)devid);
+		if (!root->fs_info->metadump)
+			printk("warning devid %llu not found already\n",
+				(unsigned long long)devid);
 		device = kzalloc(sizeof(*device), GFP_NOFS);
 		if (!device)
 			return -ENOMEM;
@@ -1988,8 +2010,8 @@ int write_raid56_with_parity(struct btrfs_fs_info *info,
 			     u64 stripe_len, u64 *raid_map)
 {
 	struct extent_buffer **ebs, *p_eb = NULL, *q_eb = NULL;
+	void **pointers;
 	int i;
-	int j;
 	int ret;
 	int alloc_size = eb->len;
 
@@ -2023,13 +2045,10 @@ int write_raid56_with_parity(struct btrfs_fs_info *info,
 		else if (raid_map[i] == BTRFS_RAID6_Q_STRIPE)
 			q_eb = new_eb;
 	}
-	if (q_eb) {
-		void **pointers;
-
-		pointers = kmalloc(sizeof(*pointers) * multi->num_stripes,
-				   GFP_NOFS);
-		BUG_ON(!pointers);
+	pointers = kmalloc(sizeof(*pointers) * multi->num_stripes, GFP_NOFS);
+	BUG_ON(!pointers);
 
+	if (q_eb) {
 		ebs[multi->num_stripes - 2] = p_eb;
 		ebs[multi->num_stripes - 1] = q_eb;
 
@@ -2037,17 +2056,16 @@ int write_raid56_with_parity(struct btrfs_fs_info *info,
 			pointers[i] = ebs[i]->data;
 
 		raid6_gen_syndrome(multi->num_stripes, stripe_len, pointers);
-		kfree(pointers);
 	} else {
 		ebs[multi->num_stripes - 1] = p_eb;
-		memcpy(p_eb->data, ebs[0]->data, stripe_len);
-		for (j = 1; j < multi->num_stripes - 1; j++) {
-			for (i = 0; i < stripe_len; i += sizeof(unsigned long)) {
-				*(unsigned long *)(p_eb->data + i) ^=
-					*(unsigned long *)(ebs[j]->data + i);
-			}
-		}
+
+		for (i = 0; i < multi->num_stripes; i++)
+			pointers[i] = ebs[i]->data;
+
+		raid5_gen_result(multi->num_stripes, stripe_len,
+				 multi->num_stripes - 1, pointers);
 	}
+	kfree(pointers);
 
 	for (i = 0; i < multi->num_stripes; i++) {
 		ret = write_extent_to_disk(ebs[i]);